@@ -89,6 +89,14 @@ public:
         return dte->recover();
     }
 
+    /**
+     * @brief HDLC framing counters of the PPP data path, see Netif::get_stats()
+     */
+    void get_ppp_stats(ppp_stats &stats, bool reset)
+    {
+        netif.get_stats(stats, reset);
+    }
+
 protected:
     std::shared_ptr<DTE> dte;
     std::shared_ptr<SpecificModule> device;
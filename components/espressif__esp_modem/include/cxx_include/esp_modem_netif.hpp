@@ -8,6 +8,7 @@
 
 #include <memory>
 #include <cstddef>
+#include <atomic>
 #include "esp_netif.h"
 #include "cxx_include/esp_modem_primitives.hpp"
 
@@ -21,6 +22,16 @@ struct ppp_netif_driver {
     Netif *ppp;
 };
 
+/**
+ * @brief HDLC framing counters of the PPP data path
+ */
+struct ppp_stats {
+    uint32_t tx_bytes;      /*!< Bytes written to the DTE, as framed */
+    uint32_t tx_escaped;    /*!< Escape octets (0x7D) among them, one per stuffed byte */
+    uint32_t rx_bytes;      /*!< Bytes received from the DTE, as framed */
+    uint32_t rx_escaped;    /*!< Escape octets (0x7D) among them */
+};
+
 /**
  * @defgroup ESP_MODEM_NETIF
  * @brief Network interface layer of the esp-modem
@@ -56,6 +67,13 @@ public:
 
     void receive(uint8_t *data, size_t len);
 
+    /**
+     * @brief Read the HDLC framing counters
+     * @param[out] stats Counters since start or the last reset
+     * @param reset Start counting from zero again
+     */
+    void get_stats(ppp_stats &stats, bool reset);
+
 private:
 
     static esp_err_t esp_modem_dte_transmit(void *h, void *buffer, size_t len);
@@ -68,6 +86,10 @@ private:
     esp_netif_t *netif;
     struct ppp_netif_driver driver {};
     SignalGroup signal;
+    std::atomic<uint32_t> tx_bytes{0};
+    std::atomic<uint32_t> tx_escaped{0};
+    std::atomic<uint32_t> rx_bytes{0};
+    std::atomic<uint32_t> rx_escaped{0};
     static const size_t PPP_STARTED = SignalGroup::bit0;
     static const size_t PPP_EXIT = SignalGroup::bit1;
 };
@@ -140,6 +140,26 @@ esp_err_t esp_modem_command(esp_modem_dce_t *dce, const char *command, esp_err_t
  */
 esp_err_t esp_modem_set_apn(esp_modem_dce_t *dce, const char *apn);
 
+/**
+ * @brief HDLC framing counters of the PPP data path
+ */
+typedef struct esp_modem_ppp_stats {
+    uint32_t tx_bytes;      /**< Bytes sent to the modem, as framed */
+    uint32_t tx_escaped;    /**< Escape octets among them, one per byte stuffed by the ACCM or flag escaping */
+    uint32_t rx_bytes;      /**< Bytes received from the modem, as framed */
+    uint32_t rx_escaped;    /**< Escape octets among them */
+} esp_modem_ppp_stats_t;
+
+/**
+ * @brief Reads how many bytes the PPP framing exchanged and how many of them were escapes
+ *
+ * @param dce Modem DCE handle
+ * @param[out] stats Counters since start or the last reset
+ * @param reset Start counting from zero again
+ * @return ESP_OK on success
+ */
+esp_err_t esp_modem_get_ppp_stats(esp_modem_dce_t *dce, esp_modem_ppp_stats_t *stats, bool reset);
+
 /**
  * @}
  */
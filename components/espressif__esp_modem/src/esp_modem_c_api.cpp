@@ -455,3 +455,17 @@ extern "C" esp_err_t esp_modem_set_apn(esp_modem_dce_t *dce_wrap, const char *ap
     dce_wrap->dce->get_module()->configure_pdp_context(std::move(new_pdp));
     return ESP_OK;
 }
+
+extern "C" esp_err_t esp_modem_get_ppp_stats(esp_modem_dce_t *dce_wrap, esp_modem_ppp_stats_t *stats, bool reset)
+{
+    if (dce_wrap == nullptr || dce_wrap->dce == nullptr || stats == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ppp_stats s;
+    dce_wrap->dce->get_ppp_stats(s, reset);
+    stats->tx_bytes = s.tx_bytes;
+    stats->tx_escaped = s.tx_escaped;
+    stats->rx_bytes = s.rx_bytes;
+    stats->rx_escaped = s.rx_escaped;
+    return ESP_OK;
+}
@@ -45,16 +45,16 @@ static bool exit_data(DTE &dte, ModuleIf &device, Netif &netif)
         return false;
     });
     netif.wait_until_ppp_exits();
-    if (!signal->wait(1, 2000)) {
-        dte.set_read_cb(nullptr);
-        if (!device.set_mode(modem_mode::COMMAND_MODE)) {
-            return false;
-        }
-    }
+    bool carrier_lost = signal->wait(1, 2000);
     dte.set_read_cb(nullptr);
+    // DTE first: in DUAL_MODE this swaps the data terminal back to primary,
+    // the escape sequence below has to reach the port that is in data mode
     if (!dte.set_mode(modem_mode::COMMAND_MODE)) {
         return false;
     }
+    if (!carrier_lost && !device.set_mode(modem_mode::COMMAND_MODE)) {
+        return false;
+    }
     return true;
 }
 
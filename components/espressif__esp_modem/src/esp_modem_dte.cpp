@@ -225,7 +225,14 @@ bool DTE::set_mode(modem_mode m)
     }
     // transitions (COMMAND|DUAL|CMUX|UNDEF) -> DATA
     if (m == modem_mode::DATA_MODE) {
-        if (mode == modem_mode::CMUX_MODE || mode == modem_mode::CMUX_MANUAL_MODE || mode == modem_mode::DUAL_MODE) {
+        if (mode == modem_mode::DUAL_MODE) {
+            // the terminal which dialed carries the data now, commands move to the other one
+            if (!dual_swapped) {
+                secondary_term.swap(primary_term);
+                set_command_callbacks();
+                dual_swapped = true;
+            }
+        } else if (mode == modem_mode::CMUX_MODE || mode == modem_mode::CMUX_MANUAL_MODE) {
             // mode stays the same, but need to swap terminals (as command has been switched)
             secondary_term.swap(primary_term);
             set_command_callbacks();
@@ -243,7 +250,16 @@ bool DTE::set_mode(modem_mode m)
             }
             mode = modem_mode::UNDEF;
             return false;
-        } if (mode == modem_mode::CMUX_MANUAL_MODE || mode == modem_mode::DUAL_MODE) {
+        } if (mode == modem_mode::DUAL_MODE) {
+            // swap back, so that the next dial happens on the same terminal
+            if (dual_swapped) {
+                secondary_term.swap(primary_term);
+                secondary_term->set_read_cb(nullptr);
+                set_command_callbacks();
+                dual_swapped = false;
+            }
+            return true;
+        } if (mode == modem_mode::CMUX_MANUAL_MODE) {
             return true;
         } else {
             mode = m;
@@ -363,7 +379,8 @@ bool DTE::command_cb::process_line(uint8_t *data, size_t consumed, size_t len)
 
 bool DTE::recover()
 {
-    if (mode == modem_mode::CMUX_MODE || mode == modem_mode::CMUX_MANUAL_MODE || mode == modem_mode::DUAL_MODE) {
+    // two real terminals (DUAL_MODE) have no framing to resynchronize
+    if (mode == modem_mode::CMUX_MODE || mode == modem_mode::CMUX_MANUAL_MODE) {
         return cmux_term->recover();
     }
     return false;
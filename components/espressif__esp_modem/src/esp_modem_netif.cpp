@@ -6,6 +6,7 @@
 
 #include <memory>
 #include <utility>
+#include <cstring>
 #include <inttypes.h>
 #include <esp_log.h>
 #include <esp_event.h>
@@ -17,6 +18,18 @@
 
 namespace esp_modem {
 
+// Every byte stuffed by the HDLC framing is preceded by one escape octet
+static uint32_t count_escaped(const uint8_t *data, size_t len)
+{
+    uint32_t escaped = 0;
+    const uint8_t *end = data + len;
+    while ((data = static_cast<const uint8_t *>(memchr(data, 0x7D, end - data))) != nullptr) {
+        escaped++;
+        data++;
+    }
+    return escaped;
+}
+
 void Netif::on_ppp_changed(void *arg, esp_event_base_t event_base,
                            int32_t event_id, void *event_data)
 {
@@ -33,6 +46,8 @@ esp_err_t Netif::esp_modem_dte_transmit(void *h, void *buffer, size_t len)
     auto *ppp = static_cast<Netif *>(h);
     if (ppp->signal.is_any(PPP_STARTED)) {
         if (ppp->ppp_dte && ppp->ppp_dte->write((uint8_t *) buffer, len) > 0) {
+            ppp->tx_bytes += len;
+            ppp->tx_escaped += count_escaped(static_cast<const uint8_t *>(buffer), len);
             return ESP_OK;
         }
     }
@@ -65,9 +80,26 @@ esp_err_t Netif::esp_modem_post_attach(esp_netif_t *esp_netif, void *args)
 
 void Netif::receive(uint8_t *data, size_t len)
 {
+    rx_bytes += len;
+    rx_escaped += count_escaped(data, len);
     esp_netif_receive(driver.base.netif, data, len, nullptr);
 }
 
+void Netif::get_stats(ppp_stats &stats, bool reset)
+{
+    if (reset) {
+        stats.tx_bytes = tx_bytes.exchange(0);
+        stats.tx_escaped = tx_escaped.exchange(0);
+        stats.rx_bytes = rx_bytes.exchange(0);
+        stats.rx_escaped = rx_escaped.exchange(0);
+    } else {
+        stats.tx_bytes = tx_bytes;
+        stats.tx_escaped = tx_escaped;
+        stats.rx_bytes = rx_bytes;
+        stats.rx_escaped = rx_escaped;
+    }
+}
+
 Netif::Netif(std::shared_ptr<DTE> e, esp_netif_t *ppp_netif) :
     ppp_dte(std::move(e)), netif(ppp_netif)
 {
@@ -50,6 +50,7 @@ public:
     explicit UsbTerminal(const esp_modem_dte_config *config, int term_idx): buffer_size(config->dte_buffer_size)
     {
         const struct esp_modem_usb_term_config *usb_config = (struct esp_modem_usb_term_config *)(config->extension_config);
+        tx_async = usb_config->out_xfer_count > 0;
 
         // Install USB Host driver (if not already installed)
         if (usb_config->install_usb_host && !usb_host_lib_task) {
@@ -82,7 +83,10 @@ public:
             .in_buffer_size = config->dte_buffer_size,
             .event_cb = handle_notif,
             .data_cb = handle_rx,
-            .user_arg = this
+            .user_arg = this,
+            .out_xfer_count = usb_config->out_xfer_count,
+            .tx_done_cb = NULL,
+            .in_xfer_count = usb_config->in_xfer_count,
         };
 
         // Determine Terminal interface index
@@ -121,7 +125,10 @@ public:
         size_t remain = len;
         while (remain > 0) {
             int batch = std::min(buffer_size, remain);
-            if (this->CdcAcmDevice::tx_blocking(ptr, batch) != ESP_OK) {
+            // Non-blocking writes only wait when all OUT transfers are in flight, which holds back the netif
+            esp_err_t err = tx_async ? this->CdcAcmDevice::tx_async(ptr, batch, tx_timeout_ms)
+                            : this->CdcAcmDevice::tx_blocking(ptr, batch, tx_timeout_ms);
+            if (err != ESP_OK) {
                 return -1;
             }
             remain -= batch;
@@ -185,6 +192,8 @@ private:
         }
     }
     size_t buffer_size;
+    bool tx_async;
+    static constexpr uint32_t tx_timeout_ms = 100;
 };
 TaskHandle_t UsbTerminal::usb_host_lib_task = nullptr;
 
@@ -21,6 +21,8 @@ struct esp_modem_usb_term_config {
     int xCoreID;                 /*!< Core affinity of created tasks: CDC-ACM driver task and optional USB Host task */
     bool cdc_compliant;          /*!< Treat the USB device as CDC-compliant. Read CDC-ACM driver documentation for more details */
     bool install_usb_host;       /*!< Flag whether USB Host driver should be installed */
+    size_t out_xfer_count;       /*!< Bulk OUT transfers kept in flight while writing. 0 means every write waits for its transfer to complete. */
+    size_t in_xfer_count;        /*!< Bulk IN transfers queued at once, so the modem can send while received data is processed. 0 or 1 for a single one. */
 };
 
 /**
@@ -55,7 +57,9 @@ struct esp_modem_usb_term_config {
         .timeout_ms = 0,                                             \
         .xCoreID = 0,                                                \
         .cdc_compliant = false,                                      \
-        .install_usb_host = true                                     \
+        .install_usb_host = true,                                    \
+        .out_xfer_count = 0,                                         \
+        .in_xfer_count = 0                                           \
     }
 #define ESP_MODEM_DEFAULT_USB_CONFIG(_vid, _pid, _intf) ESP_MODEM_DEFAULT_USB_CONFIG_DUAL(_vid, _pid, _intf, -1)
 
@@ -88,6 +88,15 @@ static void in_xfer_cb(usb_transfer_t *transfer);
  */
 static void out_xfer_cb(usb_transfer_t *transfer);
 
+/**
+ * @brief Non-blocking data send callback
+ *
+ * Returns the transfer to the OUT ring and informs the user.
+ *
+ * @param[in] transfer Transfer that triggered the callback
+ */
+static void out_ring_xfer_cb(usb_transfer_t *transfer);
+
 /**
  * @brief USB Host Client event callback
  *
@@ -173,10 +182,11 @@ static esp_err_t cdc_acm_reset_transfer_endpoint(usb_device_handle_t dev_hdl, us
  * @param cdc_dev
  * @param[in] event_cb  Device event callback
  * @param[in] in_cb     Data received callback
+ * @param[in] out_cb    Non-blocking data transmitted callback
  * @param[in] user_arg  Optional user's argument, that will be passed to the callbacks
  * @return esp_err_t
  */
-static esp_err_t cdc_acm_start(cdc_dev_t *cdc_dev, cdc_acm_host_dev_callback_t event_cb, cdc_acm_data_callback_t in_cb, void *user_arg)
+static esp_err_t cdc_acm_start(cdc_dev_t *cdc_dev, cdc_acm_host_dev_callback_t event_cb, cdc_acm_data_callback_t in_cb, cdc_acm_tx_done_callback_t out_cb, void *user_arg)
 {
     esp_err_t ret = ESP_OK;
     assert(cdc_dev);
@@ -184,6 +194,7 @@ static esp_err_t cdc_acm_start(cdc_dev_t *cdc_dev, cdc_acm_host_dev_callback_t e
     CDC_ACM_ENTER_CRITICAL();
     cdc_dev->notif.cb = event_cb;
     cdc_dev->data.in_cb = in_cb;
+    cdc_dev->data.out_cb = out_cb;
     cdc_dev->cb_arg = user_arg;
     CDC_ACM_EXIT_CRITICAL();
 
@@ -195,7 +206,12 @@ static esp_err_t cdc_acm_start(cdc_dev_t *cdc_dev, cdc_acm_host_dev_callback_t e
             cdc_dev->data.intf_desc->bInterfaceNumber,
             cdc_dev->data.intf_desc->bAlternateSetting),
         err, TAG, "Could not claim interface");
-    if (cdc_dev->data.in_xfer) {
+    if (cdc_dev->data.in_ring) {
+        ESP_LOGD(TAG, "Submitting %d polls for BULK IN transfer", (int)cdc_dev->data.in_ring_len);
+        for (size_t i = 0; i < cdc_dev->data.in_ring_len; i++) {
+            ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_ring[i]));
+        }
+    } else if (cdc_dev->data.in_xfer) {
         ESP_LOGD(TAG, "Submitting poll for BULK IN transfer");
         ESP_ERROR_CHECK(usb_host_transfer_submit(cdc_dev->data.in_xfer));
     }
@@ -458,7 +474,14 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
     if (cdc_dev->notif.xfer != NULL) {
         usb_host_transfer_free(cdc_dev->notif.xfer);
     }
-    if (cdc_dev->data.in_xfer != NULL) {
+    if (cdc_dev->data.in_ring != NULL) {
+        for (size_t i = 0; i < cdc_dev->data.in_ring_len; i++) {
+            if (cdc_dev->data.in_ring[i] != NULL) {
+                usb_host_transfer_free(cdc_dev->data.in_ring[i]);
+            }
+        }
+        free(cdc_dev->data.in_ring);
+    } else if (cdc_dev->data.in_xfer != NULL) {
         cdc_acm_reset_in_transfer(cdc_dev);
         usb_host_transfer_free(cdc_dev->data.in_xfer);
     }
@@ -471,6 +494,20 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
         }
         usb_host_transfer_free(cdc_dev->data.out_xfer);
     }
+    if (cdc_dev->data.out_ring != NULL) {
+        for (size_t i = 0; i < cdc_dev->data.out_ring_len; i++) {
+            if (cdc_dev->data.out_ring[i] != NULL) {
+                usb_host_transfer_free(cdc_dev->data.out_ring[i]);
+            }
+        }
+        free(cdc_dev->data.out_ring);
+    }
+    if (cdc_dev->data.out_ring_free != NULL) {
+        vSemaphoreDelete(cdc_dev->data.out_ring_free);
+    }
+    if (cdc_dev->data.out_ring_mux != NULL) {
+        vSemaphoreDelete(cdc_dev->data.out_ring_mux);
+    }
     if (cdc_dev->ctrl_transfer != NULL) {
         if (cdc_dev->ctrl_transfer->context != NULL) {
             vSemaphoreDelete((SemaphoreHandle_t)cdc_dev->ctrl_transfer->context);
@@ -489,14 +526,16 @@ static void cdc_acm_transfers_free(cdc_dev_t *cdc_dev)
  * @param[in] notif_ep_desc Pointer to notification EP descriptor
  * @param[in] in_ep_desc-   Pointer to data IN EP descriptor
  * @param[in] in_buf_len    Length of data IN buffer
+ * @param[in] in_xfer_cnt   Number of data IN transfers queued at once
  * @param[in] out_ep_desc   Pointer to data OUT EP descriptor
  * @param[in] out_buf_len   Length of data OUT buffer
+ * @param[in] out_xfer_cnt  Number of data OUT transfers for non-blocking transmit
  * @return
  *     - ESP_OK:            Success
  *     - ESP_ERR_NO_MEM:    Not enough memory for transfers and semaphores allocation
  *     - ESP_ERR_NOT_FOUND: IN or OUT endpoints were not found in the selected interface
  */
-static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_desc_t *notif_ep_desc, const usb_ep_desc_t *in_ep_desc, size_t in_buf_len, const usb_ep_desc_t *out_ep_desc, size_t out_buf_len)
+static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_desc_t *notif_ep_desc, const usb_ep_desc_t *in_ep_desc, size_t in_buf_len, size_t in_xfer_cnt, const usb_ep_desc_t *out_ep_desc, size_t out_buf_len, size_t out_xfer_cnt)
 {
     assert(in_ep_desc);
     assert(out_ep_desc);
@@ -541,6 +580,25 @@ static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_des
         cdc_dev->data.in_xfer->context = cdc_dev;
         cdc_dev->data.in_mps = USB_EP_DESC_GET_MPS(in_ep_desc);
         cdc_dev->data.in_data_buffer_base = cdc_dev->data.in_xfer->data_buffer;
+
+        // Further IN transfers, so that the host controller has a buffer posted while the user processes one
+        if (in_xfer_cnt > 1) {
+            cdc_dev->data.in_ring = calloc(in_xfer_cnt, sizeof(usb_transfer_t *));
+            ESP_GOTO_ON_FALSE(cdc_dev->data.in_ring, ESP_ERR_NO_MEM, err, TAG,);
+            cdc_dev->data.in_ring_len = in_xfer_cnt;
+            cdc_dev->data.in_ring[0] = cdc_dev->data.in_xfer;
+            for (size_t i = 1; i < in_xfer_cnt; i++) {
+                ESP_GOTO_ON_ERROR(
+                    usb_host_transfer_alloc(in_buf_len, 0, &cdc_dev->data.in_ring[i]),
+                    err, TAG,
+                );
+                cdc_dev->data.in_ring[i]->callback = in_xfer_cb;
+                cdc_dev->data.in_ring[i]->num_bytes = in_buf_len;
+                cdc_dev->data.in_ring[i]->bEndpointAddress = in_ep_desc->bEndpointAddress;
+                cdc_dev->data.in_ring[i]->device_handle = cdc_dev->dev_hdl;
+                cdc_dev->data.in_ring[i]->context = cdc_dev;
+            }
+        }
     }
 
     // 4. Setup OUT bulk transfer (if it is required (out_buf_len > 0))
@@ -558,6 +616,27 @@ static esp_err_t cdc_acm_transfers_allocate(cdc_dev_t *cdc_dev, const usb_ep_des
         cdc_dev->data.out_xfer->bEndpointAddress = out_ep_desc->bEndpointAddress;
         cdc_dev->data.out_xfer->callback = out_xfer_cb;
     }
+
+    // 5. Setup OUT bulk transfers for non-blocking transmit (if they are required (out_xfer_cnt > 0))
+    if (out_buf_len != 0 && out_xfer_cnt != 0) {
+        cdc_dev->data.out_ring = calloc(out_xfer_cnt, sizeof(usb_transfer_t *));
+        ESP_GOTO_ON_FALSE(cdc_dev->data.out_ring, ESP_ERR_NO_MEM, err, TAG,);
+        cdc_dev->data.out_ring_len = out_xfer_cnt;
+        for (size_t i = 0; i < out_xfer_cnt; i++) {
+            ESP_GOTO_ON_ERROR(
+                usb_host_transfer_alloc(out_buf_len, 0, &cdc_dev->data.out_ring[i]),
+                err, TAG,
+            );
+            cdc_dev->data.out_ring[i]->device_handle = cdc_dev->dev_hdl;
+            cdc_dev->data.out_ring[i]->bEndpointAddress = out_ep_desc->bEndpointAddress;
+            cdc_dev->data.out_ring[i]->callback = out_ring_xfer_cb;
+            cdc_dev->data.out_ring[i]->context = cdc_dev;
+        }
+        cdc_dev->data.out_ring_free = xSemaphoreCreateCounting(out_xfer_cnt, out_xfer_cnt);
+        ESP_GOTO_ON_FALSE(cdc_dev->data.out_ring_free, ESP_ERR_NO_MEM, err, TAG,);
+        cdc_dev->data.out_ring_mux = xSemaphoreCreateMutex();
+        ESP_GOTO_ON_FALSE(cdc_dev->data.out_ring_mux, ESP_ERR_NO_MEM, err, TAG,);
+    }
     return ESP_OK;
 
 err:
@@ -616,9 +695,9 @@ esp_err_t cdc_acm_host_open(uint16_t vid, uint16_t pid, uint8_t interface_idx, c
 
     // Allocate USB transfers, claim CDC interfaces and return CDC-ACM handle
     ESP_GOTO_ON_ERROR(
-        cdc_acm_transfers_allocate(cdc_dev, cdc_info.notif_ep, cdc_info.in_ep, in_buf_size, cdc_info.out_ep, dev_config->out_buffer_size),
+        cdc_acm_transfers_allocate(cdc_dev, cdc_info.notif_ep, cdc_info.in_ep, in_buf_size, dev_config->in_xfer_count, cdc_info.out_ep, dev_config->out_buffer_size, dev_config->out_xfer_count),
         err, TAG,);
-    ESP_GOTO_ON_ERROR(cdc_acm_start(cdc_dev, dev_config->event_cb, dev_config->data_cb, dev_config->user_arg), err, TAG,);
+    ESP_GOTO_ON_ERROR(cdc_acm_start(cdc_dev, dev_config->event_cb, dev_config->data_cb, dev_config->tx_done_cb, dev_config->user_arg), err, TAG,);
     *cdc_hdl_ret = (cdc_acm_dev_hdl_t)cdc_dev;
     xSemaphoreGive(p_cdc_acm_obj->open_close_mutex);
     return ESP_OK;
@@ -659,12 +738,16 @@ esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl)
     // No user callbacks from this point
     cdc_dev->notif.cb = NULL;
     cdc_dev->data.in_cb = NULL;
+    cdc_dev->data.out_cb = NULL;
     CDC_ACM_EXIT_CRITICAL();
 
-    // Cancel polling of BULK IN and INTERRUPT IN
+    // Cancel polling of BULK IN and INTERRUPT IN, and non-blocking BULK OUT transfers still in flight
     if (cdc_dev->data.in_xfer) {
         ESP_ERROR_CHECK(cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->data.in_xfer));
     }
+    if (cdc_dev->data.out_ring && uxSemaphoreGetCount(cdc_dev->data.out_ring_free) < cdc_dev->data.out_ring_len) {
+        ESP_ERROR_CHECK(cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->data.out_ring[0]));
+    }
     if (cdc_dev->notif.xfer != NULL) {
         ESP_ERROR_CHECK(cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->notif.xfer));
     }
@@ -753,7 +836,10 @@ static void in_xfer_cb(usb_transfer_t *transfer)
         // In order to save RAM and CPU time, the application can indicate that the received data was not processed and that the application expects more data.
         // In this case, the next received data must be appended to the existing buffer.
         // Since the data_buffer in usb_transfer_t is a constant pointer, we must cast away to const qualifier.
-        if (!data_processed) {
+        if (cdc_dev->data.in_ring) {
+            // With several IN transfers queued, the following data is already received into another buffer,
+            // it cannot be appended to this one. The transfer is reused as it is.
+        } else if (!data_processed) {
 #if !SOC_CACHE_INTERNAL_MEM_VIA_L1CACHE
             // In case the received data was not processed, the next RX data must be appended to current buffer
             uint8_t **ptr = (uint8_t **)(&(transfer->data_buffer));
@@ -790,7 +876,7 @@ static void in_xfer_cb(usb_transfer_t *transfer)
     }
 
     ESP_LOGD(TAG, "Submitting poll for BULK IN transfer");
-    usb_host_transfer_submit(cdc_dev->data.in_xfer);
+    usb_host_transfer_submit(transfer);
 }
 
 static void notif_xfer_cb(usb_transfer_t *transfer)
@@ -842,6 +928,22 @@ static void out_xfer_cb(usb_transfer_t *transfer)
     xSemaphoreGive((SemaphoreHandle_t)transfer->context);
 }
 
+static void out_ring_xfer_cb(usb_transfer_t *transfer)
+{
+    ESP_LOGD(TAG, "out ring xfer cb");
+    cdc_dev_t *cdc_dev = (cdc_dev_t *)transfer->context;
+
+    const bool completed = cdc_acm_is_transfer_completed(transfer);
+    const size_t actual_num_bytes = transfer->actual_num_bytes;
+
+    // Transfers of one endpoint finish in submission order, so this frees the oldest one in the ring.
+    // From this point the transfer can be refilled by cdc_acm_host_data_tx_async()
+    xSemaphoreGive(cdc_dev->data.out_ring_free);
+    if (cdc_dev->data.out_cb) {
+        cdc_dev->data.out_cb(actual_num_bytes, completed, cdc_dev->cb_arg);
+    }
+}
+
 static void usb_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
 {
     switch (event_msg->event) {
@@ -929,6 +1031,42 @@ unblock:
     return ret;
 }
 
+esp_err_t cdc_acm_host_data_tx_async(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, uint32_t timeout_ms)
+{
+    esp_err_t ret;
+    CDC_ACM_CHECK(cdc_hdl, ESP_ERR_INVALID_ARG);
+    cdc_dev_t *cdc_dev = (cdc_dev_t *)cdc_hdl;
+    CDC_ACM_CHECK(data && (data_len > 0), ESP_ERR_INVALID_ARG);
+    CDC_ACM_CHECK(cdc_dev->data.out_ring, ESP_ERR_NOT_SUPPORTED); // Device was opened without non-blocking OUT transfers
+    CDC_ACM_CHECK(data_len <= cdc_dev->data.out_ring[0]->data_buffer_size, ESP_ERR_INVALID_SIZE);
+
+    // Wait for a free OUT transfer
+    if (xSemaphoreTake(cdc_dev->data.out_ring_free, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+        if (timeout_ms > 0) {
+            // No transfer finished in time, the device is not reading. Resetting the endpoint will cause all in-progress transfers to complete
+            cdc_acm_reset_transfer_endpoint(cdc_dev->dev_hdl, cdc_dev->data.out_ring[0]);
+            ESP_LOGW(TAG, "TX transfer timeout");
+        }
+        return ESP_ERR_TIMEOUT;
+    }
+
+    // Fill and submit the next transfer of the ring. The mutex is held only for the copy, not for the transfer
+    xSemaphoreTake(cdc_dev->data.out_ring_mux, portMAX_DELAY);
+    usb_transfer_t *transfer = cdc_dev->data.out_ring[cdc_dev->data.out_ring_head];
+    memcpy(transfer->data_buffer, data, data_len);
+    transfer->num_bytes = data_len;
+
+    ESP_LOGD(TAG, "Submitting non-blocking BULK OUT transfer");
+    ret = usb_host_transfer_submit(transfer);
+    if (ret == ESP_OK) {
+        cdc_dev->data.out_ring_head = (cdc_dev->data.out_ring_head + 1) % cdc_dev->data.out_ring_len;
+    } else {
+        xSemaphoreGive(cdc_dev->data.out_ring_free);
+    }
+    xSemaphoreGive(cdc_dev->data.out_ring_mux);
+    return ret;
+}
+
 esp_err_t cdc_acm_host_send_custom_request(cdc_acm_dev_hdl_t cdc_hdl, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data)
 {
     CDC_ACM_CHECK(cdc_hdl, ESP_ERR_INVALID_ARG);
@@ -38,12 +38,20 @@ struct cdc_dev_s {
     void *cb_arg;                         // Common argument for user's callbacks (data IN and Notification)
     struct {
         usb_transfer_t *out_xfer;         // OUT data transfer
-        usb_transfer_t *in_xfer;          // IN data transfer
+        usb_transfer_t *in_xfer;          // IN data transfer, the first of in_ring if there are several
+        usb_transfer_t **in_ring;         // IN data transfers queued at once, NULL if only in_xfer is used
+        size_t in_ring_len;               // Number of transfers in in_ring
         cdc_acm_data_callback_t in_cb;    // User's callback for async (non-blocking) data IN
         uint16_t in_mps;                  // IN endpoint Maximum Packet Size
         uint8_t *in_data_buffer_base;     // Pointer to IN data buffer in usb_transfer_t
         const usb_intf_desc_t *intf_desc; // Pointer to data interface descriptor
         SemaphoreHandle_t out_mux;        // OUT mutex
+        usb_transfer_t **out_ring;        // OUT data transfers of non-blocking transmit, submitted in ring order
+        size_t out_ring_len;              // Number of transfers in out_ring
+        size_t out_ring_head;             // Index of the next transfer to submit
+        SemaphoreHandle_t out_ring_free;  // Counts out_ring transfers that are not in flight
+        SemaphoreHandle_t out_ring_mux;   // Keeps non-blocking submissions in ring order
+        cdc_acm_tx_done_callback_t out_cb; // User's callback for finished non-blocking transmits
     } data;
 
     struct {
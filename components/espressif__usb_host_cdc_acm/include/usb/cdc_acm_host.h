@@ -129,6 +129,26 @@ esp_err_t cdc_acm_host_close(cdc_acm_dev_hdl_t cdc_hdl);
  */
 esp_err_t cdc_acm_host_data_tx_blocking(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, uint32_t timeout_ms);
 
+/**
+ * @brief Transmit data - non-blocking mode
+ *
+ * Data is copied to the next of out_xfer_count pre-allocated OUT transfers, which is submitted without waiting for its completion.
+ * Transfers are sent in the order of the calls. Once all of them are in flight, the call waits up to timeout_ms for one to finish.
+ * When a transfer is finished, tx_done_cb from the device configuration is called.
+ *
+ * @note If no transfer finishes within a non-zero timeout_ms, the OUT endpoint is reset and all transfers in flight are canceled.
+ * @param cdc_hdl CDC handle obtained from cdc_acm_host_open()
+ * @param[in] data       Data to be sent
+ * @param[in] data_len   Data length, at most out_buffer_size
+ * @param[in] timeout_ms Time to wait for a free OUT transfer in [ms], 0 to return immediately
+ * @return
+ *   - ESP_OK: Data submitted
+ *   - ESP_ERR_TIMEOUT: All OUT transfers are still in flight
+ *   - ESP_ERR_NOT_SUPPORTED: The device was opened with out_xfer_count set to 0
+ *   - ESP_ERR_INVALID_SIZE: data_len is larger than out_buffer_size
+ */
+esp_err_t cdc_acm_host_data_tx_async(cdc_acm_dev_hdl_t cdc_hdl, const uint8_t *data, size_t data_len, uint32_t timeout_ms);
+
 /**
  * @brief Print device's descriptors
  *
@@ -200,6 +220,11 @@ public:
         return cdc_acm_host_data_tx_blocking(this->cdc_hdl, data, len, timeout_ms);
     }
 
+    inline esp_err_t tx_async(uint8_t *data, size_t len, uint32_t timeout_ms = 0)
+    {
+        return cdc_acm_host_data_tx_async(this->cdc_hdl, data, len, timeout_ms);
+    }
+
     inline esp_err_t open(uint16_t vid, uint16_t pid, uint8_t interface_idx, const cdc_acm_host_device_config_t *dev_config)
     {
         return cdc_acm_host_open(vid, pid, interface_idx, dev_config, &this->cdc_hdl);
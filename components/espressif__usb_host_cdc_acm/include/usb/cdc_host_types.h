@@ -46,6 +46,18 @@ typedef struct {
  */
 typedef bool (*cdc_acm_data_callback_t)(const uint8_t *data, size_t data_len, void *user_arg);
 
+/**
+ * @brief Data transmitted callback type
+ *
+ * Called from the driver's task when a transfer submitted by cdc_acm_host_data_tx_async() is finished
+ * and its OUT transfer can be reused.
+ *
+ * @param[in] data_len  Number of bytes actually transmitted
+ * @param[in] completed True if the transfer completed, false if it failed or was canceled
+ * @param[in] user_arg  User's argument passed to open function
+ */
+typedef void (*cdc_acm_tx_done_callback_t)(size_t data_len, bool completed, void *user_arg);
+
 /**
  * @brief Device event callback type
  *
@@ -64,4 +76,8 @@ typedef struct {
     cdc_acm_host_dev_callback_t event_cb; /**< Device's event callback function. Can be NULL */
     cdc_acm_data_callback_t data_cb;      /**< Device's data RX callback function. Can be NULL for write-only devices */
     void *user_arg;                       /**< User's argument that will be passed to the callbacks */
+    size_t out_xfer_count;                /**< Number of bulk out transfers of out_buffer_size for cdc_acm_host_data_tx_async(), set to 0 for blocking transmit only */
+    cdc_acm_tx_done_callback_t tx_done_cb; /**< Transmit finished callback of cdc_acm_host_data_tx_async(). Can be NULL */
+    size_t in_xfer_count;                 /**< Number of bulk in transfers of in_buffer_size queued at once, 0 or 1 for a single transfer.
+                                               With more than one, a transfer is always posted while data_cb runs, but received data is never appended: the return value of data_cb is ignored */
 } cdc_acm_host_device_config_t;
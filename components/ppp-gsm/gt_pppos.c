@@ -21,10 +21,13 @@
 #include "string.h"
 #include <unistd.h> 
 #include <ctype.h>
+#include <stdio.h>
 #include "gt_pppos.h"
 #include <time.h>
 #include <sys/time.h>
 #include "ppp.h"
+#include "lwip/netif.h"
+#include "esp_system.h"
 
 #if CONFIG_GSM_SERIAL_CONFIG_USB
 #include "esp_modem_usb_config.h"
@@ -65,14 +68,142 @@ EventGroupHandle_t gsm_event_group = NULL;
 esp_modem_dce_t *dce;
 esp_netif_t *Global_Modem_Netif;
 
+// Commands of the SIM800-era TCP/IP stack (CIPSHUT, SAPBR, CSTT), LTE modules answer them with ERROR
+#define MODEM_CAP_LEGACY_IP BIT0
 
+// Until the module is known, every command is sent
+static uint32_t modem_caps = MODEM_CAP_LEGACY_IP;
 
-esp_err_t modem_init(){
+static volatile modem_state_t modem_state = MODEM_STATE_INIT;
+static conn_info_t *modem_info;
 
-    gsm_event_group = xEventGroupCreate();
+/**
+ * @brief Poll the modem with "AT" until it answers, instead of waiting a fixed boot time.
+ *
+ * @param timeout_ms How long to keep polling.
+ * @return `ESP_OK` once the modem answered, `ESP_ERR_TIMEOUT` otherwise.
+ */
+esp_err_t modem_wait_ready(int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
 
-    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &on_ip_event, NULL));
-    ESP_ERROR_CHECK(esp_event_handler_register(NETIF_PPP_STATUS, ESP_EVENT_ANY_ID, &on_ppp_changed, NULL));
+    do {
+        CHECK_USB_DISCONNECTION(gsm_event_group);
+
+        if (esp_modem_sync(dce) == ESP_OK) {
+            ESP_LOGI(TAG, "Modem ready after %d ms", (int)pdTICKS_TO_MS(xTaskGetTickCount() - start));
+            return ESP_OK;
+        }
+        vTaskDelay(pdMS_TO_TICKS(MODEM_READY_POLL_MS));
+    } while (xTaskGetTickCount() - start < pdMS_TO_TICKS(timeout_ms));
+
+    return ESP_ERR_TIMEOUT;
+}
+
+// Which optional commands the module understands, from its AT+CGMM name
+static void modem_detect(void)
+{
+    char name[128] = {0};
+
+    if (esp_modem_get_module_name(dce, name) != ESP_OK) {
+        ESP_LOGW(TAG, "Module name unknown, sending all commands");
+        return;
+    }
+
+    if (strstr(name, "A76") || strstr(name, "SIM76")) {
+        modem_caps &= ~MODEM_CAP_LEGACY_IP;
+    }
+
+    ESP_LOGI(TAG, "Module %s, legacy IP commands %s", name, (modem_caps & MODEM_CAP_LEGACY_IP) ? "on" : "off");
+}
+
+// +CREG: <n>,<stat>, registered on the home network (1) or roaming (5)
+static bool modem_is_registered(void)
+{
+    char response[500] = {0};
+    const char *creg;
+    int stat = 0;
+
+    if (esp_modem_at(dce, "AT+CREG?", response, 1000) != ESP_OK) {
+        return false;
+    }
+
+    creg = strstr(response, "+CREG:");
+    return creg && sscanf(creg, "+CREG: %*d,%d", &stat) == 1 && (stat == 1 || stat == 5);
+}
+
+// lwIP keeps its PPP control block in the state of the netif esp_netif created
+static ppp_pcb *modem_ppp_pcb(void)
+{
+    struct netif *lwip_netif = esp_netif_get_netif_impl(Global_Modem_Netif);
+
+    return lwip_netif ? (ppp_pcb *)lwip_netif->state : NULL;
+}
+
+// LCP options asked for on the next dial. USB CDC carries every octet as
+// is, so there is nothing to escape but the flag and the escape octet, and
+// the 0xFF 0x03 address/control field and the high protocol byte are dropped.
+static void modem_ppp_tune(void)
+{
+#if CONFIG_GSM_MODEM_PPP_TUNING
+    ppp_pcb *pcb = modem_ppp_pcb();
+
+    if (!pcb) {
+        return;
+    }
+
+    pcb->lcp_wantoptions.neg_asyncmap = 1;
+    pcb->lcp_wantoptions.asyncmap = 0;
+    pcb->lcp_wantoptions.neg_pcompression = 1;
+    pcb->lcp_wantoptions.neg_accompression = 1;
+
+    // whatever ACCM the modem asks for on its side is still honored
+    pcb->lcp_allowoptions.neg_asyncmap = 1;
+    pcb->lcp_allowoptions.asyncmap = 0;
+    pcb->lcp_allowoptions.neg_pcompression = 1;
+    pcb->lcp_allowoptions.neg_accompression = 1;
+#endif
+}
+
+// What LCP settled on, an ACCM not negotiated means every control character is escaped
+static void modem_ppp_log_options(void)
+{
+    ppp_pcb *pcb = modem_ppp_pcb();
+
+    if (!pcb) {
+        return;
+    }
+
+    const lcp_options *tx = &pcb->lcp_hisoptions;
+    const lcp_options *rx = &pcb->lcp_gotoptions;
+
+    ESP_LOGI(TAG, "LCP out: ACCM %08" PRIx32 ", PFC %d, ACFC %d / in: ACCM %08" PRIx32 ", PFC %d, ACFC %d",
+             tx->neg_asyncmap ? (uint32_t)tx->asyncmap : UINT32_MAX, (int)tx->neg_pcompression, (int)tx->neg_accompression,
+             rx->neg_asyncmap ? (uint32_t)rx->asyncmap : UINT32_MAX, (int)rx->neg_pcompression, (int)rx->neg_accompression);
+}
+
+// Deactivates the PDP context before dialing, plus what the legacy stack keeps open
+static void modem_clear_context(void)
+{
+    char response[500] = {0};
+
+    if (modem_caps & MODEM_CAP_LEGACY_IP) {
+        esp_modem_at(dce, "AT+CIPSHUT", response, 2000);
+        esp_modem_at(dce, "AT+SAPBR=0,1", response, 2000);
+    }
+    esp_modem_at(dce, "AT+CGACT=0", response, 2000);
+}
+
+
+
+/**
+ * @brief Create the DTE/DCE and wait until the modem answers.
+ *
+ * Runs as the first step of the modem task, see modem_start().
+ *
+ * @return `ESP_OK` once the modem answered, `ESP_ERR_TIMEOUT` if it did not within MODEM_READY_TIMEOUT_MS.
+ */
+esp_err_t modem_init(){
 
     /* Configure the PPP netif */
     esp_modem_dce_config_t dce_config = ESP_MODEM_DCE_DEFAULT_CONFIG(CONFIG_GSM_MODEM_PPP_APN);
@@ -149,12 +280,18 @@ esp_err_t modem_init(){
     struct esp_modem_usb_term_config usb_term_config = {
         .vid = 0x1E0E,                     // SimCom vendor ID
         .pid = 0x9011,                     // A7670 product ID
-        .interface_idx = 5,                // Interface 5 for AT commands
+        .interface_idx = 5,                // Interface 5 for AT commands, then PPP once dialed
+#if CONFIG_GSM_MODEM_USB_DUAL_PORT
+        .secondary_interface_idx = CONFIG_GSM_MODEM_USB_AT_INTERFACE, // AT commands while PPP runs
+#else
         .secondary_interface_idx = -1,     // No secondary interface
+#endif
         .timeout_ms = 10000,               // 10 seconds timeout
         .xCoreID = 0,                      // Core 0
         .cdc_compliant = true,             // This is critical - set it to CDC compliant
-        .install_usb_host = true           // Install USB host driver
+        .install_usb_host = true,          // Install USB host driver
+        .out_xfer_count = 4,               // PPP frames queued on bulk OUT without waiting for each other
+        .in_xfer_count = 3                 // Bulk IN buffers posted while the netif takes the previous one
     };
     
     // Create DTE configuration with USB settings
@@ -177,15 +314,14 @@ esp_err_t modem_init(){
     // Register USB error handler callback
     esp_modem_set_error_cb(dce, usb_terminal_error_handler);
     
-    ESP_LOGI(TAG, "USB modem connected, waiting 5 seconds for boot...");
-    vTaskDelay(pdMS_TO_TICKS(5000)); // Give DTE some time to boot
+    ESP_LOGI(TAG, "USB modem connected, waiting for it to answer...");
 #else
 #error Invalid serial connection to modem. Set CONFIG_GSM_SERIAL_CONFIG_UART or CONFIG_GSM_SERIAL_CONFIG_USB
 #endif
 
     xEventGroupClearBits(gsm_event_group, PPP_GOT_IP_BIT);
 
-    return ESP_OK;
+    return modem_wait_ready(MODEM_READY_TIMEOUT_MS);
 }
 
 /**
@@ -203,13 +339,10 @@ esp_err_t sim_ppp_connect() {
     const int STEP_DELAY_MS = 200;
     const int MAX_RETRIES = 2;
     
-    char response[1000] = {0};
     int retry_count = 0;
 
-    // Clear any previous USB disconnected event
-    if (gsm_event_group) {
-        xEventGroupClearBits(gsm_event_group, USB_DISCONNECTED_BIT);
-    }
+    // A new session, modem_task waits for this bit to re-dial
+    xEventGroupClearBits(gsm_event_group, PPP_STOPPED_BIT);
 
     if (esp_modem_sync(dce) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to sync modem");
@@ -220,12 +353,8 @@ esp_err_t sim_ppp_connect() {
     CHECK_USB_DISCONNECTION(gsm_event_group);
     
     // Clear modem state
-    esp_modem_at(dce, "AT+CIPSHUT", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(STEP_DELAY_MS));
-    esp_modem_at(dce, "AT+CGACT=0", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(STEP_DELAY_MS));
-    esp_modem_at(dce, "AT+SAPBR=0,1", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(STEP_DELAY_MS));
+    modem_clear_context();
+    modem_ppp_tune();
 
     while (retry_count < MAX_RETRIES) {
 
@@ -300,16 +429,24 @@ void on_ppp_changed(void *arg, esp_event_base_t event_base, int32_t event_id, vo
 
             case NETIF_PPP_PHASE_RUNNING:
                 ESP_LOGI(TAG, "PPP phase: Running");
+                modem_ppp_log_options();
                 if (gsm_event_group) {
                     xEventGroupSetBits(gsm_event_group, PPP_GOT_IP_BIT);
                 }
                 break;
 
             case NETIF_PPP_PHASE_TERMINATE:
+                ESP_LOGI(TAG, "PPP phase: Terminating");
+                if (gsm_event_group) {
+                    xEventGroupClearBits(gsm_event_group, PPP_GOT_IP_BIT);
+                }
+                break;
+
             case NETIF_PPP_PHASE_DISCONNECT:
-                ESP_LOGI(TAG, "PPP phase: Terminating/Disconnecting");
+                ESP_LOGI(TAG, "PPP phase: Disconnecting");
                 if (gsm_event_group) {
                     xEventGroupClearBits(gsm_event_group, PPP_GOT_IP_BIT);
+                    xEventGroupSetBits(gsm_event_group, PPP_STOPPED_BIT);
                 }
                 break;
 
@@ -330,9 +467,12 @@ void on_ppp_changed(void *arg, esp_event_base_t event_base, int32_t event_id, vo
             case NETIF_PPP_ERRORCONNECT:
             case NETIF_PPP_ERRORAUTHFAIL:
             case NETIF_PPP_ERRORPROTOCOL:
+            case NETIF_PPP_ERRORPEERDEAD:
                 ESP_LOGE(TAG, "PPP error event: %ld", event_id);
                 if (gsm_event_group) {
                     xEventGroupClearBits(gsm_event_group, PPP_GOT_IP_BIT);
+                    // the session is over, also when phase events are not compiled in
+                    xEventGroupSetBits(gsm_event_group, PPP_STOPPED_BIT);
                 }
                 break;
 
@@ -388,13 +528,30 @@ void on_ip_event(void *arg, esp_event_base_t event_base,
     }
 }
 
+// Polls AT+COPS? until an operator shows up, the modem registers on its own after boot
+static esp_err_t wait_operator(conn_info_t *info, int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+
+    do {
+        CHECK_USB_DISCONNECTION(gsm_event_group);
+
+        if (try_cops_query(info) == ESP_OK) {
+            ESP_LOGI(TAG, "Operator %s after %d ms", info->operator_name, (int)pdTICKS_TO_MS(xTaskGetTickCount() - start));
+            return ESP_OK;
+        }
+        vTaskDelay(pdMS_TO_TICKS(MODEM_REGISTER_POLL_MS));
+    } while (xTaskGetTickCount() - start < pdMS_TO_TICKS(timeout_ms));
+
+    return ESP_ERR_TIMEOUT;
+}
+
 /**
- * @brief Set the modem to command mode and perform various AT commands to clear the modem context and retrieve the operator name.
+ * @brief Set the modem to command mode, store the APN and wait for network registration.
  *
- * This function attempts to set the modem to command mode, clear the modem context, and retrieve the operator name. 
- * It retries the operator name retrieval up to 10 times, and if that fails, 
- * it performs additional AT commands (AT+COPS=?, AT+CFUN=0, AT+CFUN=1,1) and retries the operator name retrieval up to 3 more times.
- * In between sets to command mode again. For USB connections, it handles disconnection events.
+ * The operator is polled every MODEM_REGISTER_POLL_MS for up to MODEM_REGISTER_TIMEOUT_MS.
+ * If none shows up, the modem context is cleared, the radio is reset (AT+CFUN=0, AT+CFUN=1,1)
+ * and the operator is polled once more. For USB connections, it handles disconnection events.
  * 
  * @param info Pointer to a `conn_info_t` struct to store the retrieved operator name and signal quality information.
  * @return `ESP_OK` if the operator name was successfully retrieved, `ESP_FAIL` otherwise.
@@ -407,8 +564,6 @@ esp_err_t operator_register(conn_info_t *info)
 
     char response[1000] = {0};
 
-    esp_err_t ret;
-
     // Check if USB is disconnected (for USB configuration)
     CHECK_USB_DISCONNECTION(gsm_event_group);
 
@@ -428,85 +583,38 @@ esp_err_t operator_register(conn_info_t *info)
     }
     ESP_LOGI(TAG, "Modem in command mode now.");
 
-   //save APN to modem
-    memset(response, 0, sizeof(response));
+    // save APN to modem, each command waits for its OK so no pause is needed in between
     esp_modem_at(dce, "AT+CGDCONT=1", response, 4000);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    memset(response, 0, sizeof(response));
     esp_modem_at(dce, "AT+CGDCONT=1,\"IP\",\"" CONFIG_GSM_MODEM_PPP_APN "\"", response, 4000);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+CSTT=\"" CONFIG_GSM_MODEM_PPP_APN "\"", response, 4000);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    memset(response, 0, sizeof(response));
+    if (modem_caps & MODEM_CAP_LEGACY_IP) {
+        esp_modem_at(dce, "AT+CSTT=\"" CONFIG_GSM_MODEM_PPP_APN "\"", response, 4000);
+    }
     esp_modem_at(dce, "AT+CLTS=1", response, 3000);
-    vTaskDelay(pdMS_TO_TICKS(200));
-    memset(response, 0, sizeof(response));
     esp_modem_at(dce, "AT&W", response, 4000);
-    vTaskDelay(pdMS_TO_TICKS(200));
     
     //
-    // Step 2: Quick tries with "AT+COPS?" 
+    // Step 2: Wait for the operator
     //
-    for (int i = 0; i < 8; i++) {
-        ret = try_cops_query(info);
-        if (ret == ESP_OK) {
-            ESP_LOGI(TAG, "Operator found quickly with no reset needed");
-            return ESP_OK;
-        }
-        vTaskDelay(pdMS_TO_TICKS(3000));
+    if (wait_operator(info, MODEM_REGISTER_TIMEOUT_MS) == ESP_OK) {
+        return ESP_OK;
     }
-    ESP_LOGW(TAG, "No operator found in quick tries => do full reset.");
+    ESP_LOGW(TAG, "No operator found => do full reset.");
 
-
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+CREG?", response, 1000);
-    if (strstr(response, "+CREG: 0,1") || strstr(response, "+CREG: 0,5"))
-    {
+    if (modem_is_registered()) {
         ESP_LOGI(TAG, "Modem is registered on the network");
-    }
-    else
-    {
+    } else {
         ESP_LOGW(TAG, "Modem is not registered");
-        ESP_LOGI(TAG, "AT+CREG? response: %s", response);
     }
 
     // Clear modem context
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+CIPSHUT", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(500));
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+CGACT=0", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(500));
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+SAPBR=0,1", response, 2000);
-    vTaskDelay(pdMS_TO_TICKS(500));
+    modem_clear_context();
 
-   //
+    //
     // Step 3: Full modem reset
     //
-    modem_full_reset();
-
-
-    // Try again
-    for (int i = 0; i < 8; i++) {
-        ret = try_cops_query(info);
-        if (ret == ESP_OK) {
-            ESP_LOGI(TAG, "Operator found after full reset");
-            return ESP_OK;
-        }
-        vTaskDelay(pdMS_TO_TICKS(3000));
-    }
-
-    memset(response, 0, sizeof(response));
-    esp_modem_at(dce, "AT+CREG?", response, 1000);
-    if (strstr(response, "+CREG: 0,1") || strstr(response, "+CREG: 0,5"))
-    {
-        ESP_LOGI(TAG, "Modem is registered on the network");
-    }
-    else
-    {
-        ESP_LOGW(TAG, "Modem is not registered");
+    if (modem_full_reset() == ESP_OK && wait_operator(info, MODEM_REGISTER_TIMEOUT_MS) == ESP_OK) {
+        ESP_LOGI(TAG, "Operator found after full reset");
+        return ESP_OK;
     }
 
     // If we get here, no operator recognized
@@ -562,6 +670,7 @@ esp_err_t operator_register(conn_info_t *info)
     info->operator_name[sizeof(info->operator_name) - 1] = '\0';
     info->rssi = rssi;
     info->ber  = ber;
+    info->registered = true;
 
     return ESP_OK;
 }
@@ -590,22 +699,175 @@ esp_err_t modem_full_reset(void)
     
     // Give the modem time to reset and recover
     ESP_LOGI(TAG, "Waiting for modem to reset...");
-    vTaskDelay(pdMS_TO_TICKS(1000));  // Wait 1 second for modem to initialize
-
-    // Try to sync with modem multiple times
-    for (int i = 0; i < 5; i++) {
-        ESP_LOGI(TAG, "Attempting modem sync, try %d/5", i + 1);
-        if (esp_modem_sync(dce) == ESP_OK) {
-            ESP_LOGI(TAG, "Modem sync successful after reset");
-            return ESP_OK;
-        }
-        vTaskDelay(pdMS_TO_TICKS(1000));  // Wait 1 second between attempts
+    if (modem_wait_ready(MODEM_READY_TIMEOUT_MS) == ESP_OK) {
+        return ESP_OK;
     }
 
     ESP_LOGE(TAG, "Modem not responding after reset and sync attempts");
     return ESP_FAIL;
 }
 
+/**
+ * @brief Refresh signal quality and network registration while PPP is running.
+ *
+ * The queries go to the separate AT port, the PPP data interface is not touched.
+ * With a single port they would have to leave data mode, so they are not sent.
+ *
+ * @param info Pointer to a `conn_info_t` struct to update with rssi, ber and registration.
+ * @return `ESP_OK` on success, `ESP_ERR_NOT_SUPPORTED` without a separate AT port, `ESP_FAIL` if the modem did not answer.
+ */
+esp_err_t modem_poll_status(conn_info_t *info)
+{
+    if (!info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+#if CONFIG_GSM_MODEM_USB_DUAL_PORT
+    int rssi = 0, ber = 0;
+
+    CHECK_USB_DISCONNECTION(gsm_event_group);
+
+    if (esp_modem_get_signal_quality(dce, &rssi, &ber) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    info->rssi = rssi;
+    info->ber = ber;
+    info->registered = modem_is_registered();
+
+    ESP_LOGD(TAG, "RSSI=%d, BER=%d, registered=%d", rssi, ber, info->registered);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static const char *modem_state_name(modem_state_t state)
+{
+    switch (state) {
+        case MODEM_STATE_INIT: return "INIT";
+        case MODEM_STATE_WAIT_READY: return "WAIT_READY";
+        case MODEM_STATE_REGISTER: return "REGISTER";
+        case MODEM_STATE_DIAL: return "DIAL";
+        case MODEM_STATE_ONLINE: return "ONLINE";
+        case MODEM_STATE_RESET: return "RESET";
+        default: return "UNKNOWN";
+    }
+}
+
+static void modem_set_state(modem_state_t state)
+{
+    ESP_LOGI(TAG, "Modem state %s -> %s", modem_state_name(modem_state), modem_state_name(state));
+    modem_state = state;
+}
+
+// Bring-up and re-dial. Every step moves on as soon as the modem answers,
+// a dropped PPP session is dialed again without another registration.
+static void modem_task(void *arg)
+{
+    int dial_failures = 0;
+
+    for (;;) {
+        if (xEventGroupGetBits(gsm_event_group) & USB_DISCONNECTED_BIT) {
+            // The USB terminals are closed, only a new DCE could talk to the modem again
+            ESP_LOGE(TAG, "USB modem gone, restarting");
+            esp_restart();
+        }
+
+        switch (modem_state) {
+            case MODEM_STATE_INIT:
+                // the DCE is created once, a modem still booting is polled further in WAIT_READY
+                if (modem_init() == ESP_OK) {
+                    modem_detect();
+                    modem_set_state(MODEM_STATE_REGISTER);
+                } else {
+                    modem_set_state(MODEM_STATE_WAIT_READY);
+                }
+                break;
+
+            case MODEM_STATE_WAIT_READY:
+                if (modem_wait_ready(MODEM_READY_TIMEOUT_MS) == ESP_OK) {
+                    modem_detect();
+                    modem_set_state(MODEM_STATE_REGISTER);
+                } else {
+                    ESP_LOGW(TAG, "Modem not answering, still waiting");
+                }
+                break;
+
+            case MODEM_STATE_REGISTER:
+                modem_set_state(operator_register(modem_info) == ESP_OK ? MODEM_STATE_DIAL : MODEM_STATE_RESET);
+                break;
+
+            case MODEM_STATE_DIAL:
+                if (sim_ppp_connect() == ESP_OK) {
+                    dial_failures = 0;
+                    modem_set_state(MODEM_STATE_ONLINE);
+                } else if (++dial_failures >= MODEM_DIAL_ATTEMPTS) {
+                    dial_failures = 0;
+                    modem_set_state(MODEM_STATE_RESET);
+                } else {
+                    // maybe the registration was lost with the link
+                    vTaskDelay(pdMS_TO_TICKS(MODEM_REDIAL_DELAY_MS));
+                    modem_set_state(MODEM_STATE_REGISTER);
+                }
+                break;
+
+            case MODEM_STATE_ONLINE:
+                xEventGroupWaitBits(gsm_event_group, PPP_STOPPED_BIT | USB_DISCONNECTED_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+                if (xEventGroupGetBits(gsm_event_group) & PPP_STOPPED_BIT) {
+                    ESP_LOGW(TAG, "PPP disconnected, re-dialing");
+                    // the DCE is still in data mode, leave it so that the dial starts from command mode
+                    esp_modem_set_mode(dce, ESP_MODEM_MODE_COMMAND);
+                    modem_set_state(MODEM_STATE_DIAL);
+                }
+                break;
+
+            case MODEM_STATE_RESET:
+                modem_full_reset();
+                modem_set_state(MODEM_STATE_WAIT_READY);
+                break;
+        }
+    }
+}
+
+/**
+ * @brief Start the modem bring-up and PPP re-dial in the background.
+ *
+ * Returns right away, so the caller can prepare the camera and DTLS while the
+ * modem boots and registers. Wait for PPP_GOT_IP_BIT in gsm_event_group before
+ * using the network.
+ *
+ * @param info Pointer to a `conn_info_t` struct to store the operator name and signal quality, must stay valid.
+ * @return `ESP_OK` if the modem task was started.
+ */
+esp_err_t modem_start(conn_info_t *info)
+{
+    if (!info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (gsm_event_group) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    modem_info = info;
+    gsm_event_group = xEventGroupCreate();
+    if (!gsm_event_group) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, ESP_EVENT_ANY_ID, &on_ip_event, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(NETIF_PPP_STATUS, ESP_EVENT_ANY_ID, &on_ppp_changed, NULL));
+
+    if (xTaskCreate(modem_task, "modem", MODEM_TASK_STACK_SIZE, NULL, MODEM_TASK_PRIORITY, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+modem_state_t modem_get_state(void)
+{
+    return modem_state;
+}
+
 esp_err_t set_data_mode(esp_modem_dce_t *dce)
 {
     if (dce == NULL) {
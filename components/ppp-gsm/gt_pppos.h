@@ -20,6 +20,7 @@ typedef struct {
     char operator_name[32];
     int rssi;
     int ber;
+    bool registered;
 } conn_info_t;
 
 // Global variables
@@ -45,8 +46,30 @@ extern esp_netif_t *Global_Modem_Netif;
 
 #define PPP_CONNECT_TIMEOUT_MS    15000
 
+#define MODEM_READY_TIMEOUT_MS    20000 // boot or reset until the modem answers "AT"
+#define MODEM_READY_POLL_MS       200
+#define MODEM_REGISTER_TIMEOUT_MS 30000 // until an operator shows up
+#define MODEM_REGISTER_POLL_MS    1000
+#define MODEM_DIAL_ATTEMPTS       3     // failed dials in a row before the radio is reset
+#define MODEM_REDIAL_DELAY_MS     1000
+#define MODEM_TASK_STACK_SIZE     8192
+#define MODEM_TASK_PRIORITY       5
+
+// Bring-up and re-dial steps of the modem task
+typedef enum {
+    MODEM_STATE_INIT,       // creating the DTE/DCE
+    MODEM_STATE_WAIT_READY, // polling "AT" until the modem answers
+    MODEM_STATE_REGISTER,   // storing the APN, waiting for an operator
+    MODEM_STATE_DIAL,       // entering data mode, waiting for PPP
+    MODEM_STATE_ONLINE,     // PPP up, waiting for it to drop
+    MODEM_STATE_RESET,      // radio reset after repeated failures
+} modem_state_t;
+
 
 // Function prototypes
+esp_err_t modem_start(conn_info_t *info);
+modem_state_t modem_get_state(void);
+esp_err_t modem_wait_ready(int timeout_ms);
 esp_err_t modem_init();
 esp_err_t sim_ppp_connect(void);
 esp_err_t operator_register(conn_info_t *info);
@@ -58,6 +81,7 @@ const char* ppp_err_to_name(int32_t err) ;
  bool is_known_operator(const char *response, char *name, size_t name_size) ;
  esp_err_t try_cops_query(conn_info_t *info);
  esp_err_t modem_full_reset(void);
+esp_err_t modem_poll_status(conn_info_t *info);
 
 #if CONFIG_GSM_SERIAL_CONFIG_USB
 void usb_terminal_error_handler(esp_modem_terminal_error_t err);
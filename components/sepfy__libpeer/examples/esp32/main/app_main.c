@@ -88,12 +88,12 @@ void peer_connection_task(void *arg) {
 
   for(;;) {
 
+    peer_connection_wait(g_pc, 100);
+
     if (xSemaphoreTake(xSemaphore, portMAX_DELAY)) {
         peer_connection_loop(g_pc);
         xSemaphoreGive(xSemaphore);
     }
-
-    vTaskDelay(pdMS_TO_TICKS(1));
   }
 }
 
@@ -56,8 +56,8 @@ static void* peer_connection_task(void *data) {
 
   while (!g_interrupted) {
 
+    peer_connection_wait(g_pc, 100);
     peer_connection_loop(g_pc);
-    usleep(1000); 
   }
 
   pthread_exit(NULL); 
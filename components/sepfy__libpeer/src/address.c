@@ -60,6 +60,16 @@ int addr_to_string(const Address *addr, char *buf, size_t len) {
 }
 
 int addr_equal(const Address *a, const Address *b) {
-  // TODO
-  return 1;
+
+  if (a->family != b->family || a->port != b->port) {
+    return 0;
+  }
+
+  switch (a->family) {
+    case AF_INET6:
+      return memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, sizeof(struct in6_addr)) == 0;
+    case AF_INET:
+    default:
+      return a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+  }
 }
@@ -14,10 +14,23 @@
 #include "base64.h"
 #include "agent.h"
 #include "ports.h"
+#include "ssl_transport.h"
 
 #define AGENT_POLL_TIMEOUT 1
-#define AGENT_CONNCHECK_MAX 300
-#define AGENT_CONNCHECK_PERIOD 100
+#define AGENT_CHECK_TA 50 // ms between two checks, RFC 8445 14.2
+#define AGENT_CHECK_RTO 500 // ms, lower bound of the check RTO, RFC 8445 14.3
+#define AGENT_CHECK_RETRANSMITS 4
+#define AGENT_CHECKLIST_TIMEOUT 10000 // ms the peer may still reach us when every pair failed
+#define AGENT_NOMINATION_WAIT 500 // ms a better pair may still succeed before the best valid one is nominated
+#define AGENT_GATHER_TIMEOUT 3000 // ms for all ICE servers together
+#define AGENT_GATHER_RTO 500 // ms, initial RTO of RFC 5389 7.2.1, doubled on each retransmission
+#define AGENT_GATHER_RETRANSMITS 6 // Rc - 1, over UDP only
+
+#define AGENT_TURN_LIFETIME 600 // s, asked for on every allocation refresh
+#define AGENT_TURN_CHANNEL_LIFETIME 300000 // ms, a ChannelBind also refreshes the permission, which lasts 5 minutes
+#define AGENT_TURN_REFRESH_MARGIN 60000 // ms before expiry
+#define AGENT_TURN_RTO 1000 // ms before an unanswered TURN request is sent again
+#define AGENT_TURN_CHANNEL_MIN 0x4000
 
 static int agent_create_sockets(Agent *agent) {
 
@@ -38,17 +51,232 @@ static int agent_create_sockets(Agent *agent) {
   return 0;
 }
 
+static int agent_turn_stream_fd(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+
+  switch (turn->transport) {
+    case TURN_TRANSPORT_TCP:
+      return turn->tcp_socket.fd > 0 ? turn->tcp_socket.fd : -1;
+    case TURN_TRANSPORT_TLS:
+      return turn->tls && turn->tls->tcp_socket.fd > 0 ? turn->tls->tcp_socket.fd : -1;
+    default:
+      return -1;
+  }
+}
+
+static void agent_turn_stream_close(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+
+  if (turn->tls) {
+    ssl_transport_disconnect(turn->tls);
+    free(turn->tls);
+    turn->tls = NULL;
+  } else if (turn->transport == TURN_TRANSPORT_TCP && turn->tcp_socket.fd > 0) {
+    tcp_socket_close(&turn->tcp_socket);
+  }
+
+  turn->tcp_socket.fd = -1;
+  turn->rx_len = 0;
+}
+
+static int agent_turn_stream_open(Agent *agent, const char *hostname, Address *serv_addr) {
+
+  TurnAllocation *turn = &agent->turn;
+  TcpSocket *tcp_socket = &turn->tcp_socket;
+
+  turn->rx_len = 0;
+
+  if (turn->transport == TURN_TRANSPORT_TLS) {
+
+    if ((turn->tls = calloc(1, sizeof(NetworkContext_t))) == NULL) {
+      LOGE("Failed to allocate TLS context");
+      return -1;
+    }
+
+    if (ssl_transport_connect(turn->tls, hostname, serv_addr->port, NULL) < 0) {
+      LOGE("Failed to connect TURN server over TLS");
+      agent_turn_stream_close(agent);
+      return -1;
+    }
+    tcp_socket = &turn->tls->tcp_socket;
+
+  } else if (tcp_socket_open(tcp_socket, serv_addr->family) < 0 || tcp_socket_connect(tcp_socket, serv_addr) < 0) {
+    LOGE("Failed to connect TURN server over TCP");
+    agent_turn_stream_close(agent);
+    return -1;
+  }
+
+  // media frames go out as they come instead of waiting for the ACK of the previous one
+  tcp_socket_set_low_latency(tcp_socket, TURN_TCP_SNDBUF);
+  return 0;
+}
+
+// Length of the first whole message in rx_buf, 0 if more bytes are needed.
+// Both kinds delimit themselves: a STUN header carries its length, and a
+// ChannelData one too but padded to 4 bytes on a stream (RFC 8656 12.5).
+static int agent_turn_stream_frame_len(TurnAllocation *turn) {
+
+  int len;
+
+  if (turn->rx_len < 4) {
+    return 0;
+  }
+
+  len = (turn->rx_buf[2] << 8) | turn->rx_buf[3];
+
+  if ((turn->rx_buf[0] & 0xc0) == 0x40) {
+    len = 4 + ((len + 3) & ~3);
+  } else if ((turn->rx_buf[0] & 0xc0) == 0x00) {
+    len = 20 + len;
+  } else {
+    return -1;
+  }
+
+  if (len > sizeof(turn->rx_buf)) {
+    return -1;
+  }
+
+  return turn->rx_len >= len ? len : 0;
+}
+
+// A whole message is buffered, or TLS already decrypted bytes the socket will not signal again
+static int agent_turn_stream_pending(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+
+  if (agent_turn_stream_frame_len(turn) != 0) {
+    return 1;
+  }
+
+  return turn->tls && mbedtls_ssl_get_bytes_avail(&turn->tls->ssl) > 0;
+}
+
+// Hands out one message per call, reading the stream only when none is buffered
+static int agent_turn_stream_recv(Agent *agent, uint8_t *buf, int len) {
+
+  TurnAllocation *turn = &agent->turn;
+  int frame_len;
+  int ret;
+
+  if ((frame_len = agent_turn_stream_frame_len(turn)) == 0) {
+
+    if (turn->transport == TURN_TRANSPORT_TLS) {
+      ret = ssl_transport_recv(turn->tls, turn->rx_buf + turn->rx_len, sizeof(turn->rx_buf) - turn->rx_len);
+      if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return 0;
+      }
+    } else {
+      ret = tcp_socket_recv(&turn->tcp_socket, turn->rx_buf + turn->rx_len, sizeof(turn->rx_buf) - turn->rx_len);
+    }
+
+    if (ret <= 0) {
+      LOGE("TURN server closed the connection");
+      agent_turn_stream_close(agent);
+      agent->b_turn = 0;
+      return -1;
+    }
+
+    turn->rx_len += ret;
+    frame_len = agent_turn_stream_frame_len(turn);
+  }
+
+  if (frame_len < 0) {
+    LOGE("Lost framing on the TURN stream");
+    agent_turn_stream_close(agent);
+    agent->b_turn = 0;
+    return -1;
+  } else if (frame_len == 0) {
+    return 0;
+  }
+
+  ret = frame_len;
+  if (frame_len > len) {
+    LOGW("TURN message too large: %d", frame_len);
+    ret = 0;
+  } else {
+    memcpy(buf, turn->rx_buf, frame_len);
+  }
+
+  turn->rx_len -= frame_len;
+  memmove(turn->rx_buf, turn->rx_buf + frame_len, turn->rx_len);
+  return ret;
+}
+
+#if AGENT_RECV_BATCH > 1
+// Everything the socket holds in one system call, the rest of the batch
+// waits in the agent for the next agent_recv
+static int agent_socket_recv_batch(Agent *agent, UdpSocket *udp_socket) {
+
+  int ret;
+  int i;
+
+  for (i = 0; i < AGENT_RECV_BATCH; i++) {
+    agent->recv_packets[i].buf = agent->recv_bufs[i];
+    agent->recv_packets[i].size = sizeof(agent->recv_bufs[i]);
+  }
+
+  if ((ret = udp_socket_recvmmsg(udp_socket, agent->recv_packets, AGENT_RECV_BATCH)) > 0) {
+    agent->recv_head = 0;
+    agent->recv_count = ret;
+  }
+
+  return ret;
+}
+
+static int agent_recv_pop(Agent *agent, Address *addr, uint8_t *buf, int len) {
+
+  UdpPacket *packet = &agent->recv_packets[agent->recv_head];
+
+  agent->recv_head++;
+  agent->recv_count--;
+
+  if (packet->len > len) {
+    LOGW("datagram too large: %d", packet->len);
+    return 0;
+  }
+
+  if (addr) {
+    memcpy(addr, &packet->addr, sizeof(Address));
+  }
+
+  memcpy(buf, packet->buf, packet->len);
+  return packet->len;
+}
+#endif
+
 static int agent_socket_recv(Agent *agent, Address *addr, uint8_t *buf, int len) {
 
   int ret = -1;
   int i = 0;
   int maxfd = 0;
+  int stream_fd = agent_turn_stream_fd(agent);
   fd_set rfds;
   struct timeval tv;
   tv.tv_sec = 0;
   tv.tv_usec = AGENT_POLL_TIMEOUT * 1000;
   FD_ZERO(&rfds);
 
+#if AGENT_RECV_BATCH > 1
+  if (agent->recv_count > 0) {
+    return agent_recv_pop(agent, addr, buf, len);
+  }
+#endif
+
+  if (stream_fd > 0) {
+
+    if (agent_turn_stream_pending(agent)) {
+      if (addr) {
+        memcpy(addr, &agent->turn.server, sizeof(Address));
+      }
+      return agent_turn_stream_recv(agent, buf, len);
+    }
+
+    FD_SET(stream_fd, &rfds);
+    maxfd = stream_fd;
+  }
+
   for (i = 0; i < 2; i++) {
     if (agent->udp_sockets[i].fd > maxfd) {
       maxfd = agent->udp_sockets[i].fd;
@@ -63,15 +291,199 @@ static int agent_socket_recv(Agent *agent, Address *addr, uint8_t *buf, int len)
     LOGE("select error");
   } else if (ret == 0) {
     // timeout
+  } else if (stream_fd > 0 && FD_ISSET(stream_fd, &rfds)) {
+    if (addr) {
+      memcpy(addr, &agent->turn.server, sizeof(Address));
+    }
+    ret = agent_turn_stream_recv(agent, buf, len);
   } else {
     for (i = 0; i < 2; i++) {
       if (FD_ISSET(agent->udp_sockets[i].fd, &rfds)) {
+#if AGENT_RECV_BATCH > 1
+        if ((ret = agent_socket_recv_batch(agent, &agent->udp_sockets[i])) > 0) {
+          ret = agent_recv_pop(agent, addr, buf, len);
+        }
+#else
         ret = udp_socket_recvfrom(&agent->udp_sockets[i], addr, buf, len);
+#endif
+        break;
+      }
+    }
+  }
+
+  return ret;
+}
+
+// ms until a TURN refresh or retransmission is due, -1 if there is none
+static int agent_turn_timeout(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+  uint32_t now = ports_get_epoch_time();
+  int32_t next;
+  int32_t timeout;
+  int i;
+
+  if (!agent->b_turn) {
+    return -1;
+  }
+
+  if (turn->sent_time) {
+    timeout = (int32_t)(turn->sent_time + AGENT_TURN_RTO - now);
+  } else {
+    timeout = (int32_t)(turn->expires - AGENT_TURN_REFRESH_MARGIN - now);
+  }
+
+  for (i = 0; i < turn->channels_num; i++) {
+
+    if (turn->channels[i].sent_time) {
+      next = (int32_t)(turn->channels[i].sent_time + AGENT_TURN_RTO - now);
+    } else if (turn->channels[i].bound) {
+      next = (int32_t)(turn->channels[i].expires - AGENT_TURN_REFRESH_MARGIN - now);
+    } else {
+      next = 0;
+    }
+
+    if (next < timeout) {
+      timeout = next;
+    }
+  }
+
+  return timeout > 0 ? timeout : 0;
+}
+
+// ms until a check is to be sent or retransmitted, -1 once a pair is selected
+static int agent_nominating(Agent *agent) {
+
+  int i;
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].use_candidate && agent->candidate_pairs[i].state != ICE_CANDIDATE_STATE_FAILED) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int agent_check_timeout(Agent *agent) {
+
+  IceCandidatePair *pair;
+  uint32_t now = ports_get_epoch_time();
+  int32_t next;
+  int32_t timeout = -1;
+  int nominate;
+  int i;
+
+  if (agent->selected_pair) {
+    if (agent->consent_time == 0) {
+      return -1;
+    }
+    timeout = (int32_t)(agent->consent_check_time - now);
+    return timeout > 0 ? timeout : 0;
+  }
+
+  if (agent->candidate_pairs_num == 0) {
+    return -1;
+  }
+
+  nominate = agent->mode == AGENT_MODE_CONTROLLING && agent->nomination == AGENT_NOMINATION_REGULAR && !agent_nominating(agent);
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+
+    pair = &agent->candidate_pairs[i];
+    switch (pair->state) {
+      case ICE_CANDIDATE_STATE_INPROGRESS:
+        next = (int32_t)(pair->sent_time + pair->rto - now);
+        break;
+      case ICE_CANDIDATE_STATE_WAITING:
+      case ICE_CANDIDATE_STATE_FROZEN:
+        next = (int32_t)(agent->check_time + AGENT_CHECK_TA - now);
+        break;
+      case ICE_CANDIDATE_STATE_SUCCEEDED:
+        if (!nominate) {
+          continue;
+        }
+        next = (int32_t)(agent->valid_time + AGENT_NOMINATION_WAIT - now);
         break;
+      default:
+        continue;
+    }
+
+    if (next < 0) {
+      next = 0;
+    }
+
+    if (timeout < 0 || next < timeout) {
+      timeout = next;
+    }
+  }
+
+  return timeout;
+}
+
+int agent_wait(Agent *agent, int event_fd, int timeout) {
+
+  int ret;
+  int i;
+  int maxfd = event_fd;
+  int turn_timeout;
+  int check_timeout;
+  int stream_fd = agent_turn_stream_fd(agent);
+  int pending = stream_fd > 0 && agent_turn_stream_pending(agent);
+  fd_set rfds;
+
+#if AGENT_RECV_BATCH > 1
+  pending = pending || agent->recv_count > 0;
+#endif
+  struct timeval tv;
+
+  if ((turn_timeout = agent_turn_timeout(agent)) >= 0 && turn_timeout < timeout) {
+    timeout = turn_timeout;
+  }
+
+  if ((check_timeout = agent_check_timeout(agent)) >= 0 && check_timeout < timeout) {
+    timeout = check_timeout;
+  }
+
+  if (pending) {
+    timeout = 0;
+  }
+
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  FD_ZERO(&rfds);
+
+  if (stream_fd > 0) {
+    FD_SET(stream_fd, &rfds);
+    if (stream_fd > maxfd) {
+      maxfd = stream_fd;
+    }
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (agent->udp_sockets[i].fd > 0) {
+      FD_SET(agent->udp_sockets[i].fd, &rfds);
+      if (agent->udp_sockets[i].fd > maxfd) {
+        maxfd = agent->udp_sockets[i].fd;
       }
     }
   }
 
+  if (event_fd >= 0) {
+    FD_SET(event_fd, &rfds);
+  }
+
+  ret = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+  if (ret < 0) {
+    LOGE("select error");
+  } else if (ret > 0 && event_fd >= 0 && FD_ISSET(event_fd, &rfds)) {
+    ports_event_wait(event_fd, 0);
+  }
+
+  if (ret == 0 && pending) {
+    ret = 1;
+  }
+
   return ret;
 }
 
@@ -87,320 +499,1232 @@ static int agent_socket_send(Agent *agent, Address *addr, const uint8_t *buf, in
   return -1;
 }
 
-static int agent_create_host_addr(Agent *agent) {
+// Everything for the TURN server, on the allocation's transport
+static int agent_turn_socket_send(Agent *agent, const uint8_t *buf, int len) {
+
+  TurnAllocation *turn = &agent->turn;
+
+  switch (turn->transport) {
+    case TURN_TRANSPORT_TCP:
+      return tcp_socket_send(&turn->tcp_socket, buf, len);
+    case TURN_TRANSPORT_TLS:
+      return turn->tls ? ssl_transport_send(turn->tls, buf, len) : -1;
+    case TURN_TRANSPORT_UDP:
+    default:
+      return agent_socket_send(agent, &turn->server, buf, len);
+  }
+}
+
+static void agent_turn_send_request(Agent *agent, StunMessage *msg, uint32_t *transaction_id) {
+
+  TurnAllocation *turn = &agent->turn;
+  StunHeader *header = (StunHeader *)msg->buf;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    transaction_id[i] = rand();
+  }
+  memcpy(header->transaction_id, transaction_id, sizeof(header->transaction_id));
+
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(turn->username), turn->username);
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_REALM, strlen(turn->realm), turn->realm);
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_NONCE, strlen(turn->nonce), turn->nonce);
+  stun_msg_finish(msg, STUN_CREDENTIAL_LONG_TERM, turn->credential, strlen(turn->credential));
+
+  agent_turn_socket_send(agent, msg->buf, msg->size);
+}
+
+static void agent_turn_send_refresh(Agent *agent, uint32_t lifetime) {
+
+  StunMessage msg;
+
+  memset(&msg, 0, sizeof(msg));
+  stun_msg_create(&msg, STUN_CLASS_REQUEST | STUN_METHOD_REFRESH);
+  lifetime = htonl(lifetime);
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_LIFETIME, sizeof(lifetime), (char *)&lifetime);
+  agent_turn_send_request(agent, &msg, agent->turn.transaction_id);
+  agent->turn.sent_time = ports_get_epoch_time();
+}
+
+static void agent_turn_send_channel_bind(Agent *agent, TurnChannel *channel) {
+
+  StunMessage msg;
+  uint32_t cookie = htonl(MAGIC_COOKIE);
+  char number[4] = { channel->number >> 8, channel->number & 0xff, 0, 0 };
+  char peer_address[8];
+
+  memset(&msg, 0, sizeof(msg));
+  stun_msg_create(&msg, STUN_CLASS_REQUEST | STUN_METHOD_CHANNEL_BIND);
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_CHANNEL_NUMBER, sizeof(number), number);
+  stun_set_mapped_address(peer_address, (uint8_t *)&cookie, &channel->peer);
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_XOR_PEER_ADDRESS, sizeof(peer_address), peer_address);
+  agent_turn_send_request(agent, &msg, channel->transaction_id);
+  channel->sent_time = ports_get_epoch_time();
+}
+
+// The channel to a peer, bound on first use. A ChannelBind also installs the
+// permission, so no CreatePermission is needed.
+static TurnChannel *agent_turn_channel(Agent *agent, Address *peer) {
+
+  TurnAllocation *turn = &agent->turn;
+  TurnChannel *channel;
+  int i;
+
+  for (i = 0; i < turn->channels_num; i++) {
+    if (addr_equal(&turn->channels[i].peer, peer)) {
+      return &turn->channels[i];
+    }
+  }
+
+  if (turn->channels_num >= AGENT_TURN_MAX_CHANNELS || peer->family != AF_INET) {
+    return NULL;
+  }
+
+  channel = &turn->channels[turn->channels_num];
+  memset(channel, 0, sizeof(TurnChannel));
+  memcpy(&channel->peer, peer, sizeof(Address));
+  channel->number = AGENT_TURN_CHANNEL_MIN + turn->channels_num;
+  turn->channels_num++;
+
+  agent_turn_send_channel_bind(agent, channel);
+  return channel;
+}
+
+// ChannelData costs 4 bytes where a Send indication costs 36 or more
+static int agent_turn_send(Agent *agent, Address *peer, const uint8_t *buf, int len) {
+
+  TurnAllocation *turn = &agent->turn;
+  TurnChannel *channel;
+  int size = len + 4;
+
+  if (len > AGENT_TURN_BUF_SIZE) {
+    LOGE("Datagram too large for the TURN channel: %d", len);
+    return -1;
+  }
+
+  if ((channel = agent_turn_channel(agent, peer)) == NULL) {
+    return -1;
+  }
+
+  if (!channel->bound) {
+    // lost like any other datagram until the ChannelBind succeeds
+    return len;
+  }
+
+  turn->buf[0] = channel->number >> 8;
+  turn->buf[1] = channel->number & 0xff;
+  turn->buf[2] = len >> 8;
+  turn->buf[3] = len & 0xff;
+  memcpy(turn->buf + 4, buf, len);
+
+  if (turn->transport != TURN_TRANSPORT_UDP) {
+    // padded on a stream so the next message starts aligned
+    for (; size & 3; size++) {
+      turn->buf[size] = 0;
+    }
+  }
+
+  if ((size = agent_turn_socket_send(agent, turn->buf, size)) < 0) {
+    return size;
+  }
+
+  return len;
+}
+
+static int agent_send_to(Agent *agent, IceCandidate *local, Address *addr, const uint8_t *buf, int len) {
+
+  if (agent->b_turn && local && local->type == ICE_CANDIDATE_TYPE_RELAY) {
+    return agent_turn_send(agent, addr, buf, len);
+  }
+
+  return agent_socket_send(agent, addr, buf, len);
+}
+
+static void agent_turn_process_response(Agent *agent, StunMessage *msg) {
+
+  TurnAllocation *turn = &agent->turn;
+  StunHeader *header = (StunHeader *)msg->buf;
+  TurnChannel *channel = NULL;
+  uint32_t now = ports_get_epoch_time();
+  int i;
+
+  if (memcmp(header->transaction_id, turn->transaction_id, sizeof(header->transaction_id)) != 0) {
+
+    for (i = 0; i < turn->channels_num; i++) {
+      if (memcmp(header->transaction_id, turn->channels[i].transaction_id, sizeof(header->transaction_id)) == 0) {
+        channel = &turn->channels[i];
+        break;
+      }
+    }
+
+    if (channel == NULL) {
+      return;
+    }
+  }
+
+  if (msg->stunclass == STUN_CLASS_ERROR) {
+
+    if ((msg->error_code == 438 || msg->error_code == 401) && msg->nonce[0]) {
+
+      // stale nonce, the retry carries the new one
+      snprintf(turn->nonce, sizeof(turn->nonce), "%s", msg->nonce);
+      if (msg->realm[0]) {
+        snprintf(turn->realm, sizeof(turn->realm), "%s", msg->realm);
+      }
+
+      if (channel) {
+        agent_turn_send_channel_bind(agent, channel);
+      } else {
+        agent_turn_send_refresh(agent, AGENT_TURN_LIFETIME);
+      }
+
+    } else {
+      // retried when AGENT_TURN_RTO expires
+      LOGE("TURN %s failed: %d", channel ? "ChannelBind" : "Refresh", msg->error_code);
+    }
+    return;
+  }
+
+  if (channel) {
+
+    if (!channel->bound) {
+      LOGI("TURN channel 0x%04x bound", channel->number);
+    }
+    channel->bound = 1;
+    channel->expires = now + AGENT_TURN_CHANNEL_LIFETIME;
+    channel->sent_time = 0;
+
+  } else {
+
+    turn->expires = now + (msg->lifetime ? msg->lifetime : AGENT_TURN_LIFETIME) * 1000;
+    turn->sent_time = 0;
+  }
+}
+
+// Unwraps what the TURN server relayed into buf and sets addr to the peer.
+// Returns the length of the relayed datagram, 0 if the server's message
+// carried nothing to hand up.
+static int agent_turn_recv(Agent *agent, Address *addr, uint8_t *buf, int len) {
+
+  TurnAllocation *turn = &agent->turn;
+  StunMessage msg;
+  StunHeader *header = (StunHeader *)buf;
+  uint8_t mask[16];
+  uint8_t *value;
+  uint16_t number;
+  uint16_t length;
+  int i;
+
+  if (len >= 4 && (buf[0] & 0xc0) == 0x40) {
+
+    // ChannelData
+    number = (buf[0] << 8) | buf[1];
+    length = (buf[2] << 8) | buf[3];
+
+    for (i = 0; i < turn->channels_num; i++) {
+      if (turn->channels[i].number == number && length <= len - 4) {
+        memcpy(addr, &turn->channels[i].peer, sizeof(Address));
+        memmove(buf, buf + 4, length);
+        return length;
+      }
+    }
+    return 0;
+  }
+
+  if (stun_probe(buf, len) != 0) {
+    return 0;
+  }
+
+  if (ntohs(header->type) == (STUN_CLASS_INDICATION | STUN_METHOD_DATA)) {
+
+    // relayed before the channel was bound
+    if ((value = stun_msg_find_attr(buf, len, STUN_ATTR_TYPE_XOR_PEER_ADDRESS, &length)) == NULL || length < 8) {
+      return 0;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    *((uint32_t *)mask) = htonl(MAGIC_COOKIE);
+    stun_get_mapped_address((char *)value, mask, addr);
+
+    if ((value = stun_msg_find_attr(buf, len, STUN_ATTR_TYPE_DATA, &length)) == NULL) {
+      return 0;
+    }
+
+    memmove(buf, value, length);
+    return length;
+  }
+
+  if (len > sizeof(msg.buf)) {
+    return 0;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memcpy(msg.buf, buf, len);
+  msg.size = len;
+  stun_parse_msg_buf(&msg);
+
+  if (msg.stunclass == STUN_CLASS_RESPONSE || msg.stunclass == STUN_CLASS_ERROR) {
+    agent_turn_process_response(agent, &msg);
+  }
+
+  return 0;
+}
+
+void agent_turn_refresh(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+  TurnChannel *channel;
+  uint32_t now = ports_get_epoch_time();
+  int i;
+
+  if (!agent->b_turn) {
+    return;
+  }
+
+  if ((int32_t)(now - turn->expires) >= 0) {
+    LOGE("TURN allocation expired");
+    agent->b_turn = 0;
+    return;
+  }
+
+  if (turn->sent_time ? (int32_t)(now - turn->sent_time) >= AGENT_TURN_RTO
+   : (int32_t)(turn->expires - AGENT_TURN_REFRESH_MARGIN - now) <= 0) {
+    agent_turn_send_refresh(agent, AGENT_TURN_LIFETIME);
+  }
+
+  for (i = 0; i < turn->channels_num; i++) {
+
+    channel = &turn->channels[i];
+
+    if (channel->bound && (int32_t)(now - channel->expires) >= 0) {
+      LOGW("TURN channel 0x%04x expired", channel->number);
+      channel->bound = 0;
+    }
+
+    if (channel->sent_time ? (int32_t)(now - channel->sent_time) >= AGENT_TURN_RTO
+     : !channel->bound || (int32_t)(channel->expires - AGENT_TURN_REFRESH_MARGIN - now) <= 0) {
+      agent_turn_send_channel_bind(agent, channel);
+    }
+  }
+}
+
+static int agent_create_host_addr(Agent *agent) {
+
+  UdpSocket *udp_socket;
+
+  udp_socket = &agent->udp_sockets[0];
+  if (ports_get_host_addr(&udp_socket->bind_addr)) {
+    //LOGD("addr: %d.%d.%d.%d", udp_socket->bind_addr.ipv4[0], udp_socket->bind_addr.ipv4[1], udp_socket->bind_addr.ipv4[2], udp_socket->bind_addr.ipv4[3]);
+    IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
+    ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST, &udp_socket->bind_addr);
+  }
+
+#if CONFIG_IPV6
+  udp_socket = &agent->udp_sockets[1];
+  if (ports_get_host_addr(&udp_socket->bind_addr)) {
+    //LOGD("addr: %x:%x:%x:%x:%x:%x:%x:%x", udp_socket->bind_addr.ipv6[0], udp_socket->bind_addr.ipv6[1], udp_socket->bind_addr.ipv6[2], udp_socket->bind_addr.ipv6[3], udp_socket->bind_addr.ipv6[4], udp_socket->bind_addr.ipv6[5], udp_socket->bind_addr.ipv6[6], udp_socket->bind_addr.ipv6[7]);
+    IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
+    ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST, &udp_socket->bind_addr);
+  }
+#endif
+  return 0;
+}
+
+static void agent_add_candidate(Agent *agent, IceCandidateType type, Address *addr) {
+
+  IceCandidate *ice_candidate;
+  int i;
+
+  for (i = 0; i < agent->local_candidates_count; i++) {
+    // every STUN server sees the same mapping
+    if (agent->local_candidates[i].type == type && addr_equal(&agent->local_candidates[i].addr, addr)) {
+      return;
+    }
+  }
+
+  if (agent->local_candidates_count >= AGENT_MAX_CANDIDATES) {
+    LOGW("Too many local candidates");
+    return;
+  }
+
+  ice_candidate = agent->local_candidates + agent->local_candidates_count++;
+  ice_candidate_create(ice_candidate, agent->local_candidates_count, type, addr);
+  LOGI("gathered candidate %d, type %d", agent->local_candidates_count, type);
+}
+
+static int agent_gather_send(Agent *agent, GatherProbe *probe) {
+
+  probe->sent_time = ports_get_epoch_time();
+
+  if (probe->turn) {
+    return agent_turn_socket_send(agent, probe->request, probe->request_size);
+  }
+
+  return agent_socket_send(agent, &probe->server, probe->request, probe->request_size);
+}
+
+// A Binding, or an Allocate signed once the server told its realm and nonce.
+// Every call starts a new transaction.
+static int agent_gather_request(Agent *agent, GatherProbe *probe) {
+
+  TurnAllocation *turn = &agent->turn;
+  uint32_t attr = ntohl(0x11000000);
+  StunMessage msg;
+  StunHeader *header = (StunHeader *)msg.buf;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+
+  if (probe->turn) {
+    stun_msg_create(&msg, STUN_METHOD_ALLOCATE);
+  } else {
+    stun_msg_create(&msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+  }
+
+  for (i = 0; i < 3; i++) {
+    header->transaction_id[i] = rand();
+  }
+
+  if (probe->turn) {
+
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr); // UDP
+    stun_msg_write_attr(&msg, STUN_ATTR_TYPE_USERNAME, strlen(probe->username), probe->username);
+
+    if (turn->nonce[0]) {
+      stun_msg_write_attr(&msg, STUN_ATTR_TYPE_NONCE, strlen(turn->nonce), turn->nonce);
+      stun_msg_write_attr(&msg, STUN_ATTR_TYPE_REALM, strlen(turn->realm), turn->realm);
+      stun_msg_finish(&msg, STUN_CREDENTIAL_LONG_TERM, probe->credential, strlen(probe->credential));
+    }
+  }
+
+  memcpy(probe->request, msg.buf, msg.size);
+  probe->request_size = msg.size;
+  probe->state = GATHER_PROBE_SENT;
+  probe->rto = AGENT_GATHER_RTO;
+  probe->retransmits = 0;
+
+  return agent_gather_send(agent, probe);
+}
+
+static void agent_gather_fail(Agent *agent, GatherProbe *probe) {
+
+  probe->state = GATHER_PROBE_FAILED;
+
+  if (probe->turn) {
+    agent_turn_stream_close(agent);
+    agent->turn.transport = TURN_TRANSPORT_UDP;
+  }
+}
+
+// TURN servers are tried one after the other, the data path relays through a
+// single allocation. The next one only starts when the current one failed.
+static void agent_gather_start_turn(Agent *agent) {
+
+  TurnAllocation *turn = &agent->turn;
+  GatherProbe *probe;
+  int i;
+
+  if (agent->b_turn || (int32_t)(ports_get_epoch_time() - agent->gather_deadline) >= 0) {
+    return;
+  }
+
+  for (i = 0; i < agent->probes_num; i++) {
+    if (agent->probes[i].turn && agent->probes[i].state == GATHER_PROBE_SENT) {
+      return;
+    }
+  }
+
+  for (i = 0; i < agent->probes_num; i++) {
+
+    probe = &agent->probes[i];
+    if (!probe->turn || probe->state != GATHER_PROBE_QUEUED) {
+      continue;
+    }
+
+    memcpy(&turn->server, &probe->server, sizeof(Address));
+    turn->transport = probe->transport;
+    turn->realm[0] = '\0';
+    turn->nonce[0] = '\0';
+
+    if (probe->transport != TURN_TRANSPORT_UDP && agent_turn_stream_open(agent, probe->hostname, &probe->server) < 0) {
+      agent_gather_fail(agent, probe);
+      continue;
+    }
+
+    if (agent_gather_request(agent, probe) < 0) {
+      LOGE("Failed to send TURN Allocate Request.");
+      agent_gather_fail(agent, probe);
+      continue;
+    }
+
+    return;
+  }
+}
+
+static void agent_gather_process_response(Agent *agent, uint8_t *buf, int len) {
+
+  TurnAllocation *turn = &agent->turn;
+  GatherProbe *probe = NULL;
+  StunMessage msg;
+  StunHeader *header = (StunHeader *)msg.buf;
+  int i;
+
+  if (len > sizeof(msg.buf) || stun_probe(buf, len) != 0) {
+    return;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memcpy(msg.buf, buf, len);
+  msg.size = len;
+  stun_parse_msg_buf(&msg);
+
+  for (i = 0; i < agent->probes_num; i++) {
+    if (agent->probes[i].state == GATHER_PROBE_SENT &&
+     memcmp(header->transaction_id, ((StunHeader *)agent->probes[i].request)->transaction_id, sizeof(header->transaction_id)) == 0) {
+      probe = &agent->probes[i];
+      break;
+    }
+  }
+
+  if (probe == NULL) {
+    return;
+  }
+
+  if (msg.stunclass == STUN_CLASS_ERROR) {
+
+    if (probe->turn && (msg.error_code == 401 || msg.error_code == 438) && msg.nonce[0] && probe->auth_retries++ < 2) {
+      snprintf(turn->nonce, sizeof(turn->nonce), "%s", msg.nonce);
+      snprintf(turn->realm, sizeof(turn->realm), "%s", msg.realm);
+      if (agent_gather_request(agent, probe) >= 0) {
+        return;
+      }
+    }
+
+    LOGE("%s %s failed: %d", probe->turn ? "TURN" : "STUN", probe->hostname, msg.error_code);
+    agent_gather_fail(agent, probe);
+    agent_gather_start_turn(agent);
+    return;
+
+  } else if (msg.stunclass != STUN_CLASS_RESPONSE) {
+    return;
+  }
+
+  probe->state = GATHER_PROBE_DONE;
+
+  // an Allocate response carries the mapped address as well
+  if (msg.mapped_addr.family) {
+    agent_add_candidate(agent, ICE_CANDIDATE_TYPE_SRFLX, &msg.mapped_addr);
+  }
+
+  if (probe->turn) {
+
+    agent_add_candidate(agent, ICE_CANDIDATE_TYPE_RELAY, &msg.relayed_addr);
+
+    // kept for the refreshes and channel bindings of the data path
+    memcpy(&turn->relayed, &msg.relayed_addr, sizeof(Address));
+    snprintf(turn->username, sizeof(turn->username), "%s", probe->username);
+    snprintf(turn->credential, sizeof(turn->credential), "%s", probe->credential);
+    turn->expires = ports_get_epoch_time() + (msg.lifetime ? msg.lifetime : AGENT_TURN_LIFETIME) * 1000;
+    turn->channels_num = 0;
+    agent->b_turn = 1;
+  }
+}
+
+int agent_gather_wait(Agent *agent, int timeout) {
+
+  GatherProbe *probe;
+  uint8_t buf[STUN_ATTR_BUF_SIZE];
+  uint32_t now = ports_get_epoch_time();
+  uint32_t end = now + timeout;
+  int32_t next;
+  int32_t due;
+  int pending;
+  int ret;
+  int i;
+
+  if ((int32_t)(agent->gather_deadline - end) < 0) {
+    end = agent->gather_deadline;
+  }
+
+  for (;;) {
+
+    now = ports_get_epoch_time();
+    next = (int32_t)(end - now);
+    pending = 0;
+
+    for (i = 0; i < agent->probes_num; i++) {
+
+      probe = &agent->probes[i];
+      if (probe->state != GATHER_PROBE_SENT) {
+        continue;
+      }
+
+      if ((int32_t)(now - agent->gather_deadline) >= 0) {
+        LOGW("No answer from %s", probe->hostname);
+        agent_gather_fail(agent, probe);
+        continue;
+      }
+
+      // a stream delivers or breaks, only UDP is retransmitted
+      if (!probe->turn || probe->transport == TURN_TRANSPORT_UDP) {
+
+        if ((due = (int32_t)(probe->sent_time + probe->rto - now)) <= 0) {
+
+          if (probe->retransmits >= AGENT_GATHER_RETRANSMITS) {
+            LOGW("No answer from %s", probe->hostname);
+            agent_gather_fail(agent, probe);
+            agent_gather_start_turn(agent);
+            continue;
+          }
+
+          probe->retransmits++;
+          probe->rto *= 2;
+          agent_gather_send(agent, probe);
+          due = probe->rto;
+        }
+
+        if (due < next) {
+          next = due;
+        }
+      }
+
+      pending = 1;
+    }
+
+    if (!pending) {
+      return 0;
+    } else if (next <= 0) {
+      return 1;
+    }
+
+    if (agent_wait(agent, -1, next) > 0 && (ret = agent_socket_recv(agent, NULL, buf, sizeof(buf))) > 0) {
+      agent_gather_process_response(agent, buf, ret);
+    }
+  }
+}
+
+void agent_init(Agent *agent) {
+  memset(agent, 0, sizeof(Agent));
+}
+
+void agent_deinit(Agent *agent) {
+
+  if (agent->b_turn) {
+    // release the allocation instead of letting it time out on the server
+    agent_turn_send_refresh(agent, 0);
+  }
+
+  agent_turn_stream_close(agent);
+  udp_socket_close(&agent->udp_sockets[0]);
+  udp_socket_close(&agent->udp_sockets[1]);
+  memset(agent, 0, sizeof(Agent));
+}
+
+// stun:host[:port], turn:host[:port][?transport=udp|tcp] or turns:host[:port][?transport=tcp]
+static int agent_parse_url(const char *url, char *hostname, int size, int *port, int *turn, TurnTransport *transport) {
+
+  const char *host;
+  const char *end;
+  const char *query;
+
+  if (strncmp(url, "stun:", 5) == 0) {
+    host = url + 5;
+    *turn = 0;
+    *transport = TURN_TRANSPORT_UDP;
+    *port = 3478;
+  } else if (strncmp(url, "turn:", 5) == 0) {
+    host = url + 5;
+    *turn = 1;
+    *transport = TURN_TRANSPORT_UDP;
+    *port = 3478;
+  } else if (strncmp(url, "turns:", 6) == 0) {
+    host = url + 6;
+    *turn = 1;
+    *transport = TURN_TRANSPORT_TLS;
+    *port = 5349;
+  } else {
+    LOGE("Unknown ICE server scheme: %s", url);
+    return -1;
+  }
+
+  if ((query = strchr(host, '?')) == NULL) {
+    query = host + strlen(host);
+  } else if (*turn && strncmp(query, "?transport=tcp", 14) == 0 && *transport == TURN_TRANSPORT_UDP) {
+    *transport = TURN_TRANSPORT_TCP;
+  }
+
+  if ((end = memchr(host, ':', query - host)) != NULL) {
+    *port = atoi(end + 1);
+  } else {
+    end = query;
+  }
+
+  if (*port <= 0 || end == host || end - host >= size) {
+    LOGE("Cannot parse ICE server: %s", url);
+    return -1;
+  }
+
+  memcpy(hostname, host, end - host);
+  hostname[end - host] = '\0';
+  return 0;
+}
+
+/*
+ * gather candidates
+ * create sockets and host candidate on the first call
+ * send the Binding or Allocate request of the server, answered in agent_gather_wait
+ */
+void agent_gather_candidate(Agent *agent, const char *urls, const char *username, const char *credential) {
+
+  GatherProbe *probe;
+  AgentMode mode;
+  AgentNomination nomination;
+  int port;
+  char addr_string[ADDRSTRLEN];
+
+  // called once per ICE server, the candidates of the earlier ones are kept
+  if (agent->state != AGENT_STATE_GATHERING_STARTED) {
+    mode = agent->mode;
+    nomination = agent->nomination;
+    memset(agent, 0, sizeof(Agent));
+    agent->mode = mode;
+    agent->nomination = nomination;
+    agent->tie_breaker = ((uint64_t)rand() << 32) | rand();
+    agent_create_sockets(agent);
+    agent_create_host_addr(agent);
+    agent->state = AGENT_STATE_GATHERING_STARTED;
+    agent->gather_deadline = ports_get_epoch_time() + AGENT_GATHER_TIMEOUT;
+  }
+
+  if (urls == NULL) {
+    return;
+  }
+
+  if (agent->probes_num >= AGENT_MAX_ICE_SERVERS) {
+    LOGW("Too many ICE servers, skip %s", urls);
+    return;
+  }
+
+  probe = &agent->probes[agent->probes_num];
+  memset(probe, 0, sizeof(GatherProbe));
+
+  if (agent_parse_url(urls, probe->hostname, sizeof(probe->hostname), &port, &probe->turn, &probe->transport) < 0) {
+    return;
+  }
+
+  // ipv6 no need stun
+  if (ports_resolve_addr(probe->hostname, &probe->server) != 0) {
+    LOGE("Cannot resolve %s", probe->hostname);
+    return;
+  }
+
+  addr_set_port(&probe->server, port);
+  addr_to_string(&probe->server, addr_string, sizeof(addr_string));
+  LOGI("stun/turn server %s:%d", addr_string, port);
+
+  snprintf(probe->username, sizeof(probe->username), "%s", username ? username : "");
+  snprintf(probe->credential, sizeof(probe->credential), "%s", credential ? credential : "");
+  agent->probes_num++;
+
+  if (probe->turn) {
+    agent_gather_start_turn(agent);
+  } else if (agent_gather_request(agent, probe) < 0) {
+    LOGE("Failed to send STUN Binding Request.");
+    agent_gather_fail(agent, probe);
+  }
+}
+
+void agent_get_local_description(Agent *agent, char *description, int length) {
+
+  int ncandidates = 0;
+
+  memset(description, 0, length);
+  memset(agent->local_ufrag, 0, sizeof(agent->local_ufrag));
+  memset(agent->local_upwd, 0, sizeof(agent->local_upwd));
+
+  // Generate random ICE username fragment and password
+  utils_random_string(agent->local_ufrag, 4);
+  utils_random_string(agent->local_upwd, 24);
+  stun_key_init(&agent->local_key, agent->local_upwd, strlen(agent->local_upwd));
+
+  // Format the ICE credentials into SDP format
+  snprintf(description, length, "a=ice-ufrag:%s\r\na=ice-pwd:%s\r\n", agent->local_ufrag, agent->local_upwd);
+  ncandidates = agent->local_candidates_count;
+
+  // Add all gathered ICE candidates to the description
+  for (int i = 0; i < agent->local_candidates_count; i++) {
+    ice_candidate_to_description(&agent->local_candidates[i], description + strlen(description), length - strlen(description));
+  }
+
+  // remove last \n
+  description[strlen(description)] = '\0';
+  LOGD("local description:\n%s", description);
+}
+
+int agent_send(Agent *agent, const uint8_t *buf, int len) {
+
+  return agent_send_to(agent, agent->selected_pair->local, &agent->selected_pair->remote->addr, buf, len);
+}
+
+int agent_send_batch(Agent *agent, UdpPacket *packets, int count) {
+
+  IceCandidatePair *pair = agent->selected_pair;
+  Address *addr = &pair->remote->addr;
+  int ret;
+  int i;
+
+  // each datagram gets its own ChannelData header through the allocation
+  if (agent->b_turn && pair->local->type == ICE_CANDIDATE_TYPE_RELAY) {
+
+    for (i = 0; i < count; i++) {
+      if ((ret = agent_turn_send(agent, addr, packets[i].buf, packets[i].len)) == -2) {
+        break;
+      } else if (ret < 0) {
+        return i > 0 ? i : -1;
+      }
+    }
+    return i;
+  }
+
+  switch (addr->family) {
+    case AF_INET6:
+      return udp_socket_sendmmsg(&agent->udp_sockets[1], addr, packets, count);
+    case AF_INET:
+    default:
+      return udp_socket_sendmmsg(&agent->udp_sockets[0], addr, packets, count);
+  }
+}
+
+static void agent_create_binding_response(Agent *agent, StunMessage *msg, Address *addr) {
+
+  msg->size = stun_binding_response(msg->buf, agent->transaction_id, addr, &agent->local_key);
+}
+
+static void agent_create_role_conflict(Agent *agent, StunMessage *msg) {
+
+  char error_code[4 + sizeof("Role Conflict") - 1] = { 0, 0, 4, 87 };
+  StunHeader *header;
+  memcpy(error_code + 4, "Role Conflict", sizeof(error_code) - 4);
+  memset(msg, 0, sizeof(StunMessage));
+  stun_msg_create(msg, STUN_CLASS_ERROR | STUN_METHOD_BINDING);
+  header = (StunHeader *)msg->buf;
+  memcpy(header->transaction_id, agent->transaction_id, sizeof(header->transaction_id));
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_ERROR_CODE, sizeof(error_code), error_code);
+  stun_msg_finish_key(msg, &agent->local_key);
+}
+
+static void agent_create_binding_request(Agent *agent, StunMessage *msg, IceCandidatePair *pair) {
+
+  char tie_breaker[8];
+  // of the peer-reflexive candidate the check may reveal, type preference 110
+  uint32_t priority = htonl((110 << 24) | (pair->local->priority & 0x00ffffff));
+  StunHeader *header;
+  int i;
+
+  memset(msg, 0, sizeof(StunMessage));
+  stun_msg_create(msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+  header = (StunHeader *)msg->buf;
+  memcpy(header->transaction_id, pair->transaction_id, sizeof(header->transaction_id));
+
+  for (i = 0; i < sizeof(tie_breaker); i++) {
+    tie_breaker[i] = agent->tie_breaker >> (56 - 8 * i);
+  }
+
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(agent->check_username), agent->check_username);
+  stun_msg_write_attr(msg, STUN_ATTR_TYPE_PRIORITY, sizeof(priority), (char *)&priority);
+
+  if (agent->mode == AGENT_MODE_CONTROLLING) {
+    stun_msg_write_attr(msg, STUN_ATTR_TYPE_ICE_CONTROLLING, sizeof(tie_breaker), tie_breaker);
+    if (pair->use_candidate) {
+      stun_msg_write_attr(msg, STUN_ATTR_TYPE_USE_CANDIDATE, 0, NULL);
+    }
+  } else {
+    stun_msg_write_attr(msg, STUN_ATTR_TYPE_ICE_CONTROLLED, sizeof(tie_breaker), tie_breaker);
+  }
+
+  stun_msg_finish_key(msg, &agent->remote_key);
+}
+
+static void agent_reply(Agent *agent, Address *addr, int relayed, StunMessage *msg) {
+
+  if (relayed) {
+    agent_turn_send(agent, addr, msg->buf, msg->size);
+  } else {
+    agent_socket_send(agent, addr, msg->buf, msg->size);
+  }
+}
+
+static void agent_check_send(Agent *agent, IceCandidatePair *pair) {
+
+  char addr_string[ADDRSTRLEN];
+  StunMessage msg;
+
+  addr_to_string(&pair->remote->addr, addr_string, sizeof(addr_string));
+  LOGD("send binding request to remote ip: %s, port: %d%s", addr_string, pair->remote->addr.port, pair->use_candidate ? ", USE-CANDIDATE" : "");
+  agent_create_binding_request(agent, &msg, pair);
+  agent_send_to(agent, pair->local, &pair->remote->addr, msg.buf, msg.size);
+  pair->sent_time = ports_get_epoch_time();
+}
+
+// A new transaction on the pair, with the RTO of RFC 8445 14.3
+static void agent_check_start(Agent *agent, IceCandidatePair *pair) {
 
-  UdpSocket *udp_socket;
+  int active = 0;
+  int i;
 
-  udp_socket = &agent->udp_sockets[0];
-  if (ports_get_host_addr(&udp_socket->bind_addr)) {
-    //LOGD("addr: %d.%d.%d.%d", udp_socket->bind_addr.ipv4[0], udp_socket->bind_addr.ipv4[1], udp_socket->bind_addr.ipv4[2], udp_socket->bind_addr.ipv4[3]);
-    IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-    ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST, &udp_socket->bind_addr);
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_WAITING || agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_INPROGRESS) {
+      active++;
+    }
   }
 
-#if CONFIG_IPV6
-  udp_socket = &agent->udp_sockets[1];
-  if (ports_get_host_addr(&udp_socket->bind_addr)) {
-    //LOGD("addr: %x:%x:%x:%x:%x:%x:%x:%x", udp_socket->bind_addr.ipv6[0], udp_socket->bind_addr.ipv6[1], udp_socket->bind_addr.ipv6[2], udp_socket->bind_addr.ipv6[3], udp_socket->bind_addr.ipv6[4], udp_socket->bind_addr.ipv6[5], udp_socket->bind_addr.ipv6[6], udp_socket->bind_addr.ipv6[7]);
-    IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-    ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_HOST, &udp_socket->bind_addr);
+  for (i = 0; i < 3; i++) {
+    pair->transaction_id[i] = rand();
   }
-#endif
-  return 0;
-}
 
-static int agent_create_bind_addr(Agent *agent, Address *serv_addr) {
+  if (agent->mode == AGENT_MODE_CONTROLLING && agent->nomination == AGENT_NOMINATION_AGGRESSIVE) {
+    pair->use_candidate = 1;
+  }
 
-  int ret = -1;
-  int retry = 0;
-  Address bind_addr;
-  StunMessage send_msg;
-  StunMessage recv_msg;
-  memset(&send_msg, 0, sizeof(send_msg));
-  memset(&recv_msg, 0, sizeof(recv_msg));
+  pair->rto = AGENT_CHECK_TA * active > AGENT_CHECK_RTO ? AGENT_CHECK_TA * active : AGENT_CHECK_RTO;
+  pair->retransmits = 0;
+  pair->triggered = 0;
+  pair->state = ICE_CANDIDATE_STATE_INPROGRESS;
+  agent->check_time = ports_get_epoch_time();
+  agent_check_send(agent, pair);
+}
 
-  stun_msg_create(&send_msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+static IceCandidatePair *agent_add_pair(Agent *agent, IceCandidate *local, IceCandidate *remote) {
 
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
+  IceCandidatePair *pair;
 
-  if (ret == -1) {
-    LOGE("Failed to send STUN Binding Request.");
-    return ret;
+  if (agent->candidate_pairs_num >= AGENT_MAX_CANDIDATE_PAIRS) {
+    return NULL;
   }
 
-  // blocking 1 second
-  while (retry < 1000) {
-    ret = agent_socket_recv(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf));
-    if (ret > 0) {
-      break;
-    }
-  }
+  pair = &agent->candidate_pairs[agent->candidate_pairs_num++];
+  memset(pair, 0, sizeof(IceCandidatePair));
+  pair->local = local;
+  pair->remote = remote;
+  pair->priority = ice_candidate_pair_priority(local, remote, agent->mode == AGENT_MODE_CONTROLLING);
+  pair->state = ICE_CANDIDATE_STATE_FROZEN;
 
-  if (ret <= 0) {
-    LOGD("Failed to receive STUN Binding Response.");
-    return ret;
+  // bind the channel now so it is ready when the checks start
+  if (agent->b_turn && local->type == ICE_CANDIDATE_TYPE_RELAY) {
+    agent_turn_channel(agent, &remote->addr);
   }
 
-  stun_parse_msg_buf(&recv_msg);
-  memcpy(&bind_addr, &recv_msg.mapped_addr, sizeof(Address));
-  IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-  ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_SRFLX, &bind_addr);
-  return ret;
+  return pair;
 }
 
-static int agent_create_turn_addr(Agent *agent, Address *serv_addr, const char *username, const char *credential) {
+static IceCandidatePair *agent_find_pair(Agent *agent, IceCandidate *local, IceCandidate *remote) {
 
-  int ret = -1;
-  uint32_t attr = ntohl(0x11000000);
-  int retry = 0;
-  Address turn_addr;
-  StunMessage send_msg;
-  StunMessage recv_msg;
-  memset(&recv_msg, 0, sizeof(recv_msg));
-  memset(&send_msg, 0, sizeof(send_msg));
-  stun_msg_create(&send_msg, STUN_METHOD_ALLOCATE);
-  stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr); // UDP
-  stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_USERNAME, strlen(username), (char*)username);
-
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
-  if (ret == -1) {
-    LOGE("Failed to send TURN Binding Request.");
-    return -1;
-  }
+  int i;
 
-  // blocking 1 second
-  while (retry < 1000) {
-    ret = agent_socket_recv(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf));
-    if (ret > 0) {
-      break;
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].local == local && agent->candidate_pairs[i].remote == remote) {
+      return &agent->candidate_pairs[i];
     }
   }
 
-  if (ret <= 0) {
-    LOGD("Failed to receive STUN Binding Response.");
-    return ret;
+  return NULL;
+}
+
+// The candidate a datagram arrived on: the relay, or the host candidate that is
+// also the base of the server-reflexive ones
+static IceCandidate *agent_local_candidate(Agent *agent, Address *addr, int relayed) {
+
+  IceCandidate *local = NULL;
+  int i;
+
+  for (i = 0; i < agent->local_candidates_count; i++) {
+
+    if ((agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_RELAY) != relayed) {
+      continue;
+    } else if (relayed) {
+      return &agent->local_candidates[i];
+    } else if (agent->local_candidates[i].addr.family != addr->family) {
+      continue;
+    } else if (agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_HOST) {
+      return &agent->local_candidates[i];
+    } else if (local == NULL) {
+      local = &agent->local_candidates[i];
+    }
   }
 
-  stun_parse_msg_buf(&recv_msg);
+  return local;
+}
+
+// A check from an address the peer did not signal reveals a peer-reflexive candidate, RFC 8445 7.3.1.3
+static IceCandidate *agent_remote_candidate(Agent *agent, Address *addr, StunView *view) {
 
-  if (recv_msg.stunclass == STUN_CLASS_ERROR && recv_msg.stunmethod == STUN_METHOD_ALLOCATE) {
+  IceCandidate *remote;
+  uint32_t priority;
+  char addr_string[ADDRSTRLEN];
+  int i;
 
-    memset(&send_msg, 0, sizeof(send_msg));
-    stun_msg_create(&send_msg, STUN_METHOD_ALLOCATE);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REQUESTED_TRANSPORT, sizeof(attr), (char*)&attr); // UDP
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_USERNAME, strlen(username), (char*)username);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_NONCE, strlen(recv_msg.nonce), recv_msg.nonce);
-    stun_msg_write_attr(&send_msg, STUN_ATTR_TYPE_REALM, strlen(recv_msg.realm), recv_msg.realm);
-    stun_msg_finish(&send_msg, STUN_CREDENTIAL_LONG_TERM, credential, strlen(credential));
-  } else {
-    LOGE("Invalid TURN Binding Response.");
-    return -1;
+  for (i = 0; i < agent->remote_candidates_count; i++) {
+    if (addr_equal(&agent->remote_candidates[i].addr, addr)) {
+      return &agent->remote_candidates[i];
+    }
   }
 
-  ret = agent_socket_send(agent, serv_addr, send_msg.buf, send_msg.size);
-  if (ret < 0) {
-    LOGE("Failed to send TURN Binding Request.");
-    return -1;
+  if (agent->remote_candidates_count >= AGENT_MAX_CANDIDATES) {
+    return NULL;
   }
 
-  memset(&recv_msg, 0, sizeof(recv_msg));
-  ret = agent_socket_recv(agent, NULL, recv_msg.buf, sizeof(recv_msg.buf));
-  if (ret <= 0) {
-    LOGD("Failed to receive TURN Binding Response.");
-    return ret;
+  remote = &agent->remote_candidates[agent->remote_candidates_count++];
+  memset(remote, 0, sizeof(IceCandidate));
+  ice_candidate_create(remote, 0, ICE_CANDIDATE_TYPE_PRFLX, addr);
+
+  if (view->priority) {
+    memcpy(&priority, view->buf + view->priority, sizeof(priority));
+    remote->priority = ntohl(priority);
   }
 
-  stun_parse_msg_buf(&recv_msg);
-  memcpy(&turn_addr, &recv_msg.relayed_addr, sizeof(Address));
-  IceCandidate *ice_candidate = agent->local_candidates + agent->local_candidates_count++;
-  ice_candidate_create(ice_candidate, agent->local_candidates_count, ICE_CANDIDATE_TYPE_RELAY, &turn_addr);
-  return ret;
+  addr_to_string(addr, addr_string, sizeof(addr_string));
+  LOGI("peer-reflexive candidate %s:%d", addr_string, addr->port);
+  return remote;
 }
 
-void agent_init(Agent *agent) {
-  agent->local_candidates_count = 0;
-}
+static void agent_switch_role(Agent *agent, AgentMode mode) {
 
-void agent_deinit(Agent *agent) {
+  int i;
 
-  udp_socket_close(&agent->udp_socket);
-  memset(agent, 0, sizeof(Agent));
+  LOGI("ICE role conflict, now %s", mode == AGENT_MODE_CONTROLLING ? "controlling" : "controlled");
+  agent->mode = mode;
+  agent->nominated_pair = NULL;
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    agent->candidate_pairs[i].priority = ice_candidate_pair_priority(agent->candidate_pairs[i].local,
+     agent->candidate_pairs[i].remote, mode == AGENT_MODE_CONTROLLING);
+    agent->candidate_pairs[i].use_candidate = 0;
+  }
 }
 
-/*
- * gather candidates
- * create sockets
- * create host candidate
- * create server-reflexive candidate or relay candidate
- */
-void agent_gather_candidate(Agent *agent, const char *urls, const char *username, const char *credential) {
+// A pair is nominated once it succeeded with USE-CANDIDATE, sent when
+// controlling or received when controlled, and the best one carries the data.
+// A controlled agent uses the best valid pair until the peer nominates.
+static void agent_update_selected(Agent *agent) {
 
-  char *pos;
-  int port;
-  char hostname[64];
-  char addr_string[ADDRSTRLEN];
+  IceCandidatePair *pair;
+  IceCandidatePair *nominated = NULL;
+  IceCandidatePair *valid = NULL;
   int i;
-  int addr_type[1] = {AF_INET}; // ipv6 no need stun
-  Address resolved_addr;
-  memset(hostname, 0, sizeof(hostname));
-  memset(agent, 0, sizeof(Agent));
-  agent_create_sockets(agent);
 
-  agent_create_host_addr(agent);
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
 
-  do {
+    pair = &agent->candidate_pairs[i];
+    if (pair->state != ICE_CANDIDATE_STATE_SUCCEEDED) {
+      continue;
+    }
 
-    if ((pos = strstr(urls + 5, ":")) == NULL) {
-      break;
+    if (pair->use_candidate && (nominated == NULL || pair->priority > nominated->priority)) {
+      nominated = pair;
     }
 
-    port = atoi(pos + 1);
-    if (port <= 0) {
-      break;
-      LOGE("Cannot parse port");
+    if (valid == NULL || pair->priority > valid->priority) {
+      valid = pair;
     }
+  }
 
-    snprintf(hostname, pos - urls - 5 + 1, "%s", urls + 5);
+  if (nominated && nominated != agent->nominated_pair) {
+    LOGI("nominated candidate pair %d", (int)(nominated - agent->candidate_pairs));
+    agent->nominated_pair = nominated;
+  }
 
-    for (i = 0; i < sizeof(addr_type) / sizeof(addr_type[0]); i++) {
+  if (agent->nominated_pair) {
+    agent->selected_pair = agent->nominated_pair;
+  } else if (agent->mode == AGENT_MODE_CONTROLLED) {
+    agent->selected_pair = valid;
+  }
+}
 
-      if (ports_resolve_addr(hostname, &resolved_addr) != 0) {
-        continue;
-      }
+static void agent_unfreeze(Agent *agent, IceCandidatePair *pair) {
 
-      addr_set_port(&resolved_addr, port);
-      addr_to_string(&resolved_addr, addr_string, sizeof(addr_string));
-      LOGI("stun/turn server %s:%d", addr_string, port);
+  int i;
 
-      if (strncmp(urls, "stun:", 5) == 0) {
-        LOGD("create stun addr");
-        agent_create_bind_addr(agent, &resolved_addr);
-      } else if (strncmp(urls, "turn:", 5) == 0) {
-        LOGD("create turn addr");
-        agent_create_turn_addr(agent, &resolved_addr, username, credential);
-      }
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FROZEN
+     && agent->candidate_pairs[i].local->foundation == pair->local->foundation
+     && agent->candidate_pairs[i].remote->foundation == pair->remote->foundation) {
+      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_WAITING;
     }
+  }
+}
 
-  } while (0);
+// USERNAME of a check for us starts with our ufrag, RFC 8445 7.3
+static int agent_check_username(Agent *agent, StunView *view) {
 
+  size_t len = strlen(agent->local_ufrag);
+
+  return view->username && view->username_length > len && view->buf[view->username + len] == ':'
+   && memcmp(view->buf + view->username, agent->local_ufrag, len) == 0;
 }
 
-void agent_get_local_description(Agent *agent, char *description, int length) {
+void agent_process_stun_request(Agent *agent, StunView *view, Address *addr, int relayed) {
 
-  int ncandidates = 0;
+  StunMessage msg;
+  StunHeader *header = (StunHeader *)view->buf;
+  IceCandidate *local;
+  IceCandidate *remote;
+  IceCandidatePair *pair;
+  uint64_t tie_breaker = 0;
+  uint16_t attr;
+  int i;
 
-  memset(description, 0, length);
-  memset(agent->local_ufrag, 0, sizeof(agent->local_ufrag));
-  memset(agent->local_upwd, 0, sizeof(agent->local_upwd));
+  if (view->stunmethod != STUN_METHOD_BINDING || !agent_check_username(agent, view) || stun_view_verify(view, &agent->local_key) != 0) {
+    return;
+  }
 
-  // Generate random ICE username fragment and password
-  utils_random_string(agent->local_ufrag, 4);
-  utils_random_string(agent->local_upwd, 24);
+  memcpy(agent->transaction_id, header->transaction_id, sizeof(header->transaction_id));
 
-  // Format the ICE credentials into SDP format
-  snprintf(description, length, "a=ice-ufrag:%s\r\na=ice-pwd:%s\r\n", agent->local_ufrag, agent->local_upwd);
-  ncandidates = agent->local_candidates_count;
+  // both claim the same role, the larger tie-breaker controls, RFC 8445 7.3.1.1
+  attr = agent->mode == AGENT_MODE_CONTROLLING ? view->ice_controlling : view->ice_controlled;
 
-  // Add all gathered ICE candidates to the description
-  for (int i = 0; i < agent->local_candidates_count; i++) {
-    ice_candidate_to_description(&agent->local_candidates[i], description + strlen(description), length - strlen(description));
-  }
+  if (attr) {
 
-  // remove last \n
-  description[strlen(description)] = '\0';
-  LOGD("local description:\n%s", description);
-}
+    for (i = 0; i < sizeof(tie_breaker); i++) {
+      tie_breaker = (tie_breaker << 8) | view->buf[attr + i];
+    }
 
-int agent_send(Agent *agent, const uint8_t *buf, int len) {
+    if ((agent->tie_breaker >= tie_breaker) == (agent->mode == AGENT_MODE_CONTROLLING)) {
+      agent_create_role_conflict(agent, &msg);
+      agent_reply(agent, addr, relayed, &msg);
+      return;
+    }
 
-  return agent_socket_send(agent, &agent->nominated_pair->remote->addr, buf, len);
-}
+    agent_switch_role(agent, agent->mode == AGENT_MODE_CONTROLLING ? AGENT_MODE_CONTROLLED : AGENT_MODE_CONTROLLING);
+  }
 
-static void agent_create_binding_response(Agent *agent, StunMessage *msg, Address *addr) {
+  agent_create_binding_response(agent, &msg, addr);
+  agent_reply(agent, addr, relayed, &msg);
+  agent->binding_request_time = ports_get_epoch_time();
 
-  char username[584];
-  char mapped_address[8];
-  StunHeader *header;
-  stun_msg_create(msg, STUN_CLASS_RESPONSE | STUN_METHOD_BINDING);
-  header = (StunHeader *)msg->buf;
-  memcpy(header->transaction_id, agent->transaction_id, sizeof(header->transaction_id));
-  snprintf(username, sizeof(username), "%s:%s", agent->local_ufrag, agent->remote_ufrag);
-  // TODO: XOR-MAPPED-ADDRESS
-  stun_set_mapped_address(mapped_address, NULL, addr);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_MAPPED_ADDRESS, 8, mapped_address);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(username), username);
-  stun_msg_finish(msg, STUN_CREDENTIAL_SHORT_TERM, agent->local_upwd, strlen(agent->local_upwd));
-}
+  // an early check, the pairs are formed with the remote description
+  if (agent->remote_upwd[0] == '\0') {
+    return;
+  }
 
-static void agent_create_binding_request(Agent *agent, StunMessage *msg) {
+  if ((local = agent_local_candidate(agent, addr, relayed)) == NULL
+   || (remote = agent_remote_candidate(agent, addr, view)) == NULL) {
+    return;
+  }
 
-  uint64_t tie_breaker = 0; // always be controlled
-  // send binding request
-  stun_msg_create(msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
-  char username[584];
-  memset(username, 0, sizeof(username));
-  snprintf(username, sizeof(username), "%s:%s", agent->remote_ufrag, agent->local_ufrag);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_USERNAME, strlen(username), username);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_PRIORITY, 4, (char *)&agent->nominated_pair->priority);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_USE_CANDIDATE, 0, NULL);
-  stun_msg_write_attr(msg, STUN_ATTR_TYPE_ICE_CONTROLLED, 8, (char *)&tie_breaker);
-  stun_msg_finish(msg, STUN_CREDENTIAL_SHORT_TERM, agent->remote_upwd, strlen(agent->remote_upwd));
-}
+  if ((pair = agent_find_pair(agent, local, remote)) == NULL && (pair = agent_add_pair(agent, local, remote)) == NULL) {
+    return;
+  }
 
-void agent_process_stun_request(Agent *agent, StunMessage *stun_msg, Address *addr) {
+  if (agent->mode == AGENT_MODE_CONTROLLED && view->use_candidate) {
+    pair->use_candidate = 1;
+  }
 
-  StunMessage msg;
-  StunHeader *header;
-  switch (stun_msg->stunmethod) {
-    case STUN_METHOD_BINDING:
-      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, agent->local_upwd) == 0) {
-        header = (StunHeader *)stun_msg->buf;
-        memcpy(agent->transaction_id, header->transaction_id, sizeof(header->transaction_id));
-        agent_create_binding_response(agent, &msg, addr);
-        agent_socket_send(agent, addr, msg.buf, msg.size);
-        agent->binding_request_time = ports_get_epoch_time();
-      }
+  // triggered check, RFC 8445 7.3.1.4
+  switch (pair->state) {
+    case ICE_CANDIDATE_STATE_SUCCEEDED:
+      agent_update_selected(agent);
+      break;
+    case ICE_CANDIDATE_STATE_INPROGRESS:
       break;
     default:
+      pair->state = ICE_CANDIDATE_STATE_WAITING;
+      pair->triggered = 1;
+      // not paced when it completes a nomination or once a pair is selected
+      if (agent->selected_pair || (agent->mode == AGENT_MODE_CONTROLLED && pair->use_candidate)) {
+        agent_check_start(agent, pair);
+      }
       break;
   }
 }
 
-void agent_process_stun_response(Agent *agent, StunMessage *stun_msg) {
+void agent_process_stun_response(Agent *agent, StunView *view, Address *addr, int relayed) {
 
-  switch (stun_msg->stunmethod) {
-    case STUN_METHOD_BINDING:
-      if (stun_msg_is_valid(stun_msg->buf, stun_msg->size, agent->remote_upwd) == 0) {
-        agent->nominated_pair->state = ICE_CANDIDATE_STATE_SUCCEEDED;
-      }
-      break;
-    default:
+  StunHeader *header = (StunHeader *)view->buf;
+  IceCandidatePair *pair = NULL;
+  int i;
+
+  if (view->stunmethod != STUN_METHOD_BINDING) {
+    return;
+  }
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if ((agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_INPROGRESS || &agent->candidate_pairs[i] == agent->selected_pair)
+     && memcmp(header->transaction_id, agent->candidate_pairs[i].transaction_id, sizeof(header->transaction_id)) == 0) {
+      pair = &agent->candidate_pairs[i];
       break;
+    }
   }
-}
 
+  if (pair == NULL || stun_view_verify(view, &agent->remote_key) != 0) {
+    return;
+  }
+
+  // an answer to a consent check
+  if (pair == agent->selected_pair && pair->state == ICE_CANDIDATE_STATE_SUCCEEDED) {
+    if (view->stunclass == STUN_CLASS_RESPONSE && addr_equal(addr, &pair->remote->addr)) {
+      agent->consent_time = ports_get_epoch_time();
+    }
+    return;
+  }
+
+  if (view->stunclass == STUN_CLASS_ERROR) {
+
+    if (stun_view_error_code(view) == 487) {
+      // take the other role and check the pair again, RFC 8445 7.2.5.1
+      agent_switch_role(agent, agent->mode == AGENT_MODE_CONTROLLING ? AGENT_MODE_CONTROLLED : AGENT_MODE_CONTROLLING);
+      pair->state = ICE_CANDIDATE_STATE_WAITING;
+      pair->triggered = 1;
+    } else {
+      pair->state = ICE_CANDIDATE_STATE_FAILED;
+    }
+    return;
+  }
+
+  // the answer has to come back the way the check went, RFC 8445 7.2.5.2.1
+  if (!addr_equal(addr, &pair->remote->addr) || relayed != (pair->local->type == ICE_CANDIDATE_TYPE_RELAY)) {
+    pair->state = ICE_CANDIDATE_STATE_FAILED;
+    return;
+  }
+
+  pair->state = ICE_CANDIDATE_STATE_SUCCEEDED;
+  if (agent->valid_time == 0) {
+    agent->valid_time = ports_get_epoch_time();
+  }
+
+  agent_unfreeze(agent, pair);
+  agent_update_selected(agent);
+}
 
 int agent_recv(Agent *agent, uint8_t *buf, int len) {
 
   int ret = -1;
-  StunMessage stun_msg;
+  int relayed = 0;
+  StunView view;
   Address addr;
-  if ((ret = agent_socket_recv(agent, &addr, buf, len)) > 0 && stun_probe(buf, len) == 0) {
-
-    memcpy(stun_msg.buf, buf, ret);
-    stun_msg.size = ret;
-    stun_parse_msg_buf(&stun_msg);
-    switch (stun_msg.stunclass) {
-      case STUN_CLASS_REQUEST:
-        agent_process_stun_request(agent, &stun_msg, &addr);
-        break;
-      case STUN_CLASS_RESPONSE:
-        agent_process_stun_response(agent, &stun_msg);
-        break;
-      case STUN_CLASS_ERROR:
-        break;
-      default:
-        break;
+
+  if ((ret = agent_socket_recv(agent, &addr, buf, len)) > 0 && agent->b_turn && addr_equal(&addr, &agent->turn.server)) {
+
+    relayed = 1;
+    if ((ret = agent_turn_recv(agent, &addr, buf, ret)) <= 0) {
+      return 0;
+    }
+  }
+
+  if (ret > 0 && stun_probe(buf, ret) == 0) {
+
+    // parsed and checked where it was received
+    if (stun_view_parse(&view, buf, ret) == 0) {
+      switch (view.stunclass) {
+        case STUN_CLASS_REQUEST:
+          agent_process_stun_request(agent, &view, &addr, relayed);
+          break;
+        case STUN_CLASS_RESPONSE:
+        case STUN_CLASS_ERROR:
+          agent_process_stun_response(agent, &view, &addr, relayed);
+          break;
+        default:
+          break;
+      }
     }
     ret = 0;
   }
@@ -414,6 +1738,7 @@ a=ice-ufrag:Iexb
 a=ice-pwd:IexbSoY7JulyMbjKwISsG9
 a=candidate:1 1 UDP 1 36.231.28.50 38143 typ srflx
 */
+  IceCandidatePair *pair;
   int i, j;
 
   LOGD("Set remote description:\n%s", description);
@@ -444,78 +1769,212 @@ a=candidate:1 1 UDP 1 36.231.28.50 38143 typ srflx
   LOGD("remote ufrag: %s", agent->remote_ufrag);
   LOGD("remote upwd: %s", agent->remote_upwd);
 
+  stun_key_init(&agent->remote_key, agent->remote_upwd, strlen(agent->remote_upwd));
+  snprintf(agent->check_username, sizeof(agent->check_username), "%s:%s", agent->remote_ufrag, agent->local_ufrag);
+
   // Please set gather candidates before set remote description
   for (i = 0; i < agent->local_candidates_count; i++) {
+
+    // a server-reflexive candidate sends from its host base, the host pair covers it, RFC 8445 6.1.2.4
+    if (agent->local_candidates[i].type == ICE_CANDIDATE_TYPE_SRFLX) {
+      for (j = 0; j < agent->local_candidates_count; j++) {
+        if (agent->local_candidates[j].type == ICE_CANDIDATE_TYPE_HOST && agent->local_candidates[j].addr.family == agent->local_candidates[i].addr.family) {
+          break;
+        }
+      }
+      if (j < agent->local_candidates_count) {
+        continue;
+      }
+    }
+
     for (j = 0; j < agent->remote_candidates_count; j++) {
       if (agent->local_candidates[i].addr.family == agent->remote_candidates[j].addr.family) {
-	agent->candidate_pairs[agent->candidate_pairs_num].local = &agent->local_candidates[i];
-	agent->candidate_pairs[agent->candidate_pairs_num].remote = &agent->remote_candidates[j];
-	agent->candidate_pairs[agent->candidate_pairs_num].priority = agent->local_candidates[i].priority + agent->remote_candidates[j].priority;
-	agent->candidate_pairs[agent->candidate_pairs_num].state = ICE_CANDIDATE_STATE_FROZEN;
-	agent->candidate_pairs_num++;
+        agent_add_pair(agent, &agent->local_candidates[i], &agent->remote_candidates[j]);
+      }
+    }
+  }
+
+  // the best pair of each foundation starts Waiting, the others follow it, RFC 8445 6.1.2.6
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+
+    pair = &agent->candidate_pairs[i];
+    for (j = 0; j < agent->candidate_pairs_num; j++) {
+      if (agent->candidate_pairs[j].state == ICE_CANDIDATE_STATE_WAITING
+       && agent->candidate_pairs[j].local->foundation == pair->local->foundation
+       && agent->candidate_pairs[j].remote->foundation == pair->remote->foundation) {
+        break;
+      }
+    }
+
+    if (j == agent->candidate_pairs_num) {
+      for (j = 0; j < agent->candidate_pairs_num; j++) {
+        if (agent->candidate_pairs[j].priority > pair->priority
+         && agent->candidate_pairs[j].local->foundation == pair->local->foundation
+         && agent->candidate_pairs[j].remote->foundation == pair->remote->foundation) {
+          break;
+        }
+      }
+      if (j == agent->candidate_pairs_num) {
+        pair->state = ICE_CANDIDATE_STATE_WAITING;
       }
     }
   }
+
+  // the first check goes out right away
+  agent->checks_start = ports_get_epoch_time();
+  agent->check_time = agent->checks_start - AGENT_CHECK_TA;
   LOGD("candidate pairs num: %d", agent->candidate_pairs_num);
 }
 
+// Regular nomination: USE-CANDIDATE on the best valid pair once no better pair
+// is left to check, or AGENT_NOMINATION_WAIT after the first pair became valid
+static void agent_nominate(Agent *agent, uint32_t now) {
+
+  IceCandidatePair *pair;
+  IceCandidatePair *best = NULL;
+  int i;
+
+  if (agent->mode != AGENT_MODE_CONTROLLING || agent->nomination != AGENT_NOMINATION_REGULAR
+   || agent->valid_time == 0 || agent_nominating(agent)) {
+    return;
+  }
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    pair = &agent->candidate_pairs[i];
+    if (pair->state == ICE_CANDIDATE_STATE_SUCCEEDED && (best == NULL || pair->priority > best->priority)) {
+      best = pair;
+    }
+  }
+
+  if (best == NULL) {
+    return;
+  }
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    pair = &agent->candidate_pairs[i];
+    if (pair->priority > best->priority && pair->state != ICE_CANDIDATE_STATE_FAILED
+     && pair->state != ICE_CANDIDATE_STATE_SUCCEEDED && (int32_t)(now - agent->valid_time) < AGENT_NOMINATION_WAIT) {
+      return;
+    }
+  }
+
+  // not paced, the nominating check is the last one ICE needs
+  best->use_candidate = 1;
+  agent_check_start(agent, best);
+}
 
 int agent_connectivity_check(Agent *agent) {
 
-  char addr_string[ADDRSTRLEN];
-  uint8_t buf[1400];
-  StunMessage msg;
+  IceCandidatePair *pair;
+  IceCandidatePair *next = NULL;
+  uint32_t now = ports_get_epoch_time();
+  int rank, next_rank = -1;
+  int i;
 
-  if (agent->nominated_pair->state != ICE_CANDIDATE_STATE_INPROGRESS) {
-    LOGI("nominated pair is not in progress");
-    return -1;
+  if (agent->selected_pair) {
+    return 0;
   }
 
-  memset(&msg, 0, sizeof(msg));
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
 
-  if (agent->nominated_pair->conncheck % AGENT_CONNCHECK_PERIOD == 0) {
+    pair = &agent->candidate_pairs[i];
+    if (pair->state != ICE_CANDIDATE_STATE_INPROGRESS || (int32_t)(now - pair->sent_time) < (int32_t)pair->rto) {
+      continue;
+    }
+
+    if (pair->retransmits >= AGENT_CHECK_RETRANSMITS) {
+      LOGD("candidate pair %d failed", i);
+      pair->state = ICE_CANDIDATE_STATE_FAILED;
+      continue;
+    }
 
-    addr_to_string(&agent->nominated_pair->remote->addr, addr_string, sizeof(addr_string));
-    LOGD("send binding request to remote ip: %s, port: %d", addr_string, agent->nominated_pair->remote->addr.port);
-    agent_create_binding_request(agent, &msg);
-    agent_socket_send(agent, &agent->nominated_pair->remote->addr, msg.buf, msg.size);
+    pair->retransmits++;
+    pair->rto *= 2;
+    agent_check_send(agent, pair);
   }
 
-  agent_recv(agent, buf, sizeof(buf));
+  agent_nominate(agent, now);
 
-  // XXX: FULL ICE
-  if (agent->nominated_pair->state == ICE_CANDIDATE_STATE_SUCCEEDED) {
-    agent->selected_pair = agent->nominated_pair;
-    return 0;
+  // one new check every Ta: triggered first, then the best Waiting pair,
+  // then the best Frozen one when nothing is Waiting
+  if ((int32_t)(now - agent->check_time) < AGENT_CHECK_TA) {
+    return -1;
+  }
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+
+    pair = &agent->candidate_pairs[i];
+    if (pair->state == ICE_CANDIDATE_STATE_WAITING) {
+      rank = pair->triggered ? 2 : 1;
+    } else if (pair->state == ICE_CANDIDATE_STATE_FROZEN) {
+      rank = 0;
+    } else {
+      continue;
+    }
+
+    if (rank > next_rank || (rank == next_rank && pair->priority > next->priority)) {
+      next = pair;
+      next_rank = rank;
+    }
+  }
+
+  if (next) {
+    agent_check_start(agent, next);
   }
 
   return -1;
 }
 
-int agent_select_candidate_pair(Agent *agent) {
+int agent_consent_check(Agent *agent) {
 
+  IceCandidatePair *pair = agent->selected_pair;
+  uint32_t now = ports_get_epoch_time();
   int i;
-  for (i = 0; i < agent->candidate_pairs_num; i++) {
 
-    if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FROZEN) {
-      // nominate this pair
-      agent->nominated_pair = &agent->candidate_pairs[i];
-      agent->candidate_pairs[i].conncheck = 0;
-      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_INPROGRESS;
-      return 0;
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_INPROGRESS) {
-      agent->candidate_pairs[i].conncheck++;
-      if (agent->candidate_pairs[i].conncheck < AGENT_CONNCHECK_MAX) {
-        return 0;
-      }
-      agent->candidate_pairs[i].state = ICE_CANDIDATE_STATE_FAILED;
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_FAILED) {
+  if (pair == NULL) {
+    return -1;
+  }
+
+  // the checks that selected the pair granted it
+  if (agent->consent_time == 0) {
+    agent->consent_time = now;
+    agent->consent_check_time = now;
+  }
+
+  if ((int32_t)(now - agent->consent_time) > ICE_CONSENT_TIMEOUT) {
+    LOGW("consent to send expired");
+    return -1;
+  }
+
+  if ((int32_t)(now - agent->consent_check_time) >= 0) {
 
-    } else if (agent->candidate_pairs[i].state == ICE_CANDIDATE_STATE_SUCCEEDED) {
-      agent->selected_pair = &agent->candidate_pairs[i];
+    for (i = 0; i < 3; i++) {
+      pair->transaction_id[i] = rand();
+    }
+
+    agent_check_send(agent, pair);
+    // 0.8 to 1.2 times the interval, so the checks do not line up with other traffic
+    agent->consent_check_time = now + ICE_CONSENT_INTERVAL * 4 / 5 + rand() % (ICE_CONSENT_INTERVAL * 2 / 5 + 1);
+  }
+
+  return 0;
+}
+
+int agent_select_candidate_pair(Agent *agent) {
+
+  int i;
+
+  for (i = 0; i < agent->candidate_pairs_num; i++) {
+    if (agent->candidate_pairs[i].state != ICE_CANDIDATE_STATE_FAILED) {
       return 0;
     }
   }
-  // all candidate pairs are failed
+
+  // a peer that learns our candidates from the answer still gets the time to check
+  if ((int32_t)(ports_get_epoch_time() - agent->checks_start) < AGENT_CHECKLIST_TIMEOUT) {
+    return 0;
+  }
+
+  LOGE("all candidate pairs failed");
   return -1;
 }
@@ -28,6 +28,28 @@
 #define AGENT_MAX_CANDIDATE_PAIRS 100
 #endif
 
+#ifndef AGENT_MAX_ICE_SERVERS
+#define AGENT_MAX_ICE_SERVERS 5
+#endif
+
+#ifndef AGENT_TURN_MAX_CHANNELS
+#define AGENT_TURN_MAX_CHANNELS AGENT_MAX_CANDIDATES
+#endif
+
+// largest datagram relayed through a ChannelData message
+#define AGENT_TURN_BUF_SIZE 1500
+
+// datagrams taken from the socket by one recvmmsg, lwIP has none so one by one there
+#ifndef AGENT_RECV_BATCH
+#ifdef ESP32
+#define AGENT_RECV_BATCH 1
+#else
+#define AGENT_RECV_BATCH 16
+#endif
+#endif
+
+struct NetworkContext;
+
 typedef enum AgentState {
 
   AGENT_STATE_GATHERING_ENDED = 0,
@@ -43,6 +65,88 @@ typedef enum AgentMode {
 
 } AgentMode;
 
+typedef enum AgentNomination {
+
+  // checks first, then USE-CANDIDATE on the best valid pair, RFC 8445 8.1.1
+  AGENT_NOMINATION_REGULAR = 0,
+  // USE-CANDIDATE on every check, the first pair that succeeds is used, RFC 5245 8.1.1.2
+  AGENT_NOMINATION_AGGRESSIVE,
+
+} AgentNomination;
+
+typedef enum TurnTransport {
+
+  TURN_TRANSPORT_UDP = 0,
+  TURN_TRANSPORT_TCP,
+  TURN_TRANSPORT_TLS,
+
+} TurnTransport;
+
+typedef struct TurnChannel {
+
+  Address peer;
+  uint16_t number;
+  int bound;
+  uint32_t expires;
+  uint32_t sent_time; // of the pending ChannelBind, 0 if none
+  uint32_t transaction_id[3];
+
+} TurnChannel;
+
+typedef struct TurnAllocation {
+
+  Address server;
+  Address relayed;
+  char username[128];
+  char credential[128];
+  char realm[64];
+  char nonce[64];
+  uint32_t expires;
+  uint32_t sent_time; // of the pending Refresh, 0 if none
+  uint32_t transaction_id[3];
+
+  TurnChannel channels[AGENT_TURN_MAX_CHANNELS];
+  int channels_num;
+
+  // turn: over TCP and turns: carry STUN and ChannelData on a stream
+  TurnTransport transport;
+  TcpSocket tcp_socket;
+  struct NetworkContext *tls;
+  uint8_t rx_buf[2 * (AGENT_TURN_BUF_SIZE + 4)];
+  int rx_len;
+
+  uint8_t buf[AGENT_TURN_BUF_SIZE + 8];
+
+} TurnAllocation;
+
+typedef enum GatherProbeState {
+
+  GATHER_PROBE_QUEUED = 0,
+  GATHER_PROBE_SENT,
+  GATHER_PROBE_DONE,
+  GATHER_PROBE_FAILED,
+
+} GatherProbeState;
+
+// A Binding or Allocate request to one ICE server, in flight while gathering
+typedef struct GatherProbe {
+
+  Address server;
+  char hostname[64];
+  int turn;
+  TurnTransport transport;
+  char username[128];
+  char credential[128];
+  GatherProbeState state;
+  int auth_retries;
+  uint32_t sent_time;
+  uint32_t rto;
+  int retransmits;
+  uint8_t request[STUN_ATTR_BUF_SIZE]; // resent as is, same transaction id
+  int request_size;
+
+} GatherProbe;
+
 typedef struct Agent Agent;
 
 struct Agent {
@@ -53,6 +157,11 @@ struct Agent {
   char local_ufrag[ICE_UFRAG_LENGTH + 1];
   char local_upwd[ICE_UPWD_LENGTH + 1];
 
+  // short-term credentials prepared once per session for every check and answer
+  StunKey local_key;
+  StunKey remote_key;
+  char check_username[2 * ICE_UFRAG_LENGTH + 2]; // USERNAME of our checks, remote:local
+
   IceCandidate local_candidates[AGENT_MAX_CANDIDATES];
   IceCandidate remote_candidates[AGENT_MAX_CANDIDATES];
 
@@ -62,6 +171,14 @@ struct Agent {
   UdpSocket udp_socket;
   UdpSocket udp_sockets[2];
 
+#if AGENT_RECV_BATCH > 1
+  // read ahead by recvmmsg, handed out one by one by agent_recv
+  UdpPacket recv_packets[AGENT_RECV_BATCH];
+  uint8_t recv_bufs[AGENT_RECV_BATCH][AGENT_TURN_BUF_SIZE];
+  int recv_head;
+  int recv_count;
+#endif
+
   Address host_addr;
   int b_host_addr;
   int controlling;
@@ -69,40 +186,104 @@ struct Agent {
   AgentState state;
 
   AgentMode mode;
+  AgentNomination nomination;
+  uint64_t tie_breaker;
 
   IceCandidatePair candidate_pairs[AGENT_MAX_CANDIDATE_PAIRS];
-  IceCandidatePair *selected_pair;
+  IceCandidatePair *selected_pair; // carries the data, the nominated pair once there is one
   IceCandidatePair *nominated_pair;
 
   int candidate_pairs_num;
 
-  int use_candidate;
+  uint32_t checks_start;
+  uint32_t check_time; // of the last paced check
+  uint32_t valid_time; // of the first valid pair, for regular nomination
+
+  // consent freshness on the selected pair, RFC 7675
+  uint32_t consent_time; // of the last answer
+  uint32_t consent_check_time; // of the next check
 
   uint32_t transaction_id[3];
+
+  TurnAllocation turn;
+  int b_turn;
+
+  GatherProbe probes[AGENT_MAX_ICE_SERVERS];
+  int probes_num;
+  uint32_t gather_deadline;
 };
 
+/**
+ * @brief add an ICE server and send its Binding or Allocate request without waiting for the answer
+ * @param[in] urls stun:, turn: or turns: URL
+ */
 void agent_gather_candidate(Agent *agent, const char *urls, const char *username, const char *credential);
 
+/**
+ * @brief handle the answers of the ICE servers for up to timeout ms, retransmitting requests that are due
+ * @param[in] timeout in milliseconds, bounded by the gathering deadline
+ * @return 1 while a server is still to answer, 0 once gathering is complete
+ */
+int agent_gather_wait(Agent *agent, int timeout);
+
 void agent_get_local_description(Agent *agent, char *description, int length);
 
 int agent_loop(Agent *agent);
 
+/**
+ * @brief send a datagram on the selected pair
+ * @return bytes sent, -2 when the socket buffer is full, -1 on error
+ */
 int agent_send(Agent *agent, const uint8_t *buf, int len);
 
+/**
+ * @brief send datagrams on the selected pair with as few system calls as the platform allows
+ * @param[in] packets buf and len of each datagram, back to back in memory for UDP GSO
+ * @return datagrams sent, fewer than count when the socket buffer is full, -1 on error
+ */
+int agent_send_batch(Agent *agent, UdpPacket *packets, int count);
+
 int agent_recv(Agent *agent, uint8_t *buf, int len);
 
+/**
+ * @brief block until a datagram is ready on the agent sockets, the event is signaled or the timeout expires
+ * @param[in] event file descriptor from ports_event_create(), -1 to wait on the sockets only
+ * @param[in] timeout in milliseconds, 0 to poll
+ * @return number of ready descriptors, 0 on timeout, -1 on error
+ */
+int agent_wait(Agent *agent, int event_fd, int timeout);
+
 void agent_set_remote_description(Agent *agent, char *description);
 
 void *agent_thread(void *arg);
 
+/**
+ * @brief tell whether the checks can still succeed
+ * @return 0 while a pair is left to check or the peer may still send checks, -1 once all pairs failed
+ */
 int agent_select_candidate_pair(Agent *agent);
 
 void agent_attach_recv_cb(Agent *agent, void (*data_recv_cb)(char *buf, int len, void *user_data));
 
 void agent_set_host_address(Agent *agent, Address *addr);
 
+/**
+ * @brief send the check due every Ta, retransmit unanswered ones and nominate, answers arrive through agent_recv
+ * @return 0 once a pair is selected for the data, -1 while checking
+ */
 int agent_connectivity_check(Agent *agent);
 
+/**
+ * @brief send the consent check on the selected pair when it is due
+ * @return 0 while the peer keeps answering, -1 once consent to send expired
+ */
+int agent_consent_check(Agent *agent);
+
+/**
+ * @brief refresh the TURN allocation and channel bindings that are due, retransmit unanswered requests
+ */
+void agent_turn_refresh(Agent *agent);
+
 void agent_init(Agent *agent);
 
 void agent_deinit(Agent *agent);
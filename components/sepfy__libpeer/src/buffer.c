@@ -3,149 +3,189 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef ESP32
+#include <esp_heap_caps.h>
+#endif
+
 #include "utils.h"
 #include "buffer.h"
 
-Buffer* buffer_new(int size) {
+#define BUFFER_HEADER_SIZE 4
+#define BUFFER_WRAP_MARKER 0xffffffff
+
+#define BUFFER_RECORD_SIZE(size) ALIGN32((uint32_t)(size) + BUFFER_HEADER_SIZE)
+
+Buffer* buffer_new(int size, int in_psram) {
 
   Buffer *rb;
   rb = (Buffer*)calloc(1, sizeof(Buffer));
+  if (!rb) {
+    return NULL;
+  }
+
+  rb->size = size & ~3;
 
-  rb->data = (uint8_t*)calloc(1, size);
-  rb->size = size;
-  rb->head = 0;
-  rb->tail = 0;
+#ifdef ESP32
+  if (in_psram) {
+    rb->data = (uint8_t*)heap_caps_malloc(rb->size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    rb->in_psram = rb->data != NULL;
+  }
+#endif
+
+  if (!rb->data) {
+    rb->data = (uint8_t*)malloc(rb->size);
+  }
+
+  if (!rb->data) {
+    LOGE("Failed to allocate %d bytes ring buffer", (int)rb->size);
+    free(rb);
+    return NULL;
+  }
 
+  buffer_clear(rb);
   return rb;
 }
 
 void buffer_clear(Buffer *rb) {
 
-  rb->head = 0;
-  rb->tail = 0;
+  atomic_store(&rb->head, 0);
+  atomic_store(&rb->tail, 0);
+  rb->reserve_size = -1;
 }
 
 void buffer_free(Buffer *rb) {
 
   if (rb) {
 
+#ifdef ESP32
+    heap_caps_free(rb->data);
+#else
     free(rb->data);
-    rb->data = NULL;
-    rb = NULL;
+#endif
+    free(rb);
   }
 }
 
-// int buffer_push_tail(Buffer* rb, const uint8_t* data, int size) {
-//   int free_space = (rb->size + rb->head - rb->tail - 1) % rb->size;
+uint32_t buffer_used(Buffer *rb) {
 
-//   int align_size = ALIGN32(size + 4);
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
 
-//   if (align_size > free_space) {
-//     LOGE("no enough space");
-//     return -1;
-//   }
-
-//   int tail_end = (rb->tail + align_size) % rb->size;
-
-//   if (tail_end < rb->tail) {
-//     if (rb->head < align_size) {
-//       LOGE("no enough space");
-//       return -1;
-//     }
-
-//     int* p = (int*)(rb->data + rb->tail);
-//     *p = size;
-//     memcpy(rb->data, data, size);
-//     rb->tail = size;
-
-//   } else {
-//     int* p = (int*)(rb->data + rb->tail);
-//     *p = size;
-//     memcpy(rb->data + rb->tail + 4, data, size);
-//     rb->tail = tail_end;
-//   }
-
-//   return size;
-// }
-
-int buffer_push_tail(Buffer *rb, const uint8_t *data, int size) {
-    int free_space = (rb->size + rb->head - rb->tail - 1) % rb->size;  // Calculate free space
-    int align_size = ALIGN32(size + 4);  // Align data size + 4 bytes for storing the size
-
-    // Check if there is enough free space
-    if (align_size > free_space) {
-        printf("LOGE: No enough space\n");
-        return -1;
-    }
+  return (tail + rb->size - head) % rb->size;
+}
 
-    // Calculate the end of the tail after adding new data
-    int tail_end = (rb->tail + align_size) % rb->size;
-
-    // Handle wrap-around if tail_end is before the current tail
-    if (tail_end < rb->tail) {
-        // Check if enough space is available at the start of the buffer (head area)
-        if (rb->head < align_size) {
-            printf("LOGE: No enough space due to wrap-around\n");
-            return -1;
-        }
-        // Store size at the tail and copy data at the beginning of the buffer
-        int *p = (int*)(rb->data + rb->tail);
-        *p = size;
-        memcpy(rb->data, data, size);  // Copy data at the start of the buffer
-        rb->tail = size;  // Update tail to the size of the data
+uint8_t* buffer_reserve(Buffer *rb, int size) {
+
+  uint32_t need = BUFFER_RECORD_SIZE(size);
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_acquire);
+  uint32_t pos;
+
+  // tail never catches up with head, that would read as empty
+  if (size < 0 || need >= rb->size) {
+    pos = rb->size;
+  } else if (tail >= head) {
+    if (tail + need < rb->size || (tail + need == rb->size && head > 0)) {
+      pos = tail;
+    } else if (need < head) {
+      pos = 0;
     } else {
-        // Store size at the tail and copy data within the buffer
-        int *p = (int*)(rb->data + rb->tail);
-        *p = size;
-        memcpy(rb->data + rb->tail + 4, data, size);  // Copy data after the size field
-        rb->tail = tail_end;  // Update tail
+      pos = rb->size;
     }
+  } else if (tail + need < head) {
+    pos = tail;
+  } else {
+    pos = rb->size;
+  }
 
-    return size;  // Return size of data written
+  if (pos == rb->size) {
+    rb->overflows++;
+    rb->reserve_size = -1;
+    return NULL;
+  }
+
+  rb->reserve_pos = pos;
+  rb->reserve_size = size;
+  return rb->data + pos + BUFFER_HEADER_SIZE;
 }
 
-uint8_t* buffer_peak_head(Buffer *rb, int *size) {
+void buffer_commit(Buffer *rb, int size) {
 
-  if (!rb || rb->head == rb->tail) {
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+  uint32_t used;
 
-    return NULL;
+  if (rb->reserve_size < 0) {
+    return;
   }
 
-  *size = *((int*)(rb->data + rb->head));
+  if (size < 0 || size > rb->reserve_size) {
+    size = rb->reserve_size;
+  }
 
-  int align_size = ALIGN32(*size + 4);
+  // the consumer reads the marker only once tail moves past it
+  if (rb->reserve_pos != tail) {
+    *(uint32_t*)(rb->data + tail) = BUFFER_WRAP_MARKER;
+  }
 
-  int head_end = (rb->head + align_size) % rb->size;
+  *(uint32_t*)(rb->data + rb->reserve_pos) = size;
+  rb->reserve_size = -1;
 
-  if (head_end < rb->head) {
+  atomic_store_explicit(&rb->tail, (rb->reserve_pos + BUFFER_RECORD_SIZE(size)) % rb->size, memory_order_release);
 
-    return rb->data;
+  used = buffer_used(rb);
+  if (used > rb->high_watermark) {
+    rb->high_watermark = used;
+  }
+}
 
-  } else {
+int buffer_push(Buffer *rb, const uint8_t *data, int size) {
+
+  uint8_t *p = buffer_reserve(rb, size);
 
-    return rb->data + (rb->head + 4);
+  if (!p) {
+    return -1;
   }
+
+  memcpy(p, data, size);
+  buffer_commit(rb, size);
+  return size;
 }
 
-void buffer_pop_head(Buffer *rb) {
+uint8_t* buffer_peek(Buffer *rb, int *size) {
 
-  if (!rb || rb->head == rb->tail) {
-    return;
+  uint32_t head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+  uint32_t len;
+
+  if (head == tail) {
+    return NULL;
   }
 
-  int *size = (int*)(rb->data + rb->head);
+  len = *(uint32_t*)(rb->data + head);
 
-  int align_size = ALIGN32(*size + 4);
+  if (len == BUFFER_WRAP_MARKER) {
 
-  int head_end = (rb->head + align_size) % rb->size;
+    atomic_store_explicit(&rb->head, 0, memory_order_release);
+    if (tail == 0) {
+      return NULL;
+    }
+    head = 0;
+    len = *(uint32_t*)(rb->data + head);
+  }
 
-  if (head_end < rb->head) {
+  *size = len;
+  return rb->data + head + BUFFER_HEADER_SIZE;
+}
 
-    rb->head = *size;
+void buffer_release(Buffer *rb) {
 
-  } else {
+  int size;
+  uint32_t head;
 
-    rb->head = rb->head + align_size;
+  if (!buffer_peek(rb, &size)) {
+    return;
   }
-}
 
+  head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+  atomic_store_explicit(&rb->head, (head + BUFFER_RECORD_SIZE(size)) % rb->size, memory_order_release);
+}
@@ -4,26 +4,80 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Single producer / single consumer ring of variable length records.
+ * Every record is a 4-byte length followed by the payload, padded to 4 bytes,
+ * and is always contiguous: a record that does not fit before the end of the
+ * ring leaves a wrap marker and starts over at offset 0.
+ */
 
 typedef struct Buffer {
 
   uint8_t *data;
-  int size;
-  int head;
-  int tail;
+  uint32_t size;
+  atomic_uint head; // written by the consumer only
+  atomic_uint tail; // written by the producer only
+
+  // producer side reservation, not visible to the consumer until committed
+  uint32_t reserve_pos;
+  int reserve_size; // -1 when nothing is reserved
+
+  // statistics, updated by the producer
+  uint32_t high_watermark; // most bytes ever in use, including headers and padding
+  uint32_t overflows;      // reservations refused for lack of space
+
+  int in_psram;
 
 } Buffer;
 
-Buffer* buffer_new(int size);
+/**
+ * @brief allocate a ring buffer
+ * @param[in] capacity in bytes, rounded down to a multiple of 4
+ * @param[in] place the storage in PSRAM when available
+ */
+Buffer* buffer_new(int size, int in_psram);
 
 void buffer_free(Buffer *rb);
 
-uint8_t* buffer_peak_head(Buffer *rb, int *size);
+/**
+ * @brief reserve contiguous space for a record of up to size bytes
+ * @return pointer to write the payload to, NULL if the ring is full
+ */
+uint8_t* buffer_reserve(Buffer *rb, int size);
+
+/**
+ * @brief publish the reserved record to the consumer
+ * @param[in] bytes actually written, not more than reserved
+ */
+void buffer_commit(Buffer *rb, int size);
+
+/**
+ * @brief copy a record in, reserve and commit in one step
+ * @return size on success, -1 if the ring is full
+ */
+int buffer_push(Buffer *rb, const uint8_t *data, int size);
+
+/**
+ * @brief oldest record, stays valid until buffer_release
+ * @return pointer to the payload, NULL if the ring is empty
+ */
+uint8_t* buffer_peek(Buffer *rb, int *size);
+
+/**
+ * @brief drop the record returned by buffer_peek
+ */
+void buffer_release(Buffer *rb);
 
-int buffer_push_tail(Buffer *rb, const uint8_t *data, int size);
-   
-void buffer_pop_head(Buffer *rb);
+/**
+ * @brief bytes in use, including headers and padding
+ */
+uint32_t buffer_used(Buffer *rb);
 
+/**
+ * @brief drop every record, only while neither side is running
+ */
 void buffer_clear(Buffer *rb);
 
 #endif // BUFFER_H_
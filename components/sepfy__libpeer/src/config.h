@@ -4,21 +4,47 @@
 #define SCTP_MTU (1200)
 #define CONFIG_MTU (1300)
 #define RSA_KEY_LENGTH 1024
+// DTLS identity, an ECDSA P-256 key (1) or an RSA_KEY_LENGTH one (0), generated once and kept in storage
+#define DTLS_SRTP_IDENTITY_ECDSA 1
+#define STORAGE_NAMESPACE "libpeer"
 
 #ifdef ESP32
 #define VIDEO_RB_DATA_LENGTH (CONFIG_MTU * 64)
 #define AUDIO_RB_DATA_LENGTH (CONFIG_MTU * 64)
 #define DATA_RB_DATA_LENGTH (SCTP_MTU * 128)
+#define RB_IN_PSRAM 1
+#define PEER_CONNECTION_SEND_BATCH 1
+#define PACER_QUEUE_LENGTH (CONFIG_MTU * 96)
 #else
 #define HAVE_USRSCTP
 #define VIDEO_RB_DATA_LENGTH (CONFIG_MTU * 256)
 #define AUDIO_RB_DATA_LENGTH (CONFIG_MTU * 256)
 #define DATA_RB_DATA_LENGTH (SCTP_MTU * 128)
+#define RB_IN_PSRAM 0
+// RTP packets of a video frame encrypted back to back and sent with one sendmmsg or UDP GSO
+#define PEER_CONNECTION_SEND_BATCH 32
+#define PACER_QUEUE_LENGTH (CONFIG_MTU * 256)
+#define STORAGE_DIR "/var/tmp"
 #endif
 
 #define AUDIO_LATENCY 20 // ms
-#define KEEPALIVE_CONNCHECK 10000
+#define BITRATE_START 300000
+#define BITRATE_MIN 50000
+#define BITRATE_MAX 2000000
+// the pacer drains its queues at this multiple of the target bitrate, at most PACER_BURST_MS worth at once
+#define PACER_RATE_FACTOR 1.25f
+#define PACER_BURST_MS 40
+// and faster when what is queued would wait longer than this many ms
+#define PACER_MAX_QUEUE_TIME 1000
+// consent freshness of RFC 7675, the peer has to answer a check on the selected pair within the timeout
+#define ICE_CONSENT_INTERVAL 5000
+#define ICE_CONSENT_TIMEOUT 30000
+// USE-CANDIDATE on every check, the first pair that works is used and ICE completes one round trip earlier
+#define ICE_AGGRESSIVE_NOMINATION 0
+#define PEER_CONNECTION_RECV_BATCH 16 // datagrams handled per loop before the send queues are looked at again
 #define CONFIG_IPV6 0
+// send buffer of the TURN TCP/TLS connection, lwIP sizes it from CONFIG_LWIP_TCP_SND_BUF_DEFAULT instead
+#define TURN_TCP_SNDBUF (32 * 1024)
 // default use wifi interface
 #define IFR_NAME "w"
 
@@ -0,0 +1,400 @@
+#include <string.h>
+
+#include "congestion.h"
+#include "utils.h"
+
+// Google Congestion Control, draft-ietf-rmcat-gcc-02 with the trendline
+// estimator used by current browsers in place of the Kalman filter.
+
+#define TRENDLINE_SMOOTHING 0.9f
+#define TRENDLINE_GAIN 4.0f
+#define THRESHOLD_INITIAL 12.5f
+#define THRESHOLD_K_UP 0.0087f
+#define THRESHOLD_K_DOWN 0.039f
+#define OVERUSE_TIME_THRESHOLD 10.0f // ms
+#define BETA 0.85f
+#define ACKED_WINDOW 500 // ms
+
+void congestion_init(CongestionController *cc, uint32_t start_bitrate, uint32_t min_bitrate, uint32_t max_bitrate) {
+
+  memset(cc, 0, sizeof(CongestionController));
+  cc->min_bitrate = min_bitrate;
+  cc->max_bitrate = max_bitrate;
+  cc->target_bitrate = start_bitrate;
+  cc->loss_bitrate = start_bitrate;
+  cc->delay_bitrate = start_bitrate;
+  cc->threshold = THRESHOLD_INITIAL;
+  cc->time_over_using = -1;
+  cc->state = RATE_CONTROL_INCREASE;
+}
+
+static void congestion_update_target(CongestionController *cc) {
+
+  uint32_t target = cc->delay_bitrate;
+
+  if (cc->loss_bitrate < target)
+    target = cc->loss_bitrate;
+
+  if (cc->remb_bitrate > 0 && cc->remb_bitrate < target)
+    target = cc->remb_bitrate;
+
+  if (target < cc->min_bitrate)
+    target = cc->min_bitrate;
+  else if (target > cc->max_bitrate)
+    target = cc->max_bitrate;
+
+  cc->target_bitrate = target;
+}
+
+uint16_t congestion_on_packet_sent(CongestionController *cc, size_t size, uint32_t now) {
+
+  SentPacket *packet = &cc->history[cc->twcc_seq & (CONGESTION_HISTORY_SIZE - 1)];
+
+  packet->seq = cc->twcc_seq;
+  packet->size = size;
+  packet->send_time = now;
+  packet->valid = 1;
+
+  return cc->twcc_seq++;
+}
+
+static void congestion_update_loss_bitrate(CongestionController *cc, float loss) {
+
+  cc->fraction_lost = loss;
+
+  if (loss < 0.02f) {
+    cc->loss_bitrate = (uint32_t)(cc->loss_bitrate * 1.05f) + 1000;
+  } else if (loss > 0.1f) {
+    cc->loss_bitrate = (uint32_t)(cc->loss_bitrate * (1.0f - 0.5f * loss));
+  }
+
+  if (cc->loss_bitrate < cc->min_bitrate)
+    cc->loss_bitrate = cc->min_bitrate;
+  else if (cc->loss_bitrate > cc->max_bitrate)
+    cc->loss_bitrate = cc->max_bitrate;
+
+  congestion_update_target(cc);
+}
+
+void congestion_on_receiver_report(CongestionController *cc, uint8_t fraction_lost, uint32_t jitter, uint32_t now) {
+
+  cc->jitter = jitter;
+  cc->last_rr_time = now;
+  LOGD("RR fraction lost %d jitter %d", fraction_lost, (int)jitter);
+  congestion_update_loss_bitrate(cc, (float)fraction_lost / 256.0f);
+}
+
+void congestion_on_remb(CongestionController *cc, uint32_t bitrate) {
+
+  cc->remb_bitrate = bitrate;
+  congestion_update_target(cc);
+}
+
+static float congestion_trendline_slope(CongestionController *cc) {
+
+  int n = CONGESTION_TRENDLINE_WINDOW;
+  float avg_x = 0;
+  float avg_y = 0;
+  float numerator = 0;
+  float denominator = 0;
+
+  for (int i = 0; i < n; i++) {
+    avg_x += cc->trend_x[i];
+    avg_y += cc->trend_y[i];
+  }
+  avg_x /= n;
+  avg_y /= n;
+
+  for (int i = 0; i < n; i++) {
+    numerator += (cc->trend_x[i] - avg_x) * (cc->trend_y[i] - avg_y);
+    denominator += (cc->trend_x[i] - avg_x) * (cc->trend_x[i] - avg_x);
+  }
+
+  if (denominator == 0)
+    return cc->trend;
+
+  return numerator / denominator;
+}
+
+static void congestion_detect(CongestionController *cc, float send_delta, uint32_t now) {
+
+  float modified_trend;
+  float abs_trend;
+  float k;
+  uint32_t dt;
+
+  if (cc->trend_count < CONGESTION_TRENDLINE_WINDOW)
+    return;
+
+  modified_trend = (cc->num_deltas < 60 ? cc->num_deltas : 60) * cc->trend * TRENDLINE_GAIN;
+
+  if (modified_trend > cc->threshold) {
+
+    if (cc->time_over_using < 0)
+      cc->time_over_using = send_delta / 2;
+    else
+      cc->time_over_using += send_delta;
+
+    cc->overuse_count++;
+    if (cc->time_over_using > OVERUSE_TIME_THRESHOLD && cc->overuse_count > 1 && cc->trend >= cc->prev_trend) {
+      cc->time_over_using = 0;
+      cc->overuse_count = 0;
+      cc->usage = BANDWIDTH_OVERUSING;
+    }
+
+  } else if (modified_trend < -cc->threshold) {
+
+    cc->time_over_using = -1;
+    cc->overuse_count = 0;
+    cc->usage = BANDWIDTH_UNDERUSING;
+
+  } else {
+
+    cc->time_over_using = -1;
+    cc->overuse_count = 0;
+    cc->usage = BANDWIDTH_NORMAL;
+  }
+
+  cc->prev_trend = cc->trend;
+
+  // adaptive threshold, ignore spikes far above it
+  abs_trend = modified_trend < 0 ? -modified_trend : modified_trend;
+  if (cc->last_threshold_update == 0)
+    cc->last_threshold_update = now;
+
+  if (abs_trend <= cc->threshold + 15.0f) {
+
+    k = abs_trend < cc->threshold ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+    dt = now - cc->last_threshold_update;
+    if (dt > 100)
+      dt = 100;
+
+    cc->threshold += k * (abs_trend - cc->threshold) * dt;
+    if (cc->threshold < 6.0f)
+      cc->threshold = 6.0f;
+    else if (cc->threshold > 600.0f)
+      cc->threshold = 600.0f;
+  }
+  cc->last_threshold_update = now;
+}
+
+static void congestion_on_group_delta(CongestionController *cc, float send_delta, float arrival_delta, int64_t arrival_time, uint32_t now) {
+
+  int pos;
+
+  if (cc->num_deltas < 1000)
+    cc->num_deltas++;
+
+  cc->accumulated_delay += arrival_delta - send_delta;
+  cc->smoothed_delay = TRENDLINE_SMOOTHING * cc->smoothed_delay + (1 - TRENDLINE_SMOOTHING) * cc->accumulated_delay;
+
+  if (cc->first_arrival_time == 0)
+    cc->first_arrival_time = arrival_time;
+
+  pos = cc->trend_count % CONGESTION_TRENDLINE_WINDOW;
+  cc->trend_x[pos] = (float)(arrival_time - cc->first_arrival_time) / 1000.0f;
+  cc->trend_y[pos] = cc->smoothed_delay;
+  cc->trend_count++;
+
+  if (cc->trend_count >= CONGESTION_TRENDLINE_WINDOW)
+    cc->trend = congestion_trendline_slope(cc);
+
+  congestion_detect(cc, send_delta, now);
+}
+
+// send_time in ms of the local clock, arrival_time in us of the remote clock
+static void congestion_on_packet_acked(CongestionController *cc, uint32_t send_time, int64_t arrival_time, uint32_t now) {
+
+  PacketGroup *group = &cc->group;
+
+  if (group->valid && send_time - group->first_send_time <= CONGESTION_BURST_INTERVAL) {
+
+    group->last_send_time = send_time;
+    if (arrival_time > group->last_arrival_time)
+      group->last_arrival_time = arrival_time;
+    return;
+  }
+
+  if (group->valid && cc->prev_group.valid) {
+    congestion_on_group_delta(cc, (float)(group->last_send_time - cc->prev_group.last_send_time),
+     (float)(group->last_arrival_time - cc->prev_group.last_arrival_time) / 1000.0f, group->last_arrival_time, now);
+  }
+
+  if (group->valid)
+    cc->prev_group = *group;
+
+  group->first_send_time = send_time;
+  group->last_send_time = send_time;
+  group->last_arrival_time = arrival_time;
+  group->valid = 1;
+}
+
+static void congestion_update_delay_bitrate(CongestionController *cc, uint32_t now) {
+
+  uint32_t dt;
+  uint32_t bitrate = cc->delay_bitrate;
+  uint32_t limit;
+
+  switch (cc->usage) {
+    case BANDWIDTH_OVERUSING:
+      cc->state = RATE_CONTROL_DECREASE;
+      break;
+    case BANDWIDTH_UNDERUSING:
+      cc->state = RATE_CONTROL_HOLD;
+      break;
+    case BANDWIDTH_NORMAL:
+      if (cc->state == RATE_CONTROL_HOLD)
+        cc->state = RATE_CONTROL_INCREASE;
+      break;
+  }
+
+  dt = cc->last_rate_update ? now - cc->last_rate_update : 0;
+  if (dt > 1000)
+    dt = 1000;
+  cc->last_rate_update = now;
+
+  switch (cc->state) {
+    case RATE_CONTROL_INCREASE:
+      // 8% per second, but never far beyond what actually got through
+      bitrate = (uint32_t)(bitrate * (1.0f + 0.08f * dt / 1000.0f)) + 1;
+      if (cc->acked_bitrate > 0) {
+        limit = cc->acked_bitrate * 3 / 2 + 10000;
+        if (bitrate > limit)
+          bitrate = limit > cc->delay_bitrate ? limit : cc->delay_bitrate;
+      }
+      break;
+    case RATE_CONTROL_DECREASE:
+      if (cc->acked_bitrate > 0 && BETA * cc->acked_bitrate < bitrate)
+        bitrate = (uint32_t)(BETA * cc->acked_bitrate);
+      else
+        bitrate = (uint32_t)(BETA * bitrate);
+      cc->state = RATE_CONTROL_HOLD;
+      // do not act on the same over-use twice
+      cc->usage = BANDWIDTH_NORMAL;
+      LOGD("delay based decrease to %d", (int)bitrate);
+      break;
+    default:
+      break;
+  }
+
+  if (bitrate < cc->min_bitrate)
+    bitrate = cc->min_bitrate;
+  else if (bitrate > cc->max_bitrate)
+    bitrate = cc->max_bitrate;
+
+  cc->delay_bitrate = bitrate;
+}
+
+int congestion_on_transport_feedback(CongestionController *cc, const uint8_t *fci, size_t len, uint32_t now) {
+
+  uint8_t status[CONGESTION_HISTORY_SIZE];
+  uint16_t base_seq;
+  uint16_t status_count;
+  uint16_t chunk;
+  int32_t reference_time;
+  int64_t arrival_time;
+  int16_t delta;
+  SentPacket *packet;
+  size_t pos = 8;
+  int n = 0;
+  int i;
+
+  if (len < 8)
+    return -1;
+
+  base_seq = (fci[0] << 8) | fci[1];
+  status_count = (fci[2] << 8) | fci[3];
+  reference_time = (fci[4] << 16) | (fci[5] << 8) | fci[6];
+  // 24 bit signed, multiples of 64 ms
+  if (reference_time & 0x800000)
+    reference_time -= 0x1000000;
+
+  if (status_count > CONGESTION_HISTORY_SIZE)
+    status_count = CONGESTION_HISTORY_SIZE;
+
+  while (n < status_count) {
+
+    if (pos + 2 > len)
+      return -1;
+
+    chunk = (fci[pos] << 8) | fci[pos + 1];
+    pos += 2;
+
+    if ((chunk & 0x8000) == 0) {
+      // run length chunk
+      for (i = 0; i < (chunk & 0x1fff) && n < status_count; i++)
+        status[n++] = (chunk >> 13) & 0x03;
+    } else if ((chunk & 0x4000) == 0) {
+      // status vector chunk, 14 one bit symbols
+      for (i = 0; i < 14 && n < status_count; i++)
+        status[n++] = (chunk >> (13 - i)) & 0x01;
+    } else {
+      // status vector chunk, 7 two bit symbols
+      for (i = 0; i < 7 && n < status_count; i++)
+        status[n++] = (chunk >> (12 - 2 * i)) & 0x03;
+    }
+  }
+
+  arrival_time = (int64_t)reference_time * 64000;
+
+  for (i = 0; i < n; i++) {
+
+    if (status[i] == 0) {
+      cc->twcc_lost++;
+      continue;
+    }
+    cc->twcc_received++;
+
+    if (status[i] == 1) {
+      if (pos + 1 > len)
+        return -1;
+      delta = fci[pos];
+      pos += 1;
+    } else {
+      if (pos + 2 > len)
+        return -1;
+      delta = (int16_t)((fci[pos] << 8) | fci[pos + 1]);
+      pos += 2;
+    }
+
+    // 250 us per tick
+    arrival_time += delta * 250;
+
+    packet = &cc->history[(uint16_t)(base_seq + i) & (CONGESTION_HISTORY_SIZE - 1)];
+    if (!packet->valid || packet->seq != (uint16_t)(base_seq + i))
+      continue;
+
+    packet->valid = 0;
+    cc->acked_bytes += packet->size;
+    congestion_on_packet_acked(cc, packet->send_time, arrival_time, now);
+  }
+
+  if (cc->acked_window_start == 0) {
+    cc->acked_window_start = now;
+  } else if (now - cc->acked_window_start >= ACKED_WINDOW) {
+    cc->acked_bitrate = (uint64_t)cc->acked_bytes * 8 * 1000 / (now - cc->acked_window_start);
+    cc->acked_bytes = 0;
+    cc->acked_window_start = now;
+  }
+
+  // without receiver reports, feed the loss controller from the feedback itself
+  if (cc->twcc_loss_window_start == 0) {
+    cc->twcc_loss_window_start = now;
+  } else if (now - cc->twcc_loss_window_start >= 1000) {
+    if ((cc->last_rr_time == 0 || now - cc->last_rr_time > 2000) && cc->twcc_lost + cc->twcc_received > 0) {
+      congestion_update_loss_bitrate(cc, (float)cc->twcc_lost / (cc->twcc_lost + cc->twcc_received));
+    }
+    cc->twcc_lost = 0;
+    cc->twcc_received = 0;
+    cc->twcc_loss_window_start = now;
+  }
+
+  congestion_update_delay_bitrate(cc, now);
+  congestion_update_target(cc);
+  return 0;
+}
+
+uint32_t congestion_get_target_bitrate(CongestionController *cc) {
+
+  return cc->target_bitrate;
+}
@@ -0,0 +1,114 @@
+#ifndef CONGESTION_H_
+#define CONGESTION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "config.h"
+
+// sent packets remembered until transport-cc feedback arrives, power of 2
+#define CONGESTION_HISTORY_SIZE 512
+#define CONGESTION_TRENDLINE_WINDOW 20
+#define CONGESTION_BURST_INTERVAL 5 // ms
+
+typedef enum BandwidthUsage {
+
+  BANDWIDTH_NORMAL = 0,
+  BANDWIDTH_UNDERUSING,
+  BANDWIDTH_OVERUSING,
+
+} BandwidthUsage;
+
+typedef enum RateControlState {
+
+  RATE_CONTROL_HOLD = 0,
+  RATE_CONTROL_INCREASE,
+  RATE_CONTROL_DECREASE,
+
+} RateControlState;
+
+typedef struct SentPacket {
+
+  uint16_t seq;
+  uint16_t size;
+  uint32_t send_time;
+  uint8_t valid;
+
+} SentPacket;
+
+typedef struct PacketGroup {
+
+  uint32_t first_send_time;
+  uint32_t last_send_time;
+  int64_t last_arrival_time;
+  int valid;
+
+} PacketGroup;
+
+typedef struct CongestionController {
+
+  uint32_t min_bitrate;
+  uint32_t max_bitrate;
+  uint32_t target_bitrate;
+  uint32_t loss_bitrate;
+  uint32_t delay_bitrate;
+  uint32_t remb_bitrate;
+
+  // receiver reports
+  float fraction_lost;
+  uint32_t jitter;
+  uint32_t last_rr_time;
+  uint32_t twcc_lost;
+  uint32_t twcc_received;
+  uint32_t twcc_loss_window_start;
+
+  // transport-cc
+  uint16_t twcc_seq;
+  SentPacket history[CONGESTION_HISTORY_SIZE];
+
+  // trendline over-use detector, times in ms
+  PacketGroup group;
+  PacketGroup prev_group;
+  int num_deltas;
+  float accumulated_delay;
+  float smoothed_delay;
+  float trend_x[CONGESTION_TRENDLINE_WINDOW];
+  float trend_y[CONGESTION_TRENDLINE_WINDOW];
+  int trend_count;
+  int64_t first_arrival_time;
+  float trend;
+  float prev_trend;
+  float threshold;
+  float time_over_using;
+  int overuse_count;
+  uint32_t last_threshold_update;
+  BandwidthUsage usage;
+
+  // AIMD rate control
+  RateControlState state;
+  uint32_t last_rate_update;
+  uint32_t acked_bytes;
+  uint32_t acked_window_start;
+  uint32_t acked_bitrate;
+
+} CongestionController;
+
+void congestion_init(CongestionController *cc, uint32_t start_bitrate, uint32_t min_bitrate, uint32_t max_bitrate);
+
+/**
+ * @brief allocate the transport-wide sequence number of an outgoing RTP packet
+ */
+uint16_t congestion_on_packet_sent(CongestionController *cc, size_t size, uint32_t now);
+
+void congestion_on_receiver_report(CongestionController *cc, uint8_t fraction_lost, uint32_t jitter, uint32_t now);
+
+void congestion_on_remb(CongestionController *cc, uint32_t bitrate);
+
+/**
+ * @brief process the FCI of a transport-cc feedback message (RTPFB FMT 15)
+ */
+int congestion_on_transport_feedback(CongestionController *cc, const uint8_t *fci, size_t len, uint32_t now);
+
+uint32_t congestion_get_target_bitrate(CongestionController *cc);
+
+#endif // CONGESTION_H_
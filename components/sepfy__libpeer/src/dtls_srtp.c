@@ -8,6 +8,7 @@
 #include "dtls_srtp.h"
 #include "address.h"
 #include "socket.h"
+#include "ports.h"
 #include "config.h"
 #include "utils.h"
 
@@ -44,9 +45,9 @@ int dtls_srtp_udp_recv(void *ctx, uint8_t *buf, size_t len) {
 
   int ret;
 
-  while ((ret = udp_socket_recvfrom(udp_socket, &udp_socket->bind_addr, buf, len)) <= 0) {
+  if ((ret = udp_socket_recvfrom(udp_socket, &udp_socket->bind_addr, buf, len)) <= 0) {
 
-    usleep(1000);
+    return MBEDTLS_ERR_SSL_WANT_READ;
   }
 
   LOGD("dtls_srtp_udp_recv (%d)", ret);
@@ -82,40 +83,37 @@ static inline __attribute__((unused)) int dtls_srtp_cert_verify(void *data, mbed
   return 0;
 }
 
-static int dtls_srtp_selfsign_cert(DtlsSrtp *dtls_srtp) {
+// Key and certificate in DER with the fingerprint announced in the SDP, as kept in storage
+typedef struct DtlsSrtpIdentity {
 
-  int ret;
+  uint32_t magic;
+  uint32_t type;
+  uint16_t key_len;
+  uint16_t cert_len;
+  char fingerprint[DTLS_SRTP_FINGERPRINT_LENGTH];
+  unsigned char key[DTLS_SRTP_IDENTITY_KEY_SIZE];
+  unsigned char cert[DTLS_SRTP_IDENTITY_CERT_SIZE];
 
-  mbedtls_x509write_cert crt;
+} DtlsSrtpIdentity;
 
-  unsigned char *cert_buf = NULL;
-  const char *serial = "peer";
-  const char *pers = "dtls_srtp";
+// Shared by every peer connection, the first one loads or generates it
+static DtlsSrtpIdentity g_identity;
 
-  cert_buf = (unsigned char *)malloc(RSA_KEY_LENGTH * 2);
-  if (cert_buf == NULL) {
-
-    LOGE("malloc failed");
-    return -1;
-  }
+static int dtls_srtp_identity_write(DtlsSrtp *dtls_srtp, DtlsSrtpIdentity *identity, mbedtls_pk_context *pkey) {
 
-  mbedtls_ctr_drbg_seed(&dtls_srtp->ctr_drbg, mbedtls_entropy_func, &dtls_srtp->entropy, (const unsigned char *) pers, strlen(pers));
-
-  mbedtls_pk_setup(&dtls_srtp->pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA));
- 
-  mbedtls_rsa_gen_key(mbedtls_pk_rsa(dtls_srtp->pkey), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg, RSA_KEY_LENGTH, 65537);
+  int ret;
+  mbedtls_x509write_cert crt;
+  const char *serial = "peer";
 
   mbedtls_x509write_crt_init(&crt);
 
-  mbedtls_x509write_crt_set_subject_key(&crt, &dtls_srtp->pkey);
-
   mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
 
   mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
 
-  mbedtls_x509write_crt_set_subject_key(&crt, &dtls_srtp->pkey);
+  mbedtls_x509write_crt_set_subject_key(&crt, pkey);
 
-  mbedtls_x509write_crt_set_issuer_key(&crt, &dtls_srtp->pkey);
+  mbedtls_x509write_crt_set_issuer_key(&crt, pkey);
 
   mbedtls_x509write_crt_set_subject_name(&crt, "CN=dtls_srtp");
 
@@ -125,34 +123,178 @@ static int dtls_srtp_selfsign_cert(DtlsSrtp *dtls_srtp) {
 
   mbedtls_x509write_crt_set_validity(&crt, "20180101000000", "20280101000000");
 
-  ret = mbedtls_x509write_crt_pem(&crt, cert_buf, 2*RSA_KEY_LENGTH, mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+  // both writers fill the end of the buffer
+  ret = mbedtls_x509write_crt_der(&crt, identity->cert, sizeof(identity->cert), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+
+  mbedtls_x509write_crt_free(&crt);
 
   if (ret < 0) {
 
-    LOGE("mbedtls_x509write_crt_pem failed");
+    LOGE("mbedtls_x509write_crt_der failed(-0x%.4x)", (unsigned int) -ret);
+    return -1;
   }
 
-  mbedtls_x509_crt_parse(&dtls_srtp->cert, cert_buf, 2*RSA_KEY_LENGTH);
+  identity->cert_len = ret;
+  memmove(identity->cert, identity->cert + sizeof(identity->cert) - ret, ret);
 
-  mbedtls_x509write_crt_free(&crt);
+  ret = mbedtls_pk_write_key_der(pkey, identity->key, sizeof(identity->key));
+
+  if (ret < 0) {
 
-  free(cert_buf);
+    LOGE("mbedtls_pk_write_key_der failed(-0x%.4x)", (unsigned int) -ret);
+    return -1;
+  }
+
+  identity->key_len = ret;
+  memmove(identity->key, identity->key + sizeof(identity->key) - ret, ret);
+
+  return 0;
+}
+
+static int dtls_srtp_identity_generate(DtlsSrtp *dtls_srtp, DtlsSrtpIdentity *identity) {
+
+  int ret;
+  mbedtls_pk_context pkey;
+  mbedtls_x509_crt cert;
+
+  mbedtls_pk_init(&pkey);
+  mbedtls_x509_crt_init(&cert);
+
+#if DTLS_SRTP_IDENTITY_ECDSA
+  mbedtls_pk_setup(&pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY));
+
+  ret = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(pkey), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg);
+#else
+  mbedtls_pk_setup(&pkey, mbedtls_pk_info_from_type(MBEDTLS_PK_RSA));
+
+  ret = mbedtls_rsa_gen_key(mbedtls_pk_rsa(pkey), mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg, RSA_KEY_LENGTH, 65537);
+#endif
+
+  if (ret != 0) {
+
+    LOGE("key generation failed(-0x%.4x)", (unsigned int) -ret);
+    ret = -1;
+
+  } else if (dtls_srtp_identity_write(dtls_srtp, identity, &pkey) != 0
+   || mbedtls_x509_crt_parse_der(&cert, identity->cert, identity->cert_len) != 0) {
+
+    ret = -1;
+
+  } else {
+
+    // the fingerprint is the hash of the whole certificate, done once here
+    dtls_srtp_x509_digest(&cert, identity->fingerprint);
+    identity->magic = DTLS_SRTP_IDENTITY_MAGIC;
+    identity->type = DTLS_SRTP_IDENTITY_TYPE;
+  }
+
+  mbedtls_x509_crt_free(&cert);
+  mbedtls_pk_free(&pkey);
 
   return ret;
 }
 
-int dtls_srtp_init(DtlsSrtp *dtls_srtp, DtlsSrtpRole role, void *user_data) {
+static int dtls_srtp_identity_valid(DtlsSrtpIdentity *identity) {
+
+  return identity->magic == DTLS_SRTP_IDENTITY_MAGIC
+   && identity->type == DTLS_SRTP_IDENTITY_TYPE
+   && identity->key_len > 0 && identity->key_len <= sizeof(identity->key)
+   && identity->cert_len > 0 && identity->cert_len <= sizeof(identity->cert)
+   && memchr(identity->fingerprint, '\0', sizeof(identity->fingerprint)) != NULL;
+}
+
+// Key generation and signing take seconds on the ESP32 with RSA, so the
+// identity is made once per device and reused across boots
+static int dtls_srtp_load_identity(DtlsSrtp *dtls_srtp) {
+
+  int ret;
 
-  static const mbedtls_ssl_srtp_profile default_profiles[] = {
+  if (!dtls_srtp_identity_valid(&g_identity)) {
+
+    ret = ports_storage_load(DTLS_SRTP_IDENTITY_NAME, &g_identity, sizeof(g_identity));
+
+    if (ret != sizeof(g_identity) || !dtls_srtp_identity_valid(&g_identity)) {
+
+      LOGI("Generating DTLS identity");
+      memset(&g_identity, 0, sizeof(g_identity));
+
+      if (dtls_srtp_identity_generate(dtls_srtp, &g_identity) != 0) {
+
+        memset(&g_identity, 0, sizeof(g_identity));
+        return -1;
+      }
+
+      ports_storage_save(DTLS_SRTP_IDENTITY_NAME, &g_identity, sizeof(g_identity));
+    }
+  }
+
+  if ((ret = mbedtls_pk_parse_key(&dtls_srtp->pkey, g_identity.key, g_identity.key_len, NULL, 0,
+   mbedtls_ctr_drbg_random, &dtls_srtp->ctr_drbg)) != 0) {
+
+    LOGE("mbedtls_pk_parse_key failed(-0x%.4x)", (unsigned int) -ret);
+    return -1;
+  }
+
+  if ((ret = mbedtls_x509_crt_parse_der(&dtls_srtp->cert, g_identity.cert, g_identity.cert_len)) != 0) {
+
+    LOGE("mbedtls_x509_crt_parse_der failed(-0x%.4x)", (unsigned int) -ret);
+    return -1;
+  }
+
+  strcpy(dtls_srtp->local_fingerprint, g_identity.fingerprint);
+
+  return 0;
+}
+
+// Offer the profiles both mbedTLS and libsrtp know. AEAD_AES_128_GCM is not
+// among them, mbedTLS 3.x rejects its use_srtp value.
+static void dtls_srtp_select_profiles(DtlsSrtp *dtls_srtp) {
+
+  static const mbedtls_ssl_srtp_profile preferred_profiles[] = {
    MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_80,
    MBEDTLS_TLS_SRTP_AES128_CM_HMAC_SHA1_32,
    MBEDTLS_TLS_SRTP_NULL_HMAC_SHA1_80,
-   MBEDTLS_TLS_SRTP_NULL_HMAC_SHA1_32,
-   MBEDTLS_TLS_SRTP_UNSET
   };
 
+  int i;
+  int n = 0;
+  srtp_crypto_policy_t policy;
+
+  for (i = 0; i < sizeof(preferred_profiles)/sizeof(preferred_profiles[0]) && n < MBEDTLS_TLS_SRTP_MAX_PROFILE_LIST_LENGTH; i++) {
+
+    if (srtp_profile_get_master_key_length((srtp_profile_t) preferred_profiles[i]) > SRTP_MASTER_KEY_LENGTH
+     || srtp_profile_get_master_salt_length((srtp_profile_t) preferred_profiles[i]) > SRTP_MASTER_SALT_LENGTH
+     || srtp_crypto_policy_set_from_profile_for_rtp(&policy, (srtp_profile_t) preferred_profiles[i]) != srtp_err_status_ok) {
+
+      LOGD("SRTP profile 0x%04x not supported by libsrtp", preferred_profiles[i]);
+      continue;
+    }
+
+    dtls_srtp->profiles[n++] = preferred_profiles[i];
+  }
+
+  dtls_srtp->profiles[n] = MBEDTLS_TLS_SRTP_UNSET;
+}
+
+int dtls_srtp_init(DtlsSrtp *dtls_srtp, DtlsSrtpRole role, void *user_data) {
+
+  const char *pers = "dtls_srtp";
+
+#if DTLS_SRTP_IDENTITY_ECDSA
+  static const int ecdsa_ciphersuites[] = {
+   MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+   MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+   MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+   MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+   MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
+   0
+  };
+#endif
+
   dtls_srtp->role = role;
   dtls_srtp->state = DTLS_SRTP_STATE_INIT;
+  dtls_srtp->handshake_done = 0;
+  dtls_srtp->timer_fin_ms = 0;
   dtls_srtp->user_data = user_data;
   dtls_srtp->udp_send = dtls_srtp_udp_send;
   dtls_srtp->udp_recv = dtls_srtp_udp_recv;
@@ -165,7 +307,19 @@ int dtls_srtp_init(DtlsSrtp *dtls_srtp, DtlsSrtpRole role, void *user_data) {
   mbedtls_entropy_init(&dtls_srtp->entropy);
   mbedtls_ctr_drbg_init(&dtls_srtp->ctr_drbg);
 
-  dtls_srtp_selfsign_cert(dtls_srtp);
+  mbedtls_ctr_drbg_seed(&dtls_srtp->ctr_drbg, mbedtls_entropy_func, &dtls_srtp->entropy, (const unsigned char *) pers, strlen(pers));
+
+  if (dtls_srtp_load_identity(dtls_srtp) != 0) {
+
+    LOGE("No DTLS identity");
+    mbedtls_x509_crt_free(&dtls_srtp->cert);
+    mbedtls_pk_free(&dtls_srtp->pkey);
+    mbedtls_entropy_free(&dtls_srtp->entropy);
+    mbedtls_ctr_drbg_free(&dtls_srtp->ctr_drbg);
+    mbedtls_ssl_free(&dtls_srtp->ssl);
+    mbedtls_ssl_config_free(&dtls_srtp->conf);
+    return -1;
+  }
 
 // XXX: Not sure if this is needed
 #if 0
@@ -203,11 +357,15 @@ int dtls_srtp_init(DtlsSrtp *dtls_srtp, DtlsSrtpRole role, void *user_data) {
      MBEDTLS_SSL_PRESET_DEFAULT);
   }
 
-  dtls_srtp_x509_digest(&dtls_srtp->cert, dtls_srtp->local_fingerprint);
+#if DTLS_SRTP_IDENTITY_ECDSA
+  mbedtls_ssl_conf_ciphersuites(&dtls_srtp->conf, ecdsa_ciphersuites);
+#endif
 
   LOGD("local fingerprint: %s", dtls_srtp->local_fingerprint);
 
-  mbedtls_ssl_conf_dtls_srtp_protection_profiles(&dtls_srtp->conf, default_profiles);
+  dtls_srtp_select_profiles(dtls_srtp);
+
+  mbedtls_ssl_conf_dtls_srtp_protection_profiles(&dtls_srtp->conf, dtls_srtp->profiles);
 
   mbedtls_ssl_conf_srtp_mki_value_supported(&dtls_srtp->conf, MBEDTLS_SSL_DTLS_SRTP_MKI_UNSUPPORTED);
 
@@ -254,21 +412,46 @@ static void dtls_srtp_key_derivation(void *context, mbedtls_ssl_key_export_type
 
   uint8_t key_material[DTLS_SRTP_KEY_MATERIAL_LENGTH];
 
+  mbedtls_dtls_srtp_info srtp_info;
+  srtp_profile_t profile;
+  int key_length;
+  int salt_length;
+  uint8_t *client_key, *server_key, *client_salt, *server_salt;
+
+  mbedtls_ssl_get_dtls_srtp_negotiation_result(&dtls_srtp->ssl, &srtp_info);
+  profile = (srtp_profile_t) srtp_info.MBEDTLS_PRIVATE(chosen_dtls_srtp_profile);
+
+  key_length = srtp_profile_get_master_key_length(profile);
+  salt_length = srtp_profile_get_master_salt_length(profile);
+
+  if (key_length == 0 || salt_length == 0) {
+
+    LOGE("Unsupported SRTP profile 0x%04x", profile);
+    return;
+  }
+
+  LOGI("SRTP profile 0x%04x", profile);
+
   memcpy(randbytes, client_random, 32);
   memcpy(randbytes + 32, server_random, 32);
 
-  // Export keying material
+  // Export keying material, RFC 5764 4.2: client key, server key, client salt, server salt
   if ((ret = mbedtls_ssl_tls_prf(tls_prf_type, secret, secret_len, dtls_srtp_label,
-   randbytes, sizeof(randbytes), key_material, sizeof(key_material))) != 0) {
+   randbytes, sizeof(randbytes), key_material, 2 * (key_length + salt_length))) != 0) {
     
     LOGE("mbedtls_ssl_tls_prf failed(%d)", ret);
     return;
   }
 
+  client_key = key_material;
+  server_key = client_key + key_length;
+  client_salt = server_key + key_length;
+  server_salt = client_salt + salt_length;
+
 #if 0
   int i, j;
   printf("    DTLS-SRTP key material is:");
-  for (j = 0; j < sizeof(key_material); j++) {
+  for (j = 0; j < 2 * (key_length + salt_length); j++) {
     if (j % 8 == 0) {
       printf("\n    ");
     }
@@ -281,7 +464,7 @@ static void dtls_srtp_key_derivation(void *context, mbedtls_ssl_key_export_type
    * - interop test with openssl which client produces this kind of output
    */
   printf("    Keying material: ");
-  for (j = 0; j < sizeof(key_material); j++) {
+  for (j = 0; j < 2 * (key_length + salt_length); j++) {
     printf("%02X", key_material[j]);
   }
   printf("\n");
@@ -291,11 +474,19 @@ static void dtls_srtp_key_derivation(void *context, mbedtls_ssl_key_export_type
 
   memset(&dtls_srtp->remote_policy, 0, sizeof(dtls_srtp->remote_policy));
 
-  srtp_crypto_policy_set_rtp_default(&dtls_srtp->remote_policy.rtp); 
-  srtp_crypto_policy_set_rtcp_default(&dtls_srtp->remote_policy.rtcp);
+  srtp_crypto_policy_set_from_profile_for_rtp(&dtls_srtp->remote_policy.rtp, profile);
+  srtp_crypto_policy_set_from_profile_for_rtcp(&dtls_srtp->remote_policy.rtcp, profile);
 
-  memcpy(dtls_srtp->remote_policy_key, key_material, SRTP_MASTER_KEY_LENGTH);
-  memcpy(dtls_srtp->remote_policy_key + SRTP_MASTER_KEY_LENGTH, key_material + SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_KEY_LENGTH, SRTP_MASTER_SALT_LENGTH);
+  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
+
+    memcpy(dtls_srtp->remote_policy_key, client_key, key_length);
+    memcpy(dtls_srtp->remote_policy_key + key_length, client_salt, salt_length);
+
+  } else {
+
+    memcpy(dtls_srtp->remote_policy_key, server_key, key_length);
+    memcpy(dtls_srtp->remote_policy_key + key_length, server_salt, salt_length);
+  }
 
   dtls_srtp->remote_policy.ssrc.type = ssrc_any_inbound;
   dtls_srtp->remote_policy.key = dtls_srtp->remote_policy_key;
@@ -312,11 +503,19 @@ static void dtls_srtp_key_derivation(void *context, mbedtls_ssl_key_export_type
   // derive outbounds keys
   memset(&dtls_srtp->local_policy, 0, sizeof(dtls_srtp->local_policy));
 
-  srtp_crypto_policy_set_rtp_default(&dtls_srtp->local_policy.rtp);
-  srtp_crypto_policy_set_rtcp_default(&dtls_srtp->local_policy.rtcp);
+  srtp_crypto_policy_set_from_profile_for_rtp(&dtls_srtp->local_policy.rtp, profile);
+  srtp_crypto_policy_set_from_profile_for_rtcp(&dtls_srtp->local_policy.rtcp, profile);
 
-  memcpy(dtls_srtp->local_policy_key, key_material + SRTP_MASTER_KEY_LENGTH, SRTP_MASTER_KEY_LENGTH);
-  memcpy(dtls_srtp->local_policy_key + SRTP_MASTER_KEY_LENGTH, key_material + SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH, SRTP_MASTER_SALT_LENGTH);
+  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
+
+    memcpy(dtls_srtp->local_policy_key, server_key, key_length);
+    memcpy(dtls_srtp->local_policy_key + key_length, server_salt, salt_length);
+
+  } else {
+
+    memcpy(dtls_srtp->local_policy_key, client_key, key_length);
+    memcpy(dtls_srtp->local_policy_key + key_length, client_salt, salt_length);
+  }
 
   dtls_srtp->local_policy.ssrc.type = ssrc_any_outbound;
   dtls_srtp->local_policy.key = dtls_srtp->local_policy_key;
@@ -332,94 +531,91 @@ static void dtls_srtp_key_derivation(void *context, mbedtls_ssl_key_export_type
   dtls_srtp->state = DTLS_SRTP_STATE_CONNECTED;
 }
 
-static int dtls_srtp_do_handshake(DtlsSrtp *dtls_srtp) {
-
-  int ret;
-  
-  static mbedtls_timing_delay_context timer; 
-
-  mbedtls_ssl_set_timer_cb(&dtls_srtp->ssl, &timer, mbedtls_timing_set_delay, mbedtls_timing_get_delay);
-
-  mbedtls_ssl_set_export_keys_cb(&dtls_srtp->ssl, dtls_srtp_key_derivation, dtls_srtp);
+// mbedtls_ssl_set_timer_cb() callbacks on the timer of this session
+static void dtls_srtp_set_delay(void *ctx, uint32_t int_ms, uint32_t fin_ms) {
 
-  mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp->udp_send, dtls_srtp->udp_recv, NULL);
-  
-  do {
-
-    ret = mbedtls_ssl_handshake(&dtls_srtp->ssl);
-
-  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  DtlsSrtp *dtls_srtp = (DtlsSrtp *) ctx;
 
-  return ret;
+  dtls_srtp->timer_start = ports_get_epoch_time();
+  dtls_srtp->timer_int_ms = int_ms;
+  dtls_srtp->timer_fin_ms = fin_ms;
 }
 
-static int dtls_srtp_handshake_server(DtlsSrtp *dtls_srtp) {
-
-  int ret;
+static int dtls_srtp_get_delay(void *ctx) {
 
-  while (1) {
+  DtlsSrtp *dtls_srtp = (DtlsSrtp *) ctx;
+  uint32_t elapsed;
 
-    unsigned char client_ip[] = "test";
+  if (dtls_srtp->timer_fin_ms == 0) {
 
-    mbedtls_ssl_session_reset(&dtls_srtp->ssl);
+    return -1;
+  }
 
-    mbedtls_ssl_set_client_transport_id(&dtls_srtp->ssl, client_ip, sizeof(client_ip)); 
+  elapsed = ports_get_epoch_time() - dtls_srtp->timer_start;
 
-    ret = dtls_srtp_do_handshake(dtls_srtp);
+  if (elapsed >= dtls_srtp->timer_fin_ms) {
 
-    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+    return 2;
 
-      LOGD("DTLS hello verification requested");
+  } else if (elapsed >= dtls_srtp->timer_int_ms) {
 
-    } else if (ret != 0) {
+    return 1;
+  }
 
-      LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x", (unsigned int) -ret);
+  return 0;
+}
 
-      break;
+static void dtls_srtp_handshake_start(DtlsSrtp *dtls_srtp) {
 
-    } else {
+  unsigned char client_ip[] = "test";
 
-      break;
-    }
-  }
+  mbedtls_ssl_session_reset(&dtls_srtp->ssl);
 
-  LOGD("DTLS server handshake done");
+  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
 
-  return ret;
-}
+    mbedtls_ssl_set_client_transport_id(&dtls_srtp->ssl, client_ip, sizeof(client_ip));
+  }
 
-static int dtls_srtp_handshake_client(DtlsSrtp *dtls_srtp) {
+  mbedtls_ssl_set_timer_cb(&dtls_srtp->ssl, dtls_srtp, dtls_srtp_set_delay, dtls_srtp_get_delay);
 
-  int ret;
+  mbedtls_ssl_set_export_keys_cb(&dtls_srtp->ssl, dtls_srtp_key_derivation, dtls_srtp);
 
-  ret = dtls_srtp_do_handshake(dtls_srtp);
+  mbedtls_ssl_set_bio(&dtls_srtp->ssl, dtls_srtp, dtls_srtp->udp_send, dtls_srtp->udp_recv, NULL);
 
-  if (ret != 0) {
+  dtls_srtp->state = DTLS_SRTP_STATE_HANDSHAKE;
+}
 
-    LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x\n\n", (unsigned int) -ret);
-  }
+static void dtls_srtp_handshake_done(DtlsSrtp *dtls_srtp) {
 
   int flags;
 
-  if ((flags = mbedtls_ssl_get_verify_result(&dtls_srtp->ssl)) != 0) {
+  if (dtls_srtp->role == DTLS_SRTP_ROLE_CLIENT && (flags = mbedtls_ssl_get_verify_result(&dtls_srtp->ssl)) != 0) {
 #if !defined(MBEDTLS_X509_REMOVE_INFO)
     char vrfy_buf[512];
-#endif
-
-    printf(" failed\n");
 
-#if !defined(MBEDTLS_X509_REMOVE_INFO)
     mbedtls_x509_crt_verify_info(vrfy_buf, sizeof(vrfy_buf), "  ! ", flags);
 
-    printf("%s\n", vrfy_buf);
+    LOGW("certificate verification failed\n%s", vrfy_buf);
 #endif
   }
 
-  LOGD("DTLS client handshake done");
+// XXX: Not sure if this is needed
+#if 0
+  const mbedtls_x509_crt *remote_crt;
+  if ((remote_crt = mbedtls_ssl_get_peer_cert(&dtls_srtp->ssl)) != NULL) {
 
-  return ret;
-}
+    dtls_srtp_x509_digest(remote_crt, dtls_srtp->remote_fingerprint);
 
+    LOGD("remote fingerprint: %s", dtls_srtp->remote_fingerprint);
+
+  } else {
+
+    LOGE("no remote fingerprint");
+  }
+#endif
+
+  LOGD("DTLS %s handshake done", dtls_srtp->role == DTLS_SRTP_ROLE_SERVER ? "server" : "client");
+}
 
 int dtls_srtp_handshake(DtlsSrtp *dtls_srtp, Address *addr) {
 
@@ -427,35 +623,54 @@ int dtls_srtp_handshake(DtlsSrtp *dtls_srtp, Address *addr) {
 
   dtls_srtp->remote_addr = addr;
 
-  if (dtls_srtp->role == DTLS_SRTP_ROLE_SERVER) {
+  if (dtls_srtp->state == DTLS_SRTP_STATE_INIT) {
 
-    ret = dtls_srtp_handshake_server(dtls_srtp);
+    dtls_srtp_handshake_start(dtls_srtp);
+  }
 
-  } else {
+  // one step, the receive callback hands over at most the datagram at hand
+  ret = mbedtls_ssl_handshake(&dtls_srtp->ssl);
+
+  if (ret == 0) {
 
-    ret = dtls_srtp_handshake_client(dtls_srtp);
+    if (dtls_srtp->handshake_done == 0) {
 
+      dtls_srtp->handshake_done = 1;
+      dtls_srtp_handshake_done(dtls_srtp);
+    }
+
+    return 0;
+
+  } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+
+    return 1;
+
+  } else if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+
+    // the ClientHello with the cookie starts over on a fresh session
+    LOGD("DTLS hello verification requested");
+    dtls_srtp_handshake_start(dtls_srtp);
+    return 1;
   }
 
-// XXX: Not sure if this is needed
-#if 0
-  const mbedtls_x509_crt *remote_crt;
-  if ((remote_crt = mbedtls_ssl_get_peer_cert(&dtls_srtp->ssl)) != NULL) {
+  LOGE("failed! mbedtls_ssl_handshake returned -0x%.4x", (unsigned int) -ret);
+  dtls_srtp_reset_session(dtls_srtp);
 
-    dtls_srtp_x509_digest(remote_crt, dtls_srtp->remote_fingerprint);
+  return -1;
+}
 
-    LOGD("remote fingerprint: %s", dtls_srtp->remote_fingerprint);
+int dtls_srtp_handshake_timeout(DtlsSrtp *dtls_srtp) {
 
-  } else {
+  uint32_t elapsed;
 
-    LOGE("no remote fingerprint");
+  if (dtls_srtp->state == DTLS_SRTP_STATE_INIT || dtls_srtp->handshake_done || dtls_srtp->timer_fin_ms == 0) {
+
+    return -1;
   }
-#endif
 
-  mbedtls_dtls_srtp_info dtls_srtp_negotiation_result;
-  mbedtls_ssl_get_dtls_srtp_negotiation_result(&dtls_srtp->ssl, &dtls_srtp_negotiation_result);
+  elapsed = ports_get_epoch_time() - dtls_srtp->timer_start;
 
-  return ret;
+  return elapsed >= dtls_srtp->timer_fin_ms ? 0 : dtls_srtp->timer_fin_ms - elapsed;
 }
 
 void dtls_srtp_reset_session(DtlsSrtp *dtls_srtp) {
@@ -468,6 +683,8 @@ void dtls_srtp_reset_session(DtlsSrtp *dtls_srtp) {
   }
 
   dtls_srtp->state = DTLS_SRTP_STATE_INIT;
+  dtls_srtp->handshake_done = 0;
+  dtls_srtp->timer_fin_ms = 0;
 }
 
 int dtls_srtp_write(DtlsSrtp *dtls_srtp, const unsigned char *buf, size_t len) {
@@ -488,11 +705,8 @@ int dtls_srtp_read(DtlsSrtp *dtls_srtp, unsigned char *buf, size_t len) {
 
   memset(buf, 0, len);
 
-  do {
-
-    ret = mbedtls_ssl_read(&dtls_srtp->ssl, buf, len);
-
-  } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+  // a retransmitted handshake flight is answered here and yields WANT_READ
+  ret = mbedtls_ssl_read(&dtls_srtp->ssl, buf, len);
 
   return ret;
 }
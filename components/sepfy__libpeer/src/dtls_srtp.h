@@ -11,16 +11,25 @@
 #include <mbedtls/pk.h>
 #include <mbedtls/x509_crt.h>
 #include <mbedtls/x509_csr.h>
-#include <mbedtls/timing.h>
 
 #include <srtp2/srtp.h>
 
 #include "address.h"
 
+// largest master key and salt of the offered profiles, the negotiated one decides
 #define SRTP_MASTER_KEY_LENGTH  16
 #define SRTP_MASTER_SALT_LENGTH 14
-#define DTLS_SRTP_KEY_MATERIAL_LENGTH 60
+#define DTLS_SRTP_KEY_MATERIAL_LENGTH (2 * (SRTP_MASTER_KEY_LENGTH + SRTP_MASTER_SALT_LENGTH))
 #define DTLS_SRTP_FINGERPRINT_LENGTH 160
+#define DTLS_SRTP_IDENTITY_NAME "identity"
+#define DTLS_SRTP_IDENTITY_MAGIC 0x64746c73
+#define DTLS_SRTP_IDENTITY_KEY_SIZE 1280
+#define DTLS_SRTP_IDENTITY_CERT_SIZE 1024
+#if DTLS_SRTP_IDENTITY_ECDSA
+#define DTLS_SRTP_IDENTITY_TYPE 256
+#else
+#define DTLS_SRTP_IDENTITY_TYPE RSA_KEY_LENGTH
+#endif
 
 typedef enum DtlsSrtpRole {
 
@@ -47,6 +56,7 @@ typedef struct DtlsSrtp {
   mbedtls_pk_context pkey;
   mbedtls_entropy_context entropy;
   mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_ssl_srtp_profile profiles[MBEDTLS_TLS_SRTP_MAX_PROFILE_LIST_LENGTH + 1];
 
   // SRTP
   srtp_policy_t remote_policy;
@@ -64,6 +74,12 @@ typedef struct DtlsSrtp {
 
   DtlsSrtpRole role;
   DtlsSrtpState state;
+  int handshake_done;
+
+  // retransmission timer of the handshake, ms
+  uint32_t timer_start;
+  uint32_t timer_int_ms;
+  uint32_t timer_fin_ms;
 
   char local_fingerprint[DTLS_SRTP_FINGERPRINT_LENGTH];
   char remote_fingerprint[DTLS_SRTP_FINGERPRINT_LENGTH];
@@ -78,8 +94,19 @@ void dtls_srtp_deinit(DtlsSrtp *dtls_srtp);
 
 int dtls_srtp_create_cert(DtlsSrtp *dtls_srtp);
 
+/**
+ * @brief run one step of the handshake, call it again on every datagram and when the timer fires
+ * @param[in] addr of the peer for the default socket callbacks, NULL with custom ones
+ * @return 0 once done, 1 while in progress, -1 on failure, the next call starts over
+ */
 int dtls_srtp_handshake(DtlsSrtp *dtls_srtp, Address *addr);
 
+/**
+ * @brief time until the handshake retransmission timer fires
+ * @return ms to wait, -1 if no timer runs
+ */
+int dtls_srtp_handshake_timeout(DtlsSrtp *dtls_srtp);
+
 void dtls_srtp_reset_session(DtlsSrtp *dtls_srtp);
 
 int dtls_srtp_write(DtlsSrtp *dtls_srtp, const uint8_t *buf, size_t len);
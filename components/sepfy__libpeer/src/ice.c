@@ -18,6 +18,8 @@ static uint8_t ice_candidate_type_preference(IceCandidateType type) {
   switch (type) {
     case ICE_CANDIDATE_TYPE_HOST:
       return 126;
+    case ICE_CANDIDATE_TYPE_PRFLX:
+      return 110;
     case ICE_CANDIDATE_TYPE_SRFLX:
       return 100;
     case ICE_CANDIDATE_TYPE_RELAY:
@@ -51,6 +53,15 @@ void ice_candidate_create(IceCandidate *candidate, int foundation, IceCandidateT
   snprintf(candidate->transport, sizeof(candidate->transport), "%s", "UDP");
 }
 
+uint64_t ice_candidate_pair_priority(IceCandidate *local, IceCandidate *remote, int controlling) {
+
+  // 2^32*MIN(G,D) + 2*MAX(G,D) + (G>D?1:0), G of the controlling agent, D of the controlled one
+  uint64_t g = controlling ? local->priority : remote->priority;
+  uint64_t d = controlling ? remote->priority : local->priority;
+
+  return ((g < d ? g : d) << 32) + 2 * (g > d ? g : d) + (g > d ? 1 : 0);
+}
+
 void ice_candidate_to_description(IceCandidate *candidate, char *description, int length) {
 
   char addr_string[ADDRSTRLEN];
@@ -58,12 +58,26 @@ struct IceCandidatePair {
   IceCandidateState state;
   IceCandidate *local;
   IceCandidate *remote;
-  int conncheck;
   uint64_t priority;
+
+  // the Binding transaction of the check
+  uint32_t transaction_id[3];
+  uint32_t sent_time;
+  uint32_t rto;
+  int retransmits;
+
+  int triggered; // checked ahead of the ordinary checks
+  int use_candidate; // USE-CANDIDATE sent when controlling, received when controlled
 };
 
 void ice_candidate_create(IceCandidate *ice_candidate, int foundation, IceCandidateType type, Address *addr);
 
+/**
+ * @brief pair priority of RFC 8445 6.1.2.3
+ * @param[in] controlling whether the local agent is the controlling one
+ */
+uint64_t ice_candidate_pair_priority(IceCandidate *local, IceCandidate *remote, int controlling);
+
 void ice_candidate_to_description(IceCandidate *candidate, char *description, int length);
 
 int ice_candidate_from_description(IceCandidate *candidate, char *description, char *end);
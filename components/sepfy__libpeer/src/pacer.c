@@ -0,0 +1,218 @@
+#include <string.h>
+
+#include "pacer.h"
+#include "utils.h"
+
+#define PACER_CONTROL_QUEUE_LENGTH (CONFIG_MTU * 8)
+#define PACER_AUDIO_QUEUE_LENGTH (CONFIG_MTU * 32)
+#define PACER_MIN_BURST (2 * CONFIG_MTU) // bytes, a low rate still lets a full packet through
+#define PACER_DELAY_WEIGHT 16 // moving average over ~16 packets
+
+typedef struct PacerPacket {
+
+  uint32_t enqueue_time;
+  uint16_t len;
+  uint16_t flags;
+  uint8_t data[0];
+
+} PacerPacket;
+
+int pacer_init(Pacer *pacer, uint32_t rate) {
+
+  memset(pacer, 0, sizeof(Pacer));
+
+  pacer->queues[PACER_PRIORITY_CONTROL] = buffer_new(PACER_CONTROL_QUEUE_LENGTH, 0);
+  pacer->queues[PACER_PRIORITY_AUDIO] = buffer_new(PACER_AUDIO_QUEUE_LENGTH, 0);
+  pacer->queues[PACER_PRIORITY_MEDIA] = buffer_new(PACER_QUEUE_LENGTH, RB_IN_PSRAM);
+
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+    if (!pacer->queues[i]) {
+      pacer_deinit(pacer);
+      return -1;
+    }
+  }
+
+  pacer_set_rate(pacer, rate);
+  return 0;
+}
+
+void pacer_deinit(Pacer *pacer) {
+
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+    buffer_free(pacer->queues[i]);
+    pacer->queues[i] = NULL;
+  }
+}
+
+void pacer_set_rate(Pacer *pacer, uint32_t rate) {
+
+  pacer->rate = rate;
+}
+
+// The configured rate, or faster when the queued bytes would otherwise wait
+// longer than PACER_MAX_QUEUE_TIME. The deadline is that of the oldest packet,
+// a rate from the queued bytes alone would fall as the queue drains and leave
+// its tail waiting far longer.
+static uint32_t pacer_rate(Pacer *pacer, uint32_t now) {
+
+  PacerPacket *packet;
+  uint64_t drain = 0;
+  uint32_t oldest = 0;
+  uint32_t age;
+  int size;
+
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+
+    drain += pacer->stats.queued_bytes[i];
+
+    if ((packet = (PacerPacket*)buffer_peek(pacer->queues[i], &size)) != NULL
+     && (age = now - packet->enqueue_time) > oldest) {
+      oldest = age;
+    }
+  }
+
+  if (oldest + PACER_BURST_MS < PACER_MAX_QUEUE_TIME) {
+    drain = drain * 8000 / (PACER_MAX_QUEUE_TIME - oldest);
+  } else {
+    drain = drain * 8000 / PACER_BURST_MS;
+  }
+
+  return drain > pacer->rate ? (uint32_t)drain : pacer->rate;
+}
+
+static void pacer_update_budget(Pacer *pacer, uint32_t now) {
+
+  int64_t earned;
+  int64_t burst;
+
+  pacer->stats.rate = pacer_rate(pacer, now);
+
+  // less than a byte since the last update, keep counting from there
+  if ((earned = (int64_t)pacer->stats.rate * (uint32_t)(now - pacer->last_update) / 8000) == 0) {
+    return;
+  }
+  pacer->last_update = now;
+
+  // an idle pacer has earned at most the burst budget
+  burst = (int64_t)pacer->stats.rate * PACER_BURST_MS / 8000;
+  if (burst < PACER_MIN_BURST) {
+    burst = PACER_MIN_BURST;
+  }
+
+  pacer->budget = pacer->budget + earned > burst ? (int32_t)burst : (int32_t)(pacer->budget + earned);
+}
+
+uint8_t* pacer_reserve(Pacer *pacer, PacerPriority priority, int size) {
+
+  uint8_t *buf;
+
+  if ((buf = buffer_reserve(pacer->queues[priority], sizeof(PacerPacket) + size)) == NULL) {
+    pacer->stats.dropped++;
+    return NULL;
+  }
+
+  pacer->reserved[priority] = buf;
+  return ((PacerPacket*)buf)->data;
+}
+
+void pacer_commit(Pacer *pacer, PacerPriority priority, int len, int flags, uint32_t now) {
+
+  PacerPacket *packet = (PacerPacket*)pacer->reserved[priority];
+
+  packet->enqueue_time = now;
+  packet->len = len;
+  packet->flags = flags;
+  buffer_commit(pacer->queues[priority], sizeof(PacerPacket) + len);
+
+  pacer->stats.queued_packets[priority]++;
+  pacer->stats.queued_bytes[priority] += len;
+}
+
+int pacer_enqueue(Pacer *pacer, PacerPriority priority, const uint8_t *buf, int len, int flags, uint32_t now) {
+
+  uint8_t *data;
+
+  if ((data = pacer_reserve(pacer, priority, len)) == NULL) {
+    return -2;
+  }
+
+  memcpy(data, buf, len);
+  pacer_commit(pacer, priority, len, flags, now);
+  return len;
+}
+
+int pacer_process(Pacer *pacer, uint32_t now, PacerSendFunc send, void *user_data) {
+
+  PacerPacket *packet;
+  uint32_t delay;
+  int released = 0;
+  int size;
+
+  pacer_update_budget(pacer, now);
+
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+
+    while ((packet = (PacerPacket*)buffer_peek(pacer->queues[i], &size)) != NULL) {
+
+      if (i != PACER_PRIORITY_CONTROL && pacer->budget <= 0) {
+        return released;
+      }
+
+      send(packet->data, packet->len, packet->flags, user_data);
+
+      pacer->budget -= packet->len;
+      pacer->stats.queued_packets[i]--;
+      pacer->stats.queued_bytes[i] -= packet->len;
+
+      delay = now - packet->enqueue_time;
+      pacer->stats.avg_delay += ((int32_t)delay - (int32_t)pacer->stats.avg_delay) / PACER_DELAY_WEIGHT;
+      if (delay > pacer->stats.max_delay) {
+        pacer->stats.max_delay = delay;
+      }
+
+      buffer_release(pacer->queues[i]);
+      released++;
+    }
+  }
+
+  return released;
+}
+
+int pacer_timeout(Pacer *pacer, uint32_t now) {
+
+  int32_t budget;
+
+  if (pacer->stats.queued_packets[PACER_PRIORITY_CONTROL] > 0) {
+    return 0;
+  }
+
+  if (pacer->stats.queued_packets[PACER_PRIORITY_AUDIO] == 0 && pacer->stats.queued_packets[PACER_PRIORITY_MEDIA] == 0) {
+    return -1;
+  }
+
+  pacer->stats.rate = pacer_rate(pacer, now);
+  budget = pacer->budget + (int64_t)pacer->stats.rate * (uint32_t)(now - pacer->last_update) / 8000;
+  if (budget > 0 || pacer->stats.rate == 0) {
+    return 0;
+  }
+
+  // rounded up, waking early would find no budget yet
+  return (int)(((uint64_t)(1 - budget) * 8000 + pacer->stats.rate - 1) / pacer->stats.rate);
+}
+
+void pacer_clear(Pacer *pacer) {
+
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+    buffer_clear(pacer->queues[i]);
+    pacer->stats.queued_packets[i] = 0;
+    pacer->stats.queued_bytes[i] = 0;
+  }
+
+  pacer->budget = 0;
+}
+
+void pacer_get_stats(Pacer *pacer, PacerStats *stats) {
+
+  memcpy(stats, &pacer->stats, sizeof(PacerStats));
+  pacer->stats.max_delay = 0;
+}
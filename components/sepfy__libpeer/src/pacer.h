@@ -0,0 +1,98 @@
+#ifndef PACER_H_
+#define PACER_H_
+
+#include <stdint.h>
+
+#include "config.h"
+#include "buffer.h"
+
+typedef enum PacerPriority {
+
+  PACER_PRIORITY_CONTROL = 0, // RTCP, never held back by the budget
+  PACER_PRIORITY_AUDIO,
+  PACER_PRIORITY_MEDIA, // video and data channel
+  PACER_PRIORITY_NUM,
+
+} PacerPriority;
+
+typedef struct PacerStats {
+
+  uint32_t queued_packets[PACER_PRIORITY_NUM];
+  uint32_t queued_bytes[PACER_PRIORITY_NUM];
+  uint32_t rate; // bps the queues are drained at
+  uint32_t avg_delay; // ms a released packet waited, smoothed
+  uint32_t max_delay; // ms, longest wait since the last pacer_get_stats
+  uint32_t dropped; // packets refused by a full queue
+
+} PacerStats;
+
+/**
+ * @brief called for every packet the pacer releases
+ * @param[in] buf payload as queued, writable until the callback returns
+ * @param[in] flags as given to pacer_commit
+ */
+typedef void (*PacerSendFunc)(uint8_t *buf, int len, int flags, void *user_data);
+
+// Leaky bucket in front of the socket. Packets wait in one queue per
+// priority and leave at the pacing rate, with at most a burst budget at once,
+// so a video frame does not hit the modem as a single burst.
+typedef struct Pacer {
+
+  Buffer *queues[PACER_PRIORITY_NUM];
+  uint8_t *reserved[PACER_PRIORITY_NUM]; // record of the packet being written
+
+  uint32_t rate; // bps
+  int32_t budget; // bytes that may leave now, negative while a large packet is paid off
+  uint32_t last_update;
+
+  PacerStats stats;
+
+} Pacer;
+
+int pacer_init(Pacer *pacer, uint32_t rate);
+
+void pacer_deinit(Pacer *pacer);
+
+void pacer_set_rate(Pacer *pacer, uint32_t rate);
+
+/**
+ * @brief reserve room for a packet in the queue of its priority, to be filled in place
+ * @return pointer to write the packet to, NULL if the queue is full
+ */
+uint8_t* pacer_reserve(Pacer *pacer, PacerPriority priority, int size);
+
+/**
+ * @brief queue the reserved packet
+ * @param[in] len bytes written, not more than reserved
+ * @param[in] flags handed back to the PacerSendFunc
+ */
+void pacer_commit(Pacer *pacer, PacerPriority priority, int len, int flags, uint32_t now);
+
+/**
+ * @brief copy a packet into the queue of its priority
+ * @return len on success, -2 if the queue is full
+ */
+int pacer_enqueue(Pacer *pacer, PacerPriority priority, const uint8_t *buf, int len, int flags, uint32_t now);
+
+/**
+ * @brief release what the budget allows, control first, then audio, then media
+ * @return packets released
+ */
+int pacer_process(Pacer *pacer, uint32_t now, PacerSendFunc send, void *user_data);
+
+/**
+ * @return ms until the next packet may leave, 0 if one may now, -1 if the queues are empty
+ */
+int pacer_timeout(Pacer *pacer, uint32_t now);
+
+/**
+ * @brief drop every queued packet
+ */
+void pacer_clear(Pacer *pacer);
+
+/**
+ * @brief current queue depth and pacing delay, restarts the max_delay window
+ */
+void pacer_get_stats(Pacer *pacer, PacerStats *stats);
+
+#endif // PACER_H_
@@ -10,10 +10,22 @@
 #include "config.h"
 #include "rtp.h"
 #include "rtcp.h"
+#include "congestion.h"
+#include "pacer.h"
 #include "buffer.h"
 #include "ports.h"
 #include "peer_connection.h"
 
+// what the pacer callback does to a packet before it leaves
+typedef enum PeerConnectionPacket {
+
+  PEER_CONNECTION_PACKET_RTP = 0,
+  PEER_CONNECTION_PACKET_RTP_TWCC, // gets the transport-wide sequence number when it leaves
+  PEER_CONNECTION_PACKET_RTCP,
+  PEER_CONNECTION_PACKET_DTLS, // a record mbedTLS already protected
+
+} PeerConnectionPacket;
+
 #define STATE_CHANGED(pc, curr_state) if(pc->oniceconnectionstatechange && pc->state != curr_state) { pc->oniceconnectionstatechange(curr_state, pc->config.user_data); pc->state = curr_state; }
 
 struct PeerConnection {
@@ -34,8 +46,16 @@ struct PeerConnection {
 
   uint8_t temp_buf[CONFIG_MTU];
   uint8_t agent_buf[CONFIG_MTU];
+  uint8_t send_buf[PEER_CONNECTION_SEND_BATCH * (CONFIG_MTU + 128)];
+  UdpPacket send_packets[PEER_CONNECTION_SEND_BATCH];
+  int send_count;
+  int send_offset;
+  int b_send_blocked; // packets of the frame were refused by a full pacer queue or socket buffer
   int agent_ret;
   int b_offer_created;
+  int b_ice_restart; // requested by peer_connection_restart_ice, handled by the loop
+  int b_ice_restarting; // DTLS and SCTP are kept for the pair the restart finds
+  int event_fd;
 
   Buffer *audio_rb;
   Buffer *video_rb;
@@ -49,92 +69,280 @@ struct PeerConnection {
   uint32_t remote_assrc;
   uint32_t remote_vssrc;
 
+  CongestionController cc;
+  uint32_t notified_bitrate;
+  int b_rate_estimated; // RTCP feedback moved the congestion controller, DTLS records are paced from then on
+  Pacer pacer;
+
 };
 
+// Everything but STUN leaves through the pacer once the session is up,
+// DTLS records only once RTCP gave a rate. The agent sends its checks and
+// consent requests straight away.
+static int peer_connection_queue(PeerConnection *pc, PacerPriority priority, PeerConnectionPacket kind, const uint8_t *buf, int len) {
+
+  if (pacer_enqueue(&pc->pacer, priority, buf, len, kind, ports_get_epoch_time()) < 0) {
+    pc->b_send_blocked = 1;
+    return -2;
+  }
+
+  return len;
+}
+
 static void peer_connection_outgoing_rtp_packet(uint8_t *data, size_t size, void *user_data) {
 
   PeerConnection *pc = (PeerConnection *) user_data;
-  dtls_srtp_encrypt_rtp_packet(&pc->dtls_srtp, data, (int*)&size);
-  agent_send(&pc->agent, data, size);
+  peer_connection_queue(pc, PACER_PRIORITY_AUDIO, PEER_CONNECTION_PACKET_RTP, data, size);
 }
 
-static int peer_connection_dtls_srtp_recv(void *ctx, unsigned char *buf, size_t len) {
+// RFC 8285 one-byte header extension carrying the transport-wide sequence number
+static void peer_connection_write_twcc_ext(PeerConnection *pc, uint8_t *ext, size_t size) {
 
-  static const int MAX_RECV = 200;
-  int recv_max = 0; 
-  int ret; 
-  DtlsSrtp *dtls_srtp = (DtlsSrtp *) ctx; 
-  PeerConnection *pc = (PeerConnection *) dtls_srtp->user_data;
+  uint16_t seq = congestion_on_packet_sent(&pc->cc, size + RTP_TWCC_EXT_SIZE, ports_get_epoch_time());
 
-  if (pc->agent_ret > 0 && pc->agent_ret <= len) {
+  ext[0] = 0xbe;
+  ext[1] = 0xde;
+  ext[2] = 0x00;
+  ext[3] = 0x01;
+  ext[4] = (RTP_EXT_TWCC_ID << 4) | 0x01;
+  ext[5] = seq >> 8;
+  ext[6] = seq & 0xff;
+  ext[7] = 0x00;
+}
+
+static void peer_connection_outgoing_video_packet(uint8_t *data, size_t size, void *user_data) {
 
-    memcpy(buf, pc->agent_buf, pc->agent_ret);
-    return pc->agent_ret;
+  PeerConnection *pc = (PeerConnection *) user_data;
+  peer_connection_queue(pc, PACER_PRIORITY_MEDIA, PEER_CONNECTION_PACKET_RTP_TWCC, data, size);
+}
+
+static void peer_connection_outgoing_rtp_packetv(const RtpIovec *iov, int iovcnt, void *user_data) {
+
+  PeerConnection *pc = (PeerConnection *) user_data;
+  uint8_t *buf;
+  int size = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    size += iov[i].len;
   }
 
-  while (recv_max < MAX_RECV) {
+  if ((buf = pacer_reserve(&pc->pacer, PACER_PRIORITY_MEDIA, size)) == NULL) {
+    pc->b_send_blocked = 1;
+    return;
+  }
 
-    ret = agent_recv(&pc->agent, buf, len);
+  // the payload is copied once, out of the frame buffer into the pacer queue
+  for (i = 0, size = 0; i < iovcnt; i++) {
+    memcpy(buf + size, iov[i].base, iov[i].len);
+    size += iov[i].len;
+  }
 
-    if (ret > 0) {
+  pacer_commit(&pc->pacer, PACER_PRIORITY_MEDIA, size, PEER_CONNECTION_PACKET_RTP_TWCC, ports_get_epoch_time());
+}
+
+// Sends the encrypted packets batched by peer_connection_pacer_send.
+// What the socket buffer has no room for is dropped, transport-cc reports
+// it lost and the congestion controller backs off.
+static void peer_connection_flush(PeerConnection *pc) {
+
+  int ret;
+
+  if (pc->send_count == 0) {
+    return;
+  }
+
+  if ((ret = agent_send_batch(&pc->agent, pc->send_packets, pc->send_count)) < pc->send_count) {
+    LOGD("dropped %d of %d packets", ret < 0 ? pc->send_count : pc->send_count - ret, pc->send_count);
+    pc->b_send_blocked = 1;
+  }
+
+  pc->send_count = 0;
+  pc->send_offset = 0;
+}
+
+// Called by the pacer for each packet it releases. The transport-wide
+// sequence number is taken here so its send time is when the packet really
+// left. Packets of a batch lie back to back, so equal sized ones can leave
+// with UDP GSO.
+static void peer_connection_pacer_send(uint8_t *data, int len, int kind, void *user_data) {
+
+  PeerConnection *pc = (PeerConnection *) user_data;
+  uint8_t *buf;
+  int size = len;
+
+  if (len + RTP_TWCC_EXT_SIZE + SRTP_MAX_TRAILER_LEN > CONFIG_MTU + 128) {
+    LOGE("packet too large: %d", len);
+    return;
+  }
+
+  if (pc->send_count >= PEER_CONNECTION_SEND_BATCH) {
+    peer_connection_flush(pc);
+  }
+
+  buf = pc->send_buf + pc->send_offset;
+
+  switch (kind) {
+    case PEER_CONNECTION_PACKET_RTP_TWCC:
+      memcpy(buf, data, sizeof(RtpHeader));
+      memcpy(buf + sizeof(RtpHeader) + RTP_TWCC_EXT_SIZE, data + sizeof(RtpHeader), len - sizeof(RtpHeader));
+      peer_connection_write_twcc_ext(pc, buf + sizeof(RtpHeader), len);
+      ((RtpHeader*)buf)->extension = 1;
+      size += RTP_TWCC_EXT_SIZE;
+      dtls_srtp_encrypt_rtp_packet(&pc->dtls_srtp, buf, &size);
       break;
-    }
+    case PEER_CONNECTION_PACKET_RTP:
+      memcpy(buf, data, len);
+      dtls_srtp_encrypt_rtp_packet(&pc->dtls_srtp, buf, &size);
+      break;
+    case PEER_CONNECTION_PACKET_RTCP:
+      memcpy(buf, data, len);
+      dtls_srtp_encrypt_rctp_packet(&pc->dtls_srtp, buf, &size);
+      break;
+    case PEER_CONNECTION_PACKET_DTLS:
+    default:
+      memcpy(buf, data, len);
+      break;
+  }
+
+  pc->send_packets[pc->send_count].buf = buf;
+  pc->send_packets[pc->send_count].len = size;
+  pc->send_count++;
+  pc->send_offset += size;
+}
+
+static void peer_connection_pace(PeerConnection *pc) {
 
-    recv_max++;
+  pacer_process(&pc->pacer, ports_get_epoch_time(), peer_connection_pacer_send, pc);
+  peer_connection_flush(pc);
+}
+
+// Hands mbedTLS the datagram the loop just received, once, so neither the
+// handshake nor a read ever waits on the socket
+static int peer_connection_dtls_srtp_recv(void *ctx, unsigned char *buf, size_t len) {
 
+  DtlsSrtp *dtls_srtp = (DtlsSrtp *) ctx; 
+  PeerConnection *pc = (PeerConnection *) dtls_srtp->user_data;
+  int ret = pc->agent_ret;
+
+  if (ret <= 0 || ret > len) {
+
+    return MBEDTLS_ERR_SSL_WANT_READ;
   }
-  return ret;	
+
+  memcpy(buf, pc->agent_buf, ret);
+  pc->agent_ret = -1;
+  return ret;
 }
 
 static int peer_connection_dtls_srtp_send(void *ctx, const uint8_t *buf, size_t len) {
   
   DtlsSrtp *dtls_srtp = (DtlsSrtp *) ctx; 
   PeerConnection *pc = (PeerConnection *) dtls_srtp->user_data;
+  int ret;
 
   //LOGD("send %.4x %.4x, %ld", *(uint16_t*)buf, *(uint16_t*)(buf + 2), len); 
-  return agent_send(&pc->agent, buf, len);
+  // a record without room in the queue or the socket is lost like any datagram, DTLS and SCTP retransmit.
+  // Without RTCP feedback the pacer rate would stay at BITRATE_START, a data channel
+  // only session leaves the rate to the SCTP congestion window instead.
+  if (pc->state == PEER_CONNECTION_COMPLETED && pc->b_rate_estimated) {
+    peer_connection_queue(pc, PACER_PRIORITY_MEDIA, PEER_CONNECTION_PACKET_DTLS, buf, len);
+    return len;
+  }
+
+  if ((ret = agent_send(&pc->agent, buf, len)) == -2) {
+    return len;
+  }
+
+  return ret;
   
 }
 
+static void peer_connection_update_bitrate(PeerConnection *pc) {
+
+  uint32_t bitrate = congestion_get_target_bitrate(&pc->cc);
+  uint32_t diff = bitrate > pc->notified_bitrate ? bitrate - pc->notified_bitrate : pc->notified_bitrate - bitrate;
+
+  pacer_set_rate(&pc->pacer, bitrate * PACER_RATE_FACTOR);
+
+  // only report changes worth re-tuning the encoder for
+  if (diff * 20 < pc->notified_bitrate)
+    return;
+
+  LOGI("target bitrate %d bps", (int)bitrate);
+  pc->notified_bitrate = bitrate;
+  if (pc->config.on_bitrate_change) {
+    pc->config.on_bitrate_change(bitrate, pc->config.user_data);
+  }
+}
+
 static void peer_connection_incoming_rtcp(PeerConnection *pc, uint8_t *buf, size_t len) {
 
   RtcpHeader *rtcp_header;
+  RtcpReportBlock block;
+  uint32_t now = ports_get_epoch_time();
+  uint32_t bitrate;
+  size_t block_len;
+  int estimated = 0;
   size_t pos = 0;
 
-  while (pos < len) {
+  while (pos + sizeof(RtcpHeader) <= len) {
 
     rtcp_header = (RtcpHeader*)(buf + pos);
+    block_len = 4*ntohs(rtcp_header->length) + 4;
+    if (pos + block_len > len)
+      break;
 
     switch(rtcp_header->type) {
       case RTCP_RR:
         LOGD("RTCP_PR");
-        if(rtcp_header->rc > 0) {
-// TODO: REMB, GCC ...etc
-#if 0
-          RtcpRr rtcp_rr = rtcp_parse_rr(buf);
-          uint32_t fraction = ntohl(rtcp_rr.report_block[0].flcnpl) >> 24;
-          uint32_t total = ntohl(rtcp_rr.report_block[0].flcnpl) & 0x00FFFFFF;
+        for (int i = 0; i < rtcp_header->rc && 8 + (i + 1)*sizeof(RtcpReportBlock) <= block_len; i++) {
+
+          memcpy(&block, buf + pos + 8 + i*sizeof(RtcpReportBlock), sizeof(block));
+          if (ntohl(block.ssrc) != pc->vrtp_encoder.ssrc)
+            continue;
+
+          uint32_t fraction = ntohl(block.flcnpl) >> 24;
+          uint32_t total = ntohl(block.flcnpl) & 0x00FFFFFF;
           if(pc->on_receiver_packet_loss && fraction > 0) {
 
             pc->on_receiver_packet_loss((float)fraction/256.0, total, pc->config.user_data);
           }
-#endif
+          congestion_on_receiver_report(&pc->cc, fraction, ntohl(block.jitter), now);
+          estimated = 1;
+        }
+        break;
+      case RTCP_RTPFB:
+        LOGD("RTCP_RTPFB %d", rtcp_header->rc);
+        if (rtcp_header->rc == RTCP_RTPFB_TWCC && block_len > 12) {
+          congestion_on_transport_feedback(&pc->cc, buf + pos + 12, block_len - 12, now);
+          estimated = 1;
         }
         break;
       case RTCP_PSFB: {
         int fmt = rtcp_header->rc;
         LOGD("RTCP_PSFB %d", fmt);
         // PLI and FIR
-        if ((fmt == 1 || fmt == 4) && pc->config.on_request_keyframe) {
+        if ((fmt == RTCP_PSFB_PLI || fmt == RTCP_PSFB_FIR) && pc->config.on_request_keyframe) {
             pc->config.on_request_keyframe();
-        } 
+        } else if (fmt == RTCP_PSFB_AFB && rtcp_parse_remb(buf + pos, block_len, &bitrate) == 0) {
+            congestion_on_remb(&pc->cc, bitrate);
+            estimated = 1;
+        }
+        break;
       }
       default:
         break;
     }
 
-    pos += 4*ntohs(rtcp_header->length) + 4;
+    pos += block_len;
+  }
+
+  if (estimated) {
+    pc->b_rate_estimated = 1;
   }
+
+  peer_connection_update_bitrate(pc);
 }
 
 const char* peer_connection_state_to_string(PeerConnectionState state) {
@@ -178,22 +386,38 @@ PeerConnection* peer_connection_create(PeerConfiguration *config) {
 
   memcpy(&pc->config, config, sizeof(PeerConfiguration));
 
-  pc->agent.mode = AGENT_MODE_CONTROLLED;
+  if ((pc->event_fd = ports_event_create()) < 0) {
+    free(pc);
+    return NULL;
+  }
 
   memset(&pc->sctp, 0, sizeof(pc->sctp));
-  dtls_srtp_init(&pc->dtls_srtp, DTLS_SRTP_ROLE_SERVER, pc);
+  congestion_init(&pc->cc, BITRATE_START, BITRATE_MIN, BITRATE_MAX);
+  pc->notified_bitrate = BITRATE_START;
+  if (pacer_init(&pc->pacer, BITRATE_START * PACER_RATE_FACTOR) < 0) {
+    ports_event_destroy(pc->event_fd);
+    free(pc);
+    return NULL;
+  }
+
+  if (dtls_srtp_init(&pc->dtls_srtp, DTLS_SRTP_ROLE_SERVER, pc) < 0) {
+    pacer_deinit(&pc->pacer);
+    ports_event_destroy(pc->event_fd);
+    free(pc);
+    return NULL;
+  }
 
   pc->dtls_srtp.udp_recv = peer_connection_dtls_srtp_recv;
   pc->dtls_srtp.udp_send = peer_connection_dtls_srtp_send;
 
   if (pc->config.datachannel) {
     LOGI("Datachannel allocates heap size: %d", DATA_RB_DATA_LENGTH);
-    pc->data_rb = buffer_new(DATA_RB_DATA_LENGTH);
+    pc->data_rb = buffer_new(DATA_RB_DATA_LENGTH, RB_IN_PSRAM);
   }
 
   if (pc->config.audio_codec) {
     LOGI("Audio allocates heap size: %d", AUDIO_RB_DATA_LENGTH);
-    pc->audio_rb = buffer_new(AUDIO_RB_DATA_LENGTH);
+    pc->audio_rb = buffer_new(AUDIO_RB_DATA_LENGTH, RB_IN_PSRAM);
 
     rtp_encoder_init(&pc->artp_encoder, pc->config.audio_codec,
      peer_connection_outgoing_rtp_packet, (void*)pc);
@@ -204,10 +428,12 @@ PeerConnection* peer_connection_create(PeerConfiguration *config) {
 
   if (pc->config.video_codec) {
     LOGI("Video allocates heap size: %d", VIDEO_RB_DATA_LENGTH);
-    pc->video_rb = buffer_new(VIDEO_RB_DATA_LENGTH);
+    pc->video_rb = buffer_new(VIDEO_RB_DATA_LENGTH, RB_IN_PSRAM);
 
     rtp_encoder_init(&pc->vrtp_encoder, pc->config.video_codec,
-     peer_connection_outgoing_rtp_packet, (void*)pc);
+     peer_connection_outgoing_video_packet, (void*)pc);
+
+    rtp_encoder_set_packetv(&pc->vrtp_encoder, peer_connection_outgoing_rtp_packetv);
 
     rtp_decoder_init(&pc->vrtp_decoder, pc->config.video_codec,
      pc->config.onvideotrack, pc->config.user_data);
@@ -223,7 +449,9 @@ void peer_connection_destroy(PeerConnection *pc) {
     buffer_free(pc->data_rb);
     buffer_free(pc->audio_rb);
     buffer_free(pc->video_rb);
+    pacer_deinit(&pc->pacer);
 
+    ports_event_destroy(pc->event_fd);
     free(pc);
     pc = NULL;
   }
@@ -232,26 +460,61 @@ void peer_connection_destroy(PeerConnection *pc) {
 void peer_connection_close(PeerConnection *pc) {
 
   pc->state = PEER_CONNECTION_CLOSED;
+  ports_event_signal(pc->event_fd);
 }
 
 int peer_connection_send_audio(PeerConnection *pc, const uint8_t *buf, size_t len) {
 
+  int ret;
+
   if (pc->state != PEER_CONNECTION_COMPLETED) {
     //LOGE("dtls_srtp not connected");
     return -1;
   }
 
-  return buffer_push_tail(pc->audio_rb, buf, len);
+  ret = buffer_push(pc->audio_rb, buf, len);
+  ports_event_signal(pc->event_fd);
+  return ret;
 }
 
 int peer_connection_send_video(PeerConnection *pc, const uint8_t *buf, size_t len) {
 
+  int ret;
+
   if (pc->state != PEER_CONNECTION_COMPLETED) {
     //LOGE("dtls_srtp not connected");
     return -1;
   }
 
-  return buffer_push_tail(pc->video_rb, buf, len);
+  ret = buffer_push(pc->video_rb, buf, len);
+  ports_event_signal(pc->event_fd);
+  return ret;
+}
+
+int peer_connection_send_video_frame(PeerConnection *pc, const uint8_t *buf, size_t len) {
+
+  int ret;
+
+  if (pc->state != PEER_CONNECTION_COMPLETED) {
+    return -1;
+  }
+
+  pc->b_send_blocked = 0;
+  ret = rtp_encoder_encode(&pc->vrtp_encoder, (uint8_t*)buf, len);
+  // the burst budget leaves now, the rest as the loop paces it out
+  peer_connection_pace(pc);
+
+  // the uplink could not take the whole frame
+  if (ret >= 0 && pc->b_send_blocked) {
+    return -2;
+  }
+
+  return ret;
+}
+
+uint32_t peer_connection_get_target_bitrate(PeerConnection *pc) {
+
+  return congestion_get_target_bitrate(&pc->cc);
 }
 
 int peer_connection_datachannel_send(PeerConnection *pc, char *message, size_t len) {
@@ -260,15 +523,26 @@ int peer_connection_datachannel_send(PeerConnection *pc, char *message, size_t l
 
 int peer_connection_datachannel_send_sid(PeerConnection *pc, char *message, size_t len, uint16_t sid) {
 
+  int ret;
+
   if(!sctp_is_connected(&pc->sctp)) {
     LOGE("sctp not connected");
     return -1;
   }
 
   if (pc->config.datachannel == DATA_CHANNEL_STRING)
-    return sctp_outgoing_data(&pc->sctp, message, len, PPID_STRING, sid);
+    ret = sctp_outgoing_data(&pc->sctp, message, len, PPID_STRING, sid);
   else
-    return sctp_outgoing_data(&pc->sctp, message, len, PPID_BINARY, sid);
+    ret = sctp_outgoing_data(&pc->sctp, message, len, PPID_BINARY, sid);
+
+  // a new T3-rtx deadline may be earlier than the one the loop sleeps on
+  ports_event_signal(pc->event_fd);
+  return ret;
+}
+
+void peer_connection_datachannel_set_policy(PeerConnection *pc, uint16_t sid, int max_retransmits, uint32_t lifetime) {
+
+  sctp_set_stream_policy(&pc->sctp, sid, max_retransmits, lifetime);
 }
 
 static void peer_connection_state_new(PeerConnection *pc) {
@@ -278,10 +552,18 @@ static void peer_connection_state_new(PeerConnection *pc) {
   memset(pc->temp_buf, 0, sizeof(pc->temp_buf));
 
   agent_deinit(&pc->agent);
-
-  dtls_srtp_reset_session(&pc->dtls_srtp);
-
-  pc->sctp.connected = 0;
+  // the device makes the offer and so controls ICE, also after a role conflict
+  // in the previous session
+  pc->agent.mode = AGENT_MODE_CONTROLLING;
+  pc->agent.nomination = ICE_AGGRESSIVE_NOMINATION ? AGENT_NOMINATION_AGGRESSIVE : AGENT_NOMINATION_REGULAR;
+  // whatever waited for the old pair is stale by the time a new one is found
+  pacer_clear(&pc->pacer);
+
+  if (!pc->b_ice_restarting) {
+    dtls_srtp_reset_session(&pc->dtls_srtp);
+    pc->sctp.connected = 0;
+    pc->b_rate_estimated = 0;
+  }
 
   for (int i = 0; i < sizeof(pc->config.ice_servers)/sizeof(pc->config.ice_servers[0]); ++i) {
 
@@ -291,6 +573,9 @@ static void peer_connection_state_new(PeerConnection *pc) {
     }
   }
 
+  // the servers answer in parallel, done when all did or the gathering deadline passed
+  while (agent_gather_wait(&pc->agent, 1000) > 0);
+
   agent_get_local_description(&pc->agent, description, sizeof(pc->temp_buf));
 
   memset(&pc->local_sdp, 0, sizeof(pc->local_sdp));
@@ -301,12 +586,26 @@ static void peer_connection_state_new(PeerConnection *pc) {
    pc->config.datachannel);
 
 
-  if (pc->config.video_codec == CODEC_H264) {
+  switch (pc->config.video_codec) {
 
-    sdp_append_h264(&pc->local_sdp);
-    sdp_append(&pc->local_sdp, "a=fingerprint:sha-256 %s", pc->dtls_srtp.local_fingerprint);
-    sdp_append(&pc->local_sdp, "a=setup:passive");
-    strcat(pc->local_sdp.content, description);
+    case CODEC_H264:
+
+      sdp_append_h264(&pc->local_sdp);
+      sdp_append(&pc->local_sdp, "a=fingerprint:sha-256 %s", pc->dtls_srtp.local_fingerprint);
+      sdp_append(&pc->local_sdp, "a=setup:passive");
+      strcat(pc->local_sdp.content, description);
+      break;
+
+    case CODEC_MJPEG:
+
+      sdp_append_mjpeg(&pc->local_sdp);
+      sdp_append(&pc->local_sdp, "a=fingerprint:sha-256 %s", pc->dtls_srtp.local_fingerprint);
+      sdp_append(&pc->local_sdp, "a=setup:passive");
+      strcat(pc->local_sdp.content, description);
+      break;
+
+    default:
+      break;
   }
 
 
@@ -352,14 +651,125 @@ static void peer_connection_state_new(PeerConnection *pc) {
   }
 }
 
+static void peer_connection_incoming_packet(PeerConnection *pc) {
+
+  int ret;
+  uint32_t ssrc = 0;
+
+  if (rtcp_probe(pc->agent_buf, pc->agent_ret)) {
+    LOGD("Got RTCP packet");
+    dtls_srtp_decrypt_rtcp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
+    peer_connection_incoming_rtcp(pc, pc->agent_buf, pc->agent_ret);
+
+  } else if (dtls_srtp_probe(pc->agent_buf)) {
+
+    ret = dtls_srtp_read(&pc->dtls_srtp, pc->temp_buf, sizeof(pc->temp_buf));
+    LOGD("Got DTLS data %d", ret);
+
+    if (ret > 0) {
+      sctp_incoming_data(&pc->sctp, (char*)pc->temp_buf, ret);
+    }
+
+  } else if (rtp_packet_validate(pc->agent_buf, pc->agent_ret)) {
+    LOGD("Got RTP packet");
+
+    dtls_srtp_decrypt_rtp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
+
+    ssrc = rtp_get_ssrc(pc->agent_buf);
+    if (ssrc == pc->remote_assrc) {
+      rtp_decoder_decode(&pc->artp_decoder, pc->agent_buf, pc->agent_ret);
+    } else if (ssrc == pc->remote_vssrc) {
+      rtp_decoder_decode(&pc->vrtp_decoder, pc->agent_buf, pc->agent_ret);
+    }
+
+  } else {
+    LOGW("Unknown data");
+  }
+}
+
+int peer_connection_wait(PeerConnection *pc, int timeout) {
+
+  int next;
+
+  switch (pc->state) {
+    case PEER_CONNECTION_CHECKING:
+      // agent_wait also wakes up when the next check or retransmission is due
+      return agent_wait(&pc->agent, pc->event_fd, timeout);
+
+    case PEER_CONNECTION_CONNECTED:
+
+      if ((next = dtls_srtp_handshake_timeout(&pc->dtls_srtp)) >= 0 && next < timeout) {
+        timeout = next;
+      }
+
+      return agent_wait(&pc->agent, pc->event_fd, timeout);
+
+    case PEER_CONNECTION_COMPLETED:
+
+      if (pc->config.datachannel && (next = sctp_get_timeout(&pc->sctp)) >= 0 && next < timeout) {
+        timeout = next;
+      }
+
+      if ((next = pacer_timeout(&pc->pacer, ports_get_epoch_time())) >= 0 && next < timeout) {
+        timeout = next;
+      }
+
+      // agent_wait also wakes up for the next consent check
+      return agent_wait(&pc->agent, pc->event_fd, timeout);
+
+    case PEER_CONNECTION_NEW:
+      if (!pc->b_offer_created) {
+        return 0;
+      }
+      // fall through
+    default:
+      // nothing arrives on the sockets that the loop would handle in these states
+      return ports_event_wait(pc->event_fd, timeout);
+  }
+}
+
+void peer_connection_notify(PeerConnection *pc) {
+
+  ports_event_signal(pc->event_fd);
+}
+
+// Gathers again and offers new ICE credentials. A session past the DTLS
+// handshake keeps DTLS, SRTP and SCTP, media resumes once a pair is selected.
+static void peer_connection_ice_restart(PeerConnection *pc) {
+
+  switch (pc->state) {
+    case PEER_CONNECTION_COMPLETED:
+      pc->b_ice_restarting = 1;
+      // fall through
+    case PEER_CONNECTION_NEW:
+    case PEER_CONNECTION_CHECKING:
+    case PEER_CONNECTION_CONNECTED:
+      LOGI("ICE restart%s", pc->b_ice_restarting ? ", DTLS kept" : "");
+      STATE_CHANGED(pc, PEER_CONNECTION_NEW);
+      pc->b_offer_created = 0;
+      break;
+    default:
+      break;
+  }
+}
+
 int peer_connection_loop(PeerConnection *pc) {
 
+  int i;
   int bytes;
+  int ret;
   uint8_t *data = NULL;
-  uint32_t ssrc = 0;
   memset(pc->agent_buf, 0, sizeof(pc->agent_buf));
   pc->agent_ret = -1;
 
+  // agent_wait wakes up when the TURN allocation or a channel is due
+  agent_turn_refresh(&pc->agent);
+
+  if (pc->b_ice_restart) {
+    pc->b_ice_restart = 0;
+    peer_connection_ice_restart(pc);
+  }
+
   switch (pc->state) {
     case PEER_CONNECTION_NEW:
 
@@ -370,16 +780,56 @@ int peer_connection_loop(PeerConnection *pc) {
 
     case PEER_CONNECTION_CHECKING:
 
+      // checks and their answers, a ClientHello that overtakes the nomination is kept for the handshake
+      for (i = 0; i < PEER_CONNECTION_RECV_BATCH && agent_wait(&pc->agent, -1, 0) > 0; i++) {
+        if ((pc->agent_ret = agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf))) > 0) {
+          break;
+        }
+      }
+
       if (agent_select_candidate_pair(&pc->agent) < 0) {
         STATE_CHANGED(pc, PEER_CONNECTION_FAILED);
       } else if (agent_connectivity_check(&pc->agent) == 0) {
-        STATE_CHANGED(pc, PEER_CONNECTION_CONNECTED);
+
+        if (pc->b_ice_restarting) {
+          // DTLS and SCTP carry on over the new pair
+          pc->b_ice_restarting = 0;
+          STATE_CHANGED(pc, PEER_CONNECTION_COMPLETED);
+          if (pc->agent_ret > 0) {
+            peer_connection_incoming_packet(pc);
+          }
+        } else {
+          STATE_CHANGED(pc, PEER_CONNECTION_CONNECTED);
+          if (pc->agent_ret > 0 && dtls_srtp_probe(pc->agent_buf)) {
+            dtls_srtp_handshake(&pc->dtls_srtp, NULL);
+          }
+        }
       }
+      pc->agent_ret = -1;
       break;
 
     case PEER_CONNECTION_CONNECTED:
 
-      if (dtls_srtp_handshake(&pc->dtls_srtp, NULL) == 0) {
+      // step the handshake on every flight that arrived, STUN is answered in between
+      ret = 1;
+      for (i = 0; i < PEER_CONNECTION_RECV_BATCH && agent_wait(&pc->agent, -1, 0) > 0; i++) {
+
+        if ((pc->agent_ret = agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf))) > 0
+         && dtls_srtp_probe(pc->agent_buf)) {
+
+          if ((ret = dtls_srtp_handshake(&pc->dtls_srtp, NULL)) <= 0) {
+            break;
+          }
+        }
+      }
+      pc->agent_ret = -1;
+
+      // nothing to read, starts the handshake or retransmits when the timer expired
+      if (ret > 0) {
+        ret = dtls_srtp_handshake(&pc->dtls_srtp, NULL);
+      }
+
+      if (ret == 0) {
 
         LOGD("DTLS-SRTP handshake done");
 
@@ -394,67 +844,51 @@ int peer_connection_loop(PeerConnection *pc) {
       break;
     case PEER_CONNECTION_COMPLETED:
 
-      data = buffer_peak_head(pc->video_rb, &bytes);
-      if (data) {
+      // drain everything queued since the last wakeup
+      while ((data = buffer_peek(pc->video_rb, &bytes))) {
         rtp_encoder_encode(&pc->vrtp_encoder, data, bytes);
-        buffer_pop_head(pc->video_rb);
+        buffer_release(pc->video_rb);
       }
 
-      data = buffer_peak_head(pc->audio_rb, &bytes);
-      if (data) {
+      while ((data = buffer_peek(pc->audio_rb, &bytes))) {
         rtp_encoder_encode(&pc->artp_encoder, data, bytes);
-        buffer_pop_head(pc->audio_rb);
+        buffer_release(pc->audio_rb);
       }
 
-      data = buffer_peak_head(pc->data_rb, &bytes);
-      if (data) {
+      while ((data = buffer_peek(pc->data_rb, &bytes))) {
 
          if (pc->config.datachannel == DATA_CHANNEL_STRING)
-           sctp_outgoing_data(&pc->sctp, (char*)data, bytes, PPID_STRING, 0);
+           ret = sctp_outgoing_data(&pc->sctp, (char*)data, bytes, PPID_STRING, 0);
          else
-           sctp_outgoing_data(&pc->sctp, (char*)data, bytes, PPID_BINARY, 0);
-         buffer_pop_head(pc->data_rb);
-      }
-
-      if ((pc->agent_ret = agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf))) > 0) {
-        LOGD("agent_recv %d", pc->agent_ret);
-
-        if (rtcp_probe(pc->agent_buf, pc->agent_ret)) {
-          LOGD("Got RTCP packet");
-          dtls_srtp_decrypt_rtcp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
-          peer_connection_incoming_rtcp(pc, pc->agent_buf, pc->agent_ret);
+           ret = sctp_outgoing_data(&pc->sctp, (char*)data, bytes, PPID_BINARY, 0);
 
-        } else if (dtls_srtp_probe(pc->agent_buf)) {
+         // keep it queued until the retransmission queue drains, a message that
+         // can never be sent (-1) is released like a sent one
+         if (ret == -2)
+           break;
 
-          int ret = dtls_srtp_read(&pc->dtls_srtp, pc->temp_buf, sizeof(pc->temp_buf));
-          LOGD("Got DTLS data %d", ret);
-
-          if (ret > 0) {
-            sctp_incoming_data(&pc->sctp, (char*)pc->temp_buf, ret);
-          }
-
-        } else if (rtp_packet_validate(pc->agent_buf, pc->agent_ret)) {
-          LOGD("Got RTP packet");
+         buffer_release(pc->data_rb);
+      }
 
-          dtls_srtp_decrypt_rtp_packet(&pc->dtls_srtp, pc->agent_buf, &pc->agent_ret);
+      if (pc->config.datachannel) {
+        sctp_handle_timeout(&pc->sctp);
+      }
 
-          ssrc = rtp_get_ssrc(pc->agent_buf);
-          if (ssrc == pc->remote_assrc) {
-            rtp_decoder_decode(&pc->artp_decoder, pc->agent_buf, pc->agent_ret);
-          } else if (ssrc == pc->remote_vssrc) {
-            rtp_decoder_decode(&pc->vrtp_decoder, pc->agent_buf, pc->agent_ret);
-          }
+      // then every datagram already waiting, bounded so outgoing media is not starved
+      for (i = 0; i < PEER_CONNECTION_RECV_BATCH && agent_wait(&pc->agent, -1, 0) > 0; i++) {
 
-        } else {
-          LOGW("Unknown data");
+        if ((pc->agent_ret = agent_recv(&pc->agent, pc->agent_buf, sizeof(pc->agent_buf))) > 0) {
+          LOGD("agent_recv %d", pc->agent_ret);
+          peer_connection_incoming_packet(pc);
         }
-
       }
+      pc->agent_ret = -1;
 
-      if (KEEPALIVE_CONNCHECK > 0 && (ports_get_epoch_time() - pc->agent.binding_request_time) > KEEPALIVE_CONNCHECK) {
+      peer_connection_pace(pc);
 
-        LOGI("binding request timeout");
-        STATE_CHANGED(pc, PEER_CONNECTION_CLOSED);
+      // the path is gone, e.g. the PPP link came back with another address
+      if (agent_consent_check(&pc->agent) < 0) {
+        peer_connection_ice_restart(pc);
       }
 
       break;
@@ -501,26 +935,57 @@ void peer_connection_set_remote_description(PeerConnection *pc, const char *sdp_
 
   agent_set_remote_description(&pc->agent, (char*)sdp_text);
   STATE_CHANGED(pc, PEER_CONNECTION_CHECKING);
+  ports_event_signal(pc->event_fd);
+}
+
+void peer_connection_restart_ice(PeerConnection *pc) {
+
+  pc->b_ice_restart = 1;
+  ports_event_signal(pc->event_fd);
 }
 
 void peer_connection_create_offer(PeerConnection *pc) {
 
   STATE_CHANGED(pc, PEER_CONNECTION_NEW);
   pc->b_offer_created = 0;
+  pc->b_ice_restarting = 0;
+  ports_event_signal(pc->event_fd);
 }
 
 int peer_connection_send_rtcp_pil(PeerConnection *pc, uint32_t ssrc) {
 
-  int ret = -1;
   uint8_t plibuf[128];
+
+  if (pc->state != PEER_CONNECTION_COMPLETED) {
+    return -1;
+  }
+
   rtcp_get_pli(plibuf, 12, ssrc);
- 
-  //TODO: encrypt rtcp packet
-  //guint size = 12;
-  //dtls_transport_encrypt_rctp_packet(pc->dtls_transport, plibuf, &size);
-  //ret = nice_agent_send(pc->nice_agent, pc->stream_id, pc->component_id, size, (gchar*)plibuf);
 
-  return ret;
+  // encrypted as it leaves, ahead of any queued media
+  if (peer_connection_queue(pc, PACER_PRIORITY_CONTROL, PEER_CONNECTION_PACKET_RTCP, plibuf, 12) < 0) {
+    return -2;
+  }
+
+  ports_event_signal(pc->event_fd);
+  return 0;
+}
+
+void peer_connection_get_pacer_stats(PeerConnection *pc, PeerConnectionPacerStats *stats) {
+
+  PacerStats pacer_stats;
+
+  pacer_get_stats(&pc->pacer, &pacer_stats);
+
+  memset(stats, 0, sizeof(PeerConnectionPacerStats));
+  for (int i = 0; i < PACER_PRIORITY_NUM; i++) {
+    stats->queued_packets += pacer_stats.queued_packets[i];
+    stats->queued_bytes += pacer_stats.queued_bytes[i];
+  }
+  stats->rate = pacer_stats.rate;
+  stats->avg_delay = pacer_stats.avg_delay;
+  stats->max_delay = pacer_stats.max_delay;
+  stats->dropped = pacer_stats.dropped;
 }
 
 // callbacks
@@ -39,7 +39,7 @@ typedef enum MediaCodec {
   /* Video */
   CODEC_H264,
   CODEC_VP8, // not implemented yet 
-  CODEC_MJPEG, // not implemented yet
+  CODEC_MJPEG, // RFC 2435, send only
 
   /* Audio */
   CODEC_OPUS, // not implemented yet
@@ -67,10 +67,22 @@ typedef struct PeerConfiguration {
   void (*onaudiotrack)(uint8_t *data, size_t size, void *userdata);
   void (*onvideotrack)(uint8_t *data, size_t size, void *userdata);
   void (*on_request_keyframe)();
+  void (*on_bitrate_change)(uint32_t bitrate, void *userdata);
   void *user_data;
 
 } PeerConfiguration;
 
+typedef struct PeerConnectionPacerStats {
+
+  uint32_t queued_packets; // RTCP, audio, video and data channel waiting to leave
+  uint32_t queued_bytes;
+  uint32_t rate; // bps the queues are drained at
+  uint32_t avg_delay; // ms a packet waited in the pacer, smoothed
+  uint32_t max_delay; // ms
+  uint32_t dropped; // packets refused by a full queue
+
+} PeerConnectionPacerStats;
+
 typedef struct PeerConnection PeerConnection;
 
 const char* peer_connection_state_to_string(PeerConnectionState state);
@@ -85,7 +97,28 @@ void peer_connection_destroy(PeerConnection *pc);
 
 void peer_connection_close(PeerConnection *pc);
 
+/**
+ * @brief process the pending work of the peer connection without blocking on it
+ * @param[in] peer connection
+ * @note In the completed state this drains the send queues and all datagrams that are ready.
+ */
 int peer_connection_loop(PeerConnection *pc);
+
+/**
+ * @brief block until peer_connection_loop has work to do
+ * @param[in] peer connection
+ * @param[in] longest time to block in milliseconds, shortened to the next SCTP, pacer or keepalive deadline
+ * @return > 0 when woken up by an inbound datagram or peer_connection_notify, 0 on timeout
+ * @note Only reads the connection state, so it can be called without the lock that serializes senders.
+ */
+int peer_connection_wait(PeerConnection *pc, int timeout);
+
+/**
+ * @brief wake up peer_connection_wait, e.g. after queuing data from another task
+ * @param[in] peer connection
+ */
+void peer_connection_notify(PeerConnection *pc);
+
 /**
  * @brief send message to data channel
  * @param[in] peer connection
@@ -96,14 +129,54 @@ int peer_connection_datachannel_send(PeerConnection *pc, char *message, size_t l
 
 int peer_connection_datachannel_send_sid(PeerConnection *pc, char *message, size_t len, uint16_t sid);
 
+/**
+ * @brief make a data channel stream partially reliable, stale messages are dropped instead of retransmitted
+ * @param[in] peer connection
+ * @param[in] stream id
+ * @param[in] max retransmissions of a message, -1 for unlimited
+ * @param[in] lifetime of a message in ms, 0 for unlimited
+ */
+void peer_connection_datachannel_set_policy(PeerConnection *pc, uint16_t sid, int max_retransmits, uint32_t lifetime);
+
+/**
+ * @brief estimated bitrate the path can carry, from transport-cc, REMB and receiver reports
+ * @param[in] peer connection
+ * @return bits per second
+ */
+uint32_t peer_connection_get_target_bitrate(PeerConnection *pc);
+
+/**
+ * @brief queue depth and pacing delay of the send pacer
+ * @param[in] peer connection
+ * @param[out] stats, max_delay covers the time since the previous call
+ */
+void peer_connection_get_pacer_stats(PeerConnection *pc, PeerConnectionPacerStats *stats);
+
 int peer_connection_send_audio(PeerConnection *pc, const uint8_t *packet, size_t bytes);
 
 int peer_connection_send_video(PeerConnection *pc, const uint8_t *packet, size_t bytes);
 
+/**
+ * @brief packetize and send a video frame straight from the caller's buffer
+ * @param[in] peer connection
+ * @param[in] frame buffer, e.g. camera_fb_t::buf, read once while packetizing
+ * @param[in] length of frame
+ * @return 0 on success, -2 when packets were dropped on a full pacer queue or socket buffer, -1 on error
+ * @note Bypasses the video ring buffer. Must not run concurrently with peer_connection_loop.
+ */
+int peer_connection_send_video_frame(PeerConnection *pc, const uint8_t *buf, size_t len);
+
 void peer_connection_set_remote_description(PeerConnection *pc, const char *sdp);
 
 void peer_connection_create_offer(PeerConnection *pc);
 
+/**
+ * @brief gather again and send a new offer with new ICE credentials, e.g. after the
+ * network interface got a new address. An established session keeps DTLS, SRTP and SCTP.
+ * Safe to call from another task.
+ */
+void peer_connection_restart_ice(PeerConnection *pc);
+
 /**
  * @brief register callback function to handle packet loss from RTCP receiver report
  * @param[in] peer connection
@@ -389,6 +389,7 @@ static int peer_signaling_mqtt_connect(const char *hostname, int port) {
 
   if (status != MQTTSuccess) {
     LOGE("MQTT_Connect failed: Status=%s.", MQTT_Status_strerror(status));
+    ssl_transport_disconnect(&g_ps.net_ctx);
     return -1;
   }
 
@@ -448,6 +449,20 @@ static void peer_signaling_onicecandidate(char *description, void *userdata) {
     }
     cJSON_Delete(res);
     g_ps.id = 0;
+  } else if (g_ps.mqtt_port > 0) {
+    // an offer nobody asked for restarts ICE: a JSON-RPC notification
+    // {"jsonrpc":"2.0","method":"offer","params":"<sdp>"} without an id,
+    // the viewer replies with the usual "answer" request
+    res = cJSON_CreateObject();
+    cJSON_AddStringToObject(res, "jsonrpc", RPC_VERSION);
+    cJSON_AddStringToObject(res, "method", RPC_METHOD_OFFER);
+    cJSON_AddStringToObject(res, "params", description);
+    payload = cJSON_PrintUnformatted(res);
+    if (payload) {
+      peer_signaling_mqtt_publish(&g_ps.mqtt_ctx, payload);
+      free(payload);
+    }
+    cJSON_Delete(res);
   } else {
     // enable authentication
     if (strlen(g_ps.username) > 0 && strlen(g_ps.password) > 0) {
@@ -534,6 +549,11 @@ void peer_signaling_leave_channel() {
       LOGE("Failed to disconnect with broker: %s", MQTT_Status_strerror(status));
     }
   }
+
+  // the next join opens a new connection, the old one may already be dead with its link
+  if (g_ps.mqtt_port > 0) {
+    ssl_transport_disconnect(&g_ps.net_ctx);
+  }
 }
 
 void peer_signaling_set_config(ServiceConfiguration *service_config) {
@@ -5,15 +5,21 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
 
 #ifdef ESP32
 #include <esp_netif.h>
+#include <esp_vfs_eventfd.h>
+#include <nvs.h>
 #else
+#include <stdio.h>
 #include <ifaddrs.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 #endif
 
+#include "config.h"
 #include "ports.h"
 #include "utils.h"
 
@@ -172,3 +178,166 @@ uint32_t ports_get_epoch_time() {
   gettimeofday(&tv, NULL);
   return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
+
+int ports_event_create() {
+
+  int fd;
+
+#ifdef ESP32
+  static int registered = 0;
+  esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+
+  if (!registered) {
+    if (esp_vfs_eventfd_register(&config) != ESP_OK) {
+      LOGE("Failed to register eventfd");
+      return -1;
+    }
+    registered = 1;
+  }
+#endif
+
+  if ((fd = eventfd(0, 0)) < 0) {
+    LOGE("Failed to create eventfd");
+    return -1;
+  }
+
+  return fd;
+}
+
+void ports_event_destroy(int fd) {
+
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void ports_event_signal(int fd) {
+
+  uint64_t value = 1;
+
+  if (fd >= 0 && write(fd, &value, sizeof(value)) != sizeof(value)) {
+    LOGW("Failed to signal event");
+  }
+}
+
+int ports_event_wait(int fd, int timeout) {
+
+  int ret;
+  uint64_t value;
+  fd_set rfds;
+  struct timeval tv;
+
+  if (fd < 0) {
+    return -1;
+  }
+
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+
+  ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+  if (ret < 0) {
+    LOGE("select error");
+    return -1;
+  } else if (ret == 0) {
+    return 0;
+  }
+
+  // signals sent before this point are all covered by this wakeup
+  if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+    LOGW("Failed to clear event");
+  }
+
+  return 1;
+}
+
+int ports_storage_load(const char *name, void *buf, size_t size) {
+
+#ifdef ESP32
+  nvs_handle_t handle;
+  size_t len = size;
+  int ret = -1;
+
+  if (nvs_open(STORAGE_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return -1;
+  }
+
+  if (nvs_get_blob(handle, name, buf, &len) == ESP_OK) {
+    ret = len;
+  }
+
+  nvs_close(handle);
+  return ret;
+#else
+  char path[256];
+  FILE *fp;
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/%s_%s", STORAGE_DIR, STORAGE_NAMESPACE, name);
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    return -1;
+  }
+
+  ret = fread(buf, 1, size, fp);
+  // larger than the caller expects, not ours
+  if (fgetc(fp) != EOF) {
+    ret = -1;
+  }
+
+  fclose(fp);
+  return ret;
+#endif
+}
+
+int ports_storage_save(const char *name, const void *buf, size_t len) {
+
+#ifdef ESP32
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  if ((err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+    LOGE("nvs_open failed: %s", esp_err_to_name(err));
+    return -1;
+  }
+
+  if ((err = nvs_set_blob(handle, name, buf, len)) == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+
+  nvs_close(handle);
+
+  if (err != ESP_OK) {
+    LOGE("Failed to store %s: %s", name, esp_err_to_name(err));
+    return -1;
+  }
+
+  return 0;
+#else
+  char path[256];
+  char tmp_path[260];
+  FILE *fp;
+  int ret = 0;
+
+  snprintf(path, sizeof(path), "%s/%s_%s", STORAGE_DIR, STORAGE_NAMESPACE, name);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  if ((fp = fopen(tmp_path, "wb")) == NULL) {
+    LOGE("Failed to open %s: %s", tmp_path, strerror(errno));
+    return -1;
+  }
+
+  if (fwrite(buf, 1, len, fp) != len) {
+    ret = -1;
+  }
+
+  if (fclose(fp) != 0 || ret < 0 || rename(tmp_path, path) != 0) {
+    LOGE("Failed to store %s: %s", path, strerror(errno));
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+#endif
+}
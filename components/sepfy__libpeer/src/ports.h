@@ -12,4 +12,37 @@ int ports_get_host_addr(Address *addr);
 
 uint32_t ports_get_epoch_time();
 
+/**
+ * @brief create a file descriptor that becomes readable when signaled, for waking a task blocked in select()
+ * @return file descriptor, -1 on failure
+ */
+int ports_event_create();
+
+void ports_event_destroy(int fd);
+
+/**
+ * @brief wake up whoever is waiting on the event, safe to call from any task
+ */
+void ports_event_signal(int fd);
+
+/**
+ * @brief block until the event is signaled or the timeout expires, consuming the pending signals
+ * @param[in] timeout in milliseconds, 0 to poll
+ * @return 1 if signaled, 0 on timeout, -1 on error
+ */
+int ports_event_wait(int fd, int timeout);
+
+/**
+ * @brief read a blob kept across reboots, NVS on ESP32 and a file under STORAGE_DIR otherwise
+ * @param[in] name of the blob, at most 15 characters
+ * @return length of the blob, -1 if there is none or it does not fit in size
+ */
+int ports_storage_load(const char *name, void *buf, size_t size);
+
+/**
+ * @brief store a blob for ports_storage_load, replacing the previous one
+ * @return 0 on success, -1 on failure
+ */
+int ports_storage_save(const char *name, const void *buf, size_t len);
+
 #endif // PORTS_H_
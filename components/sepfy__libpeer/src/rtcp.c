@@ -61,3 +61,24 @@ RtcpRr rtcp_parse_rr(uint8_t *packet) {
   return rtcp_rr;
 }
 
+
+int rtcp_parse_remb(uint8_t *packet, int len, uint32_t *bitrate) {
+
+  uint8_t *fci = packet + 12;
+  uint32_t mantissa;
+  uint8_t exp;
+
+  // unique identifier "REMB", num ssrc, br exp, br mantissa
+  if (len < 20 || memcmp(fci, "REMB", 4) != 0)
+    return -1;
+
+  exp = fci[5] >> 2;
+  mantissa = ((fci[5] & 0x03) << 16) | (fci[6] << 8) | fci[7];
+
+  if (exp > 14)
+    *bitrate = UINT32_MAX;
+  else
+    *bitrate = mantissa << exp;
+
+  return 0;
+}
@@ -23,6 +23,16 @@ typedef enum RtcpType {
 
 } RtcpType;
 
+typedef enum RtcpFbFormat {
+
+  RTCP_RTPFB_NACK = 1,
+  RTCP_RTPFB_TWCC = 15,
+  RTCP_PSFB_PLI = 1,
+  RTCP_PSFB_FIR = 4,
+  RTCP_PSFB_AFB = 15,
+
+} RtcpFbFormat;
+
 typedef struct RtcpHeader {
 
 #if __BYTE_ORDER == __BIG_ENDIAN
@@ -84,4 +94,6 @@ int rtcp_get_fir(uint8_t *packet, int len, int *seqnr);
 
 RtcpRr rtcp_parse_rr(uint8_t *packet);
 
+int rtcp_parse_remb(uint8_t *packet, int len, uint32_t *bitrate);
+
 #endif // RTCP_H_
@@ -4,6 +4,7 @@
 
 #include "peer_connection.h"
 #include "rtp.h"
+#include "ports.h"
 #include "utils.h"
 
 typedef enum RtpH264Type {
@@ -28,6 +29,20 @@ typedef struct FuHeader {
   uint8_t s:1;
 } FuHeader;
 
+typedef struct JpegFrame {
+
+  uint8_t type;
+  uint16_t width;
+  uint16_t height;
+  uint16_t dri;
+  uint8_t *qtables[4];
+  uint8_t qtable_len[4];
+  uint8_t qtable_precision[4];
+  uint8_t qtable_order[2];
+  uint8_t *scan;
+  size_t scan_len;
+} JpegFrame;
+
 #define RTP_PAYLOAD_SIZE (CONFIG_MTU - sizeof(RtpHeader))
 #define FU_PAYLOAD_SIZE (CONFIG_MTU - sizeof(RtpHeader) - sizeof(FuHeader) - sizeof(NaluHeader))
 
@@ -174,6 +189,208 @@ static int rtp_encoder_encode_h264(RtpEncoder *rtp_encoder, uint8_t *buf, size_t
   return 0;
 }
 
+// RFC 2435 JPEG payload
+static int jpeg_parse(JpegFrame *frame, uint8_t *buf, size_t size) {
+
+  uint8_t *p = buf + 2;
+  uint8_t *end = buf + size;
+  uint8_t *seg;
+  uint16_t seg_len;
+  uint8_t tq[2] = {0, 1};
+  int i;
+
+  memset(frame, 0, sizeof(JpegFrame));
+
+  if (size < 4 || buf[0] != 0xff || buf[1] != 0xd8) {
+    LOGE("JPEG SOI not found");
+    return -1;
+  }
+
+  while (p + 4 <= end) {
+
+    if (p[0] != 0xff) {
+      LOGE("invalid JPEG marker");
+      return -1;
+    }
+
+    seg = p + 4;
+    seg_len = (p[2] << 8) | p[3];
+
+    if (seg_len < 2 || p + 2 + seg_len > end) {
+      LOGE("truncated JPEG segment");
+      return -1;
+    }
+
+    switch (p[1]) {
+      case 0xdb: // DQT
+        for (i = 0; i < seg_len - 2; ) {
+          uint8_t pq = seg[i] >> 4;
+          uint8_t id = seg[i] & 0x03;
+          if (i + 1 + (pq ? 128 : 64) > seg_len - 2) {
+            LOGE("truncated JPEG DQT");
+            return -1;
+          }
+          frame->qtables[id] = seg + i + 1;
+          frame->qtable_len[id] = pq ? 128 : 64;
+          frame->qtable_precision[id] = pq;
+          i += 1 + frame->qtable_len[id];
+        }
+        break;
+      case 0xc0: // SOF0, baseline only
+        if (seg_len < 17) {
+          LOGE("truncated JPEG SOF0");
+          return -1;
+        }
+        frame->height = (seg[1] << 8) | seg[2];
+        frame->width = (seg[3] << 8) | seg[4];
+        if (seg[5] != 3) {
+          LOGE("unsupported JPEG components %d", seg[5]);
+          return -1;
+        }
+        // luma sampling 2x1 -> type 0 (4:2:2), 2x2 -> type 1 (4:2:0)
+        if (seg[7] == 0x21) {
+          frame->type = 0;
+        } else if (seg[7] == 0x22) {
+          frame->type = 1;
+        } else {
+          LOGE("unsupported JPEG sampling 0x%02x", seg[7]);
+          return -1;
+        }
+        tq[0] = seg[8] & 0x03;
+        tq[1] = seg[11] & 0x03;
+        break;
+      case 0xdd: // DRI
+        frame->dri = (seg[0] << 8) | seg[1];
+        break;
+      case 0xda: // SOS, entropy-coded data follows
+        frame->scan = p + 2 + seg_len;
+        frame->scan_len = end - frame->scan;
+        // drop EOI and any padding the sensor appends after it
+        while (frame->scan_len >= 2) {
+          if (frame->scan[frame->scan_len - 2] == 0xff && frame->scan[frame->scan_len - 1] == 0xd9) {
+            frame->scan_len -= 2;
+            break;
+          }
+          frame->scan_len--;
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (frame->scan) {
+      break;
+    }
+
+    p += 2 + seg_len;
+  }
+
+  if (!frame->scan || frame->width == 0 || frame->height == 0
+   || frame->width > 2040 || frame->height > 2040) {
+    LOGE("incomplete JPEG frame");
+    return -1;
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (!frame->qtables[tq[i]]) {
+      LOGE("missing JPEG quantization table %d", tq[i]);
+      return -1;
+    }
+    frame->qtable_order[i] = tq[i];
+  }
+
+  return 0;
+}
+
+static int rtp_encoder_encode_mjpeg(RtpEncoder *rtp_encoder, uint8_t *buf, size_t size) {
+
+  JpegFrame frame;
+  RtpIovec iov[2];
+  RtpPacket *rtp_packet = (RtpPacket*)rtp_encoder->buf;
+  uint8_t *hdr;
+  size_t offset = 0;
+  size_t hdr_len;
+  size_t payload_len;
+  uint16_t qt_len;
+  int i;
+
+  if (jpeg_parse(&frame, buf, size) < 0) {
+    return -1;
+  }
+
+  qt_len = frame.qtable_len[frame.qtable_order[0]] + frame.qtable_len[frame.qtable_order[1]];
+
+  rtp_packet->header.version = 2;
+  rtp_packet->header.padding = 0;
+  rtp_packet->header.extension = 0;
+  rtp_packet->header.csrccount = 0;
+  rtp_packet->header.type = rtp_encoder->type;
+  rtp_packet->header.ssrc = htonl(rtp_encoder->ssrc);
+  // 90 kHz clock from capture wall time rather than a fixed frame rate
+  rtp_encoder->timestamp = ports_get_epoch_time() * 90;
+  rtp_packet->header.timestamp = htonl(rtp_encoder->timestamp);
+
+  while (offset < frame.scan_len) {
+
+    hdr = rtp_packet->payload;
+
+    // main JPEG header
+    hdr[0] = 0;
+    hdr[1] = (offset >> 16) & 0xff;
+    hdr[2] = (offset >> 8) & 0xff;
+    hdr[3] = offset & 0xff;
+    hdr[4] = frame.dri ? frame.type + 64 : frame.type;
+    hdr[5] = 255; // dynamic tables, sent in-band
+    hdr[6] = frame.width / 8;
+    hdr[7] = frame.height / 8;
+    hdr += 8;
+
+    if (frame.dri) {
+      hdr[0] = frame.dri >> 8;
+      hdr[1] = frame.dri & 0xff;
+      hdr[2] = 0xff; // F = 1, L = 1, count = 0x3fff
+      hdr[3] = 0xff;
+      hdr += 4;
+    }
+
+    if (offset == 0) {
+      hdr[0] = 0;
+      hdr[1] = frame.qtable_precision[frame.qtable_order[0]] | (frame.qtable_precision[frame.qtable_order[1]] << 1);
+      hdr[2] = qt_len >> 8;
+      hdr[3] = qt_len & 0xff;
+      hdr += 4;
+      for (i = 0; i < 2; i++) {
+        memcpy(hdr, frame.qtables[frame.qtable_order[i]], frame.qtable_len[frame.qtable_order[i]]);
+        hdr += frame.qtable_len[frame.qtable_order[i]];
+      }
+    }
+
+    hdr_len = hdr - rtp_encoder->buf;
+    payload_len = frame.scan_len - offset;
+    if (payload_len > CONFIG_MTU - hdr_len) {
+      payload_len = CONFIG_MTU - hdr_len;
+    }
+
+    rtp_packet->header.markerbit = (offset + payload_len == frame.scan_len);
+    rtp_packet->header.seq_number = htons(rtp_encoder->seq_number++);
+
+    if (rtp_encoder->on_packetv) {
+      // leave the scan data in the frame buffer, the sink gathers it once
+      iov[0].base = rtp_encoder->buf;
+      iov[0].len = hdr_len;
+      iov[1].base = frame.scan + offset;
+      iov[1].len = payload_len;
+      rtp_encoder->on_packetv(iov, 2, rtp_encoder->user_data);
+    } else {
+      memcpy(hdr, frame.scan + offset, payload_len);
+      rtp_encoder->on_packet(rtp_encoder->buf, hdr_len + payload_len, rtp_encoder->user_data);
+    }
+    offset += payload_len;
+  }
+
+  return 0;
+}
+
 static int rtp_encoder_encode_generic(RtpEncoder *rtp_encoder, uint8_t *buf, size_t size) {
 
   RtpHeader *rtp_header = (RtpHeader*)rtp_encoder->buf;
@@ -197,6 +414,7 @@ static int rtp_encoder_encode_generic(RtpEncoder *rtp_encoder, uint8_t *buf, siz
 void rtp_encoder_init(RtpEncoder *rtp_encoder, MediaCodec codec, RtpOnPacket on_packet, void *user_data) {
 
   rtp_encoder->on_packet = on_packet;
+  rtp_encoder->on_packetv = NULL;
   rtp_encoder->user_data = user_data;
   rtp_encoder->timestamp = 0;
   rtp_encoder->seq_number = 0;
@@ -209,6 +427,12 @@ void rtp_encoder_init(RtpEncoder *rtp_encoder, MediaCodec codec, RtpOnPacket on_
       rtp_encoder->timestamp_increment = 90000/30; // 30 FPS.
       rtp_encoder->encode_func = rtp_encoder_encode_h264;
       break;
+    case CODEC_MJPEG:
+      rtp_encoder->type = PT_JPEG;
+      rtp_encoder->ssrc = SSRC_JPEG;
+      rtp_encoder->timestamp_increment = 0; // derived from capture time
+      rtp_encoder->encode_func = rtp_encoder_encode_mjpeg;
+      break;
     case CODEC_PCMA:
       rtp_encoder->type = PT_PCMA;
       rtp_encoder->ssrc = SSRC_PCMA;
@@ -232,6 +456,11 @@ void rtp_encoder_init(RtpEncoder *rtp_encoder, MediaCodec codec, RtpOnPacket on_
   }
 }
 
+void rtp_encoder_set_packetv(RtpEncoder *rtp_encoder, RtpOnPacketv on_packetv) {
+
+  rtp_encoder->on_packetv = on_packetv;
+}
+
 int rtp_encoder_encode(RtpEncoder *rtp_encoder, uint8_t *buf, size_t size) {
 
   return rtp_encoder->encode_func(rtp_encoder, buf, size);
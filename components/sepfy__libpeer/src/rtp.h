@@ -23,6 +23,7 @@ typedef enum RtpPayloadType {
   PT_PCMU = 0,
   PT_PCMA = 8,
   PT_G722 = 9,
+  PT_JPEG = 26,
   PT_H264 = 96,
   PT_OPUS = 111
 
@@ -31,12 +32,17 @@ typedef enum RtpPayloadType {
 typedef enum RtpSsrc {
 
   SSRC_H264 = 1,
+  SSRC_JPEG = 2,
   SSRC_PCMA = 4,
   SSRC_PCMU = 5,
   SSRC_OPUS = 6,
 
 } RtpSsrc;
 
+// one-byte header extension id of transport-wide-cc, as offered in sdp.c
+#define RTP_EXT_TWCC_ID 3
+#define RTP_TWCC_EXT_SIZE 8
+
 typedef struct RtpHeader {
 #if __BYTE_ORDER == __BIG_ENDIAN
   uint16_t version:2;
@@ -79,6 +85,16 @@ typedef struct RtpEncoder RtpEncoder;
 typedef struct RtpDecoder RtpDecoder;
 typedef void (*RtpOnPacket)(uint8_t *packet, size_t bytes, void *user_data);
 
+typedef struct RtpIovec {
+
+  const uint8_t *base;
+  size_t len;
+
+} RtpIovec;
+
+// header slice followed by a payload slice that points into the caller's frame
+typedef void (*RtpOnPacketv)(const RtpIovec *iov, int iovcnt, void *user_data);
+
 struct RtpDecoder {
 
   RtpPayloadType type;
@@ -91,6 +107,7 @@ struct RtpEncoder {
 
   RtpPayloadType type;
   RtpOnPacket on_packet;
+  RtpOnPacketv on_packetv;
   int (*encode_func)(RtpEncoder *rtp_encoder, uint8_t *data, size_t size);
   void *user_data;
   uint16_t seq_number;
@@ -104,6 +121,8 @@ int rtp_packet_validate(uint8_t *packet, size_t size);
 
 void rtp_encoder_init(RtpEncoder *rtp_encoder, MediaCodec codec, RtpOnPacket on_packet, void *user_data);
 
+void rtp_encoder_set_packetv(RtpEncoder *rtp_encoder, RtpOnPacketv on_packetv);
+
 int rtp_encoder_encode(RtpEncoder *rtp_encoder, uint8_t *data, size_t size);
 
 void rtp_decoder_init(RtpDecoder *rtp_decoder, MediaCodec codec, RtpOnPacket on_packet, void *user_data);
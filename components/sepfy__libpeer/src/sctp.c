@@ -8,6 +8,7 @@
 #endif
 
 #include "dtls_srtp.h"
+#include "ports.h"
 #include "utils.h"
 
 #define DATA_CHANNEL_PPID_CONTROL           50
@@ -16,6 +17,8 @@
 #define DATA_CHANNEL_PPID_BINARY            53
 #define DATA_CHANNEL_PPID_DOMSTRING_PARTIAL 54
 #define DATA_CHANNEL_OPEN                   0x03
+#define DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT 0x01
+#define DATA_CHANNEL_PARTIAL_RELIABLE_TIMED  0x02
 
 static const uint32_t crc32c_table[256] = {
     0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L,
@@ -109,11 +112,492 @@ static int sctp_outgoing_data_cb(void *userdata, void *buf, size_t len, uint8_t
   return 0;
 }
 
+static SctpStreamEntry* sctp_get_stream(Sctp *sctp, uint16_t sid, int create) {
+
+  SctpStreamEntry *stream;
+
+  for (int i = 0; i < sctp->stream_count; i++) {
+    if (sctp->stream_table[i].sid == sid) {
+      return &sctp->stream_table[i];
+    }
+  }
+
+  if (!create || sctp->stream_count >= SCTP_MAX_STREAMS) {
+    return NULL;
+  }
+
+  stream = &sctp->stream_table[sctp->stream_count++];
+  memset(stream, 0, sizeof(SctpStreamEntry));
+  stream->sid = sid;
+  stream->max_retransmits = -1;
+  return stream;
+}
+
+#ifndef HAVE_USRSCTP
+
+#define TSN_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define TSN_LE(a, b) ((int32_t)((a) - (b)) <= 0)
+
+static SctpRtxEntry* sctp_rtx_entry(Sctp *sctp, uint32_t tsn) {
+
+  return &sctp->rtx_queue[tsn % SCTP_RTX_QUEUE_LENGTH];
+}
+
+static void sctp_write_packet(Sctp *sctp, uint8_t *buf, size_t length) {
+
+  SctpPacket *packet = (SctpPacket*)buf;
+
+  packet->header.source_port = htons(sctp->local_port);
+  packet->header.destination_port = htons(sctp->remote_port);
+  packet->header.verification_tag = sctp->verification_tag;
+  packet->header.checksum = 0x00;
+
+  // padding 4
+  length = (4*((length + 3)/4));
+  packet->header.checksum = sctp_get_checksum(sctp, buf, length);
+  dtls_srtp_write(sctp->dtls_srtp, buf, length);
+}
+
+static void sctp_reset_association(Sctp *sctp) {
+
+  for (int i = 0; i < SCTP_RTX_QUEUE_LENGTH; i++) {
+    sctp->rtx_queue[i].state = SCTP_CHUNK_FREE;
+  }
+
+  sctp->cum_tsn_ack = sctp->tsn - 1;
+  sctp->adv_peer_ack_point = sctp->cum_tsn_ack;
+  sctp->peer_rwnd = SCTP_RWND;
+  sctp->flight_size = 0;
+  // RFC 4960 7.2.1
+  sctp->cwnd = 4 * SCTP_MTU < 4380 ? 4 * SCTP_MTU : (2 * SCTP_MTU > 4380 ? 2 * SCTP_MTU : 4380);
+  sctp->ssthresh = SCTP_RWND;
+  sctp->partial_bytes_acked = 0;
+  sctp->fast_recovery = 0;
+  sctp->rto = SCTP_RTO_INITIAL;
+  sctp->srtt = 0;
+  sctp->rttvar = 0;
+  sctp->t3_expiry = 0;
+  sctp->forward_tsn_supported = 0;
+  sctp->remote_tsn_map = 0;
+  sctp->dup_tsns_count = 0;
+}
+
+static void sctp_update_rto(Sctp *sctp, uint32_t rtt) {
+
+  uint32_t delta;
+
+  if (sctp->srtt == 0) {
+    sctp->srtt = rtt;
+    sctp->rttvar = rtt / 2;
+  } else {
+    delta = sctp->srtt > rtt ? sctp->srtt - rtt : rtt - sctp->srtt;
+    sctp->rttvar = (3 * sctp->rttvar + delta) / 4;
+    sctp->srtt = (7 * sctp->srtt + rtt) / 8;
+  }
+
+  sctp->rto = sctp->srtt + 4 * sctp->rttvar;
+  if (sctp->rto < SCTP_RTO_MIN) {
+    sctp->rto = SCTP_RTO_MIN;
+  } else if (sctp->rto > SCTP_RTO_MAX) {
+    sctp->rto = SCTP_RTO_MAX;
+  }
+}
+
+static void sctp_remove_from_flight(Sctp *sctp, SctpRtxEntry *entry) {
+
+  sctp->flight_size = sctp->flight_size > entry->len ? sctp->flight_size - entry->len : 0;
+}
+
+static int sctp_should_abandon(Sctp *sctp, SctpRtxEntry *entry, uint32_t now, int retransmit) {
+
+  SctpStreamEntry *stream;
+
+  if (!sctp->forward_tsn_supported || !(stream = sctp_get_stream(sctp, entry->sid, 0))) {
+    return 0;
+  }
+
+  if (retransmit && stream->max_retransmits >= 0 && entry->retransmits >= stream->max_retransmits) {
+    return 1;
+  }
+
+  if (stream->lifetime > 0 && now - entry->first_sent_time >= stream->lifetime) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// A message is useless once any of its fragments is dropped, abandon all of them
+static void sctp_abandon_message(Sctp *sctp, uint16_t sid, uint16_t ssn) {
+
+  SctpRtxEntry *entry;
+
+  for (uint32_t tsn = sctp->cum_tsn_ack + 1; TSN_LT(tsn, sctp->tsn); tsn++) {
+
+    entry = sctp_rtx_entry(sctp, tsn);
+    if (entry->sid != sid || entry->ssn != ssn) {
+      continue;
+    }
+
+    if (entry->state == SCTP_CHUNK_OUTSTANDING) {
+      sctp_remove_from_flight(sctp, entry);
+      entry->state = SCTP_CHUNK_ABANDONED;
+    } else if (entry->state == SCTP_CHUNK_ACKED || entry->state == SCTP_CHUNK_PENDING) {
+      entry->state = SCTP_CHUNK_ABANDONED;
+    }
+  }
+}
+
+static void sctp_send_forward_tsn(Sctp *sctp) {
+
+  uint8_t buf[sizeof(SctpPacket) + sizeof(SctpForwardTsnChunk)];
+  SctpForwardTsnChunk *forward_tsn = (SctpForwardTsnChunk*)((SctpPacket*)buf)->chunks;
+
+  // all outgoing messages are unordered, no stream sequence numbers to skip
+  memset(buf, 0, sizeof(buf));
+  forward_tsn->common.type = SCTP_FORWARD_TSN;
+  forward_tsn->common.length = htons(8);
+  forward_tsn->new_cumulative_tsn = htonl(sctp->adv_peer_ack_point);
+  sctp_write_packet(sctp, buf, sizeof(SctpPacket) + 8);
+}
+
+static void sctp_advance_peer_ack_point(Sctp *sctp) {
+
+  if (TSN_LT(sctp->adv_peer_ack_point, sctp->cum_tsn_ack)) {
+    sctp->adv_peer_ack_point = sctp->cum_tsn_ack;
+  }
+
+  while (TSN_LT(sctp->adv_peer_ack_point + 1, sctp->tsn)
+   && sctp_rtx_entry(sctp, sctp->adv_peer_ack_point + 1)->state == SCTP_CHUNK_ABANDONED) {
+    sctp->adv_peer_ack_point++;
+  }
+
+  if (TSN_LT(sctp->cum_tsn_ack, sctp->adv_peer_ack_point)) {
+    sctp_send_forward_tsn(sctp);
+  }
+}
+
+static void sctp_retransmit(Sctp *sctp, SctpRtxEntry *entry, uint32_t now) {
+
+  if (sctp_should_abandon(sctp, entry, now, 1)) {
+    LOGD("abandon message sid %d ssn %d", entry->sid, entry->ssn);
+    sctp_abandon_message(sctp, entry->sid, entry->ssn);
+    return;
+  }
+
+  entry->retransmits++;
+  entry->sent_time = now;
+  sctp_write_packet(sctp, entry->packet, entry->len);
+}
+
+// RFC 4960 6.1, chunks leave in TSN order while the congestion window has
+// room, so the ones marked for retransmission go first. The peer window may
+// be overrun only to probe it when nothing is in flight.
+static void sctp_send_pending(Sctp *sctp, uint32_t now) {
+
+  SctpRtxEntry *entry;
+  int abandoned = 0;
+
+  for (uint32_t tsn = sctp->cum_tsn_ack + 1; TSN_LT(tsn, sctp->tsn); tsn++) {
+
+    entry = sctp_rtx_entry(sctp, tsn);
+    if (entry->state != SCTP_CHUNK_PENDING) {
+      continue;
+    }
+
+    if (sctp->flight_size >= sctp->cwnd || (sctp->flight_size > 0 && sctp->peer_rwnd < entry->len)) {
+      break;
+    }
+
+    if (entry->sent) {
+      sctp_retransmit(sctp, entry, now);
+      if (entry->state != SCTP_CHUNK_PENDING) {
+        abandoned = 1;
+        continue;
+      }
+    } else {
+      entry->sent = 1;
+      entry->sent_time = now;
+      sctp_write_packet(sctp, entry->packet, entry->len);
+    }
+
+    entry->state = SCTP_CHUNK_OUTSTANDING;
+    sctp->flight_size += entry->len;
+    sctp->peer_rwnd = sctp->peer_rwnd > entry->len ? sctp->peer_rwnd - entry->len : 0;
+  }
+
+  if (abandoned) {
+    sctp_advance_peer_ack_point(sctp);
+  }
+
+  if (sctp->t3_expiry == 0 && sctp->flight_size > 0) {
+    sctp->t3_expiry = now + sctp->rto;
+  }
+}
+
+static void sctp_restart_t3(Sctp *sctp, uint32_t now) {
+
+  if (sctp->flight_size > 0 || TSN_LT(sctp->cum_tsn_ack, sctp->adv_peer_ack_point)) {
+    sctp->t3_expiry = now + sctp->rto;
+  } else {
+    sctp->t3_expiry = 0;
+  }
+}
+
+static void sctp_handle_sack(Sctp *sctp, SctpSackChunk *sack, size_t chunk_len) {
+
+  uint32_t now = ports_get_epoch_time();
+  uint32_t cum_tsn_ack;
+  uint32_t highest_tsn;
+  uint32_t start;
+  uint32_t end;
+  uint16_t blocks;
+  uint16_t block[2];
+  SctpRtxEntry *entry;
+  uint32_t flight_before = sctp->flight_size;
+  uint32_t acked = 0;
+  int advanced = 0;
+
+  if (chunk_len < sizeof(SctpSackChunk)) {
+    return;
+  }
+
+  cum_tsn_ack = ntohl(sack->cumulative_tsn_ack);
+  blocks = ntohs(sack->number_of_gap_ack_blocks);
+  if (blocks > (chunk_len - sizeof(SctpSackChunk)) / 4) {
+    blocks = (chunk_len - sizeof(SctpSackChunk)) / 4;
+  }
+
+  // stale SACK, or one acking data we never sent
+  if (TSN_LT(cum_tsn_ack, sctp->cum_tsn_ack) || !TSN_LT(cum_tsn_ack, sctp->tsn)) {
+    return;
+  }
+
+  while (TSN_LT(sctp->cum_tsn_ack, cum_tsn_ack)) {
+
+    sctp->cum_tsn_ack++;
+    entry = sctp_rtx_entry(sctp, sctp->cum_tsn_ack);
+    if (entry->state == SCTP_CHUNK_OUTSTANDING) {
+      sctp_remove_from_flight(sctp, entry);
+      acked += entry->len;
+      // Karn's algorithm, never sample a retransmitted chunk
+      if (entry->retransmits == 0 && sctp->cum_tsn_ack == cum_tsn_ack) {
+        sctp_update_rto(sctp, now - entry->sent_time);
+      }
+    }
+    entry->state = SCTP_CHUNK_FREE;
+    advanced = 1;
+  }
+
+  highest_tsn = cum_tsn_ack;
+  for (int i = 0; i < blocks; i++) {
+
+    memcpy(block, sack->blocks + i * 4, sizeof(block));
+    start = cum_tsn_ack + ntohs(block[0]);
+    end = cum_tsn_ack + ntohs(block[1]);
+    if (!TSN_LT(end, sctp->tsn)) {
+      end = sctp->tsn - 1;
+    }
+
+    for (uint32_t tsn = start; TSN_LE(tsn, end); tsn++) {
+      entry = sctp_rtx_entry(sctp, tsn);
+      if (!TSN_LT(cum_tsn_ack, tsn)) {
+        continue;
+      }
+      if (entry->state == SCTP_CHUNK_OUTSTANDING) {
+        sctp_remove_from_flight(sctp, entry);
+        acked += entry->len;
+        entry->state = SCTP_CHUNK_ACKED;
+      } else if (entry->state == SCTP_CHUNK_PENDING && entry->sent) {
+        // the first transmission arrived after all
+        entry->state = SCTP_CHUNK_ACKED;
+      }
+    }
+
+    if (TSN_LT(highest_tsn, end)) {
+      highest_tsn = end;
+    }
+  }
+
+  // chunks below the highest gap acked TSN were missed, fast retransmit after 3 reports
+  for (uint32_t tsn = cum_tsn_ack + 1; TSN_LT(tsn, highest_tsn); tsn++) {
+    entry = sctp_rtx_entry(sctp, tsn);
+    if (entry->state == SCTP_CHUNK_OUTSTANDING && !entry->fast_retransmitted
+     && ++entry->missing_reports >= 3) {
+      // RFC 4960 7.2.4, the window is cut once per loss event
+      if (!sctp->fast_recovery) {
+        sctp->ssthresh = sctp->cwnd / 2 > 4 * SCTP_MTU ? sctp->cwnd / 2 : 4 * SCTP_MTU;
+        sctp->cwnd = sctp->ssthresh;
+        sctp->partial_bytes_acked = 0;
+        sctp->fast_recovery = 1;
+        sctp->recovery_point = sctp->tsn - 1;
+      }
+      entry->fast_retransmitted = 1;
+      sctp_retransmit(sctp, entry, now);
+    }
+  }
+
+  if (sctp->fast_recovery && !TSN_LT(sctp->cum_tsn_ack, sctp->recovery_point)) {
+    sctp->fast_recovery = 0;
+  }
+
+  // RFC 4960 7.2.1 and 7.2.2, the window grows only while it was in use
+  if (advanced && !sctp->fast_recovery && flight_before >= sctp->cwnd) {
+    if (sctp->cwnd <= sctp->ssthresh) {
+      sctp->cwnd += acked < SCTP_MTU ? acked : SCTP_MTU;
+    } else if ((sctp->partial_bytes_acked += acked) >= sctp->cwnd) {
+      sctp->partial_bytes_acked -= sctp->cwnd;
+      sctp->cwnd += SCTP_MTU;
+    }
+  }
+
+  if (sctp->flight_size == 0) {
+    sctp->partial_bytes_acked = 0;
+  }
+
+  sctp->peer_rwnd = ntohl(sack->a_rwnd);
+  sctp->peer_rwnd = sctp->peer_rwnd > sctp->flight_size ? sctp->peer_rwnd - sctp->flight_size : 0;
+
+  sctp_advance_peer_ack_point(sctp);
+  sctp_send_pending(sctp, now);
+
+  if (advanced || sctp->flight_size == 0) {
+    sctp_restart_t3(sctp, now);
+  }
+}
+
+// Returns 1 if the chunk is new and should be delivered
+static int sctp_record_tsn(Sctp *sctp, uint32_t tsn) {
+
+  uint32_t offset = tsn - sctp->remote_cum_tsn;
+
+  if ((int32_t)offset <= 0
+   || (offset <= 64 && (sctp->remote_tsn_map & (1ULL << (offset - 1))))) {
+    if (sctp->dup_tsns_count < SCTP_MAX_DUP_TSNS) {
+      sctp->dup_tsns[sctp->dup_tsns_count++] = tsn;
+    }
+    return 0;
+  }
+
+  if (offset > 64) {
+    // too far ahead to track, the peer will retransmit it
+    return 0;
+  }
+
+  sctp->remote_tsn_map |= 1ULL << (offset - 1);
+  while (sctp->remote_tsn_map & 1) {
+    sctp->remote_tsn_map >>= 1;
+    sctp->remote_cum_tsn++;
+  }
+
+  return 1;
+}
+
+static void sctp_forward_remote_tsn(Sctp *sctp, uint32_t new_cum_tsn) {
+
+  uint32_t offset = new_cum_tsn - sctp->remote_cum_tsn;
+
+  if ((int32_t)offset <= 0) {
+    return;
+  }
+
+  if (offset >= 64) {
+    sctp->remote_tsn_map = 0;
+  } else {
+    sctp->remote_tsn_map >>= offset;
+  }
+  sctp->remote_cum_tsn = new_cum_tsn;
+
+  while (sctp->remote_tsn_map & 1) {
+    sctp->remote_tsn_map >>= 1;
+    sctp->remote_cum_tsn++;
+  }
+}
+
+static void sctp_send_sack(Sctp *sctp) {
+
+  uint8_t buf[sizeof(SctpPacket) + sizeof(SctpSackChunk) + SCTP_MAX_GAP_ACK_BLOCKS * 4 + SCTP_MAX_DUP_TSNS * 4];
+  SctpSackChunk *sack = (SctpSackChunk*)((SctpPacket*)buf)->chunks;
+  uint8_t *pos = sack->blocks;
+  uint64_t map = sctp->remote_tsn_map;
+  uint16_t offset = 1;
+  uint16_t blocks = 0;
+  uint16_t block[2];
+  uint32_t dup_tsn;
+
+  memset(buf, 0, sizeof(buf));
+
+  while (map && blocks < SCTP_MAX_GAP_ACK_BLOCKS) {
+
+    while (!(map & 1)) {
+      map >>= 1;
+      offset++;
+    }
+    block[0] = htons(offset);
+
+    while (map & 1) {
+      map >>= 1;
+      offset++;
+    }
+    block[1] = htons(offset - 1);
+
+    memcpy(pos, block, sizeof(block));
+    pos += sizeof(block);
+    blocks++;
+  }
+
+  for (int i = 0; i < sctp->dup_tsns_count; i++) {
+    dup_tsn = htonl(sctp->dup_tsns[i]);
+    memcpy(pos, &dup_tsn, sizeof(dup_tsn));
+    pos += sizeof(dup_tsn);
+  }
+
+  sack->common.type = SCTP_SACK;
+  sack->common.flags = 0x00;
+  sack->common.length = htons(pos - (uint8_t*)sack);
+  sack->cumulative_tsn_ack = htonl(sctp->remote_cum_tsn);
+  // messages are handed to the application on arrival, nothing is held back
+  sack->a_rwnd = htonl(SCTP_RWND);
+  sack->number_of_gap_ack_blocks = htons(blocks);
+  sack->number_of_dup_tsns = htons(sctp->dup_tsns_count);
+  sctp->dup_tsns_count = 0;
+
+  sctp_write_packet(sctp, buf, pos - buf);
+}
+
+static void sctp_parse_init(Sctp *sctp, SctpInitChunk *init_chunk, size_t chunk_len) {
+
+  size_t pos = sizeof(SctpInitChunk);
+  SctpChunkParam *param;
+
+  sctp_reset_association(sctp);
+  sctp->peer_rwnd = ntohl(init_chunk->a_rwnd);
+  sctp->ssthresh = sctp->peer_rwnd;
+  sctp->remote_cum_tsn = ntohl(init_chunk->initial_tsn) - 1;
+
+  while (pos + sizeof(SctpChunkParam) <= chunk_len) {
+
+    param = (SctpChunkParam*)((uint8_t*)init_chunk + pos);
+    if (ntohs(param->length) < sizeof(SctpChunkParam)) {
+      break;
+    }
+
+    if (ntohs(param->type) == SCTP_PARAM_FORWARD_TSN_SUPPORTED) {
+      sctp->forward_tsn_supported = 1;
+    }
+
+    pos += 4*((ntohs(param->length) + 3)/4);
+  }
+}
+
+#endif
+
 int sctp_outgoing_data(Sctp *sctp, char *buf, size_t len, SctpDataPpid ppid, uint16_t sid) {
 
 #ifdef HAVE_USRSCTP
   int res;
   struct sctp_sendv_spa spa = {0};
+  SctpStreamEntry *stream = sctp_get_stream(sctp, sid, 0);
 
   spa.sendv_flags = SCTP_SEND_SNDINFO_VALID;
 
@@ -121,68 +605,209 @@ int sctp_outgoing_data(Sctp *sctp, char *buf, size_t len, SctpDataPpid ppid, uin
   spa.sendv_sndinfo.snd_flags = SCTP_EOR;
   spa.sendv_sndinfo.snd_ppid = htonl(ppid);
 
+  if (stream && stream->max_retransmits >= 0) {
+    spa.sendv_flags |= SCTP_SEND_PRINFO_VALID;
+    spa.sendv_prinfo.pr_policy = SCTP_PR_SCTP_RTX;
+    spa.sendv_prinfo.pr_value = stream->max_retransmits;
+  } else if (stream && stream->lifetime > 0) {
+    spa.sendv_flags |= SCTP_SEND_PRINFO_VALID;
+    spa.sendv_prinfo.pr_policy = SCTP_PR_SCTP_TTL;
+    spa.sendv_prinfo.pr_value = stream->lifetime;
+  }
+
   res = usrsctp_sendv(sctp->sock, buf, len, NULL, 0, &spa, sizeof(spa), SCTP_SENDV_SPA, 0);
   if(res < 0) 
     LOGE("sctp sendv error %d %s", errno, strerror(errno));
   return res;
 #else
-  size_t padding_len = 0;
   size_t payload_max = SCTP_MTU - sizeof(SctpPacket) - sizeof(SctpDataChunk);
   size_t pos = 0;
-  static uint16_t sqn = 0;
+  size_t chunk_len;
+  size_t count = (len + payload_max - 1) / payload_max;
+  uint32_t now = ports_get_epoch_time();
+  uint16_t ssn = 0;
+  SctpStreamEntry *stream;
+  SctpRtxEntry *entry;
+  SctpDataChunk *chunk;
+
+  if (len == 0) {
+    return 0;
+  }
 
-  SctpPacket *packet = (SctpPacket*)(sctp->buf);
-  SctpDataChunk *chunk = (SctpDataChunk*)(packet->chunks);
+  // would not fit even into an empty queue, waiting for it to drain never ends
+  if (count > SCTP_RTX_QUEUE_LENGTH) {
+    LOGW("sctp message of %d bytes exceeds %d fragments, dropped", (int)len, SCTP_RTX_QUEUE_LENGTH);
+    return -1;
+  }
 
-  packet->header.source_port = htons(sctp->local_port);
-  packet->header.destination_port = htons(sctp->remote_port);
-  packet->header.verification_tag = sctp->verification_tag;
+  // every fragment must fit in the retransmission queue, it also holds what waits for the windows
+  if (sctp->tsn - sctp->cum_tsn_ack - 1 + count > SCTP_RTX_QUEUE_LENGTH) {
+    return -2;
+  }
 
-  chunk->type = SCTP_DATA;
-  chunk->iube = 0x06;
-  chunk->sid = htons(0);
-  chunk->sqn = htons(sqn++);
-  chunk->ppid = htonl(ppid);
+  stream = sctp_get_stream(sctp, sid, 1);
+  if (stream) {
+    ssn = stream->ssn++;
+  }
 
-  while (len > payload_max) {
+  while (pos < len) {
 
-    chunk->length = htons(payload_max + sizeof(SctpDataChunk));
-    chunk->tsn = htonl(sctp->tsn++);
-    memcpy(chunk->data, buf + pos, payload_max);
-    packet->header.checksum = 0;
+    chunk_len = len - pos > payload_max ? payload_max : len - pos;
 
-    packet->header.checksum = sctp_get_checksum(sctp, (const uint8_t*)sctp->buf, SCTP_MTU);
+    entry = sctp_rtx_entry(sctp, sctp->tsn);
+    chunk = (SctpDataChunk*)((SctpPacket*)entry->packet)->chunks;
 
-    sctp_outgoing_data_cb(sctp, sctp->buf, SCTP_MTU, 0, 0);
+    chunk->type = SCTP_DATA;
     chunk->iube = 0x04;
-    len -= payload_max;
-    pos += payload_max;
+    if (pos == 0)
+      chunk->iube |= 0x02;
+    if (pos + chunk_len == len)
+      chunk->iube |= 0x01;
+    chunk->length = htons(chunk_len + sizeof(SctpDataChunk));
+    chunk->tsn = htonl(sctp->tsn);
+    chunk->sid = htons(sid);
+    chunk->sqn = htons(ssn);
+    chunk->ppid = htonl(ppid);
+    memcpy(chunk->data, buf + pos, chunk_len);
+
+    entry->len = sizeof(SctpPacket) + sizeof(SctpDataChunk) + chunk_len;
+    memset(chunk->data + chunk_len, 0, 4*((entry->len + 3)/4) - entry->len);
+    entry->len = 4*((entry->len + 3)/4);
+
+    entry->tsn = sctp->tsn;
+    entry->sid = sid;
+    entry->ssn = ssn;
+    entry->state = SCTP_CHUNK_PENDING;
+    entry->retransmits = 0;
+    entry->missing_reports = 0;
+    entry->fast_retransmitted = 0;
+    entry->sent = 0;
+    entry->first_sent_time = now;
+    entry->sent_time = now;
+
+    sctp->tsn++;
+    pos += chunk_len;
   }
 
-  if (len > 0) {
+  sctp_send_pending(sctp, now);
+#endif
+  return len;
+}
 
-    chunk->length = htons(len + sizeof(SctpDataChunk));
-    chunk->iube++;
-    chunk->tsn = htonl(sctp->tsn++);
-    memset(chunk->data, 0, payload_max);
-    memcpy(chunk->data, buf + pos, len);
-    packet->header.checksum = 0;
-    
-    padding_len = 4 * ((len + sizeof(SctpDataChunk) + sizeof(SctpPacket) + 3) / 4);
+void sctp_handle_timeout(Sctp *sctp) {
+
+#ifndef HAVE_USRSCTP
+  uint32_t now;
+  SctpRtxEntry *entry;
+  int abandoned = 0;
+
+  if (!sctp->connected) {
+    return;
+  }
+
+  now = ports_get_epoch_time();
+
+  // expire timed messages without waiting for T3-rtx
+  for (uint32_t tsn = sctp->cum_tsn_ack + 1; TSN_LT(tsn, sctp->tsn); tsn++) {
+    entry = sctp_rtx_entry(sctp, tsn);
+    if ((entry->state == SCTP_CHUNK_OUTSTANDING || entry->state == SCTP_CHUNK_PENDING) && sctp_should_abandon(sctp, entry, now, 0)) {
+      sctp_abandon_message(sctp, entry->sid, entry->ssn);
+      abandoned = 1;
+    }
+  }
+
+  if (abandoned) {
+    sctp_advance_peer_ack_point(sctp);
+  }
+
+  if (sctp->t3_expiry == 0 || (int32_t)(now - sctp->t3_expiry) < 0) {
+    return;
+  }
+
+  LOGD("T3-rtx expired, rto %d", (int)sctp->rto);
+
+  sctp->rto = sctp->rto * 2 > SCTP_RTO_MAX ? SCTP_RTO_MAX : sctp->rto * 2;
 
-    packet->header.checksum = sctp_get_checksum(sctp, (const uint8_t*)sctp->buf, padding_len);
+  // RFC 4960 6.3.3 and 7.2.3, back to one packet in flight. Everything
+  // outstanding is marked, the earliest one leaves now, the rest as SACKs
+  // open the window again.
+  sctp->ssthresh = sctp->cwnd / 2 > 4 * SCTP_MTU ? sctp->cwnd / 2 : 4 * SCTP_MTU;
+  sctp->cwnd = SCTP_MTU;
+  sctp->partial_bytes_acked = 0;
+  sctp->fast_recovery = 0;
 
-    sctp_outgoing_data_cb(sctp, sctp->buf, padding_len, 0, 0);
+  for (uint32_t tsn = sctp->cum_tsn_ack + 1; TSN_LT(tsn, sctp->tsn); tsn++) {
+    entry = sctp_rtx_entry(sctp, tsn);
+    if (entry->state == SCTP_CHUNK_OUTSTANDING) {
+      sctp_remove_from_flight(sctp, entry);
+      entry->state = SCTP_CHUNK_PENDING;
+      entry->missing_reports = 0;
+    }
   }
+
+  sctp->t3_expiry = 0;
+  sctp_send_pending(sctp, now);
+
+  // also resends a FORWARD TSN the peer has not acknowledged yet
+  sctp_advance_peer_ack_point(sctp);
+  sctp_restart_t3(sctp, now);
 #endif
-  return len;
+}
+
+int sctp_get_timeout(Sctp *sctp) {
+
+  int timeout = -1;
+#ifndef HAVE_USRSCTP
+  uint32_t now;
+  int32_t remaining;
+  SctpRtxEntry *entry;
+  SctpStreamEntry *stream;
+
+  if (!sctp->connected || sctp->t3_expiry == 0) {
+    return -1;
+  }
+
+  now = ports_get_epoch_time();
+  remaining = (int32_t)(sctp->t3_expiry - now);
+  timeout = remaining > 0 ? remaining : 0;
+
+  // messages with a lifetime may expire before T3-rtx does
+  if (sctp->forward_tsn_supported) {
+    for (uint32_t tsn = sctp->cum_tsn_ack + 1; TSN_LT(tsn, sctp->tsn); tsn++) {
+      entry = sctp_rtx_entry(sctp, tsn);
+      if ((entry->state != SCTP_CHUNK_OUTSTANDING && entry->state != SCTP_CHUNK_PENDING)
+       || !(stream = sctp_get_stream(sctp, entry->sid, 0)) || stream->lifetime == 0) {
+        continue;
+      }
+
+      remaining = (int32_t)(entry->first_sent_time + stream->lifetime - now);
+      if (remaining < timeout) {
+        timeout = remaining > 0 ? remaining : 0;
+      }
+    }
+  }
+#endif
+  return timeout;
+}
+
+void sctp_set_stream_policy(Sctp *sctp, uint16_t sid, int max_retransmits, uint32_t lifetime) {
+
+  SctpStreamEntry *stream = sctp_get_stream(sctp, sid, 1);
+
+  if (!stream) {
+    LOGE("Stream table full. Cannot set policy.");
+    return;
+  }
+
+  stream->max_retransmits = max_retransmits;
+  stream->lifetime = lifetime;
+  stream->policy_set = 1;
 }
 
 void sctp_add_stream_mapping(Sctp *sctp, const char *label, uint16_t sid) {
-  if (sctp->stream_count<SCTP_MAX_STREAMS) {
-    strncpy(sctp->stream_table[sctp->stream_count].label, label, sizeof(sctp->stream_table[sctp->stream_count].label));
-    sctp->stream_table[sctp->stream_count].sid = sid;
-    sctp->stream_count++;
+  SctpStreamEntry *stream = sctp_get_stream(sctp, sid, 1);
+  if (stream) {
+    strncpy(stream->label, label, sizeof(stream->label));
   } else 
       LOGE("Stream table full. Cannot add more streams.");    
 }
@@ -194,6 +819,8 @@ void sctp_parse_data_channel_open(Sctp *sctp, uint16_t sid, char *data, size_t l
   if (data[0]==DATA_CHANNEL_OPEN) {
     uint16_t label_length = ntohs(*(uint16_t *)(data + 8));
     uint16_t protocol_length = ntohs(*(uint16_t *)(data + 10));
+    uint32_t reliability = ntohl(*(uint32_t *)(data + 4));
+    SctpStreamEntry *stream;
 
     // Ensure we have enough data for the label and protocol
     if (length < 12 + label_length + protocol_length) 
@@ -211,6 +838,21 @@ void sctp_parse_data_channel_open(Sctp *sctp, uint16_t sid, char *data, size_t l
 
     // Add stream mapping
     sctp_add_stream_mapping(sctp, label_str, sid);
+
+    // Follow the reliability the remote asked for unless set locally
+    stream = sctp_get_stream(sctp, sid, 0);
+    if (stream && !stream->policy_set) {
+      switch (data[1] & 0x7f) {
+        case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT:
+          stream->max_retransmits = reliability;
+          break;
+        case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED:
+          stream->lifetime = reliability;
+          break;
+        default:
+          break;
+      }
+    }
   }
 }
 
@@ -239,9 +881,10 @@ void sctp_incoming_data(Sctp *sctp, char *buf, size_t len) {
 #else
   size_t length = 0;
   size_t pos = sizeof(SctpHeader);
+  uint16_t chunk_len;
+  int sack_needed = 0;
   SctpChunkCommon *chunk_common;
   SctpDataChunk *data_chunk;
-  SctpSackChunk *sack;
   SctpPacket *in_packet = (SctpPacket*)buf;
   SctpPacket *out_packet = (SctpPacket*)sctp->buf;
 
@@ -265,52 +908,58 @@ void sctp_incoming_data(Sctp *sctp, char *buf, size_t len) {
   memset(sctp->buf, 0, sizeof(sctp->buf));
 
   // chunks
-  while ((4*(pos + 3)/4) < len) {
+  while (pos + sizeof(SctpChunkCommon) <= len) {
 
     chunk_common = (SctpChunkCommon*)(buf + pos);
+    chunk_len = ntohs(chunk_common->length);
+    if (chunk_len < sizeof(SctpChunkCommon) || pos + chunk_len > len) {
+      LOGE("malformed chunk");
+      break;
+    }
+
+    length = 0;
 
     switch (chunk_common->type) {
 
       case SCTP_DATA:
 
         data_chunk = (SctpDataChunk*)(buf + pos);
-        LOGD("SCTP_DATA. ppid = %ld", ntohl(data_chunk->ppid));
+        sack_needed = 1;
 
-// XXX: not check DATA_CHANNEL_OPEN?
-#if 0
-        if (ntohl(data_chunk->ppid) == DATA_CHANNEL_PPID_CONTROL && data_chunk->data[0] == DATA_CHANNEL_OPEN) {
+        if (chunk_len < sizeof(SctpDataChunk) || !sctp_record_tsn(sctp, ntohl(data_chunk->tsn))) {
+          break;
+        }
+
+        LOGD("SCTP_DATA. ppid = %ld", (long)ntohl(data_chunk->ppid));
+
+        if (ntohl(data_chunk->ppid) == DATA_CHANNEL_PPID_CONTROL) {
+
+          sctp_parse_data_channel_open(sctp, ntohs(data_chunk->sid), (char*)data_chunk->data, chunk_len - sizeof(SctpDataChunk));
 
         } else if (ntohl(data_chunk->ppid) == DATA_CHANNEL_PPID_DOMSTRING) {
-#endif
-        if (ntohl(data_chunk->ppid) == DATA_CHANNEL_PPID_DOMSTRING) {
 
           if (sctp->onmessage) {
-            sctp->onmessage((char*)data_chunk->data, ntohs(data_chunk->length) - sizeof(SctpDataChunk), sctp->userdata, ntohs(data_chunk->sid));
+            sctp->onmessage((char*)data_chunk->data, chunk_len - sizeof(SctpDataChunk), sctp->userdata, ntohs(data_chunk->sid));
           }
         }
-
-        sack = (SctpSackChunk*)out_packet->chunks;
-        sack->common.type = SCTP_SACK;
-        sack->common.flags = 0x00;
-        sack->common.length = htons(16);
-        sack->cumulative_tsn_ack = data_chunk->tsn;
-        sack->a_rwnd = htonl(0x02);
-        length = ntohs(sack->common.length) + sizeof(SctpHeader);
-        pos = len; // Do not handle other msg
         break;
       case SCTP_INIT:
         LOGD("SCTP_INIT");
 
         SctpInitChunk *init_chunk;
-        init_chunk = (SctpInitChunk*)in_packet->chunks;
+        init_chunk = (SctpInitChunk*)(buf + pos);
+        if (chunk_len < sizeof(SctpInitChunk)) {
+          break;
+        }
         sctp->verification_tag = init_chunk->initiate_tag;
+        sctp_parse_init(sctp, init_chunk, chunk_len);
 
         SctpInitChunk *init_ack = (SctpInitChunk*)out_packet->chunks;
         init_ack->common.type = SCTP_INIT_ACK;
         init_ack->common.flags = 0x00;
-        init_ack->common.length = htons(20 + 8);
+        init_ack->common.length = htons(20 + 8 + 4);
         init_ack->initiate_tag = htonl(0x12345678);
-        init_ack->a_rwnd = htonl(0x100000);
+        init_ack->a_rwnd = htonl(SCTP_RWND);
         init_ack->number_of_outbound_streams = 0xffff;
         init_ack->number_of_inbound_streams = 0xffff;
         init_ack->initial_tsn = htonl(sctp->tsn);
@@ -321,47 +970,29 @@ void sctp_incoming_data(Sctp *sctp, char *buf, size_t len) {
         param->length = htons(0x08);
         uint32_t value = htonl(0x02);
         memcpy(&param->value, &value, 4);
+
+        param = (SctpChunkParam*)((uint8_t*)param + 8);
+        param->type = htons(SCTP_PARAM_FORWARD_TSN_SUPPORTED);
+        param->length = htons(0x04);
+
         length = ntohs(init_ack->common.length) + sizeof(SctpHeader);
         break;
       case SCTP_SACK:
-#if 0
-        LOGD("SCTP_SACK");
-        sack = (SctpSackChunk*)in_packet->chunks;
-        LOGD("cumulative_tsn_ack %d", ntohl(sack->cumulative_tsn_ack));
-        LOGD("a_rwnd %d", ntohl(sack->a_rwnd));
-        LOGD("number_of_gap_ack_blocks %d", sack->number_of_gap_ack_blocks);
-        LOGD("number_of_dup_tsns %d", sack->number_of_dup_tsns);
-#endif
-// XXX: unordered sequence
-#if 0
-        if (sack->number_of_gap_ack_blocks > 0) {
-
-          int blocks = ntohs(sack->number_of_gap_ack_blocks);
-          LOGW("cumulative_tsn_ack: %ld, number_of_gap_ack_blocks: %d",
-           ntohl(sack->cumulative_tsn_ack), blocks);
-
-          for (int i = 0; i < blocks; i++) {
-
-            uint16_t *start = (uint16_t*)sack->blocks + i*2;
-            uint16_t *end = (uint16_t*)sack->blocks + i*2 + 1;
-            LOGW("start: %d, end: %d", ntohs(*start), ntohs(*end));
-            sctp->tsn = ntohl(sack->cumulative_tsn_ack) + 1;// + (*start) - 1;
-          }
-        } else if (sack->number_of_dup_tsns > 0) {
-
-          LOGW("cumulative_tsn_ack: %ld, number_of_dup_tsns: %d",
-           ntohl(sack->cumulative_tsn_ack),
-           ntohs(sack->number_of_dup_tsns));
+        sctp_handle_sack(sctp, (SctpSackChunk*)(buf + pos), chunk_len);
+        break;
+      case SCTP_FORWARD_TSN:
+        if (chunk_len >= 8) {
+          sctp_forward_remote_tsn(sctp, ntohl(((SctpForwardTsnChunk*)(buf + pos))->new_cumulative_tsn));
+          sack_needed = 1;
         }
-#endif
         break;
       case SCTP_COOKIE_ECHO:
         LOGD("SCTP_COOKIE_ECHO");
         SctpChunkCommon *common = (SctpChunkCommon*)out_packet->chunks;
         common->type = SCTP_COOKIE_ACK;
+        common->flags = 0x00;
         common->length = htons(4);
         length = ntohs(common->length) + sizeof(SctpHeader);
-        pos = len; // Do not handle other msg
 
         // XXX: Initiate the sctp association
         if (!sctp->connected) {
@@ -373,23 +1004,17 @@ void sctp_incoming_data(Sctp *sctp, char *buf, size_t len) {
         break;
       default:
         LOGI("Unknown chunk type %d", chunk_common->type);
-        length = 0;
         break;
     }
 
-    out_packet->header.source_port = htons(sctp->local_port);
-    out_packet->header.destination_port = htons(sctp->remote_port);
-    out_packet->header.verification_tag = sctp->verification_tag;
-    out_packet->header.checksum = 0x00;
-
     if (length > 0) {
-      // padding 4
-      length = (4*((length + 3)/4));
-      out_packet->header.checksum = sctp_get_checksum(sctp, sctp->buf, length);
-      dtls_srtp_write(sctp->dtls_srtp, sctp->buf, length);
-      //sctp_outgoing_data_cb(sctp, sctp->buf, SCTP_MTU, 0, 0);
+      sctp_write_packet(sctp, sctp->buf, length);
     }
-    pos += ntohs(chunk_common->length);
+    pos += 4*((chunk_len + 3)/4);
+  }
+
+  if (sack_needed) {
+    sctp_send_sack(sctp);
   }
 
 #endif
@@ -485,6 +1110,9 @@ int sctp_create_socket(Sctp *sctp, DtlsSrtp *dtls_srtp) {
   sctp->local_port = 5000;
   sctp->remote_port = 5000;
   sctp->tsn = 1234;
+#ifndef HAVE_USRSCTP
+  sctp_reset_association(sctp);
+#endif
 #ifdef HAVE_USRSCTP
   int ret = -1;
   usrsctp_init(0, sctp_outgoing_data_cb, NULL);
@@ -26,6 +26,7 @@ typedef struct SctpChunkParam {
 typedef enum SctpParamType {
 
   SCTP_PARAM_STATE_COOKIE = 7,
+  SCTP_PARAM_FORWARD_TSN_SUPPORTED = 0xc000,
 
 } SctpParamType;
 
@@ -124,6 +125,47 @@ typedef struct SctpInitChunk {
 
 } SctpInitChunk;
 
+#ifndef SCTP_RTX_QUEUE_LENGTH
+// must cover the chunks of the largest message, e.g. one VGA JPEG
+#define SCTP_RTX_QUEUE_LENGTH 64
+#endif
+
+#define SCTP_RWND (128 * 1024)
+#define SCTP_RTO_INITIAL 1000
+#define SCTP_RTO_MIN 1000 // RFC 4960 RTO.Min, the pacer and a cellular uplink can hold a chunk for hundreds of ms
+#define SCTP_RTO_MAX 10000
+#define SCTP_MAX_GAP_ACK_BLOCKS 16
+#define SCTP_MAX_DUP_TSNS 4
+
+typedef enum SctpChunkState {
+
+  SCTP_CHUNK_FREE = 0,
+  SCTP_CHUNK_PENDING, // waits for the congestion window, new or marked for retransmission
+  SCTP_CHUNK_OUTSTANDING,
+  SCTP_CHUNK_ACKED,
+  SCTP_CHUNK_ABANDONED,
+
+} SctpChunkState;
+
+// A sent DATA chunk kept until the peer's cumulative TSN passes it.
+// Slot is rtx_queue[tsn % SCTP_RTX_QUEUE_LENGTH].
+typedef struct SctpRtxEntry {
+
+  uint32_t tsn;
+  uint16_t sid;
+  uint16_t ssn;
+  uint8_t state;
+  uint8_t retransmits;
+  uint8_t missing_reports;
+  uint8_t fast_retransmitted;
+  uint8_t sent; // was on the wire at least once
+  uint32_t first_sent_time; // when it was queued, PR-SCTP lifetimes count from here
+  uint32_t sent_time;
+  uint16_t len;
+  uint8_t packet[SCTP_MTU];
+
+} SctpRtxEntry;
+
 #endif
 
 typedef enum SctpDataPpid {
@@ -141,6 +183,10 @@ typedef enum SctpDataPpid {
 typedef struct {
     char label[32];   // Stream label
     uint16_t sid;     // Stream ID
+    uint16_t ssn;     // Next outgoing stream sequence number
+    int max_retransmits; // PR-SCTP, -1 = unlimited
+    uint32_t lifetime;   // PR-SCTP in ms, 0 = unlimited
+    int policy_set;      // set locally, DCEP does not override it
 } SctpStreamEntry;
 
 typedef struct Sctp {
@@ -164,6 +210,31 @@ typedef struct Sctp {
 
   void *userdata;
   uint8_t buf[CONFIG_MTU];
+
+#ifndef HAVE_USRSCTP
+  /* sender */
+  uint32_t cum_tsn_ack;
+  uint32_t adv_peer_ack_point;
+  uint32_t peer_rwnd;
+  uint32_t flight_size;
+  uint32_t cwnd;
+  uint32_t ssthresh;
+  uint32_t partial_bytes_acked;
+  uint32_t recovery_point; // fast recovery lasts until the cumulative ack passes this TSN
+  int fast_recovery;
+  uint32_t rto;
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t t3_expiry;
+  int forward_tsn_supported;
+  SctpRtxEntry rtx_queue[SCTP_RTX_QUEUE_LENGTH];
+
+  /* receiver */
+  uint32_t remote_cum_tsn;
+  uint64_t remote_tsn_map;
+  uint32_t dup_tsns[SCTP_MAX_DUP_TSNS];
+  int dup_tsns_count;
+#endif
 } Sctp;
 
 
@@ -177,8 +248,33 @@ int sctp_is_connected(Sctp *sctp);
 
 void sctp_incoming_data(Sctp *sctp, char *buf, size_t len);
 
+/**
+ * @brief queue a message, its chunks leave as the congestion and peer windows allow
+ * @return len on success, -2 while the retransmission queue is full, -1 if the
+ * message can never be sent, e.g. needs more fragments than SCTP_RTX_QUEUE_LENGTH
+ */
 int sctp_outgoing_data(Sctp *sctp, char *buf, size_t len, SctpDataPpid ppid, uint16_t sid);
 
+/**
+ * @brief drive T3-rtx retransmission and PR-SCTP abandonment, call periodically
+ */
+void sctp_handle_timeout(Sctp *sctp);
+
+/**
+ * @brief time until sctp_handle_timeout() has work to do
+ * @return milliseconds, -1 when no timer is running
+ */
+int sctp_get_timeout(Sctp *sctp);
+
+/**
+ * @brief set a partial reliability policy for outgoing messages on a stream
+ * @param[in] sctp
+ * @param[in] stream id
+ * @param[in] max retransmissions before a message is abandoned, -1 for unlimited
+ * @param[in] lifetime in ms before a message is abandoned, 0 for unlimited
+ */
+void sctp_set_stream_policy(Sctp *sctp, uint16_t sid, int max_retransmits, uint32_t lifetime);
+
 void sctp_onmessage(Sctp *sctp, void (*onmessage)(char *msg, size_t len, void *userdata, uint16_t sid));
 
 void sctp_onopen(Sctp *sctp, void (*onopen)(void *userdata));
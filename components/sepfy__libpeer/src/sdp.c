@@ -2,6 +2,9 @@
 #include <stdarg.h>
 
 #include "sdp.h"
+#include "rtp.h"
+
+#define SDP_EXTMAP_TWCC "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
 
 int sdp_append(Sdp *sdp, const char *format, ...) {
 
@@ -32,6 +35,10 @@ void sdp_append_h264(Sdp *sdp) {
   sdp_append(sdp, "m=video 9 UDP/TLS/RTP/SAVPF 96 102");
   sdp_append(sdp, "a=rtcp-fb:102 nack");
   sdp_append(sdp, "a=rtcp-fb:102 nack pli");
+  sdp_append(sdp, "a=rtcp-fb:96 transport-cc");
+  sdp_append(sdp, "a=rtcp-fb:102 transport-cc");
+  sdp_append(sdp, "a=rtcp-fb:102 goog-remb");
+  sdp_append(sdp, "a=extmap:%d %s", RTP_EXT_TWCC_ID, SDP_EXTMAP_TWCC);
   sdp_append(sdp, "a=fmtp:96 profile-level-id=42e01f;level-asymmetry-allowed=1");
   sdp_append(sdp, "a=fmtp:102 profile-level-id=42e01f;packetization-mode=1;level-asymmetry-allowed=1");
   sdp_append(sdp, "a=rtpmap:96 H264/90000");
@@ -43,6 +50,20 @@ void sdp_append_h264(Sdp *sdp) {
   sdp_append(sdp, "a=rtcp-mux");
 }
 
+void sdp_append_mjpeg(Sdp *sdp) {
+
+  sdp_append(sdp, "m=video 9 UDP/TLS/RTP/SAVPF 26");
+  sdp_append(sdp, "a=rtpmap:26 JPEG/90000");
+  sdp_append(sdp, "a=rtcp-fb:26 transport-cc");
+  sdp_append(sdp, "a=rtcp-fb:26 goog-remb");
+  sdp_append(sdp, "a=extmap:%d %s", RTP_EXT_TWCC_ID, SDP_EXTMAP_TWCC);
+  sdp_append(sdp, "a=ssrc:2 cname:webrtc-mjpeg");
+  sdp_append(sdp, "a=sendrecv");
+  sdp_append(sdp, "a=mid:video");
+  sdp_append(sdp, "c=IN IP4 0.0.0.0");
+  sdp_append(sdp, "a=rtcp-mux");
+}
+
 void sdp_append_pcma(Sdp *sdp) {
 
   sdp_append(sdp, "m=audio 9 UDP/TLS/RTP/SAVP 8");
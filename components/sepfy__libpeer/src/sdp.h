@@ -18,6 +18,8 @@ typedef struct Sdp {
 
 void sdp_append_h264(Sdp *sdp);
 
+void sdp_append_mjpeg(Sdp *sdp);
+
 void sdp_append_pcma(Sdp *sdp);
 
 void sdp_append_pcmu(Sdp *sdp);
@@ -1,5 +1,10 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // struct mmsghdr, sendmmsg and recvmmsg
+#endif
+
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -9,10 +14,16 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <netdb.h>
+#if defined(__linux__)
+#include <netinet/udp.h>
+#endif
 
 #include "utils.h"
 #include "socket.h"
 
+#define UDP_SOCKET_MMSG_MAX 64 // datagrams per sendmmsg/recvmmsg, also the GSO segment limit
+#define UDP_SOCKET_GSO_MAX_BYTES 65000 // one GSO send is one IP datagram for the stack
+
 int udp_socket_add_multicast_group(UdpSocket *udp_socket, Address *mcast_addr) {
 
   int ret = 0;
@@ -44,6 +55,7 @@ int udp_socket_open(UdpSocket *udp_socket, int family, int port) {
   socklen_t sock_len;
 
   udp_socket->bind_addr.family = family;
+  udp_socket->gso_disabled = 0;
   switch (family) {
     case AF_INET6:
       udp_socket->fd = socket(AF_INET6, SOCK_DGRAM, 0);
@@ -112,55 +124,73 @@ void udp_socket_close(UdpSocket *udp_socket) {
   }
 }
 
-int udp_socket_sendto(UdpSocket *udp_socket, Address *addr, const uint8_t *buf, int len) {
-
-  struct sockaddr *sa;
-  socklen_t sock_len;
-  int ret = -1;
-
-  if (udp_socket->fd < 0) {
-    LOGE("sendto before socket init");
-    return -1;
-  }
+static struct sockaddr *udp_socket_sockaddr(Address *addr, socklen_t *sock_len) {
 
   switch (addr->family) {
     case AF_INET6:
       addr->sin6.sin6_family = AF_INET6;
-      sa = (struct sockaddr *)&addr->sin6;
-      sock_len = sizeof(struct sockaddr_in6);
-      break;
+      *sock_len = sizeof(struct sockaddr_in6);
+      return (struct sockaddr *)&addr->sin6;
     case AF_INET:
     default:
       addr->sin.sin_family = AF_INET;
-      sa = (struct sockaddr *)&addr->sin;
-      sock_len = sizeof(struct sockaddr_in);
+      *sock_len = sizeof(struct sockaddr_in);
+      return (struct sockaddr *)&addr->sin;
+  }
+}
+
+static void udp_socket_set_addr(UdpSocket *udp_socket, Address *addr, struct sockaddr_storage *ss) {
+
+  switch (udp_socket->bind_addr.family) {
+    case AF_INET6:
+      addr->family = AF_INET6;
+      memcpy(&addr->sin6, ss, sizeof(struct sockaddr_in6));
+      addr->port = ntohs(addr->sin6.sin6_port);
+      break;
+    case AF_INET:
+    default:
+      addr->family = AF_INET;
+      memcpy(&addr->sin, ss, sizeof(struct sockaddr_in));
+      addr->port = ntohs(addr->sin.sin_port);
       break;
   }
+}
 
-int retries = 5;
+static int udp_socket_would_block(int err) {
 
-while (retries-- > 0) {
-    ret = sendto(udp_socket->fd, buf, len, 0, sa, sock_len);
-    if (ret < 0 && errno == ENOBUFS) {
-        LOGE("Buffer full, retrying... (%d retries left)", retries);
-        usleep(10000);  // Sleep for 10 ms before retrying
-    } else if (ret >= 0) {
-        break;  // Success, exit loop
-    } else {
-        LOGE("Failed to sendto: %s", strerror(errno));  // Log error if not ENOBUFS
-        break;  // Exit on any error other than ENOBUFS
-    }
+  return err == ENOBUFS || err == EAGAIN || err == EWOULDBLOCK;
 }
 
+int udp_socket_sendto(UdpSocket *udp_socket, Address *addr, const uint8_t *buf, int len) {
+
+  struct sockaddr *sa;
+  socklen_t sock_len;
+  int ret;
+
+  if (udp_socket->fd < 0) {
+    LOGE("sendto before socket init");
+    return -1;
+  }
+
+  sa = udp_socket_sockaddr(addr, &sock_len);
+
+  // a full buffer is the caller's to handle, waiting here would stall the loop
+  if ((ret = sendto(udp_socket->fd, buf, len, 0, sa, sock_len)) < 0) {
+    if (udp_socket_would_block(errno)) {
+      LOGD("sendto: socket buffer full");
+      return -2;
+    }
+    LOGE("Failed to sendto: %s", strerror(errno));
+    return -1;
+  }
+
   return ret;
 }
 
 int udp_socket_recvfrom(UdpSocket *udp_socket, Address *addr, uint8_t *buf, int len) {
 
-  struct sockaddr_in6 sin6;
-  struct sockaddr_in sin;
-  struct sockaddr *sa;
-  socklen_t sock_len;
+  struct sockaddr_storage ss;
+  socklen_t sock_len = sizeof(ss);
   int ret;
 
   if (udp_socket->fd < 0) {
@@ -168,40 +198,208 @@ int udp_socket_recvfrom(UdpSocket *udp_socket, Address *addr, uint8_t *buf, int
     return -1; 
   }
 
-  switch (udp_socket->bind_addr.family) {
-    case AF_INET6:
-      sin6.sin6_family = AF_INET6;
-      sa = (struct sockaddr *)&sin6;
-      sock_len = sizeof(struct sockaddr_in6);
-      break;
-    case AF_INET:
-    default:
-      sin.sin_family = AF_INET;
-      sa = (struct sockaddr *)&sin;
-      sock_len = sizeof(struct sockaddr_in);
-      break;
-  }
-
-  if ((ret = recvfrom(udp_socket->fd, buf, len, 0, sa, &sock_len)) < 0) {
+  if ((ret = recvfrom(udp_socket->fd, buf, len, 0, (struct sockaddr *)&ss, &sock_len)) < 0) {
     LOGE("Failed to recvfrom: %s", strerror(errno));
     return -1;
   }
 
   if (addr) {
-    switch (udp_socket->bind_addr.family) {
-      case AF_INET6:
-        addr->family = AF_INET6;
-        addr->port = htons(addr->sin6.sin6_port);
-        memcpy(&addr->sin6, &sin6, sizeof(struct sockaddr_in6));
+    udp_socket_set_addr(udp_socket, addr, &ss);
+  }
+
+  return ret;
+}
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+// Packets of the same size laid out back to back, only the last may be
+// shorter, leave as one datagram each from a single send with UDP GSO.
+// Returns 1 when sent, 0 when GSO does not apply, -2 when the socket buffer
+// is full and -1 on error.
+static int udp_socket_send_gso(UdpSocket *udp_socket, struct sockaddr *sa, socklen_t sock_len, UdpPacket *packets, int count) {
+
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  uint16_t gso_size = packets[0].len;
+  int i;
+
+  if (udp_socket->gso_disabled || count < 2 || count * gso_size > UDP_SOCKET_GSO_MAX_BYTES) {
+    return 0;
+  }
+
+  for (i = 1; i < count; i++) {
+    if (packets[i].buf != packets[0].buf + i * gso_size || packets[i].len > gso_size || (packets[i].len < gso_size && i < count - 1)) {
+      return 0;
+    }
+  }
+
+  iov.iov_base = packets[0].buf;
+  iov.iov_len = (count - 1) * gso_size + packets[count - 1].len;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_name = sa;
+  msg.msg_namelen = sock_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(uint16_t));
+
+  if (sendmsg(udp_socket->fd, &msg, 0) >= 0) {
+    return 1;
+  } else if (udp_socket_would_block(errno)) {
+    return -2;
+  } else if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT) {
+    // no segmentation offload on this route or kernel, sendmmsg from now on
+    LOGI("UDP GSO not available: %s", strerror(errno));
+    udp_socket->gso_disabled = 1;
+    return 0;
+  }
+
+  LOGE("Failed to sendmsg: %s", strerror(errno));
+  return -1;
+}
+#endif
+
+int udp_socket_sendmmsg(UdpSocket *udp_socket, Address *addr, UdpPacket *packets, int count) {
+
+  int sent = 0;
+  int ret;
+#if defined(__linux__)
+  struct mmsghdr msgs[UDP_SOCKET_MMSG_MAX];
+  struct iovec iovs[UDP_SOCKET_MMSG_MAX];
+  struct sockaddr *sa;
+  socklen_t sock_len;
+  int i, n;
+
+  if (udp_socket->fd < 0) {
+    LOGE("sendmmsg before socket init");
+    return -1;
+  }
+
+  sa = udp_socket_sockaddr(addr, &sock_len);
+
+  while (sent < count) {
+
+    n = count - sent < UDP_SOCKET_MMSG_MAX ? count - sent : UDP_SOCKET_MMSG_MAX;
+
+#if defined(UDP_SEGMENT)
+    if ((ret = udp_socket_send_gso(udp_socket, sa, sock_len, packets + sent, n)) == 1) {
+      sent += n;
+      continue;
+    } else if (ret < 0) {
+      return ret == -2 || sent > 0 ? sent : -1;
+    }
+#endif
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for (i = 0; i < n; i++) {
+      iovs[i].iov_base = packets[sent + i].buf;
+      iovs[i].iov_len = packets[sent + i].len;
+      msgs[i].msg_hdr.msg_name = sa;
+      msgs[i].msg_hdr.msg_namelen = sock_len;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((ret = sendmmsg(udp_socket->fd, msgs, n, 0)) < 0) {
+      if (udp_socket_would_block(errno)) {
+        break;
+      }
+      LOGE("Failed to sendmmsg: %s", strerror(errno));
+      return sent > 0 ? sent : -1;
+    }
+
+    sent += ret;
+    // stopped at a full buffer
+    if (ret < n) {
       break;
-    case AF_INET:
-    default:
-        addr->family = AF_INET;
-        addr->port = htons(addr->sin.sin_port);
-        memcpy(&addr->sin, &sin, sizeof(struct sockaddr_in));
+    }
+  }
+#else
+  for (sent = 0; sent < count; sent++) {
+    if ((ret = udp_socket_sendto(udp_socket, addr, packets[sent].buf, packets[sent].len)) == -2) {
       break;
+    } else if (ret < 0) {
+      return sent > 0 ? sent : -1;
     }
   }
+#endif
+
+  return sent;
+}
+
+int udp_socket_recvmmsg(UdpSocket *udp_socket, UdpPacket *packets, int count) {
+
+  int ret;
+  int i;
+#if defined(__linux__)
+  struct mmsghdr msgs[UDP_SOCKET_MMSG_MAX];
+  struct iovec iovs[UDP_SOCKET_MMSG_MAX];
+  struct sockaddr_storage ss[UDP_SOCKET_MMSG_MAX];
+
+  if (udp_socket->fd < 0) {
+    LOGE("recvmmsg before socket init");
+    return -1;
+  }
+
+  if (count > UDP_SOCKET_MMSG_MAX) {
+    count = UDP_SOCKET_MMSG_MAX;
+  }
+
+  memset(msgs, 0, count * sizeof(struct mmsghdr));
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = packets[i].buf;
+    iovs[i].iov_len = packets[i].size;
+    msgs[i].msg_hdr.msg_name = &ss[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(ss[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  if ((ret = recvmmsg(udp_socket->fd, msgs, count, MSG_DONTWAIT, NULL)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    LOGE("Failed to recvmmsg: %s", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < ret; i++) {
+    packets[i].len = msgs[i].msg_len;
+    udp_socket_set_addr(udp_socket, &packets[i].addr, &ss[i]);
+  }
+#else
+  struct sockaddr_storage ss;
+  socklen_t sock_len;
+
+  if (udp_socket->fd < 0) {
+    LOGE("recvmmsg before socket init");
+    return -1;
+  }
+
+  for (ret = 0; ret < count; ret++) {
+
+    sock_len = sizeof(ss);
+    if ((i = recvfrom(udp_socket->fd, packets[ret].buf, packets[ret].size, MSG_DONTWAIT, (struct sockaddr *)&ss, &sock_len)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      LOGE("Failed to recvfrom: %s", strerror(errno));
+      return ret > 0 ? ret : -1;
+    }
+
+    packets[ret].len = i;
+    udp_socket_set_addr(udp_socket, &packets[ret].addr, &ss);
+  }
+#endif
 
   return ret;
 }
@@ -268,6 +466,8 @@ void tcp_socket_close(TcpSocket *tcp_socket) {
   if (tcp_socket->fd > 0) {
     close(tcp_socket->fd);
   }
+  // a second close must not hit an fd the stack has handed out again
+  tcp_socket->fd = -1;
 }
 
 int tcp_socket_send(TcpSocket *tcp_socket, const uint8_t *buf, int len) {
@@ -340,3 +540,20 @@ int tcp_socket_recv(TcpSocket *tcp_socket, uint8_t *buf, int len) {
 
   return ret;
 }
+
+int tcp_socket_set_low_latency(TcpSocket *tcp_socket, int sndbuf) {
+
+  int flag = 1;
+
+  if (setsockopt(tcp_socket->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) {
+    LOGE("Failed to set TCP_NODELAY: %s", strerror(errno));
+    return -1;
+  }
+
+  if (sndbuf > 0 && setsockopt(tcp_socket->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+    // not supported by every stack, the default buffer still works
+    LOGD("Failed to set SO_SNDBUF: %s", strerror(errno));
+  }
+
+  return 0;
+}
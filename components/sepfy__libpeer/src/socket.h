@@ -6,8 +6,18 @@
 typedef struct UdpSocket {
   int fd;
   Address bind_addr;
+  int gso_disabled; // the kernel refused UDP_SEGMENT once
 } UdpSocket;
 
+// One datagram of a batch. The receive side fills buf up to size and sets
+// len and addr, the send side sends len bytes of buf.
+typedef struct UdpPacket {
+  uint8_t *buf;
+  int size;
+  int len;
+  Address addr;
+} UdpPacket;
+
 typedef struct TcpSocket {
   int fd;
   Address bind_addr;
@@ -19,10 +29,26 @@ int udp_socket_bind(UdpSocket *udp_socket, int port);
 
 void udp_socket_close(UdpSocket *udp_socket);
 
+/**
+ * @return bytes sent, -2 when the socket buffer is full, -1 on error
+ */
 int udp_socket_sendto(UdpSocket *udp_socket, Address *bind_addr, const uint8_t *buf, int len);
 
 int udp_socket_recvfrom(UdpSocket *udp_sock, Address *bind_addr, uint8_t *buf, int len);
 
+/**
+ * @brief send datagrams to one address in as few system calls as the platform allows,
+ * sendmmsg and UDP GSO on Linux, a loop elsewhere
+ * @return datagrams sent, fewer than count when the socket buffer is full, -1 on error
+ */
+int udp_socket_sendmmsg(UdpSocket *udp_socket, Address *addr, UdpPacket *packets, int count);
+
+/**
+ * @brief read the datagrams already waiting on the socket, without blocking
+ * @return datagrams received, 0 if none was waiting, -1 on error
+ */
+int udp_socket_recvmmsg(UdpSocket *udp_socket, UdpPacket *packets, int count);
+
 int udp_socket_add_multicast_group(UdpSocket *udp_socket, Address *mcast_addr);
 
 int tcp_socket_open(TcpSocket *tcp_socket, int family);
@@ -35,4 +61,11 @@ int tcp_socket_send(TcpSocket *tcp_socket, const uint8_t *buf, int len);
 
 int tcp_socket_recv(TcpSocket *tcp_socket, uint8_t *buf, int len);
 
+/**
+ * @brief disable Nagle and enlarge the send buffer, for media carried over the stream
+ * @param[in] sndbuf send buffer size in bytes, 0 to keep the default
+ * @return 0 on success, -1 if Nagle could not be disabled
+ */
+int tcp_socket_set_low_latency(TcpSocket *tcp_socket, int sndbuf);
+
 #endif // SOCKET_H_
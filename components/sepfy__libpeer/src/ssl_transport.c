@@ -22,13 +22,15 @@ static int ssl_transport_mbedlts_send(void *ctx, const uint8_t *buf, size_t len)
   return tcp_socket_send((TcpSocket*)ctx, buf, len);
 }
 
-int ssl_transport_connect(NetworkContext_t *net_ctx,
+static int ssl_transport_open(NetworkContext_t *net_ctx,
  const char *host, uint16_t port, const char *cacert) {
 
   const char *pers = "ssl_client";
   int ret;
   Address resolved_addr;
 
+  net_ctx->tcp_socket.fd = -1;
+  net_ctx->initialized = 1;
   mbedtls_ssl_init(&net_ctx->ssl);
   mbedtls_ssl_config_init(&net_ctx->conf);
   //mbedtls_x509_crt_init(&net_ctx->cacert);
@@ -87,6 +89,7 @@ int ssl_transport_connect(NetworkContext_t *net_ctx,
   while ((ret = mbedtls_ssl_handshake(&net_ctx->ssl)) != 0) {
     if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
       LOGE("ssl handshake error: -0x%x", (unsigned int) -ret);
+      return -1;
     }
   }
 
@@ -95,8 +98,26 @@ int ssl_transport_connect(NetworkContext_t *net_ctx,
   return 0;
 }
 
+int ssl_transport_connect(NetworkContext_t *net_ctx,
+ const char *host, uint16_t port, const char *cacert) {
+
+  // a failed attempt gives back its socket and TLS state, callers retry
+  if (ssl_transport_open(net_ctx, host, port, cacert) < 0) {
+    ssl_transport_disconnect(net_ctx);
+    return -1;
+  }
+
+  return 0;
+}
+
 void ssl_transport_disconnect(NetworkContext_t *net_ctx) {
 
+  // already released, e.g. by the failed ssl_transport_connect
+  if (!net_ctx->initialized) {
+    return;
+  }
+  net_ctx->initialized = 0;
+
   mbedtls_ssl_config_free(&net_ctx->conf);
   //mbedtls_x509_crt_free(&net_ctx->cacert);
   mbedtls_ctr_drbg_free(&net_ctx->ctr_drbg);
@@ -122,7 +143,8 @@ int ssl_transport_send(NetworkContext_t *net_ctx, const void *buf, size_t len) {
   while ((ret = mbedtls_ssl_write(&net_ctx->ssl, buf, len)) <= 0) {
 
     if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-      LOGE("");
+      LOGE("ssl write error: -0x%x", (unsigned int) -ret);
+      return -1;
     }
   }
 
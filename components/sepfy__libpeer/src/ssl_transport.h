@@ -17,6 +17,7 @@ struct NetworkContext {
   mbedtls_ctr_drbg_context ctr_drbg;
   mbedtls_ssl_config conf;
   mbedtls_x509_crt cacert;
+  int initialized; // mbedtls contexts are live, cleared by ssl_transport_disconnect
 };
 
 int ssl_transport_connect(NetworkContext_t *net_ctx,
@@ -67,11 +67,18 @@ void stun_set_mapped_address(char *value, uint8_t *mask, Address *addr) {
   uint16_t *port = (uint16_t *)(value + 2);
   uint8_t *ipv4 = (uint8_t *)(value + 4);
 
+  value[0] = 0x00;
   *family = 0x01;
   *port = htons(addr->port);
 
   memcpy(ipv4, &addr->sin.sin_addr, 4);
 
+  // XOR-MAPPED-ADDRESS and XOR-PEER-ADDRESS
+  if (mask) {
+    *port ^= *(uint16_t *)mask;
+    *(uint32_t *)ipv4 ^= *(uint32_t *)mask;
+  }
+
   //LOGD("XOR Mapped Address Family: 0x%02x", *family);
   //LOGD("XOR Mapped Address Port: %d", *port);
   //LOGD("XOR Mapped Address Address: %d.%d.%d.%d", ipv4[0], ipv4[1], ipv4[2], ipv4[3]);
@@ -123,12 +130,8 @@ void stun_parse_msg_buf(StunMessage *msg) {
     msg->stunclass = STUN_CLASS_REQUEST;
   }
 
-  msg->stunmethod = ntohs(header->type) & 0x0FFF;
-  if ((msg->stunmethod & STUN_METHOD_ALLOCATE) == STUN_METHOD_ALLOCATE) {
-    msg->stunmethod = STUN_METHOD_ALLOCATE;
-  } else if ((msg->stunmethod & STUN_METHOD_BINDING) == STUN_METHOD_BINDING) {
-    msg->stunmethod = STUN_METHOD_BINDING;
-  }
+  // the class bits are interleaved with the method bits
+  msg->stunmethod = ntohs(header->type) & 0x3EEF;
 
   while (pos < length) {
 
@@ -148,15 +151,9 @@ void stun_parse_msg_buf(StunMessage *msg) {
         break;
       case STUN_ATTR_TYPE_MESSAGE_INTEGRITY:
         memcpy(msg->message_integrity, attr->value, ntohs(attr->length));
-
-        char message_integrity_hex[41];
-
-        for (int i = 0; i < 20; i++) {
-          sprintf(message_integrity_hex + 2*i, "%02x", (uint8_t)msg->message_integrity[i]);
-        }
-
         break;
       case STUN_ATTR_TYPE_LIFETIME:
+        msg->lifetime = ntohl(*(uint32_t *)attr->value);
         break;
       case STUN_ATTR_TYPE_REALM:
         memset(msg->realm, 0, sizeof(msg->realm));
@@ -174,6 +171,14 @@ void stun_parse_msg_buf(StunMessage *msg) {
         LOGD("XOR Relayed Address");
         stun_get_mapped_address(attr->value, mask, &msg->relayed_addr);
         break;
+      case STUN_ATTR_TYPE_XOR_PEER_ADDRESS:
+        *((uint32_t *)mask) = htonl(MAGIC_COOKIE);
+        memcpy(mask + 4, header->transaction_id, sizeof(header->transaction_id));
+        stun_get_mapped_address(attr->value, mask, &msg->peer_addr);
+        break;
+      case STUN_ATTR_TYPE_CHANNEL_NUMBER:
+      case STUN_ATTR_TYPE_DATA:
+        break;
       case STUN_ATTR_TYPE_XOR_MAPPED_ADDRESS:
         *((uint32_t *)mask) = htonl(MAGIC_COOKIE);
         memcpy(mask + 4, header->transaction_id, sizeof(header->transaction_id));
@@ -199,6 +204,7 @@ void stun_parse_msg_buf(StunMessage *msg) {
           uint8_t class_val = attr->value[2];
           uint8_t number = attr->value[3];
           uint16_t error_code = class_val * 100 + number;
+          msg->error_code = error_code;
           
           // If there's a reason phrase, extract it
           char reason[128] = {0};
@@ -339,34 +345,73 @@ int stun_msg_write_attr(StunMessage *msg, StunAttrType type, uint16_t length, ch
   return 0;
 }
 
-int stun_msg_finish(StunMessage *msg, StunCredential credential, const char *password, size_t password_len) {
+void stun_key_init(StunKey *key, const char *password, size_t len) {
+
+  unsigned char block[64];
+  unsigned char hash[20];
+  int i;
+
+  // RFC 2104, a key longer than the block is hashed first
+  if (len > sizeof(block)) {
+    mbedtls_sha1((const unsigned char *)password, len, hash);
+    password = (const char *)hash;
+    len = sizeof(hash);
+  }
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, password, len);
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] ^= 0x36;
+  }
+  mbedtls_sha1_init(&key->inner);
+  mbedtls_sha1_starts(&key->inner);
+  mbedtls_sha1_update(&key->inner, block, sizeof(block));
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] ^= 0x36 ^ 0x5c;
+  }
+  mbedtls_sha1_init(&key->outer);
+  mbedtls_sha1_starts(&key->outer);
+  mbedtls_sha1_update(&key->outer, block, sizeof(block));
+}
+
+void stun_key_free(StunKey *key) {
+
+  mbedtls_sha1_free(&key->inner);
+  mbedtls_sha1_free(&key->outer);
+}
+
+// The header is passed apart from the attributes, so a validator can use a
+// copy with the length MESSAGE-INTEGRITY was computed with
+static void stun_key_hmac(StunKey *key, const uint8_t *header, const uint8_t *attrs, size_t len, uint8_t *mac) {
+
+  mbedtls_sha1_context ctx;
+  unsigned char inner[20];
+
+  mbedtls_sha1_init(&ctx);
+  mbedtls_sha1_clone(&ctx, &key->inner);
+  mbedtls_sha1_update(&ctx, header, sizeof(StunHeader));
+  mbedtls_sha1_update(&ctx, attrs, len);
+  mbedtls_sha1_finish(&ctx, inner);
+
+  mbedtls_sha1_clone(&ctx, &key->outer);
+  mbedtls_sha1_update(&ctx, inner, sizeof(inner));
+  mbedtls_sha1_finish(&ctx, mac);
+  mbedtls_sha1_free(&ctx);
+}
+
+int stun_msg_finish_key(StunMessage *msg, StunKey *key) {
 
   StunHeader *header = (StunHeader *)msg->buf;
   StunAttribute *stun_attr;
-  
   uint16_t header_length = ntohs(header->length);
-  char key[256];
-  char hash_key[17];
-  memset(key, 0, sizeof(key));
-  memset(hash_key, 0, sizeof(hash_key));
-
-  switch (credential) {
-    case STUN_CREDENTIAL_LONG_TERM:
-      snprintf(key, sizeof(key), "%s:%s:%s", msg->username, msg->realm, password);
-      LOGD("key: %s", key);
-      utils_get_md5(key, strlen(key), (unsigned char*)hash_key);
-      password = hash_key;
-      password_len = 16;
-      break;
-    default:
-      break;
-  }
 
   stun_attr = (StunAttribute*)(msg->buf + msg->size);
   header->length = htons(header_length + 24); /* HMAC-SHA1 */
   stun_attr->type = htons(STUN_ATTR_TYPE_MESSAGE_INTEGRITY);
   stun_attr->length = htons(20);
-  utils_get_hmac_sha1((char*)msg->buf, msg->size, password, password_len, (unsigned char*)stun_attr->value);
+  stun_key_hmac(key, msg->buf, msg->buf + sizeof(StunHeader), msg->size - sizeof(StunHeader), (uint8_t *)stun_attr->value);
   msg->size += sizeof(StunAttribute) + 20;
   // FINGERPRINT
 
@@ -379,6 +424,32 @@ int stun_msg_finish(StunMessage *msg, StunCredential credential, const char *pas
   return 0;
 }
 
+int stun_msg_finish(StunMessage *msg, StunCredential credential, const char *password, size_t password_len) {
+
+  StunKey key;
+  char buf[256];
+  char hash_key[17];
+  memset(buf, 0, sizeof(buf));
+  memset(hash_key, 0, sizeof(hash_key));
+
+  switch (credential) {
+    case STUN_CREDENTIAL_LONG_TERM:
+      snprintf(buf, sizeof(buf), "%s:%s:%s", msg->username, msg->realm, password);
+      LOGD("key: %s", buf);
+      utils_get_md5(buf, strlen(buf), (unsigned char*)hash_key);
+      password = hash_key;
+      password_len = 16;
+      break;
+    default:
+      break;
+  }
+
+  stun_key_init(&key, password, password_len);
+  stun_msg_finish_key(msg, &key);
+  stun_key_free(&key);
+  return 0;
+}
+
 int stun_probe(uint8_t *buf, size_t size) {
 
   StunHeader *header;
@@ -395,6 +466,35 @@ int stun_probe(uint8_t *buf, size_t size) {
   return 0;
 }
 
+uint8_t *stun_msg_find_attr(uint8_t *buf, size_t size, StunAttrType type, uint16_t *length) {
+
+  StunHeader *header = (StunHeader *)buf;
+  StunAttribute *attr;
+  size_t pos = sizeof(StunHeader);
+  size_t end = sizeof(StunHeader) + ntohs(header->length);
+
+  if (end > size) {
+    return NULL;
+  }
+
+  while (pos + sizeof(StunAttribute) <= end) {
+
+    attr = (StunAttribute *)(buf + pos);
+    if (pos + sizeof(StunAttribute) + ntohs(attr->length) > end) {
+      break;
+    }
+
+    if (ntohs(attr->type) == type) {
+      *length = ntohs(attr->length);
+      return (uint8_t *)attr->value;
+    }
+
+    pos += 4*((ntohs(attr->length) + 3)/4) + sizeof(StunAttribute);
+  }
+
+  return NULL;
+}
+
 #if 0
 StunMsgType stun_is_stun_msg(uint8_t *buf, size_t size) {
 
@@ -428,48 +528,204 @@ StunMsgType stun_is_stun_msg(uint8_t *buf, size_t size) {
   return 0;
 }
 #endif
-int stun_msg_is_valid(uint8_t *buf, size_t size, char *password) {
+int stun_view_parse(StunView *view, uint8_t *buf, size_t size) {
+
+  StunHeader *header = (StunHeader *)buf;
+  StunAttribute *attr;
+  size_t pos = sizeof(StunHeader);
+  size_t end;
+  uint16_t type;
+  uint16_t length;
+  uint16_t value;
+
+  memset(view, 0, sizeof(StunView));
+
+  // the two top bits of a STUN message are zero, RFC 5389 6
+  if (size < sizeof(StunHeader) || (buf[0] & 0xc0) || header->magic_cookie != htonl(MAGIC_COOKIE)) {
+    return -1;
+  }
 
-  StunMessage msg;
+  end = sizeof(StunHeader) + ntohs(header->length);
+  if (end > size || (end & 3)) {
+    return -1;
+  }
 
-  memcpy(msg.buf, buf, size);
+  type = ntohs(header->type);
+  // the class bits are interleaved with the method bits
+  view->stunclass = type & 0x0110;
+  view->stunmethod = type & 0x3EEF;
 
-  stun_parse_msg_buf(&msg); 
+  while (pos + sizeof(StunAttribute) <= end) {
 
-  StunHeader *header = (StunHeader *)msg.buf;
+    attr = (StunAttribute *)(buf + pos);
+    type = ntohs(attr->type);
+    length = ntohs(attr->length);
+    value = pos + sizeof(StunAttribute);
 
-  // FINGERPRINT
-  uint32_t fingerprint = 0;
-  size_t length = size - 4 - sizeof(StunAttribute);
-  stun_calculate_fingerprint((char*)msg.buf, length, &fingerprint);
-  //LOGD("Fingerprint: 0x%08x", fingerprint);
+    if (value + length > end) {
+      return -1;
+    }
+
+    // nothing but FINGERPRINT counts after MESSAGE-INTEGRITY, RFC 5389 15.4
+    if (view->message_integrity && type != STUN_ATTR_TYPE_FINGERPRINT) {
+      pos = value + 4*((length + 3)/4);
+      continue;
+    }
+
+    switch (type) {
+      case STUN_ATTR_TYPE_USERNAME:
+        view->username = value;
+        view->username_length = length;
+        break;
+      case STUN_ATTR_TYPE_PRIORITY:
+        view->priority = length == 4 ? value : 0;
+        break;
+      case STUN_ATTR_TYPE_USE_CANDIDATE:
+        view->use_candidate = value;
+        break;
+      case STUN_ATTR_TYPE_ICE_CONTROLLED:
+        view->ice_controlled = length == 8 ? value : 0;
+        break;
+      case STUN_ATTR_TYPE_ICE_CONTROLLING:
+        view->ice_controlling = length == 8 ? value : 0;
+        break;
+      case STUN_ATTR_TYPE_ERROR_CODE:
+        view->error_code = length >= 4 ? value : 0;
+        break;
+      case STUN_ATTR_TYPE_XOR_MAPPED_ADDRESS:
+        view->xor_mapped_address = value;
+        break;
+      case STUN_ATTR_TYPE_MESSAGE_INTEGRITY:
+        if (length != 20) {
+          return -1;
+        }
+        view->message_integrity = value;
+        break;
+      case STUN_ATTR_TYPE_FINGERPRINT:
+        // always the last attribute
+        if (length != 4 || value + length != end) {
+          return -1;
+        }
+        view->fingerprint = value;
+        break;
+      default:
+        break;
+    }
+
+    pos = value + 4*((length + 3)/4);
+  }
+
+  view->buf = buf;
+  view->size = end;
+  return 0;
+}
 
-  if (fingerprint != msg.fingerprint) {
-    //LOGE("Fingerprint does not match.");
+int stun_view_verify(StunView *view, StunKey *key) {
+
+  StunHeader header;
+  uint32_t fingerprint;
+  uint8_t mac[20];
+
+  if (!view->message_integrity || !view->fingerprint) {
     return -1;
-  } else {
-    //LOGD("Fingerprint matches.");
   }
 
-  // MESSAGE-INTEGRITY
-  unsigned char message_integrity_hex[41];
-  unsigned char message_integrity[20];
-  header->length = htons(ntohs(header->length) - 4 - sizeof(StunAttribute));
-  length = length - 20 - sizeof(StunAttribute);
-  utils_get_hmac_sha1((char*)msg.buf, length, password, strlen(password), message_integrity);
-  for (int i = 0; i < 20; i++) {
-    sprintf((char*)&message_integrity_hex[2*i], "%02x", (uint8_t)message_integrity[i]);
+  stun_calculate_fingerprint((char*)view->buf, view->fingerprint - sizeof(StunAttribute), &fingerprint);
+  if (memcmp(&fingerprint, view->buf + view->fingerprint, sizeof(fingerprint)) != 0) {
+    return -1;
   }
 
-  //LOGD("message_integrity: 0x%s", message_integrity_hex);
+  // computed with the length ending at MESSAGE-INTEGRITY
+  memcpy(&header, view->buf, sizeof(StunHeader));
+  header.length = htons(view->message_integrity + 20 - sizeof(StunHeader));
+  stun_key_hmac(key, (uint8_t *)&header, view->buf + sizeof(StunHeader),
+   view->message_integrity - sizeof(StunAttribute) - sizeof(StunHeader), mac);
 
-  if (memcmp(message_integrity, msg.message_integrity, 20) != 0) {
-    //LOGE("Message Integrity does not match.");
-    return -1;
+  return memcmp(mac, view->buf + view->message_integrity, sizeof(mac)) == 0 ? 0 : -1;
+}
+
+int stun_view_error_code(StunView *view) {
+
+  if (!view->error_code) {
+    return 0;
+  }
+
+  return (view->buf[view->error_code + 2] & 0x07) * 100 + view->buf[view->error_code + 3];
+}
+
+int stun_binding_response(uint8_t *buf, const uint32_t *transaction_id, Address *addr, StunKey *key) {
+
+  // everything but the transaction ID, the address and the two checksums is the same in every response
+  static const uint8_t header_template[] = {
+    0x01, 0x01, 0x00, 0x00, 0x21, 0x12, 0xa4, 0x42,
+  };
+  StunHeader *header = (StunHeader *)buf;
+  uint8_t *value = buf + sizeof(StunHeader) + sizeof(StunAttribute);
+  uint8_t mask[16];
+  uint16_t port = htons(addr->port);
+  int length = addr->family == AF_INET6 ? 20 : 8;
+  int size;
+  int i;
+
+  memcpy(buf, header_template, sizeof(header_template));
+  memcpy(header->transaction_id, transaction_id, sizeof(header->transaction_id));
+
+  memcpy(mask, &header->magic_cookie, 4);
+  memcpy(mask + 4, header->transaction_id, sizeof(header->transaction_id));
+
+  buf[20] = STUN_ATTR_TYPE_XOR_MAPPED_ADDRESS >> 8;
+  buf[21] = STUN_ATTR_TYPE_XOR_MAPPED_ADDRESS & 0xff;
+  buf[22] = 0x00;
+  buf[23] = length;
+  value[0] = 0x00;
+  value[1] = addr->family == AF_INET6 ? 0x02 : 0x01;
+  memcpy(value + 2, &port, 2);
+  if (addr->family == AF_INET6) {
+    memcpy(value + 4, &addr->sin6.sin6_addr, 16);
   } else {
-    //LOGD("Message Integrity matches.");
+    memcpy(value + 4, &addr->sin.sin_addr, 4);
   }
 
-  return 0;
+  value[2] ^= mask[0];
+  value[3] ^= mask[1];
+  for (i = 0; i < length - 4; i++) {
+    value[4 + i] ^= mask[i];
+  }
+
+  size = sizeof(StunHeader) + sizeof(StunAttribute) + length;
+
+  // MESSAGE-INTEGRITY over a length that already counts it
+  header->length = htons(size - sizeof(StunHeader) + 24);
+  buf[size] = STUN_ATTR_TYPE_MESSAGE_INTEGRITY >> 8;
+  buf[size + 1] = STUN_ATTR_TYPE_MESSAGE_INTEGRITY & 0xff;
+  buf[size + 2] = 0x00;
+  buf[size + 3] = 20;
+  stun_key_hmac(key, buf, buf + sizeof(StunHeader), size - sizeof(StunHeader), buf + size + sizeof(StunAttribute));
+  size += 24;
+
+  header->length = htons(size - sizeof(StunHeader) + 8);
+  buf[size] = STUN_ATTR_TYPE_FINGERPRINT >> 8;
+  buf[size + 1] = STUN_ATTR_TYPE_FINGERPRINT & 0xff;
+  buf[size + 2] = 0x00;
+  buf[size + 3] = 4;
+  stun_calculate_fingerprint((char*)buf, size, (uint32_t*)(buf + size + sizeof(StunAttribute)));
+  size += 8;
+
+  return size;
 }
 
+int stun_msg_is_valid(uint8_t *buf, size_t size, char *password) {
+
+  StunView view;
+  StunKey key;
+  int ret;
+
+  if (stun_view_parse(&view, buf, size) != 0) {
+    return -1;
+  }
+
+  stun_key_init(&key, password, strlen(password));
+  ret = stun_view_verify(&view, &key);
+  stun_key_free(&key);
+  return ret;
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mbedtls/sha1.h"
+
 #include "address.h"
 
 typedef struct StunHeader StunHeader;
@@ -16,6 +18,8 @@ typedef struct StunMessage StunMessage;
 #define STUN_ATTR_BUF_SIZE 256
 #define MAGIC_COOKIE 0x2112A442
 #define STUN_FINGERPRINT_XOR 0x5354554e
+// header, XOR-MAPPED-ADDRESS of an IPv6 address, MESSAGE-INTEGRITY and FINGERPRINT
+#define STUN_BINDING_RESPONSE_MAX_SIZE (20 + 24 + 24 + 8)
   
 typedef enum StunClass {
   
@@ -30,6 +34,11 @@ typedef enum StunMethod {
 
   STUN_METHOD_BINDING = 0x0001,
   STUN_METHOD_ALLOCATE = 0x0003,
+  STUN_METHOD_REFRESH = 0x0004,
+  STUN_METHOD_SEND = 0x0006,
+  STUN_METHOD_DATA = 0x0007,
+  STUN_METHOD_CREATE_PERMISSION = 0x0008,
+  STUN_METHOD_CHANNEL_BIND = 0x0009,
 
 } StunMethod;
 
@@ -39,7 +48,10 @@ typedef enum StunAttrType {
   STUN_ATTR_TYPE_USERNAME = 0x0006,
   STUN_ATTR_TYPE_MESSAGE_INTEGRITY = 0x0008,
   STUN_ATTR_TYPE_ERROR_CODE = 0x0009,  // Added ERROR_CODE attribute
+  STUN_ATTR_TYPE_CHANNEL_NUMBER = 0x000c,
   STUN_ATTR_TYPE_LIFETIME = 0x000d,
+  STUN_ATTR_TYPE_XOR_PEER_ADDRESS = 0x0012,
+  STUN_ATTR_TYPE_DATA = 0x0013,
   STUN_ATTR_TYPE_REALM = 0x0014,
   STUN_ATTR_TYPE_NONCE = 0x0015,
   STUN_ATTR_TYPE_XOR_RELAYED_ADDRESS = 0x0016,
@@ -87,13 +99,47 @@ struct StunMessage {
   char username[128];
   char realm[64];
   char nonce[64];
+  uint32_t lifetime;
+  int error_code;
   Address mapped_addr;
   Address relayed_addr;
+  Address peer_addr;
   uint8_t buf[STUN_ATTR_BUF_SIZE];
   size_t size;
 
 };  
 
+// A received message parsed in place, the offsets of the attribute values
+// in buf, 0 when the message has no such attribute
+typedef struct StunView {
+
+  uint8_t *buf;
+  size_t size;
+  StunClass stunclass;
+  StunMethod stunmethod;
+
+  uint16_t username;
+  uint16_t username_length;
+  uint16_t priority;
+  uint16_t use_candidate;
+  uint16_t ice_controlled;
+  uint16_t ice_controlling;
+  uint16_t error_code;
+  uint16_t xor_mapped_address;
+  uint16_t message_integrity;
+  uint16_t fingerprint;
+
+} StunView;
+
+// HMAC-SHA1 with the key already absorbed, the inner and outer hash states
+// after the padded key block
+typedef struct StunKey {
+
+  mbedtls_sha1_context inner;
+  mbedtls_sha1_context outer;
+
+} StunKey;
+
 void stun_msg_create(StunMessage *msg, uint16_t type);
 
 void stun_set_mapped_address(char *value, uint8_t *mask, Address *addr);
@@ -112,8 +158,51 @@ int stun_msg_write_attr(StunMessage *msg, StunAttrType type, uint16_t length, ch
 
 int stun_probe(uint8_t *buf, size_t size);
 
+/**
+ * @brief find an attribute of a received message in place
+ * @param[out] length of the attribute value
+ * @return the attribute value, NULL if the message has none
+ */
+uint8_t *stun_msg_find_attr(uint8_t *buf, size_t size, StunAttrType type, uint16_t *length);
+
 int stun_msg_is_valid(uint8_t *buf, size_t len, char *password);
 
 int stun_msg_finish(StunMessage *msg, StunCredential credential, const char *password, size_t password_len);
 
+/**
+ * @brief add MESSAGE-INTEGRITY and FINGERPRINT with a precomputed key
+ */
+int stun_msg_finish_key(StunMessage *msg, StunKey *key);
+
+/**
+ * @brief precompute the HMAC-SHA1 state of a key, e.g. a short-term ICE password
+ */
+void stun_key_init(StunKey *key, const char *password, size_t len);
+
+void stun_key_free(StunKey *key);
+
+/**
+ * @brief parse a message in the receive buffer without copying it
+ * @return 0 on success, -1 if it is not a well-formed STUN message
+ */
+int stun_view_parse(StunView *view, uint8_t *buf, size_t size);
+
+/**
+ * @brief check FINGERPRINT and MESSAGE-INTEGRITY of a parsed message, the buffer is left as is
+ * @return 0 if both are present and match, -1 otherwise
+ */
+int stun_view_verify(StunView *view, StunKey *key);
+
+/**
+ * @return the code of the ERROR-CODE attribute, 0 if there is none
+ */
+int stun_view_error_code(StunView *view);
+
+/**
+ * @brief write a Binding success response with XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY and FINGERPRINT
+ * @param[out] buf at least STUN_BINDING_RESPONSE_MAX_SIZE bytes
+ * @return size of the response
+ */
+int stun_binding_response(uint8_t *buf, const uint32_t *transaction_id, Address *addr, StunKey *key);
+
 #endif // STUN_H_
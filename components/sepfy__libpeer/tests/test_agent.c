@@ -9,6 +9,7 @@ void test_turn(Agent *agent, char *turnserver, char *username, char *credential)
   char description[1024];
   memset(&description, 0, sizeof(description));
   agent_gather_candidate(agent, turnserver, username, credential);
+  while (agent_gather_wait(agent, 1000) > 0);
   agent_get_local_description(agent, description, sizeof(description));
   printf("turn server: %s\n", turnserver);
   printf("sdp: %s\n", description);
@@ -19,6 +20,7 @@ void test_stun(Agent *agent, char *stunserver) {
   char description[1024];
   memset(&description, 0, sizeof(description));
   agent_gather_candidate(agent, stunserver, NULL, NULL);
+  while (agent_gather_wait(agent, 1000) > 0);
   agent_get_local_description(agent, description, sizeof(description));
   printf("stun server: %s\n", stunserver);
   printf("sdp: %s\n", description);
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pacer.h"
+
+#define RECORD_SIZE 1230 // an SCTP packet of SCTP_MTU in a DTLS record
+#define RECORD_DTLS 3 // flags as peer_connection queues a DTLS record
+#define RECORD_RTCP 2
+#define START_TIME 100000
+
+typedef struct SentLog {
+
+  int packets;
+  int bytes;
+  int first_flags;
+  uint32_t next_seq;
+  int corrupted;
+
+} SentLog;
+
+static void fill_record(uint8_t *buf, uint32_t seq) {
+
+  memcpy(buf, &seq, sizeof(seq));
+  memset(buf + sizeof(seq), (uint8_t)seq, RECORD_SIZE - sizeof(seq));
+}
+
+static void on_send(uint8_t *buf, int len, int flags, void *user_data) {
+
+  SentLog *log = (SentLog*)user_data;
+  uint32_t seq;
+
+  if (log->packets == 0) {
+    log->first_flags = flags;
+  }
+
+  log->packets++;
+  log->bytes += len;
+
+  if (flags != RECORD_DTLS) {
+    return;
+  }
+
+  // records of a data channel message have to leave whole and in order
+  memcpy(&seq, buf, sizeof(seq));
+  if (len != RECORD_SIZE || seq != log->next_seq || buf[len - 1] != (uint8_t)seq) {
+    log->corrupted = 1;
+  }
+  log->next_seq++;
+}
+
+static int queue_message(Pacer *pacer, uint32_t first_seq, int records, uint32_t now) {
+
+  uint8_t record[RECORD_SIZE];
+
+  for (int i = 0; i < records; i++) {
+
+    fill_record(record, first_seq + i);
+    if (pacer_enqueue(pacer, PACER_PRIORITY_MEDIA, record, RECORD_SIZE, RECORD_DTLS, now) != RECORD_SIZE) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// runs the pacer the way the peer connection loop does, waking up when
+// pacer_timeout says, and returns the ms until the media queue was empty
+static int drain(Pacer *pacer, SentLog *log, uint32_t *now) {
+
+  uint32_t start = *now;
+  int timeout;
+
+  while (pacer->stats.queued_packets[PACER_PRIORITY_MEDIA] > 0) {
+
+    pacer_process(pacer, *now, on_send, log);
+
+    if ((timeout = pacer_timeout(pacer, *now)) < 0) {
+      break;
+    }
+    *now += timeout > 0 ? timeout : 1;
+  }
+
+  return *now - start;
+}
+
+// a 30 KB frame on the data channel, paced at the rate RTCP gave
+static int test_datachannel_frame() {
+
+  Pacer pacer;
+  SentLog log;
+  uint32_t now = START_TIME;
+  int records = 25;
+  int expected = records * RECORD_SIZE * 8 / 1000; // ms at 1 Mbps
+  int elapsed;
+
+  memset(&log, 0, sizeof(log));
+  pacer_init(&pacer, 1000000);
+
+  if (queue_message(&pacer, 0, records, now) != 0) {
+    printf("datachannel: enqueue failed\n");
+    return -1;
+  }
+
+  // not the whole frame at once, at most the burst budget and the packet paying it off
+  pacer_process(&pacer, now, on_send, &log);
+  if (log.bytes > 1000000 / 8 * PACER_BURST_MS / 1000 + 2 * RECORD_SIZE) {
+    printf("datachannel: burst of %d bytes\n", log.bytes);
+    return -1;
+  }
+
+  elapsed = drain(&pacer, &log, &now);
+
+  if (log.packets != records || log.corrupted) {
+    printf("datachannel: %d of %d records, corrupted %d\n", log.packets, records, log.corrupted);
+    return -1;
+  }
+
+  if (elapsed < expected - PACER_BURST_MS - 10 || elapsed > expected + 10) {
+    printf("datachannel: drained in %d ms, expected about %d\n", elapsed, expected);
+    return -1;
+  }
+
+  pacer_deinit(&pacer);
+  return 0;
+}
+
+// RTCP queued behind a frame leaves first, without waiting for budget
+static int test_control_first() {
+
+  Pacer pacer;
+  SentLog log;
+  uint8_t rtcp[64] = {0};
+  uint32_t now = START_TIME;
+
+  memset(&log, 0, sizeof(log));
+  pacer_init(&pacer, 300000);
+  queue_message(&pacer, 0, 10, now);
+
+  // spend the burst budget
+  pacer_process(&pacer, now, on_send, &log);
+  memset(&log, 0, sizeof(log));
+  log.next_seq = 10 - pacer.stats.queued_packets[PACER_PRIORITY_MEDIA];
+
+  pacer_enqueue(&pacer, PACER_PRIORITY_CONTROL, rtcp, sizeof(rtcp), RECORD_RTCP, now);
+
+  if (pacer_timeout(&pacer, now) != 0 || pacer_process(&pacer, now, on_send, &log) != 1 || log.first_flags != RECORD_RTCP) {
+    printf("control: RTCP held back behind the data channel\n");
+    return -1;
+  }
+
+  pacer_deinit(&pacer);
+  return 0;
+}
+
+// a low estimate must not let records wait much longer than PACER_MAX_QUEUE_TIME
+static int test_queue_bound() {
+
+  Pacer pacer;
+  SentLog log;
+  PacerStats stats;
+  uint32_t now = START_TIME;
+  int records = 60; // ~74 KB, 12 s at 50 kbps
+
+  memset(&log, 0, sizeof(log));
+  pacer_init(&pacer, 50000);
+  queue_message(&pacer, 0, records, now);
+
+  drain(&pacer, &log, &now);
+  pacer_get_stats(&pacer, &stats);
+
+  if (log.packets != records || log.corrupted || stats.max_delay > PACER_MAX_QUEUE_TIME + 50) {
+    printf("queue bound: %d records, max delay %d ms\n", log.packets, (int)stats.max_delay);
+    return -1;
+  }
+
+  pacer_deinit(&pacer);
+  return 0;
+}
+
+// a new estimate applies to what is already queued
+static int test_rate_update() {
+
+  Pacer pacer;
+  SentLog log;
+  uint32_t now = START_TIME;
+  int records = 40;
+  int slow;
+
+  memset(&log, 0, sizeof(log));
+  pacer_init(&pacer, 400000);
+  queue_message(&pacer, 0, records, now);
+
+  // half a second at the first rate
+  while (now < START_TIME + 500) {
+    pacer_process(&pacer, now, on_send, &log);
+    now += 10;
+  }
+  slow = log.packets;
+
+  pacer_set_rate(&pacer, 2000000);
+  drain(&pacer, &log, &now);
+
+  if (log.packets != records || log.corrupted || now - START_TIME > 500 + (records - slow) * RECORD_SIZE * 8 / 2000 + 20) {
+    printf("rate update: %d records, done after %d ms\n", log.packets, (int)(now - START_TIME));
+    return -1;
+  }
+
+  pacer_deinit(&pacer);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (test_datachannel_frame() != 0 || test_control_first() != 0
+   || test_queue_bound() != 0 || test_rate_update() != 0) {
+    return 1;
+  }
+
+  printf("test success\n");
+  return 0;
+}
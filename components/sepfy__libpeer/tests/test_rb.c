@@ -3,78 +3,149 @@
 #include <unistd.h>
 #include "buffer.h"
 
-#define MTU 800
-int g_data_length[8] = {100, 200, 300, 400, 500, 600, 700, 800};
-int g_testing = 1;
+#define RB_SIZE 2000
+#define MAX_RECORD 800
+#define RECORDS 200000
 
-int check_data(uint8_t *data, int length) {
+// payload derived from the record number, so a torn or reordered record shows up
+void fill_data(uint8_t *data, int length, uint32_t seq) {
 
-  int sum = 0;
-  int value = length*(length/100 + '0');
+  memcpy(data, &seq, sizeof(seq));
 
-  for (int i = 0; i < length; i++) {
+  for (int i = sizeof(seq); i < length; i++) {
 
-    sum += data[i];
+    data[i] = (uint8_t)(seq * 31 + i);
   }
+}
+
+int check_data(uint8_t *data, int length, uint32_t seq) {
+
+  uint32_t value;
+
+  if (((uintptr_t)data & 3) != 0) {
+
+    printf("record %u not aligned\n", seq);
+    return 0;
+  }
+
+  memcpy(&value, data, sizeof(value));
+  if (value != seq) {
+
+    printf("record %u out of order, got %u\n", seq, value);
+    return 0;
+  }
+
+  for (int i = sizeof(seq); i < length; i++) {
 
-  printf("sum: %d, value: %d\n", sum, value);
-  return sum == value;
+    if (data[i] != (uint8_t)(seq * 31 + i)) {
+
+      printf("record %u corrupted at %d\n", seq, i);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int record_length(uint32_t seq) {
+
+  // the consumer recomputes the same sequence of lengths
+  return sizeof(uint32_t) + (seq * 2654435761u >> 7) % (MAX_RECORD - sizeof(uint32_t));
 }
 
 void* test_thread(void* arg) {
 
   Buffer *rb = (Buffer*) arg;
-
+  uint32_t seq = 0;
   int size = 0;
-
   uint8_t *data = NULL;
 
-  while (g_testing) {
+  while (seq < RECORDS) {
 
-    data = buffer_peak_head(rb, &size);
+    data = buffer_peek(rb, &size);
 
     if (data) {
 
-      if (check_data(data, size) == 0) {
+      if (size != record_length(seq) || check_data(data, size, seq) == 0) {
 
-        printf("data error\n");
+        printf("data error, record %u size %d\n", seq, size);
         exit(1);
       }
 
-      buffer_pop_head(rb);
+      buffer_release(rb);
+      seq++;
 
-    } else {
+    } else if (rand() % 4 == 0) {
 
-      usleep(1000);
+      usleep(1);
     }
-
   }
 
   return NULL;
 }
 
-
 int main(int argc, char *argv[]) {
 
-  Buffer *rb = buffer_new(2000);
+  Buffer *rb = buffer_new(RB_SIZE, 0);
   pthread_t thread;
+  uint8_t *data;
+  uint8_t record[MAX_RECORD];
+  uint32_t seq = 0;
+  int length;
+
+  srand(1);
+
+  if (buffer_push(rb, record, RB_SIZE) != -1 || rb->overflows != 1) {
+
+    printf("oversized record accepted\n");
+    return 1;
+  }
 
   pthread_create(&thread, NULL, test_thread, rb);
 
-  uint8_t data[MTU];
+  while (seq < RECORDS) {
+
+    length = record_length(seq);
+
+    if (seq % 2) {
+
+      fill_data(record, length, seq);
+      if (buffer_push(rb, record, length) < 0) {
+        usleep(1);
+        continue;
+      }
+
+    } else {
+
+      // reserve more than needed and commit the real length, like an encoder would
+      if ((data = buffer_reserve(rb, MAX_RECORD)) == NULL && (data = buffer_reserve(rb, length)) == NULL) {
+        usleep(1);
+        continue;
+      }
+
+      fill_data(data, length, seq);
+      buffer_commit(rb, length);
+    }
+
+    if (buffer_used(rb) > RB_SIZE || rb->high_watermark > RB_SIZE) {
 
-  for (int i = 0; i < 8; i++) {
+      printf("used %u exceeds the ring\n", buffer_used(rb));
+      exit(1);
+    }
 
-    memset(data, i + '1', MTU);
-    buffer_push_tail(rb, data, g_data_length[i]); 
-    usleep(1000);
+    seq++;
   }
 
-  usleep(100*1000);
+  pthread_join(thread, NULL);
 
-  g_testing = 0;
+  if (buffer_peek(rb, &length) != NULL) {
+
+    printf("ring not empty\n");
+    return 1;
+  }
 
-  pthread_join(thread, NULL);  
+  printf("high watermark %u/%u, overflows %u\n", rb->high_watermark, rb->size, rb->overflows);
+  buffer_free(rb);
 
   printf("test success\n");
   return 0;
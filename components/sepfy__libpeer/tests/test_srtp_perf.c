@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <srtp2/srtp.h>
+
+#include "rtp.h"
+
+#define PAYLOAD_SIZE 1200
+#define PACKETS 20000
+
+typedef struct SrtpBenchCase {
+
+  const char *name;
+  void (*rtp)(srtp_crypto_policy_t *p);
+  int aead;
+
+} SrtpBenchCase;
+
+static SrtpBenchCase g_cases[] = {
+  { "AES_CM_128_HMAC_SHA1_80", srtp_crypto_policy_set_rtp_default, 0 },
+  { "AEAD_AES_128_GCM", srtp_crypto_policy_set_aes_gcm_128_16_auth, 1 },
+  { "AES_CM_128_NULL_AUTH", srtp_crypto_policy_set_aes_cm_128_null_auth, 0 },
+  { "NULL_CIPHER_HMAC_SHA1_80", srtp_crypto_policy_set_null_cipher_hmac_sha1_80, 0 },
+};
+
+static uint64_t now_us() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Protects PACKETS RTP packets with a 1200-byte payload, the size the video
+// packetizer produces, and reports the cost per packet.
+static int bench(SrtpBenchCase *bench_case) {
+
+  srtp_t session;
+  srtp_policy_t policy;
+  uint8_t key[SRTP_MAX_KEY_LEN];
+  uint8_t packet[sizeof(RtpHeader) + PAYLOAD_SIZE + SRTP_MAX_TRAILER_LEN];
+  RtpHeader *header = (RtpHeader*)packet;
+  uint64_t start, elapsed;
+  int len;
+
+  // libsrtp only has GCM with a crypto backend
+  if (bench_case->aead && srtp_crypto_policy_set_from_profile_for_rtp(&policy.rtp, srtp_profile_aead_aes_128_gcm) != srtp_err_status_ok) {
+    printf("%-26s not built in\n", bench_case->name);
+    return 0;
+  }
+
+  for (int i = 0; i < sizeof(key); i++) {
+    key[i] = rand();
+  }
+
+  memset(&policy, 0, sizeof(policy));
+  bench_case->rtp(&policy.rtp);
+  srtp_crypto_policy_set_rtcp_default(&policy.rtcp);
+  policy.ssrc.type = ssrc_any_outbound;
+  policy.key = key;
+  policy.window_size = 1024;
+
+  if (srtp_create(&session, &policy) != srtp_err_status_ok) {
+    printf("%s: srtp_create failed\n", bench_case->name);
+    return -1;
+  }
+
+  start = now_us();
+
+  for (int i = 0; i < PACKETS; i++) {
+
+    memset(packet, 0, sizeof(RtpHeader));
+    header->version = 2;
+    header->type = PT_JPEG;
+    header->seq_number = htons(i);
+    header->timestamp = htonl(i * 3000);
+    header->ssrc = htonl(SSRC_JPEG);
+    memset(packet + sizeof(RtpHeader), i, PAYLOAD_SIZE);
+
+    len = sizeof(RtpHeader) + PAYLOAD_SIZE;
+    if (srtp_protect(session, packet, &len) != srtp_err_status_ok) {
+      printf("%s: srtp_protect failed at packet %d\n", bench_case->name, i);
+      srtp_dealloc(session);
+      return -1;
+    }
+  }
+
+  elapsed = now_us() - start;
+
+  printf("%-26s %8.2f us/packet %8.1f Mbit/s\n", bench_case->name,
+   (double)elapsed / PACKETS, (double)PACKETS * PAYLOAD_SIZE * 8 / elapsed);
+
+  srtp_dealloc(session);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  if (srtp_init() != srtp_err_status_ok) {
+    printf("srtp_init failed\n");
+    return 1;
+  }
+
+  printf("%d packets, %d bytes payload\n", PACKETS, PAYLOAD_SIZE);
+
+  for (int i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++) {
+
+    if (bench(&g_cases[i]) < 0) {
+      return 1;
+    }
+  }
+
+  srtp_shutdown();
+  printf("test success\n");
+  return 0;
+}
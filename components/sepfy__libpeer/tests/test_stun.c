@@ -4,7 +4,112 @@
 
 #include "stun.h"
 
-int main(int argc, char *argv[]) {
+#define LOCAL_UPWD "dcaa3d9dd0b3a3e2d1a2dfa9"
+#define REMOTE_UPWD "4ZqHtpO6o9m1tdoCVsCVtKfK"
+
+static int test_request() {
+
+  StunMessage msg;
+  StunView view;
+  StunKey key;
+  char username[] = "remote:local";
+
+  stun_msg_create(&msg, STUN_CLASS_REQUEST | STUN_METHOD_BINDING);
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_USERNAME, strlen(username), username);
+  stun_msg_write_attr(&msg, STUN_ATTR_TYPE_USE_CANDIDATE, 0, NULL);
+  stun_msg_finish(&msg, STUN_CREDENTIAL_SHORT_TERM, REMOTE_UPWD, strlen(REMOTE_UPWD));
+
+  if (stun_view_parse(&view, msg.buf, msg.size) != 0) {
+    printf("request: parse failed\n");
+    return -1;
+  }
+
+  if (view.stunclass != STUN_CLASS_REQUEST || view.stunmethod != STUN_METHOD_BINDING
+   || !view.use_candidate || view.username_length != strlen(username)
+   || memcmp(view.buf + view.username, username, strlen(username)) != 0) {
+    printf("request: attributes not found\n");
+    return -1;
+  }
+
+  stun_key_init(&key, REMOTE_UPWD, strlen(REMOTE_UPWD));
+
+  if (stun_view_verify(&view, &key) != 0) {
+    printf("request: verify failed\n");
+    return -1;
+  }
+
+  if (stun_msg_is_valid(msg.buf, msg.size, REMOTE_UPWD) != 0 || stun_msg_is_valid(msg.buf, msg.size, LOCAL_UPWD) == 0) {
+    printf("request: stun_msg_is_valid mismatch\n");
+    return -1;
+  }
+
+  // a changed USERNAME keeps the fingerprint check but not the integrity
+  msg.buf[view.username] ^= 1;
+  stun_calculate_fingerprint((char*)msg.buf, view.fingerprint - 4, (uint32_t*)(msg.buf + view.fingerprint));
+
+  if (stun_view_parse(&view, msg.buf, msg.size) != 0 || stun_view_verify(&view, &key) == 0) {
+    printf("request: tampered message verified\n");
+    return -1;
+  }
+
+  // truncated in the middle of an attribute
+  if (stun_view_parse(&view, msg.buf, msg.size - 2) == 0) {
+    printf("request: truncated message parsed\n");
+    return -1;
+  }
+
+  stun_key_free(&key);
+  return 0;
+}
+
+static int test_response(const char *ip) {
+
+  uint8_t buf[STUN_BINDING_RESPONSE_MAX_SIZE];
+  uint32_t transaction_id[3] = { 0x01020304, 0x05060708, 0x090a0b0c };
+  StunMessage msg;
+  StunView view;
+  StunKey key;
+  Address addr;
+  int size;
+
+  addr_from_string(ip, &addr);
+  addr_set_port(&addr, 50000);
+
+  stun_key_init(&key, LOCAL_UPWD, strlen(LOCAL_UPWD));
+  size = stun_binding_response(buf, transaction_id, &addr, &key);
+
+  if (stun_view_parse(&view, buf, size) != 0 || view.stunclass != STUN_CLASS_RESPONSE
+   || !view.xor_mapped_address || stun_view_verify(&view, &key) != 0) {
+    printf("response %s: parse or verify failed\n", ip);
+    return -1;
+  }
+
+  if (stun_msg_is_valid(buf, size, LOCAL_UPWD) != 0) {
+    printf("response %s: stun_msg_is_valid failed\n", ip);
+    return -1;
+  }
 
+  // decoded by the generic parser
+  memset(&msg, 0, sizeof(msg));
+  memcpy(msg.buf, buf, size);
+  msg.size = size;
+  stun_parse_msg_buf(&msg);
+
+  if (!addr_equal(&msg.mapped_addr, &addr)) {
+    printf("response %s: XOR-MAPPED-ADDRESS mismatch\n", ip);
+    return -1;
+  }
+
+  stun_key_free(&key);
+  return 0;
 }
 
+int main(int argc, char *argv[]) {
+
+  if (test_request() != 0 || test_response("192.168.1.10") != 0 || test_response("2001:db8::10") != 0) {
+    return 1;
+  }
+
+  printf("test success\n");
+  return 0;
+}
@@ -77,6 +77,9 @@ extern srtp_debug_module_t srtp_mod_aes_gcm;
 #ifdef NSS
 extern srtp_debug_module_t srtp_mod_aes_gcm;
 #endif
+#ifdef MBEDTLS
+extern srtp_debug_module_t srtp_mod_aes_gcm;
+#endif
 
 /* debug modules for auth types */
 extern srtp_debug_module_t srtp_mod_hmac;
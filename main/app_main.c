@@ -19,10 +19,16 @@ static const char* TAG = "webrtc";
 static TaskHandle_t xPcTaskHandle = NULL;
 static TaskHandle_t xPsTaskHandle = NULL;
 static TaskHandle_t xCameraTaskHandle = NULL;
+static TaskHandle_t xModemTaskHandle = NULL;
+
+#define MODEM_POLL_INTERVAL_MS 5000
 
 
 extern esp_err_t camera_init();
 extern void camera_task(void* pvParameters);
+extern void camera_send_pending();
+extern void camera_on_bitrate_change(uint32_t bitrate, void* userdata);
+extern void camera_adapt_set_signal(int rssi);
 
 SemaphoreHandle_t xSemaphore = NULL;
 
@@ -30,6 +36,10 @@ PeerConnection* g_pc;
 PeerConnectionState eState = PEER_CONNECTION_CLOSED;
 int gDataChannelOpened = 0;
 
+// A re-dialed PPP session leaves the broker connection dead
+static volatile int s_signaling_joined = 0;
+static volatile int s_signaling_rejoin = 0;
+
 conn_info_t gsm_info = {
   .operator_name = "",
   .rssi = -1,
@@ -38,18 +48,36 @@ conn_info_t gsm_info = {
 static void oniceconnectionstatechange(PeerConnectionState state, void* user_data) {
   ESP_LOGI(TAG, "PeerConnectionState: %d", state);
   eState = state;
-  // not support datachannel close event
-  if (eState != PEER_CONNECTION_COMPLETED) {
+  // not support datachannel close event, an ICE restart passes through NEW with the channel still open
+  if (eState == PEER_CONNECTION_CLOSED || eState == PEER_CONNECTION_FAILED || eState == PEER_CONNECTION_DISCONNECTED) {
     gDataChannelOpened = 0;
   }
 }
 
+// The PPP link came back, the candidates and the TURN allocation of the session are gone with the old one
+static void on_ppp_got_ip(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
+
+  if (s_signaling_joined) {
+    s_signaling_rejoin = 1;
+  }
+
+  if (g_pc && eState != PEER_CONNECTION_CLOSED) {
+    ESP_LOGI(TAG, "PPP got %s address, restarting ICE", event->ip_changed ? "a new" : "its");
+    peer_connection_restart_ice(g_pc);
+  }
+}
+
 static void onmessage(char* msg, size_t len, void* userdata, uint16_t sid) {
   ESP_LOGI(TAG, "Datachannel message: %.*s", len, msg);
 }
 
 void onopen(void* userdata) {
   ESP_LOGI(TAG, "Datachannel opened");
+#if CONFIG_CAMERA_STREAM_DATACHANNEL
+  // a late frame is worthless, let SCTP drop it rather than stall the next ones
+  peer_connection_datachannel_set_policy(g_pc, 0, -1, 500);
+#endif
   gDataChannelOpened = 1;
 }
 
@@ -60,6 +88,24 @@ void peer_signaling_task(void* arg) {
   ESP_LOGI(TAG, "peer_signaling_task started");
 
   for (;;) {
+    if (!s_signaling_joined || s_signaling_rejoin) {
+      // the broker is reachable once the modem task brought PPP up
+      xEventGroupWaitBits(gsm_event_group, PPP_GOT_IP_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+      s_signaling_rejoin = 0;
+
+      if (s_signaling_joined) {
+        ESP_LOGI(TAG, "PPP was re-dialed, joining the signaling channel again");
+        peer_signaling_leave_channel();
+        s_signaling_joined = 0;
+      }
+
+      if (peer_signaling_join_channel() < 0) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        continue;
+      }
+      s_signaling_joined = 1;
+    }
+
     peer_signaling_loop();
 
     vTaskDelay(pdMS_TO_TICKS(10));
@@ -70,17 +116,51 @@ void peer_connection_task(void* arg) {
   ESP_LOGI(TAG, "peer_connection_task started");
 
   for (;;) {
+    // sleep until a datagram, a captured frame or a protocol timer needs us
+    peer_connection_wait(g_pc, 100);
+
     if (xSemaphoreTake(xSemaphore, portMAX_DELAY)) {
       peer_connection_loop(g_pc);
+      camera_send_pending();
       xSemaphoreGive(xSemaphore);
     }
-
-    vTaskDelay(pdMS_TO_TICKS(1));
   }
 }
 
 
 
+// Signal and registration come from the AT port, PPP keeps running meanwhile
+void modem_status_task(void* arg) {
+  int poll = 1;
+  esp_modem_ppp_stats_t ppp;
+
+  ESP_LOGI(TAG, "modem_status_task started");
+
+  for (;;) {
+    xEventGroupWaitBits(gsm_event_group, PPP_GOT_IP_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
+
+    esp_err_t err = poll ? modem_poll_status(&gsm_info) : ESP_ERR_NOT_SUPPORTED;
+
+    if (poll && err == ESP_ERR_NOT_SUPPORTED) {
+      ESP_LOGW(TAG, "No separate AT port, modem status is not polled");
+      poll = 0;
+    }
+
+    if (err == ESP_OK) {
+      camera_adapt_set_signal(gsm_info.rssi);
+    }
+
+    // bytes the HDLC framing stuffed, uplink the video does not get
+    if (esp_modem_get_ppp_stats(dce, &ppp, true) == ESP_OK && ppp.tx_bytes > 0) {
+      ESP_LOGI(TAG, "PPP: out %d bytes, %.1f%% stuffed / in %d bytes, %.1f%% stuffed, rssi %d",
+               (int)ppp.tx_bytes, 100.0f * ppp.tx_escaped / ppp.tx_bytes,
+               (int)ppp.rx_bytes, ppp.rx_bytes ? 100.0f * ppp.rx_escaped / ppp.rx_bytes : 0.0f, gsm_info.rssi);
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(MODEM_POLL_INTERVAL_MS));
+  }
+}
+
 void app_main(void) {
 
   static char deviceid[32] = {0};
@@ -114,6 +194,10 @@ void app_main(void) {
       },
 
       .datachannel = DATA_CHANNEL_BINARY,
+#if CONFIG_CAMERA_STREAM_RTP_MJPEG
+      .video_codec = CODEC_MJPEG,
+      .on_bitrate_change = camera_on_bitrate_change,
+#endif
   };
 
   ESP_LOGI(TAG, "[APP] Startup..");
@@ -125,9 +209,9 @@ void app_main(void) {
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   // ESP_ERROR_CHECK(example_connect());
 
-  modem_init();
-  operator_register(&gsm_info);
-  sim_ppp_connect();
+  // Registration and dialing go on in the modem task, the camera and the
+  // DTLS key and certificate are prepared meanwhile
+  ESP_ERROR_CHECK(modem_start(&gsm_info));
 
   // if (esp_read_mac(mac, ESP_MAC_WIFI_STA) == ESP_OK) {
   //     sprintf(deviceid, "esp32-%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
@@ -143,14 +227,13 @@ void app_main(void) {
   g_pc = peer_connection_create(&config);
   peer_connection_oniceconnectionstatechange(g_pc, oniceconnectionstatechange);
   peer_connection_ondatachannel(g_pc, onmessage, onopen, onclose);
+  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_GOT_IP, &on_ppp_got_ip, NULL));
 
   ServiceConfiguration service_config = SERVICE_CONFIG_DEFAULT();
   service_config.client_id = deviceid;
   service_config.pc = g_pc;
   service_config.mqtt_url = "broker.emqx.io";
   peer_signaling_set_config(&service_config);
-  
-  peer_signaling_join_channel(deviceid, g_pc);
 
   xTaskCreatePinnedToCore(camera_task, "camera", 52768, NULL, 10, &xCameraTaskHandle, 1);
 
@@ -158,6 +241,8 @@ void app_main(void) {
 
   xTaskCreatePinnedToCore(peer_signaling_task, "peer_signaling", 8192, NULL, 6, &xPsTaskHandle, 1);
 
+  xTaskCreatePinnedToCore(modem_status_task, "modem_status", 4096, NULL, 3, &xModemTaskHandle, 0);
+
   ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
 
   while (1) {
@@ -10,13 +10,20 @@
 #include "esp_timer.h"
 
 #include "peer_connection.h"
+#include "camera_adapt.h"
+#include "frame_queue.h"
 
 extern PeerConnection* g_pc;
 extern int gDataChannelOpened;
 extern PeerConnectionState eState;
-extern SemaphoreHandle_t xSemaphore;
 static const char* TAG = "Camera";
 
+// Captured frames handed to the peer connection task, which alone sends
+static frame_queue_t s_frames;
+
+// Budget until the first estimate arrives from the link
+#define CAMERA_START_BITRATE 300000
+
 #if defined(CONFIG_ESP32S3_XIAO_SENSE)
 #define CAM_PIN_PWDN -1
 #define CAM_PIN_RESET -1
@@ -65,6 +72,30 @@ static camera_config_t camera_config = {
     .fb_location = CAMERA_FB_IN_PSRAM,
 };
 
+// Frames go either to the RTP/JPEG video track or to the data channel
+static int camera_send_frame(camera_fb_t* fb) {
+#if CONFIG_CAMERA_STREAM_RTP_MJPEG
+  // Packetized straight out of the PSRAM frame buffer, no intermediate copy
+  return peer_connection_send_video_frame(g_pc, fb->buf, fb->len);
+#else
+  int ret = peer_connection_datachannel_send(g_pc, (char*)fb->buf, fb->len);
+  return ret < 0 ? ret : 0;
+#endif
+}
+
+// Called from the peer connection task when the congestion controller moves
+void camera_on_bitrate_change(uint32_t bitrate, void* userdata) {
+  camera_adapt_set_budget(bitrate);
+}
+
+static int camera_stream_ready() {
+#if CONFIG_CAMERA_STREAM_RTP_MJPEG
+  return eState == PEER_CONNECTION_COMPLETED;
+#else
+  return (eState == PEER_CONNECTION_COMPLETED) && gDataChannelOpened;
+#endif
+}
+
 int64_t get_timestamp() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -72,6 +103,8 @@ int64_t get_timestamp() {
 }
 
 esp_err_t camera_init() {
+  frame_queue_init(&s_frames);
+
   // initialize the camera
   esp_err_t err = esp_camera_init(&camera_config);
   if (err != ESP_OK) {
@@ -82,9 +115,8 @@ esp_err_t camera_init() {
   // Get sensor and apply optimization settings for cellular
   sensor_t* sensor = esp_camera_sensor_get();
   if (sensor) {
-    sensor->set_framesize(sensor, camera_config.frame_size);
-    
-    sensor->set_quality(sensor, camera_config.jpeg_quality);
+    // Frame size and quality are owned by the adaptation from here on
+    camera_adapt_init(sensor, CAMERA_START_BITRATE);
     
     // sensor->set_brightness(sensor, 0);      // Default brightness
     
@@ -107,130 +139,118 @@ esp_err_t camera_init() {
   return ESP_OK;
 }
 
-void camera_task(void* pvParameters) {
+// Called from the peer connection task after peer_connection_loop, sends
+// what the camera task queued and gives the buffers back to the driver
+void camera_send_pending() {
   // Statistics variables
   static int fps = 0;
-  static int64_t last_time;
-  int64_t curr_time;
-  
-  // Network congestion management - optimized for cellular
-  static int no_space_errors = 0;
-  static int delay_ms = 30;              // Initial delay in milliseconds between frames
-  static int delay_increment = 5;      // Increment delay by 5ms on congestion
-  static int min_delay_ms = 20;           // Minimum delay to avoid overloading network
-  static int max_delay_ms = 80;          // Maximum delay to avoid freezing camera
-  static int recovery_count = 0;
-  static int recovery_threshold = 5;     //  successful frames before reducing delay
-  
-  // For calculating network bitrate
+  static int64_t last_time = 0;
   static size_t bytes_sent = 0;
-  
-  // Track frame timing
-  static int64_t frame_start_time;
-  static int frame_processing_time;
-  static int64_t bitrate_check_time; 
-  
+  static int dropped_frames = 0;
+  static size_t frame_size = 0;
+  int64_t curr_time;
+  camera_fb_t* fb;
+
+  while ((fb = frame_queue_pop(&s_frames)) != NULL) {
+    if (camera_stream_ready()) {
+      int ret = camera_send_frame(fb);
+
+#if CONFIG_CAMERA_STREAM_DATACHANNEL
+      // No rate estimate on the data channel, the send queue is the signal
+      camera_adapt_on_send_result(ret);
+#endif
+
+      if (ret == 0) {
+        bytes_sent += fb->len;
+        frame_size = fb->len;
+        fps++;
+      } else if (ret == -2) {
+        // Queue full, skip this frame and let the adaptation catch up
+        dropped_frames++;
+      } else {
+        ESP_LOGD(TAG, "Failed to send camera frame: error %d", ret);
+      }
+    }
+
+    esp_camera_fb_return(fb);
+  }
+
+  // Log stats every ~2 seconds
+  curr_time = get_timestamp();
+  if (last_time == 0) {
+    last_time = curr_time;
+  } else if ((curr_time - last_time) > 2000) {
+    float elapsed_sec = (float)(curr_time - last_time) / 1000.0f;
+    float actual_fps = (float)fps / elapsed_sec;
+    float kbps = (float)(bytes_sent * 8) / elapsed_sec / 1000.0f;
+    unsigned int superseded = atomic_exchange(&s_frames.dropped, 0);
+    PeerConnectionPacerStats pacer;
+
+    peer_connection_get_pacer_stats(g_pc, &pacer);
+
+    if (fps > 0 || dropped_frames > 0 || superseded > 0) {
+      ESP_LOGI(TAG, "Camera: %.1f FPS, %.1f Kbps, interval: %d ms, dropped: %d, superseded: %u, frame size: %d bytes",
+               actual_fps, kbps, camera_adapt_frame_interval_ms(), dropped_frames, superseded, frame_size);
+      ESP_LOGI(TAG, "Pacer: %d Kbps, queued: %d packets / %d bytes, delay: %d ms avg, %d ms max",
+               (int)(pacer.rate / 1000), (int)pacer.queued_packets, (int)pacer.queued_bytes, (int)pacer.avg_delay, (int)pacer.max_delay);
+    }
+
+    // Reset counters
+    fps = 0;
+    bytes_sent = 0;
+    dropped_frames = 0;
+    last_time = curr_time;
+  }
+}
+
+void camera_task(void* pvParameters) {
+  int64_t curr_time;
+
+  // Capture is paced to the operating point, congestion lowers the point instead of stalling
+  int64_t next_frame_time;
+  int delay_ms;
+
   camera_fb_t* fb = NULL;
+  camera_fb_t* dropped = NULL;
 
   ESP_LOGI(TAG, "Cellular-Optimized Camera Task Started");
-  last_time = get_timestamp();
-  bitrate_check_time = last_time;
+  next_frame_time = get_timestamp();
 
   for (;;) {
-    // Apply dynamic delay based on network congestion
-    vTaskDelay(pdMS_TO_TICKS(delay_ms));
+    delay_ms = next_frame_time - get_timestamp();
+    vTaskDelay(pdMS_TO_TICKS(delay_ms > 0 ? delay_ms : 1));
     
-    // Track frame timing
-    frame_start_time = get_timestamp();
+    curr_time = get_timestamp();
+    next_frame_time += camera_adapt_frame_interval_ms();
+    if (next_frame_time < curr_time) {
+      // Fell behind, do not burst to catch up
+      next_frame_time = curr_time;
+    }
     
     // Only try to capture and send if connection is ready
-    if ((eState == PEER_CONNECTION_COMPLETED) && gDataChannelOpened) {
-      
-      // Get frame from camera
-      fb = esp_camera_fb_get();
-      if (!fb) {
-        ESP_LOGE(TAG, "Camera capture failed");
-        vTaskDelay(pdMS_TO_TICKS(100));
-        continue;
-      }
-      
-      // Try to get access to data channel with  timeout
-      if (xSemaphoreTake(xSemaphore, 20 / portTICK_PERIOD_MS)) {
-        // Attempt to send the frame
-        int ret = peer_connection_datachannel_send(g_pc, (char*)fb->buf, fb->len);
-        
-        if (ret == 0) {
-          // Successful send
-          bytes_sent += fb->len;
-          fps++;
-          recovery_count++;
-          
-          // If we've had several successful frames, try reducing delay (increasing FPS)
-          if (recovery_count >= recovery_threshold && delay_ms > min_delay_ms) {
-            delay_ms = delay_ms - 2;  //  gradual reduction
-            if (delay_ms < min_delay_ms) delay_ms = min_delay_ms;
-            recovery_count = 0;
-            ESP_LOGI(TAG, "Network conditions improving, reducing frame delay to %d ms", delay_ms);
-          }
-          
-          // Log stats every ~2 seconds
-          curr_time = get_timestamp();
-          if ((curr_time - last_time) > 2000) {
-            float elapsed_sec = (float)(curr_time - last_time) / 1000.0f;
-            float actual_fps = (float)fps / elapsed_sec;
-            float kbps = (float)(bytes_sent * 8) / elapsed_sec / 1000.0f;
-            
-            ESP_LOGI(TAG, "Camera: %.1f FPS, %.1f Kbps, delay: %d ms, frame size: %d bytes", 
-                    actual_fps, kbps, delay_ms, fb->len);
-            
-            // Reset counters
-            fps = 0;
-            bytes_sent = 0;
-            no_space_errors = 0;
-            last_time = curr_time;
-          }
-        } else {
-          // Failed to send - handle errors
-          if (ret == -2) { // No space error
-            no_space_errors++;
-            recovery_count = 0;
-            
-            // More sophisticated congestion control for cellular
-            // After multiple errors, back off 
-            if (no_space_errors > 3) {
-              delay_ms += (delay_increment * 2);
-            } else {
-              delay_ms += delay_increment;
-            }
-            
-            if (delay_ms > max_delay_ms) delay_ms = max_delay_ms;
-            
-            ESP_LOGW(TAG, "WebRTC buffer full - increased frame delay to %d ms (error %d)", 
-                    delay_ms, no_space_errors);
-          } else {
-            // Other error
-            ESP_LOGD(TAG, "Failed to send camera frame: error %d", ret);
-          }
-        }
-        
-        xSemaphoreGive(xSemaphore);
-      } else {
-        ESP_LOGW(TAG, "Semaphore timeout - datachannel busy");
-      }
-      
-      // Always return the frame buffer
-      esp_camera_fb_return(fb);
-      
-      // Calculate frame processing time
-      frame_processing_time = get_timestamp() - frame_start_time;
-      if (frame_processing_time > delay_ms) {
-        // Log when processing time exceeds our target delay
-        ESP_LOGD(TAG, "Frame processing took %lld ms (exceeds target delay of %d ms)", 
-                frame_processing_time, delay_ms);
-      }
-    } else {
+    if (!camera_stream_ready()) {
       // Connection not ready, wait 
       vTaskDelay(pdMS_TO_TICKS(200));
+      next_frame_time = get_timestamp();
+      continue;
+    }
+      
+    // Get frame from camera
+    fb = esp_camera_fb_get();
+    if (!fb) {
+      ESP_LOGE(TAG, "Camera capture failed");
+      vTaskDelay(pdMS_TO_TICKS(100));
+      continue;
+    }
+    
+    camera_adapt_on_frame(fb, curr_time);
+
+    // Hand the frame over without waiting for the network. A frame still
+    // queued is stale by now, the newer one replaces it.
+    dropped = frame_queue_push(&s_frames, fb);
+    if (dropped) {
+      esp_camera_fb_return(dropped);
     }
+    peer_connection_notify(g_pc);
   }
 }
@@ -0,0 +1,206 @@
+#include "camera_adapt.h"
+
+#include "esp_log.h"
+
+static const char* TAG = "CameraAdapt";
+
+typedef struct {
+  framesize_t framesize;
+  int quality;             // (range: 0-63, lower = better quality)
+  int fps;
+  uint32_t prior_bytes;    // typical frame size, until frames tell otherwise
+  uint32_t frame_bytes;    // learned average frame size, 0 = not visited yet
+  int64_t learned_at;
+} operating_point_t;
+
+// Ordered from the most to the least expensive. Quality goes first and
+// frame rate last, so the picture keeps moving on a poor link. The top point
+// fits BUDGET_MAX * BUDGET_HEADROOM, anything more expensive is never chosen.
+static operating_point_t points[] = {
+    {FRAMESIZE_VGA, 20, 12, 15000},    // 1.44 Mbps
+    {FRAMESIZE_HVGA, 14, 12, 12000},   // 1.15 Mbps
+    {FRAMESIZE_HVGA, 20, 10, 8500},    // 680 kbps
+    {FRAMESIZE_QVGA, 14, 10, 6000},    // 480 kbps
+    {FRAMESIZE_QVGA, 24, 8, 4000},     // 256 kbps
+    {FRAMESIZE_QVGA, 32, 8, 3000},     // 192 kbps, where CAMERA_START_BITRATE lands
+    {FRAMESIZE_QQVGA, 20, 5, 1800},    // 72 kbps
+};
+
+#define NUM_POINTS (sizeof(points) / sizeof(points[0]))
+
+#define BUDGET_HEADROOM 0.85f   // share of the budget video may use
+#define UPGRADE_HOLD_MS 3000    // the next point up must keep fitting for this long
+#define MIN_DWELL_MS 1000       // no switch sooner than this after the last one
+#define SETTLE_FRAMES 4         // frames still queued with the old settings, fb_count
+#define MODEL_STALE_MS 30000    // forget what a point cost after this long
+#define MODEL_WEIGHT 8          // moving average over ~8 frames
+#define BUDGET_MIN 50000
+#define BUDGET_MAX 2000000
+
+// Uplink to expect from a cell at or below a CSQ rssi (-113 dBm + 2 dBm per
+// step), ordered from the weakest signal up
+static const struct {
+  int rssi;
+  uint32_t cap;
+} signal_caps[] = {
+    {5, 150000},    // -103 dBm and below
+    {9, 400000},    // -95 dBm
+    {14, 1000000},  // -85 dBm
+};
+
+static sensor_t* s_sensor = NULL;
+static int s_framesize = -1;
+static volatile uint32_t s_budget = 0;
+static volatile uint32_t s_signal_cap = BUDGET_MAX;
+static int s_current = 0;
+static int s_settle = 0;
+static int s_send_ok = 0;
+static int64_t s_last_switch = 0;
+static int64_t s_upgrade_since = 0;
+static int64_t s_now = 0;
+
+// Measured bytes per frame of a point, or its prior scaled by how the
+// current scene compresses compared to the prior of the current point
+static uint32_t predicted_bytes(int i) {
+  operating_point_t* cur = &points[s_current];
+
+  if (points[i].frame_bytes && s_now - points[i].learned_at < MODEL_STALE_MS) {
+    return points[i].frame_bytes;
+  }
+
+  if (cur->frame_bytes) {
+    return (uint64_t)points[i].prior_bytes * cur->frame_bytes / cur->prior_bytes;
+  }
+
+  return points[i].prior_bytes;
+}
+
+static uint32_t predicted_bitrate(int i) {
+  return predicted_bytes(i) * 8 * points[i].fps;
+}
+
+static void apply_point(int i, int64_t now_ms) {
+  if (s_sensor) {
+    if (points[i].framesize != s_framesize) {
+      s_sensor->set_framesize(s_sensor, points[i].framesize);
+      s_framesize = points[i].framesize;
+    }
+    s_sensor->set_quality(s_sensor, points[i].quality);
+  }
+
+  ESP_LOGI(TAG, "Operating point %d -> %d: %dx%d q%d %d fps, ~%d bytes/frame, budget %d bps",
+           s_current, i, resolution[points[i].framesize].width, resolution[points[i].framesize].height,
+           points[i].quality, points[i].fps, (int)predicted_bytes(i), (int)s_budget);
+
+  s_current = i;
+  s_settle = SETTLE_FRAMES;
+  s_last_switch = now_ms;
+  s_upgrade_since = 0;
+}
+
+void camera_adapt_init(sensor_t* sensor, uint32_t budget_bps) {
+  if (budget_bps < BUDGET_MIN) budget_bps = BUDGET_MIN;
+  if (budget_bps > BUDGET_MAX) budget_bps = BUDGET_MAX;
+
+  s_sensor = sensor;
+  s_budget = budget_bps;
+  s_current = 0;
+
+  // start from the best point the initial budget can carry
+  for (int i = 0; i < NUM_POINTS; i++) {
+    s_current = i;
+    if (predicted_bitrate(i) <= s_budget * BUDGET_HEADROOM) {
+      break;
+    }
+  }
+  apply_point(s_current, 0);
+}
+
+void camera_adapt_set_budget(uint32_t budget_bps) {
+  s_budget = budget_bps;
+}
+
+void camera_adapt_set_signal(int rssi) {
+  uint32_t cap = BUDGET_MAX;
+
+  for (int i = 0; rssi != 99 && i < sizeof(signal_caps) / sizeof(signal_caps[0]); i++) {
+    if (rssi <= signal_caps[i].rssi) {
+      cap = signal_caps[i].cap;
+      break;
+    }
+  }
+
+  if (cap != s_signal_cap) {
+    ESP_LOGI(TAG, "Signal rssi %d, budget capped at %d bps", rssi, (int)cap);
+    s_signal_cap = cap;
+  }
+}
+
+void camera_adapt_on_send_result(int ret) {
+  uint32_t budget = s_budget;
+
+  if (ret == -2) {
+    // send queue full, back off hard
+    budget = budget * 4 / 5;
+    s_send_ok = 0;
+  } else if (ret >= 0 && ++s_send_ok >= 10) {
+    budget = budget * 21 / 20;
+    s_send_ok = 0;
+  }
+
+  if (budget < BUDGET_MIN) budget = BUDGET_MIN;
+  if (budget > BUDGET_MAX) budget = BUDGET_MAX;
+  s_budget = budget;
+}
+
+void camera_adapt_on_frame(camera_fb_t* fb, int64_t now_ms) {
+  operating_point_t* cur = &points[s_current];
+  uint32_t link = s_budget < s_signal_cap ? s_budget : s_signal_cap;
+  float budget = link * BUDGET_HEADROOM;
+  int target = NUM_POINTS - 1;
+
+  s_now = now_ms;
+
+  if (s_settle > 0) {
+    s_settle--;
+    return;
+  }
+
+  // learn from frames that really were taken with the current settings
+  if (fb->width == resolution[cur->framesize].width) {
+    if (cur->frame_bytes == 0 || now_ms - cur->learned_at >= MODEL_STALE_MS) {
+      cur->frame_bytes = fb->len;
+    } else {
+      cur->frame_bytes += ((int32_t)fb->len - (int32_t)cur->frame_bytes) / MODEL_WEIGHT;
+    }
+    cur->learned_at = now_ms;
+  }
+
+  for (int i = 0; i < NUM_POINTS; i++) {
+    if (predicted_bitrate(i) <= budget) {
+      target = i;
+      break;
+    }
+  }
+
+  if (target > s_current) {
+    // over budget, step down as far as needed once the last switch settled
+    s_upgrade_since = 0;
+    if (now_ms - s_last_switch >= MIN_DWELL_MS) {
+      apply_point(target, now_ms);
+    }
+  } else if (target < s_current && predicted_bitrate(s_current - 1) <= budget) {
+    // one step up at a time, and only after it fit for a while
+    if (s_upgrade_since == 0) {
+      s_upgrade_since = now_ms;
+    } else if (now_ms - s_upgrade_since >= UPGRADE_HOLD_MS && now_ms - s_last_switch >= MIN_DWELL_MS) {
+      apply_point(s_current - 1, now_ms);
+    }
+  } else {
+    s_upgrade_since = 0;
+  }
+}
+
+int camera_adapt_frame_interval_ms(void) {
+  return 1000 / points[s_current].fps;
+}
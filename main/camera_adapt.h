@@ -0,0 +1,30 @@
+#ifndef CAMERA_ADAPT_H_
+#define CAMERA_ADAPT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_camera.h"
+
+// Picks a frame size / JPEG quality / fps operating point that fits the
+// bitrate budget of the uplink, learning the frame size of each point from
+// the frames actually captured.
+
+void camera_adapt_init(sensor_t* sensor, uint32_t budget_bps);
+
+// Budget from the congestion controller, safe to call from another task
+void camera_adapt_set_budget(uint32_t budget_bps);
+
+// Radio signal from the modem, AT+CSQ rssi (0-31, 99 = unknown). A weak cell
+// caps the budget before the congestion controller sees the losses.
+void camera_adapt_set_signal(int rssi);
+
+// Send queue feedback for transports without a rate estimate
+void camera_adapt_on_send_result(int ret);
+
+// Feed every captured frame, may switch the operating point
+void camera_adapt_on_frame(camera_fb_t* fb, int64_t now_ms);
+
+int camera_adapt_frame_interval_ms(void);
+
+#endif  // CAMERA_ADAPT_H_
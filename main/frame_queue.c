@@ -0,0 +1,53 @@
+#include "frame_queue.h"
+
+#define SLOT(q, i) (&(q)->slots[(i) & (FRAME_QUEUE_LENGTH - 1)])
+
+void frame_queue_init(frame_queue_t* q) {
+  for (int i = 0; i < FRAME_QUEUE_LENGTH; i++) {
+    atomic_init(&q->slots[i], NULL);
+  }
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->dropped, 0);
+}
+
+camera_fb_t* frame_queue_push(frame_queue_t* q, camera_fb_t* fb) {
+  unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+  camera_fb_t* dropped = NULL;
+
+  // Full: claim the oldest slot the same way the consumer does, so each
+  // frame leaves the queue exactly once even when both race for it. On
+  // failure head is reloaded and the consumer has already made room.
+  while (tail - head == FRAME_QUEUE_LENGTH) {
+    camera_fb_t* oldest = atomic_load_explicit(SLOT(q, head), memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1, memory_order_acq_rel,
+                                              memory_order_acquire)) {
+      dropped = oldest;
+      atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+      break;
+    }
+  }
+
+  atomic_store_explicit(SLOT(q, tail), fb, memory_order_relaxed);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return dropped;
+}
+
+camera_fb_t* frame_queue_pop(frame_queue_t* q) {
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  camera_fb_t* fb;
+
+  for (;;) {
+    if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) {
+      return NULL;
+    }
+
+    // read before claiming, the producer only reuses the slot once head moved past it
+    fb = atomic_load_explicit(SLOT(q, head), memory_order_relaxed);
+    if (atomic_compare_exchange_weak_explicit(&q->head, &head, head + 1, memory_order_acq_rel,
+                                              memory_order_relaxed)) {
+      return fb;
+    }
+  }
+}
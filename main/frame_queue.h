@@ -0,0 +1,32 @@
+#ifndef FRAME_QUEUE_H_
+#define FRAME_QUEUE_H_
+
+#include <stdatomic.h>
+
+#include "esp_camera.h"
+
+// Frames waiting for the network task, power of 2. Together with the frame
+// being sent it must stay below fb_count so the driver keeps a buffer to
+// capture into.
+#define FRAME_QUEUE_LENGTH 2
+
+// Lock-free single producer (camera task) / single consumer (network task)
+// queue of frame buffer handles. The frames are not copied, whoever takes
+// one out owns it and returns it with esp_camera_fb_return().
+typedef struct {
+  _Atomic(camera_fb_t*) slots[FRAME_QUEUE_LENGTH];
+  atomic_uint head;     // next to pop, advanced by the consumer or by the producer dropping
+  atomic_uint tail;     // next to push, producer only
+  atomic_uint dropped;  // frames pushed out by newer ones
+} frame_queue_t;
+
+void frame_queue_init(frame_queue_t* q);
+
+// Producer side. When full the oldest frame is taken out to make room and
+// returned to the caller to hand back to the driver, NULL otherwise.
+camera_fb_t* frame_queue_push(frame_queue_t* q, camera_fb_t* fb);
+
+// Consumer side, NULL when empty
+camera_fb_t* frame_queue_pop(frame_queue_t* q);
+
+#endif  // FRAME_QUEUE_H_
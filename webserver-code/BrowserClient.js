@@ -72,6 +72,8 @@ function initializeWebRTC() {
     const message = JSON.parse(event.data);
 
     if (message.type === 'sdp') {
+      // A second offer from the ESP32 is an ICE restart after its PPP address changed.
+      // It is answered on the same connection, so DTLS and the data channel carry on.
       const sdp = message.sdp?.sdp || message.sdp;
       const sdpType = message.sdp?.type || 'offer';
       const modifiedSDP = modifySDPForPCM(sdp);
@@ -71,6 +71,17 @@ app.post('/whip', (req, res) => {
 
         logger.info(`-----------Created new client record for ESP\n`);
 
+      } else if (clients["ESP"].response !== res) {
+
+        // ICE restart: the ESP32 got a new PPP address and posts an offer with new
+        // ICE credentials. It replaces the old one, and the browser's candidates for
+        // the restarted session are forwarded again.
+        const previous = clients["ESP"].response;
+        clients["ESP"] = { sdp: sdp, response: res };
+        loggedCandidates.clear();
+        previous.end();
+
+        logger.info(`-----------Replaced ESP offer after an ICE restart\n`);
       }
 
 
@@ -100,10 +111,11 @@ app.post('/whip', (req, res) => {
   // Handle connection closure to reset state when ESP connection closes
   res.on('close', () => {
     logger.info('-----------ESP connection closed, resetting state for ESP');
-    if (clients["ESP"]) {
+    // a connection replaced by an ICE restart offer leaves the new record alone
+    if (clients["ESP"] && clients["ESP"].response === res) {
       delete clients["ESP"];  // Reset client state
+      loggedCandidates.clear(); // Clear any stored ICE candidates
     }
-    loggedCandidates.clear(); // Clear any stored ICE candidates
   });
 
   // Optional: Handle 'finish' event when the response is completed